@@ -0,0 +1,101 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Helpers shared by the benchmark programs: the deterministic synthetic
+ * input and the JSON report fields.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "kvazaar-bench-utils.h"
+
+void
+bench_json_append_double (GString * json, const gchar * key, gdouble value)
+{
+  gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+  g_string_append_printf (json, ", \"%s\": %s", key,
+      g_ascii_formatd (buf, sizeof (buf), "%.3f", value));
+}
+
+void
+bench_json_append_string (GString * json, const gchar * key, const gchar * value)
+{
+  const gchar *p;
+
+  g_string_append_printf (json, ", \"%s\": \"", key);
+  for (p = value; *p; p++) {
+    if (*p == '"' || *p == '\\')
+      g_string_append_c (json, '\\');
+    if ((guchar) * p < 0x20)
+      g_string_append_c (json, ' ');
+    else
+      g_string_append_c (json, *p);
+  }
+  g_string_append_c (json, '"');
+}
+
+/* Diagonal gradient moving by two samples per frame, with a fixed pseudo
+ * random texture so that the encoder has residual to code */
+static guint
+bench_pattern (guint c, guint x, guint y, guint n)
+{
+  guint32 h = (x * 73856093u) ^ (y * 19349663u) ^ (c * 83492791u);
+
+  h ^= h >> 13;
+  h *= 0x5bd1e995u;
+  h ^= h >> 15;
+
+  if (c == 0)
+    return ((x + y + 2 * n) & 0xbf) + (h & 0x3f);
+  return ((c == 1 ? x : y) + n + (h & 0x0f)) & 0xff;
+}
+
+guint8 *
+bench_synthetic_picture (const GstVideoInfo * info, guint n)
+{
+  guint8 *data = g_malloc0 (GST_VIDEO_INFO_SIZE (info));
+  guint c, x, y;
+
+  for (c = 0; c < GST_VIDEO_INFO_N_COMPONENTS (info); c++) {
+    guint w = GST_VIDEO_INFO_COMP_WIDTH (info, c);
+    guint h = GST_VIDEO_INFO_COMP_HEIGHT (info, c);
+    guint shift = GST_VIDEO_INFO_COMP_DEPTH (info, c) - 8;
+    gint stride = GST_VIDEO_INFO_COMP_STRIDE (info, c);
+
+    for (y = 0; y < h; y++) {
+      guint8 *line = data + GST_VIDEO_INFO_COMP_OFFSET (info, c) + y * stride;
+
+      for (x = 0; x < w; x++) {
+        guint v = bench_pattern (c, x, y, n) << shift;
+
+        if (shift) {
+          line[2 * x] = v & 0xff;
+          line[2 * x + 1] = v >> 8;
+        } else {
+          line[x] = v;
+        }
+      }
+    }
+  }
+
+  return data;
+}
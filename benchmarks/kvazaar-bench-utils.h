@@ -0,0 +1,38 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __KVAZAAR_BENCH_UTILS_H__
+#define __KVAZAAR_BENCH_UTILS_H__
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+
+G_BEGIN_DECLS
+
+/* Appends ", "key": value" to a JSON object under construction */
+void bench_json_append_double (GString * json, const gchar * key,
+    gdouble value);
+void bench_json_append_string (GString * json, const gchar * key,
+    const gchar * value);
+
+/* Picture n of the synthetic input, in the default layout of info, to be
+ * freed with g_free() */
+guint8 *bench_synthetic_picture (const GstVideoInfo * info, guint n);
+
+G_END_DECLS
+#endif /* __KVAZAAR_BENCH_UTILS_H__ */
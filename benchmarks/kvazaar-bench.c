@@ -0,0 +1,590 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Throughput benchmark of kvazaarenc.
+ *
+ * Every combination of the given presets, resolutions, input formats, thread
+ * counts and input modes is encoded through
+ *
+ *   appsrc ! kvazaarenc ! fakesink
+ *
+ * in a process of its own, so that CPU time and peak RSS belong to that case
+ * alone. The input is a deterministic synthetic pattern, or the first frames
+ * of a Y4M file, so runs on different commits encode the same pictures. With
+ * --zero-copy=on the buffers wrap the prepared pictures, with off every frame
+ * is copied into a newly allocated buffer as a capture source would do.
+ *
+ * The report is a JSON object with one entry per case: encode rate, wall and
+ * CPU time, peak RSS and mean access unit size.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/video/video.h>
+
+#include "kvazaar-bench-utils.h"
+
+/* Distinct pictures prepared for a case; longer runs cycle through them */
+#define BENCH_POOL_SIZE 30
+
+typedef struct
+{
+  gchar *preset;
+  gint width;
+  gint height;
+  GstVideoFormat format;
+  gchar *threads;
+  gboolean zero_copy;
+} BenchCase;
+
+typedef struct
+{
+  GstVideoInfo info;
+  GPtrArray *pictures;
+  guint frames;
+  guint pushed;
+  gboolean zero_copy;
+  guint64 out_frames;
+  guint64 out_bytes;
+} BenchRun;
+
+static gchar *
+bench_case_to_string (const BenchCase * c)
+{
+  return g_strdup_printf ("%s:%dx%d:%s:%s:%s", c->preset, c->width,
+      c->height, gst_video_format_to_string (c->format), c->threads,
+      c->zero_copy ? "on" : "off");
+}
+
+static gboolean
+bench_case_parse (const gchar * str, BenchCase * c)
+{
+  gchar **parts = g_strsplit (str, ":", -1);
+  gboolean ret = FALSE;
+
+  if (g_strv_length (parts) == 5
+      && sscanf (parts[1], "%dx%d", &c->width, &c->height) == 2
+      && c->width >= 0 && c->height >= 0) {
+    c->preset = g_strdup (parts[0]);
+    c->format = gst_video_format_from_string (parts[2]);
+    c->threads = g_strdup (parts[3]);
+    c->zero_copy = g_strcmp0 (parts[4], "on") == 0;
+    ret = c->format != GST_VIDEO_FORMAT_UNKNOWN;
+  }
+  g_strfreev (parts);
+
+  return ret;
+}
+
+/* Reads up to max_pictures 4:2:0 8-bit pictures of a Y4M file. The file is
+ * mapped, so that only the pictures kept are read, and a large source does
+ * not weigh on the peak RSS of the run. */
+static gboolean
+bench_load_y4m (const gchar * path, guint max_pictures, GstVideoInfo * info,
+    GPtrArray * pictures, GError ** err)
+{
+  GMappedFile *mapped;
+  gchar *contents, *p, *end, *header;
+  gsize length, size;
+  gint width = 0, height = 0;
+  gchar **tokens;
+  guint i;
+
+  mapped = g_mapped_file_new (path, FALSE, err);
+  if (!mapped)
+    return FALSE;
+
+  contents = g_mapped_file_get_contents (mapped);
+  length = g_mapped_file_get_length (mapped);
+  end = contents + length;
+  p = contents ? memchr (contents, '\n', length) : NULL;
+  if (!p || length < 10 || memcmp (contents, "YUV4MPEG2 ", 10) != 0) {
+    g_set_error (err, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s: not a Y4M file",
+        path);
+    g_mapped_file_unref (mapped);
+    return FALSE;
+  }
+
+  header = g_strndup (contents, p - contents);
+  tokens = g_strsplit (header, " ", -1);
+  for (i = 1; tokens[i]; i++) {
+    if (tokens[i][0] == 'W')
+      width = atoi (tokens[i] + 1);
+    else if (tokens[i][0] == 'H')
+      height = atoi (tokens[i] + 1);
+    else if (tokens[i][0] == 'C' && !g_str_has_prefix (tokens[i], "C420"))
+      width = 0;
+  }
+  g_strfreev (tokens);
+  g_free (header);
+
+  if (width <= 0 || height <= 0) {
+    g_set_error (err, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+        "%s: only 8-bit 4:2:0 Y4M is supported", path);
+    g_mapped_file_unref (mapped);
+    return FALSE;
+  }
+
+  gst_video_info_set_format (info, GST_VIDEO_FORMAT_I420, width, height);
+  size = width * height + 2 * ((width + 1) / 2) * ((height + 1) / 2);
+
+  p++;
+  while (pictures->len < max_pictures && end - p >= 5
+      && memcmp (p, "FRAME", 5) == 0) {
+    guint8 *data;
+    gchar *eol = memchr (p, '\n', end - p);
+    guint c, y;
+
+    if (!eol || (gsize) (end - eol - 1) < size)
+      break;
+    p = eol + 1;
+
+    /* Repack to the strides of the GstVideoInfo */
+    data = g_malloc0 (GST_VIDEO_INFO_SIZE (info));
+    for (c = 0; c < 3; c++) {
+      guint w = GST_VIDEO_INFO_COMP_WIDTH (info, c);
+      guint h = GST_VIDEO_INFO_COMP_HEIGHT (info, c);
+
+      for (y = 0; y < h; y++) {
+        memcpy (data + GST_VIDEO_INFO_COMP_OFFSET (info, c) +
+            y * GST_VIDEO_INFO_COMP_STRIDE (info, c), p, w);
+        p += w;
+      }
+    }
+    g_ptr_array_add (pictures, data);
+  }
+  g_mapped_file_unref (mapped);
+
+  if (pictures->len == 0) {
+    g_set_error (err, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s: no frames",
+        path);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void
+bench_need_data (GstAppSrc * src, guint length, gpointer user_data)
+{
+  BenchRun *run = user_data;
+  guint8 *picture;
+  gsize size = GST_VIDEO_INFO_SIZE (&run->info);
+  GstBuffer *buf;
+  gint fps_n = GST_VIDEO_INFO_FPS_N (&run->info);
+  gint fps_d = GST_VIDEO_INFO_FPS_D (&run->info);
+
+  if (run->pushed == run->frames) {
+    gst_app_src_end_of_stream (src);
+    return;
+  }
+
+  picture = g_ptr_array_index (run->pictures,
+      run->pushed % run->pictures->len);
+  if (run->zero_copy) {
+    buf = gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY, picture,
+        size, 0, size, NULL, NULL);
+  } else {
+    buf = gst_buffer_new_allocate (NULL, size, NULL);
+    gst_buffer_fill (buf, 0, picture, size);
+  }
+
+  GST_BUFFER_PTS (buf) = gst_util_uint64_scale (run->pushed,
+      fps_d * GST_SECOND, fps_n);
+  GST_BUFFER_DURATION (buf) = gst_util_uint64_scale (run->pushed + 1,
+      fps_d * GST_SECOND, fps_n) - GST_BUFFER_PTS (buf);
+  run->pushed++;
+
+  gst_app_src_push_buffer (src, buf);
+}
+
+static gboolean
+bench_count_buffer (GstBuffer ** buf, guint idx, gpointer user_data)
+{
+  BenchRun *run = user_data;
+
+  run->out_bytes += gst_buffer_get_size (*buf);
+  return TRUE;
+}
+
+static GstPadProbeReturn
+bench_count_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  BenchRun *run = user_data;
+  GstBuffer *buf;
+
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+    gst_buffer_list_foreach (GST_PAD_PROBE_INFO_BUFFER_LIST (info),
+        bench_count_buffer, run);
+    run->out_frames++;
+  } else {
+    buf = GST_PAD_PROBE_INFO_BUFFER (info);
+    run->out_bytes += gst_buffer_get_size (buf);
+    /* one access unit per buffer, fakesink does not ask for alignment=nal */
+    run->out_frames++;
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+static gdouble
+bench_cpu_time (const struct rusage *usage)
+{
+  return usage->ru_utime.tv_sec + usage->ru_stime.tv_sec +
+      (usage->ru_utime.tv_usec + usage->ru_stime.tv_usec) / 1e6;
+}
+
+/* Runs one case and prints its JSON entry */
+static gint
+bench_run_case (const BenchCase * c, guint frames, const gchar * y4m)
+{
+  GstAppSrcCallbacks callbacks = { bench_need_data, NULL, NULL };
+  BenchRun run = { {0}, };
+  GstElement *pipeline, *src, *enc;
+  GstCaps *caps;
+  GstPad *pad;
+  GstBus *bus;
+  GstMessage *msg;
+  GError *err = NULL;
+  struct rusage usage_start, usage_end;
+  gint64 start, end;
+  gchar *name, *opts;
+  GString *json;
+  guint i;
+  gint ret = 0;
+
+  run.pictures = g_ptr_array_new_with_free_func (g_free);
+  run.frames = frames;
+  run.zero_copy = c->zero_copy;
+
+  if (y4m) {
+    if (!bench_load_y4m (y4m, MIN (frames, BENCH_POOL_SIZE), &run.info,
+            run.pictures, &err)) {
+      g_printerr ("%s\n", err->message);
+      g_error_free (err);
+      g_ptr_array_unref (run.pictures);
+      return 1;
+    }
+  } else {
+    gst_video_info_set_format (&run.info, c->format, c->width, c->height);
+    for (i = 0; i < MIN (frames, BENCH_POOL_SIZE); i++)
+      g_ptr_array_add (run.pictures, bench_synthetic_picture (&run.info, i));
+  }
+  GST_VIDEO_INFO_FPS_N (&run.info) = 30;
+  GST_VIDEO_INFO_FPS_D (&run.info) = 1;
+
+  pipeline = gst_parse_launch ("appsrc name=src format=time ! "
+      "kvazaarenc name=enc ! fakesink sync=false", &err);
+  if (!pipeline) {
+    g_printerr ("%s\n", err->message);
+    g_error_free (err);
+    g_ptr_array_unref (run.pictures);
+    return 1;
+  }
+
+  src = gst_bin_get_by_name (GST_BIN (pipeline), "src");
+  enc = gst_bin_get_by_name (GST_BIN (pipeline), "enc");
+  caps = gst_video_info_to_caps (&run.info);
+  gst_app_src_set_caps (GST_APP_SRC (src), caps);
+  gst_caps_unref (caps);
+  gst_app_src_set_callbacks (GST_APP_SRC (src), &callbacks, &run, NULL);
+
+  gst_util_set_object_arg (G_OBJECT (enc), "preset", c->preset);
+  opts = g_strdup_printf ("threads=%s", c->threads);
+  g_object_set (enc, "option-string", opts, NULL);
+  g_free (opts);
+
+  pad = gst_element_get_static_pad (enc, "src");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER |
+      GST_PAD_PROBE_TYPE_BUFFER_LIST, bench_count_probe, &run, NULL);
+  gst_object_unref (pad);
+
+  bus = gst_element_get_bus (pipeline);
+  getrusage (RUSAGE_SELF, &usage_start);
+  start = g_get_monotonic_time ();
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+  msg = gst_bus_timed_pop_filtered (bus, GST_CLOCK_TIME_NONE,
+      GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  end = g_get_monotonic_time ();
+  getrusage (RUSAGE_SELF, &usage_end);
+
+  name = bench_case_to_string (c);
+  json = g_string_new ("{");
+  bench_json_append_string (json, "case", name);
+  /* drop the ", " of the first member */
+  g_string_erase (json, 1, 2);
+  bench_json_append_string (json, "preset", c->preset);
+  g_string_append_printf (json, ", \"width\": %d, \"height\": %d",
+      GST_VIDEO_INFO_WIDTH (&run.info), GST_VIDEO_INFO_HEIGHT (&run.info));
+  bench_json_append_string (json, "format",
+      gst_video_format_to_string (GST_VIDEO_INFO_FORMAT (&run.info)));
+  bench_json_append_string (json, "threads", c->threads);
+  g_string_append_printf (json, ", \"zero_copy\": %s",
+      c->zero_copy ? "true" : "false");
+
+  if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_ERROR) {
+    gchar *debug = NULL;
+
+    gst_message_parse_error (msg, &err, &debug);
+    bench_json_append_string (json, "status", "error");
+    bench_json_append_string (json, "error", err->message);
+    g_printerr ("%s: %s\n%s\n", name, err->message, debug ? debug : "");
+    g_error_free (err);
+    g_free (debug);
+    ret = 1;
+  } else {
+    gdouble wall = (end - start) / 1e6;
+    gdouble cpu = bench_cpu_time (&usage_end) - bench_cpu_time (&usage_start);
+
+    bench_json_append_string (json, "status", "ok");
+    g_string_append_printf (json, ", \"frames\": %u", run.pushed);
+    g_string_append_printf (json, ", \"output_frames\": %" G_GUINT64_FORMAT,
+        run.out_frames);
+    bench_json_append_double (json, "wall_time", wall);
+    bench_json_append_double (json, "fps", wall > 0 ? run.pushed / wall : 0);
+    bench_json_append_double (json, "cpu_time", cpu);
+    bench_json_append_double (json, "cpu_load", wall > 0 ? cpu / wall : 0);
+    /* kilobytes on Linux */
+    g_string_append_printf (json, ", \"peak_rss_kb\": %ld",
+        usage_end.ru_maxrss);
+    bench_json_append_double (json, "bytes_per_frame", run.out_frames ?
+        (gdouble) run.out_bytes / run.out_frames : 0);
+  }
+  g_string_append_c (json, '}');
+  g_print ("%s\n", json->str);
+
+  g_string_free (json, TRUE);
+  g_free (name);
+  gst_message_unref (msg);
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (bus);
+  gst_object_unref (enc);
+  gst_object_unref (src);
+  gst_object_unref (pipeline);
+  g_ptr_array_unref (run.pictures);
+
+  return ret;
+}
+
+/* Runs a case in a child process, and appends its entry to the report */
+static gboolean
+bench_spawn_case (const gchar * self, const BenchCase * c, guint frames,
+    const gchar * y4m, GString * report)
+{
+  gchar *name = bench_case_to_string (c);
+  gchar *frames_str = g_strdup_printf ("%u", frames);
+  const gchar *argv[] = { self, "--run", name, "--frames", frames_str,
+    y4m ? "--y4m" : NULL, y4m, NULL
+  };
+  gchar *out = NULL;
+  gint status = 0;
+  GError *err = NULL;
+  gboolean ret;
+
+  g_printerr ("%s\n", name);
+  ret = g_spawn_sync (NULL, (gchar **) argv, NULL, G_SPAWN_CHILD_INHERITS_STDIN,
+      NULL, NULL, &out, NULL, &status, &err);
+  if (!ret) {
+    g_printerr ("%s\n", err->message);
+    g_error_free (err);
+  } else {
+    ret = g_spawn_check_exit_status (status, NULL);
+  }
+
+  if (out && g_str_has_prefix (out, "{")) {
+    g_strchomp (out);
+    g_string_append_printf (report, "%s\n    %s",
+        report->str[report->len - 1] == '[' ? "" : ",", out);
+  } else {
+    g_string_append_printf (report, "%s\n    {\"case\": \"%s\", "
+        "\"status\": \"crashed\"}",
+        report->str[report->len - 1] == '[' ? "" : ",", name);
+    ret = FALSE;
+  }
+
+  g_free (out);
+  g_free (frames_str);
+  g_free (name);
+
+  return ret;
+}
+
+int
+main (int argc, char **argv)
+{
+  gchar *presets = g_strdup ("ultrafast,veryfast,medium");
+  gchar *resolutions = g_strdup ("640x360,1280x720,1920x1080");
+  gchar *formats = g_strdup ("I420");
+  gchar *threads = g_strdup ("1,auto");
+  gchar *zero_copy = g_strdup ("on,off");
+  gchar *y4m = NULL, *output = NULL, *plugin_path = NULL, *label = NULL;
+  gchar *run_case = NULL;
+  gint frames = 120;
+  GOptionEntry entries[] = {
+    {"presets", 'p', 0, G_OPTION_ARG_STRING, &presets,
+        "Comma separated kvazaarenc presets", "LIST"},
+    {"resolutions", 'r', 0, G_OPTION_ARG_STRING, &resolutions,
+        "Comma separated WIDTHxHEIGHT of the synthetic input", "LIST"},
+    {"formats", 'f', 0, G_OPTION_ARG_STRING, &formats,
+        "Comma separated input formats, I420 and I420_10LE", "LIST"},
+    {"threads", 't', 0, G_OPTION_ARG_STRING, &threads,
+        "Comma separated Kvazaar thread counts, or auto", "LIST"},
+    {"zero-copy", 'z', 0, G_OPTION_ARG_STRING, &zero_copy,
+        "Input modes: on wraps the pictures, off copies each frame", "LIST"},
+    {"frames", 'n', 0, G_OPTION_ARG_INT, &frames,
+        "Frames encoded per case", "N"},
+    {"y4m", 'i', 0, G_OPTION_ARG_FILENAME, &y4m,
+        "Encode the first frames of this 8-bit 4:2:0 Y4M file instead of the "
+        "synthetic pattern", "FILE"},
+    {"output", 'o', 0, G_OPTION_ARG_FILENAME, &output,
+        "Write the JSON report to FILE instead of stdout", "FILE"},
+    {"plugin-path", 0, 0, G_OPTION_ARG_FILENAME, &plugin_path,
+        "Directory of the kvazaarenc plugin to measure", "DIR"},
+    {"label", 'l', 0, G_OPTION_ARG_STRING, &label,
+        "Label of the run in the report, such as a commit", "STRING"},
+    {"run", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_STRING, &run_case,
+        NULL, NULL},
+    {NULL}
+  };
+  GOptionContext *ctx;
+  GError *err = NULL;
+  gchar **preset_list, **res_list, **format_list, **thread_list, **zc_list;
+  GstPluginFeature *feature;
+  GstPlugin *plugin;
+  GString *report;
+  guint a, b, d, e, g;
+  gint ret = 0;
+
+  ctx = g_option_context_new (NULL);
+  g_option_context_set_summary (ctx, "Measure the kvazaarenc encode rate "
+      "over a matrix of presets, resolutions, input formats, thread counts "
+      "and input modes");
+  g_option_context_add_main_entries (ctx, entries, NULL);
+  g_option_context_add_group (ctx, gst_init_get_option_group ());
+  if (!g_option_context_parse (ctx, &argc, &argv, &err) || frames <= 0) {
+    g_printerr ("%s\n", err ? err->message : "invalid number of frames");
+    g_clear_error (&err);
+    g_option_context_free (ctx);
+    return 1;
+  }
+  g_option_context_free (ctx);
+
+  if (plugin_path) {
+    const gchar *prev = g_getenv ("GST_PLUGIN_PATH");
+    gchar *path = prev ? g_strjoin (G_SEARCHPATH_SEPARATOR_S, plugin_path,
+        prev, NULL) : g_strdup (plugin_path);
+
+    /* also seen by the child processes */
+    g_setenv ("GST_PLUGIN_PATH", path, TRUE);
+    g_free (path);
+  }
+  gst_init (NULL, NULL);
+
+  if (run_case) {
+    BenchCase c;
+
+    if (!bench_case_parse (run_case, &c)) {
+      g_printerr ("invalid case %s\n", run_case);
+      return 1;
+    }
+    return bench_run_case (&c, frames, y4m);
+  }
+
+  feature = gst_registry_find_feature (gst_registry_get (), "kvazaarenc",
+      GST_TYPE_ELEMENT_FACTORY);
+  if (!feature) {
+    g_printerr ("kvazaarenc not found, see --plugin-path\n");
+    return 1;
+  }
+
+  report = g_string_new ("{\n  \"version\": 1");
+  if (label)
+    bench_json_append_string (report, "label", label);
+  plugin = gst_plugin_feature_get_plugin (feature);
+  bench_json_append_string (report, "plugin_version", plugin ?
+      gst_plugin_get_version (plugin) : "unknown");
+  if (plugin)
+    gst_object_unref (plugin);
+  bench_json_append_string (report, "gstreamer", gst_version_string ());
+  g_string_append_printf (report, ", \"cpus\": %u, \"frames\": %d",
+      g_get_num_processors (), frames);
+  if (y4m)
+    bench_json_append_string (report, "input", y4m);
+  g_string_append (report, ",\n  \"results\": [");
+  gst_object_unref (feature);
+
+  preset_list = g_strsplit (presets, ",", -1);
+  /* the resolution of a Y4M input is its own */
+  res_list = g_strsplit (y4m ? "0x0" : resolutions, ",", -1);
+  format_list = g_strsplit (y4m ? "I420" : formats, ",", -1);
+  thread_list = g_strsplit (threads, ",", -1);
+  zc_list = g_strsplit (zero_copy, ",", -1);
+
+  for (a = 0; preset_list[a]; a++)
+    for (b = 0; res_list[b]; b++)
+      for (d = 0; format_list[d]; d++)
+        for (e = 0; thread_list[e]; e++)
+          for (g = 0; zc_list[g]; g++) {
+            BenchCase c;
+
+            c.preset = preset_list[a];
+            c.format = gst_video_format_from_string (format_list[d]);
+            c.threads = thread_list[e];
+            c.zero_copy = g_strcmp0 (zc_list[g], "on") == 0;
+            if (sscanf (res_list[b], "%dx%d", &c.width, &c.height) != 2
+                || c.format == GST_VIDEO_FORMAT_UNKNOWN) {
+              g_printerr ("invalid resolution %s or format %s\n",
+                  res_list[b], format_list[d]);
+              ret = 1;
+              continue;
+            }
+            if (!bench_spawn_case (argv[0], &c, frames, y4m, report))
+              ret = 1;
+          }
+
+  g_string_append (report, "\n  ]\n}\n");
+
+  if (output) {
+    if (!g_file_set_contents (output, report->str, report->len, &err)) {
+      g_printerr ("%s\n", err->message);
+      g_error_free (err);
+      ret = 1;
+    }
+  } else {
+    g_print ("%s", report->str);
+  }
+
+  g_strfreev (preset_list);
+  g_strfreev (res_list);
+  g_strfreev (format_list);
+  g_strfreev (thread_list);
+  g_strfreev (zc_list);
+  g_string_free (report, TRUE);
+
+  return ret;
+}
@@ -0,0 +1,556 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmarks of the per-frame work of kvazaarenc outside Kvazaar.
+ *
+ * Each path runs on its own at 1080p, 4K and 8K:
+ *
+ *   map            map and unmap the input GstVideoFrame
+ *   picture        allocate and set up the kvz_picture of a frame
+ *   thumbnail      downscale the luma for the lookahead and scene detection
+ *   static         compare the CTUs with the previous picture
+ *   assemble       copy the data chunks of an access unit into a buffer
+ *   assemble_fill  the same with a gst_buffer_fill per chunk
+ *   start_codes    find the NAL units of an access unit
+ *   to_nal         remove the emulation prevention bytes of a NAL unit
+ *   psnr           squared error of the luma against the reconstruction
+ *   ssim           SSIM of the luma against the reconstruction
+ *
+ * The access units are random payloads of a key frame size, with emulation
+ * prevention where needed. With warm caches the same data is processed
+ * again, with cold caches an eviction buffer is written before every run.
+ * The median time of a frame and the bandwidth are reported as JSON.
+ *
+ * The program is built twice: kvazaar-microbench with the SIMD kernels of
+ * the target, and kvazaar-microbench-scalar without them.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <kvazaar.h>
+
+#include "gstkvazaaranalysis.h"
+#include "gstkvazaarbitstream.h"
+#include "gstkvazaarquality.h"
+
+#ifdef __SSE2__
+#define BENCH_VARIANT "sse2"
+#else
+#define BENCH_VARIANT "scalar"
+#endif
+
+/* Paths run for every frame by default, summed up in per_frame */
+#define BENCH_PER_FRAME "map,picture,assemble,start_codes"
+
+/* Key frame size in bytes per pixel */
+#define BENCH_AU_BYTES_PER_PIXEL 0.05
+
+typedef struct
+{
+  const gchar *name;
+  gint width;
+  gint height;
+} BenchResolution;
+
+static const BenchResolution bench_resolutions[] = {
+  {"1080p", 1920, 1080},
+  {"4k", 3840, 2160},
+  {"8k", 7680, 4320},
+};
+
+typedef struct
+{
+  GstVideoInfo info;
+  guint8 *pixels;
+  guint8 *prev_pixels;
+  GstBuffer *frame;
+  const kvz_api *api;
+  GstKvazaarThumbnail *thumb;
+
+  /* one access unit: as Kvazaar data chunks, and as a byte stream */
+  kvz_data_chunk *chunks;
+  guint8 *au;
+  gsize au_size;
+
+  /* a single NAL unit after a 4 bytes start code */
+  guint8 *nal;
+  gsize nal_size;
+  guint8 *nal_out;
+} BenchData;
+
+typedef struct
+{
+  const gchar *name;
+  void (*run) (BenchData * data);
+  gsize (*bytes) (BenchData * data);
+} BenchKernel;
+
+static void
+bench_map (BenchData * data)
+{
+  GstVideoFrame vframe;
+
+  if (gst_video_frame_map (&vframe, &data->info, data->frame, GST_MAP_READ))
+    gst_video_frame_unmap (&vframe);
+}
+
+static void
+bench_picture (BenchData * data)
+{
+  GstVideoInfo *info = &data->info;
+  kvz_picture *pic = data->api->picture_alloc_csp (KVZ_CSP_420,
+      info->width, info->height);
+
+  if (!pic)
+    return;
+
+  pic->y = (kvz_pixel *) (data->pixels + GST_VIDEO_INFO_PLANE_OFFSET (info,
+          0));
+  pic->u = (kvz_pixel *) (data->pixels + GST_VIDEO_INFO_PLANE_OFFSET (info,
+          1));
+  pic->v = (kvz_pixel *) (data->pixels + GST_VIDEO_INFO_PLANE_OFFSET (info,
+          2));
+  pic->stride = GST_VIDEO_INFO_PLANE_STRIDE (info, 0) / sizeof (kvz_pixel);
+  data->api->picture_free (pic);
+}
+
+static void
+bench_thumbnail (BenchData * data)
+{
+  gst_kvazaar_thumbnail_fill (data->thumb, data->pixels,
+      GST_VIDEO_INFO_PLANE_STRIDE (&data->info, 0),
+      GST_VIDEO_INFO_COMP_DEPTH (&data->info, 0));
+}
+
+static void
+bench_static (BenchData * data)
+{
+  GstVideoInfo *info = &data->info;
+  gint stride = GST_VIDEO_INFO_PLANE_STRIDE (info, 0);
+  gint x, y;
+
+  /* identical pictures, every CTU is compared in full */
+  for (y = 0; y < info->height; y += 64)
+    for (x = 0; x < info->width; x += 64) {
+      gint w = MIN (64, info->width - x);
+      gint h = MIN (64, info->height - y);
+
+      if (GST_VIDEO_INFO_COMP_DEPTH (info, 0) > 8)
+        gst_kvazaar_block_changed_u16 ((const guint16 *) (data->pixels +
+                y * stride) + x, stride / 2, (const guint16 *)
+            (data->prev_pixels + y * stride) + x, stride / 2, w, h, 0);
+      else
+        gst_kvazaar_block_changed_u8 (data->pixels + y * stride + x, stride,
+            data->prev_pixels + y * stride + x, stride, w, h, 0);
+    }
+}
+
+static void
+bench_assemble (BenchData * data)
+{
+  GstBuffer *buf = gst_kvazaar_chunks_to_buffer (data->chunks, data->au_size);
+
+  gst_buffer_unref (buf);
+}
+
+static void
+bench_assemble_fill (BenchData * data)
+{
+  GstBuffer *buf = gst_buffer_new_allocate (NULL, data->au_size, NULL);
+  kvz_data_chunk *chunk;
+  gsize offset = 0;
+
+  for (chunk = data->chunks; chunk != NULL; chunk = chunk->next) {
+    gst_buffer_fill (buf, offset, chunk->data, chunk->len);
+    offset += chunk->len;
+  }
+  gst_buffer_unref (buf);
+}
+
+static void
+bench_start_codes (BenchData * data)
+{
+  gsize pos = gst_kvazaar_next_start_code (data->au, data->au_size, 0);
+
+  while (pos < data->au_size)
+    pos = gst_kvazaar_next_start_code (data->au, data->au_size, pos + 3);
+}
+
+static void
+bench_to_nal (BenchData * data)
+{
+  gst_kvazaar_bytestream_to_nal (data->nal, data->nal_size, data->nal_out);
+}
+
+static void
+bench_psnr (BenchData * data)
+{
+  gint stride = GST_VIDEO_INFO_PLANE_STRIDE (&data->info, 0) /
+      sizeof (kvz_pixel);
+
+  gst_kvazaar_plane_sse ((const kvz_pixel *) data->pixels, stride,
+      (const kvz_pixel *) data->prev_pixels, stride, data->info.width,
+      data->info.height);
+}
+
+static void
+bench_ssim (BenchData * data)
+{
+  gint stride = GST_VIDEO_INFO_PLANE_STRIDE (&data->info, 0) /
+      sizeof (kvz_pixel);
+
+  gst_kvazaar_plane_ssim ((const kvz_pixel *) data->pixels, stride,
+      (const kvz_pixel *) data->prev_pixels, stride, data->info.width,
+      data->info.height);
+}
+
+static gsize
+bench_frame_bytes (BenchData * data)
+{
+  return GST_VIDEO_INFO_SIZE (&data->info);
+}
+
+static gsize
+bench_luma_bytes (BenchData * data)
+{
+  return GST_VIDEO_INFO_PLANE_STRIDE (&data->info, 0) *
+      GST_VIDEO_INFO_HEIGHT (&data->info);
+}
+
+static gsize
+bench_two_luma_bytes (BenchData * data)
+{
+  return 2 * bench_luma_bytes (data);
+}
+
+static gsize
+bench_au_bytes (BenchData * data)
+{
+  return data->au_size;
+}
+
+static gsize
+bench_nal_bytes (BenchData * data)
+{
+  return data->nal_size;
+}
+
+static const BenchKernel bench_kernels[] = {
+  {"map", bench_map, bench_frame_bytes},
+  {"picture", bench_picture, bench_frame_bytes},
+  {"thumbnail", bench_thumbnail, bench_luma_bytes},
+  {"static", bench_static, bench_two_luma_bytes},
+  {"assemble", bench_assemble, bench_au_bytes},
+  {"assemble_fill", bench_assemble_fill, bench_au_bytes},
+  {"start_codes", bench_start_codes, bench_au_bytes},
+  {"to_nal", bench_to_nal, bench_nal_bytes},
+  {"psnr", bench_psnr, bench_two_luma_bytes},
+  {"ssim", bench_ssim, bench_two_luma_bytes},
+};
+
+/* Random NAL unit payload with emulation prevention, as an encoder
+ * writes it */
+static void
+bench_fill_payload (GRand * rand, guint8 * out, gsize size)
+{
+  gsize i = 0;
+  guint zeros = 0;
+
+  while (i < size) {
+    guint8 b = g_rand_int_range (rand, 0, 8) ? g_rand_int (rand) : 0;
+
+    if (zeros >= 2 && b <= 3) {
+      out[i++] = 0x03;
+      zeros = 0;
+      if (i == size)
+        break;
+    }
+    out[i++] = b;
+    zeros = b ? 0 : zeros + 1;
+  }
+  /* a NAL unit does not end with a zero byte */
+  if (size && out[size - 1] == 0)
+    out[size - 1] = 0x80;
+}
+
+static void
+bench_data_init (BenchData * data, const BenchResolution * res)
+{
+  static const guint8 start_code[] = { 0x00, 0x00, 0x00, 0x01 };
+  GRand *rand = g_rand_new_with_seed (1);
+  gsize size, offset, nal;
+  kvz_data_chunk **tail;
+  guint i;
+
+  gst_video_info_set_format (&data->info, KVZ_BIT_DEPTH > 8 ?
+      GST_VIDEO_FORMAT_I420_10LE : GST_VIDEO_FORMAT_I420, res->width,
+      res->height);
+  size = GST_VIDEO_INFO_SIZE (&data->info);
+  data->pixels = g_malloc (size);
+  for (i = 0; i < size; i++) {
+    data->pixels[i] = i * 7 + (i >> 12);
+    /* high bytes of 10-bit samples */
+    if (KVZ_BIT_DEPTH > 8 && i % 2)
+      data->pixels[i] &= 0x3;
+  }
+  data->prev_pixels = g_malloc (size);
+  memcpy (data->prev_pixels, data->pixels, size);
+  data->frame = gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY,
+      data->pixels, size, 0, size, NULL, NULL);
+  data->api = kvz_api_get (KVZ_BIT_DEPTH);
+  data->thumb = gst_kvazaar_thumbnail_new (res->width, res->height);
+
+  /* VPS, SPS, PPS and one slice */
+  data->au_size = res->width * res->height * BENCH_AU_BYTES_PER_PIXEL;
+  data->au = g_malloc (data->au_size);
+  offset = 0;
+  for (i = 0; i < 4; i++) {
+    nal = i < 3 ? 24 : data->au_size - offset - sizeof (start_code);
+    memcpy (data->au + offset, start_code, sizeof (start_code));
+    offset += sizeof (start_code);
+    bench_fill_payload (rand, data->au + offset, nal);
+    offset += nal;
+  }
+
+  /* Kvazaar hands the bytes in chunks of KVZ_DATA_CHUNK_SIZE */
+  tail = &data->chunks;
+  for (offset = 0; offset < data->au_size; offset += KVZ_DATA_CHUNK_SIZE) {
+    kvz_data_chunk *chunk = g_new0 (kvz_data_chunk, 1);
+
+    chunk->len = MIN (KVZ_DATA_CHUNK_SIZE, data->au_size - offset);
+    memcpy (chunk->data, data->au + offset, chunk->len);
+    *tail = chunk;
+    tail = &chunk->next;
+  }
+
+  data->nal_size = data->au_size;
+  data->nal = g_malloc (data->nal_size);
+  memcpy (data->nal, start_code, sizeof (start_code));
+  bench_fill_payload (rand, data->nal + sizeof (start_code),
+      data->nal_size - sizeof (start_code));
+  data->nal_out = g_malloc (data->nal_size);
+
+  g_rand_free (rand);
+}
+
+static void
+bench_data_clear (BenchData * data)
+{
+  kvz_data_chunk *chunk, *next;
+
+  for (chunk = data->chunks; chunk; chunk = next) {
+    next = chunk->next;
+    g_free (chunk);
+  }
+  gst_buffer_unref (data->frame);
+  gst_kvazaar_thumbnail_free (data->thumb);
+  g_free (data->pixels);
+  g_free (data->prev_pixels);
+  g_free (data->au);
+  g_free (data->nal);
+  g_free (data->nal_out);
+  memset (data, 0, sizeof (BenchData));
+}
+
+static gint64
+bench_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * G_GINT64_CONSTANT (1000000000) + ts.tv_nsec;
+}
+
+static gint
+bench_compare_times (gconstpointer a, gconstpointer b)
+{
+  gint64 ta = *(const gint64 *) a, tb = *(const gint64 *) b;
+
+  return ta < tb ? -1 : ta > tb;
+}
+
+/* Median time of a run in ns */
+static gint64
+bench_measure (const BenchKernel * kernel, BenchData * data, guint iterations,
+    guint8 * evict, gsize evict_size)
+{
+  gint64 *times = g_new (gint64, iterations);
+  gint64 start, median;
+  guint i;
+
+  /* first touch of the data, and of the pages of the allocations */
+  kernel->run (data);
+
+  for (i = 0; i < iterations; i++) {
+    if (evict)
+      memset (evict, i, evict_size);
+    start = bench_now ();
+    kernel->run (data);
+    times[i] = bench_now () - start;
+  }
+
+  qsort (times, iterations, sizeof (gint64), bench_compare_times);
+  median = times[iterations / 2];
+  g_free (times);
+
+  return median;
+}
+
+static gboolean
+bench_in_list (gchar ** list, const gchar * name)
+{
+  if (!list)
+    return TRUE;
+
+  for (; *list; list++)
+    if (g_strcmp0 (*list, name) == 0)
+      return TRUE;
+
+  return FALSE;
+}
+
+int
+main (int argc, char **argv)
+{
+  gchar *resolutions = NULL, *kernels = NULL, *output = NULL;
+  gint iterations = 50, evict_mb = 64;
+  GOptionEntry entries[] = {
+    {"resolutions", 'r', 0, G_OPTION_ARG_STRING, &resolutions,
+        "Comma separated resolutions among 1080p, 4k and 8k", "LIST"},
+    {"kernels", 'k', 0, G_OPTION_ARG_STRING, &kernels,
+        "Comma separated paths to measure", "LIST"},
+    {"iterations", 'n', 0, G_OPTION_ARG_INT, &iterations,
+        "Runs of each path", "N"},
+    {"evict-mb", 0, 0, G_OPTION_ARG_INT, &evict_mb,
+        "Size of the buffer written for cold caches, above the last level "
+        "cache", "MB"},
+    {"output", 'o', 0, G_OPTION_ARG_FILENAME, &output,
+        "Write the JSON report to FILE instead of stdout", "FILE"},
+    {NULL}
+  };
+  GOptionContext *ctx;
+  GError *err = NULL;
+  gchar **res_list = NULL, **kernel_list = NULL;
+  gchar **per_frame = g_strsplit (BENCH_PER_FRAME, ",", -1);
+  gsize evict_size;
+  guint8 *evict;
+  GString *report, *totals;
+  guint r, k, c;
+  gint ret = 0;
+
+  ctx = g_option_context_new (NULL);
+  g_option_context_set_summary (ctx, "Measure the per-frame paths of "
+      "kvazaarenc outside Kvazaar (" BENCH_VARIANT " kernels)");
+  g_option_context_add_main_entries (ctx, entries, NULL);
+  if (!g_option_context_parse (ctx, &argc, &argv, &err) || iterations <= 0
+      || evict_mb <= 0) {
+    g_printerr ("%s\n", err ? err->message : "invalid option value");
+    g_clear_error (&err);
+    g_option_context_free (ctx);
+    return 1;
+  }
+  g_option_context_free (ctx);
+  gst_init (NULL, NULL);
+
+  if (resolutions)
+    res_list = g_strsplit (resolutions, ",", -1);
+  if (kernels)
+    kernel_list = g_strsplit (kernels, ",", -1);
+  evict_size = (gsize) evict_mb << 20;
+  evict = g_malloc (evict_size);
+
+  report = g_string_new (NULL);
+  g_string_append_printf (report, "{\n  \"version\": 1, \"variant\": \"%s\", "
+      "\"bit_depth\": %d, \"iterations\": %d,\n  \"results\": [",
+      BENCH_VARIANT, KVZ_BIT_DEPTH, iterations);
+  totals = g_string_new (NULL);
+
+  for (r = 0; r < G_N_ELEMENTS (bench_resolutions); r++) {
+    const BenchResolution *res = &bench_resolutions[r];
+    BenchData data = { {0}, };
+
+    if (!bench_in_list (res_list, res->name))
+      continue;
+
+    bench_data_init (&data, res);
+    for (c = 0; c < 2; c++) {
+      const gchar *cache = c ? "cold" : "warm";
+      gint64 per_frame_ns = 0;
+
+      for (k = 0; k < G_N_ELEMENTS (bench_kernels); k++) {
+        const BenchKernel *kernel = &bench_kernels[k];
+        gchar gbps[G_ASCII_DTOSTR_BUF_SIZE];
+        gsize bytes;
+        gint64 ns;
+
+        if (!bench_in_list (kernel_list, kernel->name))
+          continue;
+
+        ns = bench_measure (kernel, &data, iterations, c ? evict : NULL,
+            evict_size);
+        bytes = kernel->bytes (&data);
+        if (bench_in_list (per_frame, kernel->name))
+          per_frame_ns += ns;
+
+        g_string_append_printf (report, "%s\n    {\"kernel\": \"%s\", "
+            "\"resolution\": \"%s\", \"cache\": \"%s\", \"bytes\": %"
+            G_GSIZE_FORMAT ", \"ns_per_frame\": %" G_GINT64_FORMAT ", "
+            "\"gbps\": %s}", report->str[report->len - 1] == '[' ? "" : ",",
+            kernel->name, res->name, cache, bytes, ns,
+            g_ascii_formatd (gbps, sizeof (gbps), "%.3f",
+                ns > 0 ? (gdouble) bytes / ns : 0));
+      }
+
+      g_string_append_printf (totals, "%s\n    {\"resolution\": \"%s\", "
+          "\"cache\": \"%s\", \"ns_per_frame\": %" G_GINT64_FORMAT "}",
+          totals->len ? "," : "", res->name, cache, per_frame_ns);
+    }
+    bench_data_clear (&data);
+  }
+
+  g_string_append_printf (report, "\n  ],\n  \"per_frame_paths\": \"%s\","
+      "\n  \"per_frame\": [%s\n  ]\n}\n", BENCH_PER_FRAME, totals->str);
+
+  if (output) {
+    if (!g_file_set_contents (output, report->str, report->len, &err)) {
+      g_printerr ("%s\n", err->message);
+      g_error_free (err);
+      ret = 1;
+    }
+  } else {
+    g_print ("%s", report->str);
+  }
+
+  g_string_free (totals, TRUE);
+  g_string_free (report, TRUE);
+  g_free (evict);
+  g_strfreev (per_frame);
+  g_strfreev (res_list);
+  g_strfreev (kernel_list);
+
+  return ret;
+}
@@ -0,0 +1,722 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Multi-instance scaling benchmark of kvazaarenc.
+ *
+ * For each number of instances N, N pipelines
+ *
+ *   appsrc ! kvazaarenc ! fakesink
+ *
+ * encode the same synthetic input at the same time, either as N pipelines of
+ * one process (mode "threads") or as N processes of one pipeline each (mode
+ * "processes"). All instances are set up and waiting before the first
+ * picture of any of them is pushed.
+ *
+ * Each step reports the aggregate encode rate, from the first start to the
+ * last end of an instance, the mean and spread of the rates of the
+ * instances, the context switches and, where perf_event is available, the
+ * last level cache misses and references of the step. The efficiency of N
+ * instances is their aggregate rate over N times the rate of one instance in
+ * the same mode, 1 for perfect scaling.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/video/video.h>
+
+#include "kvazaar-bench-utils.h"
+
+/* Distinct pictures prepared per input; longer runs cycle through them */
+#define SCALING_POOL_SIZE 30
+
+/* Input shared by the instances of a process, and the gate they wait on
+ * before their first picture */
+typedef struct
+{
+  GstVideoInfo info;
+  GPtrArray *pictures;
+  guint frames;
+
+  GMutex lock;
+  GCond cond;
+  gboolean go;
+} ScalingInput;
+
+typedef struct
+{
+  ScalingInput *input;
+  GstElement *pipeline;
+  guint pushed;
+  gint64 end;
+} ScalingInstance;
+
+/* Start and end, in monotonic us, and frames of one instance */
+typedef struct
+{
+  gint64 start;
+  gint64 end;
+  guint frames;
+} ScalingTiming;
+
+/* Measures of one step, counters are -1 when not available */
+typedef struct
+{
+  GArray *timings;
+  gint64 context_switches;
+  gint64 llc_misses;
+  gint64 llc_references;
+} ScalingStep;
+
+/* Last level cache misses and references of the process and of the threads
+ * it creates after the counters are opened */
+typedef struct
+{
+  gint fd[2];
+} ScalingCounters;
+
+static void
+scaling_counters_open (ScalingCounters * counters)
+{
+#ifdef __linux__
+  const guint64 configs[2] = { PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_CACHE_REFERENCES
+  };
+  struct perf_event_attr attr;
+  guint i;
+
+  for (i = 0; i < 2; i++) {
+    memset (&attr, 0, sizeof (attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof (attr);
+    attr.config = configs[i];
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    counters->fd[i] = syscall (__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+#else
+  counters->fd[0] = counters->fd[1] = -1;
+#endif
+}
+
+static void
+scaling_counters_enable (ScalingCounters * counters)
+{
+#ifdef __linux__
+  guint i;
+
+  for (i = 0; i < 2; i++)
+    if (counters->fd[i] >= 0)
+      ioctl (counters->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+#endif
+}
+
+/* Reads and closes the counters */
+static void
+scaling_counters_close (ScalingCounters * counters, gint64 * misses,
+    gint64 * references)
+{
+  gint64 *values[2] = { misses, references };
+  guint i;
+
+  for (i = 0; i < 2; i++) {
+    guint64 v;
+
+    *values[i] = -1;
+    if (counters->fd[i] < 0)
+      continue;
+    /* with inherit, the value includes the threads still running */
+    if (read (counters->fd[i], &v, sizeof (v)) == sizeof (v))
+      *values[i] = v;
+    close (counters->fd[i]);
+    counters->fd[i] = -1;
+  }
+}
+
+static gint64
+scaling_context_switches (void)
+{
+  struct rusage usage;
+
+  getrusage (RUSAGE_SELF, &usage);
+  return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+static void
+scaling_need_data (GstAppSrc * src, guint length, gpointer user_data)
+{
+  ScalingInstance *inst = user_data;
+  ScalingInput *input = inst->input;
+  gsize size = GST_VIDEO_INFO_SIZE (&input->info);
+  gint fps_n = GST_VIDEO_INFO_FPS_N (&input->info);
+  gint fps_d = GST_VIDEO_INFO_FPS_D (&input->info);
+  GstBuffer *buf;
+
+  if (inst->pushed == 0) {
+    g_mutex_lock (&input->lock);
+    while (!input->go)
+      g_cond_wait (&input->cond, &input->lock);
+    g_mutex_unlock (&input->lock);
+  }
+
+  if (inst->pushed == input->frames) {
+    gst_app_src_end_of_stream (src);
+    return;
+  }
+
+  buf = gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY,
+      g_ptr_array_index (input->pictures,
+          inst->pushed % input->pictures->len), size, 0, size, NULL, NULL);
+  GST_BUFFER_PTS (buf) = gst_util_uint64_scale (inst->pushed,
+      fps_d * GST_SECOND, fps_n);
+  GST_BUFFER_DURATION (buf) = gst_util_uint64_scale (inst->pushed + 1,
+      fps_d * GST_SECOND, fps_n) - GST_BUFFER_PTS (buf);
+  inst->pushed++;
+
+  gst_app_src_push_buffer (src, buf);
+}
+
+/* Takes the end of an instance when its EOS reaches the sink, not when the
+ * bus of its pipeline is read */
+static GstPadProbeReturn
+scaling_eos_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  ScalingInstance *inst = user_data;
+
+  if (GST_EVENT_TYPE (GST_PAD_PROBE_INFO_EVENT (info)) == GST_EVENT_EOS)
+    inst->end = g_get_monotonic_time ();
+
+  return GST_PAD_PROBE_OK;
+}
+
+static GstElement *
+scaling_pipeline_new (ScalingInstance * inst, const gchar * preset,
+    const gchar * threads, GError ** err)
+{
+  GstAppSrcCallbacks callbacks = { scaling_need_data, NULL, NULL };
+  GstElement *pipeline, *src, *enc, *sink;
+  GstCaps *caps;
+  GstPad *pad;
+  gchar *opts;
+
+  pipeline = gst_parse_launch ("appsrc name=src format=time ! "
+      "kvazaarenc name=enc ! fakesink name=sink sync=false", err);
+  if (!pipeline)
+    return NULL;
+
+  src = gst_bin_get_by_name (GST_BIN (pipeline), "src");
+  caps = gst_video_info_to_caps (&inst->input->info);
+  gst_app_src_set_caps (GST_APP_SRC (src), caps);
+  gst_caps_unref (caps);
+  gst_app_src_set_callbacks (GST_APP_SRC (src), &callbacks, inst, NULL);
+  gst_object_unref (src);
+
+  enc = gst_bin_get_by_name (GST_BIN (pipeline), "enc");
+  gst_util_set_object_arg (G_OBJECT (enc), "preset", preset);
+  opts = g_strdup_printf ("threads=%s", threads);
+  g_object_set (enc, "option-string", opts, NULL);
+  g_free (opts);
+  gst_object_unref (enc);
+
+  sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+  pad = gst_element_get_static_pad (sink, "sink");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+      scaling_eos_probe, inst, NULL);
+  gst_object_unref (pad);
+  gst_object_unref (sink);
+
+  return pipeline;
+}
+
+/* Runs n instances in this process. With wait_stdin, "ready" is printed once
+ * they are set up and the first picture waits for a line on stdin. */
+static gboolean
+scaling_run_local (ScalingInput * input, guint n, const gchar * preset,
+    const gchar * threads, gboolean wait_stdin, ScalingStep * step)
+{
+  ScalingInstance *insts = g_new0 (ScalingInstance, n);
+  ScalingCounters counters;
+  gint64 start, csw;
+  gboolean ret = TRUE;
+  GError *err = NULL;
+  guint i;
+
+  input->go = FALSE;
+  /* before the pipelines, so that their threads are counted */
+  scaling_counters_open (&counters);
+
+  for (i = 0; i < n; i++) {
+    insts[i].input = input;
+    insts[i].pipeline = scaling_pipeline_new (&insts[i], preset, threads,
+        &err);
+    if (!insts[i].pipeline) {
+      g_printerr ("%s\n", err->message);
+      g_clear_error (&err);
+      ret = FALSE;
+      break;
+    }
+    gst_element_set_state (insts[i].pipeline, GST_STATE_PAUSED);
+  }
+
+  if (ret && wait_stdin) {
+    gchar line[16];
+
+    g_print ("ready\n");
+    fflush (stdout);
+    ret = fgets (line, sizeof (line), stdin) != NULL;
+  }
+
+  csw = scaling_context_switches ();
+  scaling_counters_enable (&counters);
+  start = g_get_monotonic_time ();
+  g_mutex_lock (&input->lock);
+  input->go = TRUE;
+  g_cond_broadcast (&input->cond);
+  g_mutex_unlock (&input->lock);
+
+  for (i = 0; ret && i < n; i++)
+    gst_element_set_state (insts[i].pipeline, GST_STATE_PLAYING);
+
+  for (i = 0; ret && i < n; i++) {
+    GstBus *bus = gst_element_get_bus (insts[i].pipeline);
+    GstMessage *msg = gst_bus_timed_pop_filtered (bus, GST_CLOCK_TIME_NONE,
+        GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+
+    if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_ERROR) {
+      gchar *debug = NULL;
+
+      gst_message_parse_error (msg, &err, &debug);
+      g_printerr ("%s\n%s\n", err->message, debug ? debug : "");
+      g_clear_error (&err);
+      g_free (debug);
+      ret = FALSE;
+    }
+    gst_message_unref (msg);
+    gst_object_unref (bus);
+  }
+
+  scaling_counters_close (&counters, &step->llc_misses,
+      &step->llc_references);
+  step->context_switches = scaling_context_switches () - csw;
+
+  for (i = 0; i < n; i++) {
+    ScalingTiming t = { start, insts[i].end, insts[i].pushed };
+
+    if (!insts[i].pipeline)
+      continue;
+    gst_element_set_state (insts[i].pipeline, GST_STATE_NULL);
+    gst_object_unref (insts[i].pipeline);
+    if (ret)
+      g_array_append_val (step->timings, t);
+  }
+  g_free (insts);
+
+  return ret;
+}
+
+/* Runs n child processes of one instance each, released together */
+static gboolean
+scaling_run_processes (const gchar * const *child_argv, guint n,
+    ScalingStep * step)
+{
+  gint *in_fds = g_new (gint, n);
+  FILE **outs = g_new0 (FILE *, n);
+  gboolean ret = TRUE, counted = TRUE;
+  GError *err = NULL;
+  gchar line[256];
+  guint i, started = 0;
+
+  step->context_switches = 0;
+  step->llc_misses = step->llc_references = 0;
+
+  for (i = 0; i < n; i++) {
+    gint out_fd;
+
+    if (!g_spawn_async_with_pipes (NULL, (gchar **) child_argv, NULL, 0,
+            NULL, NULL, NULL, &in_fds[i], &out_fd, NULL, &err)) {
+      g_printerr ("%s\n", err->message);
+      g_clear_error (&err);
+      ret = FALSE;
+      break;
+    }
+    outs[i] = fdopen (out_fd, "r");
+    started++;
+  }
+
+  /* wait until every child is set up */
+  for (i = 0; i < started; i++)
+    if (!fgets (line, sizeof (line), outs[i])
+        || !g_str_has_prefix (line, "ready"))
+      ret = FALSE;
+
+  for (i = 0; i < started; i++) {
+    if (write (in_fds[i], "\n", 1) != 1)
+      ret = FALSE;
+    close (in_fds[i]);
+  }
+
+  for (i = 0; i < started; i++) {
+    ScalingTiming t;
+    gint64 csw, misses, references;
+
+    if (fgets (line, sizeof (line), outs[i]) && sscanf (line,
+            "%" G_GINT64_FORMAT " %" G_GINT64_FORMAT " %u %" G_GINT64_FORMAT
+            " %" G_GINT64_FORMAT " %" G_GINT64_FORMAT, &t.start, &t.end,
+            &t.frames, &csw, &misses, &references) == 6) {
+      g_array_append_val (step->timings, t);
+      step->context_switches += csw;
+      if (misses < 0 || references < 0)
+        counted = FALSE;
+      step->llc_misses += misses;
+      step->llc_references += references;
+    } else {
+      ret = FALSE;
+    }
+    fclose (outs[i]);
+  }
+
+  if (!counted)
+    step->llc_misses = step->llc_references = -1;
+
+  g_free (outs);
+  g_free (in_fds);
+
+  return ret;
+}
+
+static void
+scaling_append_counter (GString * json, const gchar * key, gint64 value)
+{
+  if (value < 0)
+    g_string_append_printf (json, ", \"%s\": null", key);
+  else
+    g_string_append_printf (json, ", \"%s\": %" G_GINT64_FORMAT, key, value);
+}
+
+/* Appends the entry of a step to the report, and returns its aggregate
+ * encode rate */
+static gdouble
+scaling_report_step (GString * report, const gchar * mode, guint n,
+    gboolean ok, const ScalingStep * step, gdouble single_fps)
+{
+  GString *json = g_string_new ("{");
+  gint64 first = G_MAXINT64, last = G_MININT64;
+  guint64 frames = 0;
+  gdouble sum = 0, sum_sq = 0, mean, stddev, wall, fps = 0;
+  guint i;
+
+  bench_json_append_string (json, "mode", mode);
+  g_string_erase (json, 1, 2);
+  g_string_append_printf (json, ", \"instances\": %u", n);
+
+  if (!ok || step->timings->len != n) {
+    bench_json_append_string (json, "status", "error");
+    goto done;
+  }
+
+  for (i = 0; i < n; i++) {
+    const ScalingTiming *t = &g_array_index (step->timings, ScalingTiming, i);
+    gdouble inst_fps = t->end > t->start ?
+        t->frames / ((t->end - t->start) / 1e6) : 0;
+
+    first = MIN (first, t->start);
+    last = MAX (last, t->end);
+    frames += t->frames;
+    sum += inst_fps;
+    sum_sq += inst_fps * inst_fps;
+  }
+  mean = sum / n;
+  stddev = sqrt (MAX (sum_sq / n - mean * mean, 0));
+  wall = (last - first) / 1e6;
+  fps = wall > 0 ? frames / wall : 0;
+
+  bench_json_append_string (json, "status", "ok");
+  g_string_append_printf (json, ", \"frames\": %" G_GUINT64_FORMAT, frames);
+  bench_json_append_double (json, "wall_time", wall);
+  bench_json_append_double (json, "fps", fps);
+  bench_json_append_double (json, "instance_fps_mean", mean);
+  bench_json_append_double (json, "instance_fps_stddev", stddev);
+  bench_json_append_double (json, "instance_fps_cv", mean > 0 ?
+      stddev / mean : 0);
+  scaling_append_counter (json, "context_switches", step->context_switches);
+  scaling_append_counter (json, "llc_misses", step->llc_misses);
+  scaling_append_counter (json, "llc_references", step->llc_references);
+  if (step->llc_misses >= 0 && step->llc_references > 0)
+    bench_json_append_double (json, "llc_miss_rate",
+        (gdouble) step->llc_misses / step->llc_references);
+  if (single_fps > 0)
+    bench_json_append_double (json, "efficiency", fps / (n * single_fps));
+  else if (n == 1)
+    bench_json_append_double (json, "efficiency", 1.0);
+
+  g_printerr ("%-9s %3u instances: %8.2f fps, %7.2f +- %.2f per instance",
+      mode, n, fps, mean, stddev);
+  if (single_fps > 0)
+    g_printerr (", efficiency %.2f", fps / (n * single_fps));
+  g_printerr ("\n");
+
+done:
+  g_string_append_c (json, '}');
+  g_string_append_printf (report, "%s\n    %s",
+      report->str[report->len - 1] == '[' ? "" : ",", json->str);
+  g_string_free (json, TRUE);
+
+  return fps;
+}
+
+/* Parses the instance counts, 1 first as the baseline of the efficiency */
+static GArray *
+scaling_parse_instances (const gchar * str)
+{
+  GArray *counts = g_array_new (FALSE, FALSE, sizeof (guint));
+  guint one = 1, cpus = g_get_num_processors (), n, i;
+  gchar **list;
+
+  g_array_append_val (counts, one);
+  if (g_strcmp0 (str, "auto") == 0) {
+    for (n = 2; n < cpus; n *= 2)
+      g_array_append_val (counts, n);
+    if (cpus > 1)
+      g_array_append_val (counts, cpus);
+    return counts;
+  }
+
+  list = g_strsplit (str, ",", -1);
+  for (i = 0; list[i]; i++) {
+    n = strtoul (list[i], NULL, 10);
+    if (n > 1)
+      g_array_append_val (counts, n);
+  }
+  g_strfreev (list);
+
+  return counts;
+}
+
+int
+main (int argc, char **argv)
+{
+  gchar *instances = g_strdup ("auto");
+  gchar *modes = g_strdup ("threads,processes");
+  gchar *preset = g_strdup ("ultrafast");
+  gchar *resolution = g_strdup ("1280x720");
+  gchar *format = g_strdup ("I420");
+  gchar *threads = g_strdup ("1");
+  gchar *output = NULL, *plugin_path = NULL, *label = NULL;
+  gboolean run_instance = FALSE;
+  gint frames = 120;
+  GOptionEntry entries[] = {
+    {"instances", 'n', 0, G_OPTION_ARG_STRING, &instances,
+        "Comma separated numbers of concurrent instances, or auto for "
+        "powers of two up to the number of CPUs", "LIST"},
+    {"modes", 'm', 0, G_OPTION_ARG_STRING, &modes,
+        "Comma separated modes: threads runs the instances in this process, "
+        "processes one process per instance", "LIST"},
+    {"preset", 'p', 0, G_OPTION_ARG_STRING, &preset,
+        "kvazaarenc preset", "PRESET"},
+    {"resolution", 'r', 0, G_OPTION_ARG_STRING, &resolution,
+        "WIDTHxHEIGHT of the synthetic input", "WxH"},
+    {"format", 'f', 0, G_OPTION_ARG_STRING, &format,
+        "Input format, I420 or I420_10LE", "FORMAT"},
+    {"threads", 't', 0, G_OPTION_ARG_STRING, &threads,
+        "Kvazaar threads of each instance, or auto", "N"},
+    {"frames", 0, 0, G_OPTION_ARG_INT, &frames,
+        "Frames encoded by each instance", "N"},
+    {"output", 'o', 0, G_OPTION_ARG_FILENAME, &output,
+        "Write the JSON report to FILE instead of stdout", "FILE"},
+    {"plugin-path", 0, 0, G_OPTION_ARG_FILENAME, &plugin_path,
+        "Directory of the kvazaarenc plugin to measure", "DIR"},
+    {"label", 'l', 0, G_OPTION_ARG_STRING, &label,
+        "Label of the run in the report, such as a commit", "STRING"},
+    {"run-instance", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE,
+        &run_instance, NULL, NULL},
+    {NULL}
+  };
+  GOptionContext *ctx;
+  GError *err = NULL;
+  ScalingInput input;
+  GstVideoFormat fmt;
+  gint width, height;
+  GArray *counts;
+  gchar **mode_list;
+  GString *report;
+  gchar *frames_str;
+  guint i, m;
+  gint ret = 0;
+
+  ctx = g_option_context_new (NULL);
+  g_option_context_set_summary (ctx, "Measure how the kvazaarenc encode "
+      "rate scales with concurrent instances, in one process and in "
+      "separate processes");
+  g_option_context_add_main_entries (ctx, entries, NULL);
+  g_option_context_add_group (ctx, gst_init_get_option_group ());
+  if (!g_option_context_parse (ctx, &argc, &argv, &err) || frames <= 0) {
+    g_printerr ("%s\n", err ? err->message : "invalid number of frames");
+    g_clear_error (&err);
+    g_option_context_free (ctx);
+    return 1;
+  }
+  g_option_context_free (ctx);
+
+  fmt = gst_video_format_from_string (format);
+  if (sscanf (resolution, "%dx%d", &width, &height) != 2 || width <= 0
+      || height <= 0 || fmt == GST_VIDEO_FORMAT_UNKNOWN) {
+    g_printerr ("invalid resolution %s or format %s\n", resolution, format);
+    return 1;
+  }
+
+  if (plugin_path) {
+    const gchar *prev = g_getenv ("GST_PLUGIN_PATH");
+    gchar *path = prev ? g_strjoin (G_SEARCHPATH_SEPARATOR_S, plugin_path,
+        prev, NULL) : g_strdup (plugin_path);
+
+    /* also seen by the child processes */
+    g_setenv ("GST_PLUGIN_PATH", path, TRUE);
+    g_free (path);
+  }
+  gst_init (NULL, NULL);
+
+  if (!run_instance && !gst_registry_check_feature_version (gst_registry_get
+          (), "kvazaarenc", 0, 0, 0)) {
+    g_printerr ("kvazaarenc not found, see --plugin-path\n");
+    return 1;
+  }
+
+  /* the pictures are prepared before any instance starts and shared by the
+   * instances of this process */
+  gst_video_info_set_format (&input.info, fmt, width, height);
+  GST_VIDEO_INFO_FPS_N (&input.info) = 30;
+  GST_VIDEO_INFO_FPS_D (&input.info) = 1;
+  input.pictures = g_ptr_array_new_with_free_func (g_free);
+  input.frames = frames;
+  for (i = 0; i < MIN ((guint) frames, SCALING_POOL_SIZE); i++)
+    g_ptr_array_add (input.pictures, bench_synthetic_picture (&input.info, i));
+  g_mutex_init (&input.lock);
+  g_cond_init (&input.cond);
+
+  if (run_instance) {
+    ScalingStep step;
+
+    step.timings = g_array_new (FALSE, FALSE, sizeof (ScalingTiming));
+    if (scaling_run_local (&input, 1, preset, threads, TRUE, &step)) {
+      const ScalingTiming *t = &g_array_index (step.timings, ScalingTiming, 0);
+
+      g_print ("%" G_GINT64_FORMAT " %" G_GINT64_FORMAT " %u %"
+          G_GINT64_FORMAT " %" G_GINT64_FORMAT " %" G_GINT64_FORMAT "\n",
+          t->start, t->end, t->frames, step.context_switches,
+          step.llc_misses, step.llc_references);
+    } else {
+      ret = 1;
+    }
+    g_array_free (step.timings, TRUE);
+    g_ptr_array_unref (input.pictures);
+    return ret;
+  }
+
+  report = g_string_new ("{\n  \"version\": 1");
+  if (label)
+    bench_json_append_string (report, "label", label);
+  bench_json_append_string (report, "gstreamer", gst_version_string ());
+  g_string_append_printf (report, ", \"cpus\": %u",
+      g_get_num_processors ());
+  bench_json_append_string (report, "preset", preset);
+  g_string_append_printf (report, ", \"width\": %d, \"height\": %d",
+      width, height);
+  bench_json_append_string (report, "format", format);
+  bench_json_append_string (report, "threads", threads);
+  g_string_append_printf (report, ", \"frames\": %d", frames);
+  g_string_append (report, ",\n  \"results\": [");
+
+  counts = scaling_parse_instances (instances);
+  mode_list = g_strsplit (modes, ",", -1);
+  frames_str = g_strdup_printf ("%d", frames);
+
+  for (m = 0; mode_list[m]; m++) {
+    gboolean processes = g_strcmp0 (mode_list[m], "processes") == 0;
+    const gchar *child_argv[] = { argv[0], "--run-instance",
+      "--preset", preset, "--resolution", resolution, "--format", format,
+      "--threads", threads, "--frames", frames_str, NULL
+    };
+    gdouble single_fps = 0;
+
+    if (!processes && g_strcmp0 (mode_list[m], "threads") != 0) {
+      g_printerr ("unknown mode %s\n", mode_list[m]);
+      ret = 1;
+      continue;
+    }
+
+    for (i = 0; i < counts->len; i++) {
+      guint n = g_array_index (counts, guint, i);
+      ScalingStep step = { NULL, -1, -1, -1 };
+      gboolean ok;
+      gdouble fps;
+
+      step.timings = g_array_new (FALSE, FALSE, sizeof (ScalingTiming));
+      if (processes)
+        ok = scaling_run_processes (child_argv, n, &step);
+      else
+        ok = scaling_run_local (&input, n, preset, threads, FALSE, &step);
+      if (!ok)
+        ret = 1;
+
+      fps = scaling_report_step (report, mode_list[m], n, ok, &step,
+          single_fps);
+      if (n == 1)
+        single_fps = ok ? fps : 0;
+      g_array_free (step.timings, TRUE);
+    }
+  }
+
+  g_string_append (report, "\n  ]\n}\n");
+
+  if (output) {
+    if (!g_file_set_contents (output, report->str, report->len, &err)) {
+      g_printerr ("%s\n", err->message);
+      g_error_free (err);
+      ret = 1;
+    }
+  } else {
+    g_print ("%s", report->str);
+  }
+
+  g_free (frames_str);
+  g_strfreev (mode_list);
+  g_array_free (counts, TRUE);
+  g_string_free (report, TRUE);
+  g_ptr_array_unref (input.pictures);
+
+  return ret;
+}
@@ -0,0 +1,423 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Cheap picture analysis and scaling kernels.
+ *
+ * They work on 8 bits luma, either straight from the input frame or from a
+ * thumbnail downscaled by GST_KVAZAAR_THUMB_SCALE. SSE2 versions are used
+ * when the compiler targets it (always the case on x86_64).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gstkvazaaranalysis.h"
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+GstKvazaarThumbnail *
+gst_kvazaar_thumbnail_new (gint pic_width, gint pic_height)
+{
+  GstKvazaarThumbnail *thumb = g_slice_new (GstKvazaarThumbnail);
+
+  thumb->width = MAX (pic_width / GST_KVAZAAR_THUMB_SCALE, 1);
+  thumb->height = MAX (pic_height / GST_KVAZAAR_THUMB_SCALE, 1);
+  /* Keep rows 16 bytes aligned for the SIMD kernels */
+  thumb->stride = (thumb->width + 15) & ~15;
+  thumb->data = g_malloc0 (thumb->stride * thumb->height);
+
+  return thumb;
+}
+
+void
+gst_kvazaar_thumbnail_free (GstKvazaarThumbnail * thumb)
+{
+  if (!thumb)
+    return;
+
+  g_free (thumb->data);
+  g_slice_free (GstKvazaarThumbnail, thumb);
+}
+
+/*
+ * Downscale a luma plane into the thumbnail. stride is in bytes, depth is the
+ * bit depth of the samples (above 8, samples are 16 bits in native endianness).
+ */
+void
+gst_kvazaar_thumbnail_fill (GstKvazaarThumbnail * thumb, const guint8 * luma,
+    gint stride, gint depth)
+{
+  if (depth > 8)
+    gst_kvazaar_downscale_4x4_u16 (thumb->data, thumb->stride,
+        (const guint16 *) luma, stride / 2, thumb->width, thumb->height,
+        depth - 8);
+  else
+    gst_kvazaar_downscale_4x4_u8 (thumb->data, thumb->stride, luma, stride,
+        thumb->width, thumb->height);
+}
+
+void
+gst_kvazaar_downscale_4x4_u8 (guint8 * dst, gint dst_stride,
+    const guint8 * src, gint src_stride, gint dst_width, gint dst_height)
+{
+  gint x, y, i;
+
+  for (y = 0; y < dst_height; y++) {
+    const guint8 *s = src + 4 * y * src_stride;
+    guint8 *d = dst + y * dst_stride;
+
+    x = 0;
+#ifdef __SSE2__
+    {
+      const __m128i mask = _mm_set1_epi32 (0xffff);
+
+      /* 4 rows of 16 pixels give 4 output pixels */
+      for (; x + 4 <= dst_width; x += 4) {
+        __m128i acc = _mm_setzero_si128 ();
+        __m128i sum;
+
+        for (i = 0; i < 4; i++) {
+          __m128i row = _mm_loadu_si128 ((const __m128i *)
+              (s + i * src_stride + 4 * x));
+          /* pairwise byte sums, then pairs of those: 4 pixels per 32 bits */
+          __m128i lo = _mm_and_si128 (row, _mm_set1_epi16 (0xff));
+          __m128i hi = _mm_srli_epi16 (row, 8);
+          __m128i pairs = _mm_add_epi16 (lo, hi);
+          acc = _mm_add_epi16 (acc, pairs);
+        }
+        sum = _mm_add_epi32 (_mm_and_si128 (acc, mask), _mm_srli_epi32 (acc,
+                16));
+        sum = _mm_srli_epi32 (_mm_add_epi32 (sum, _mm_set1_epi32 (8)), 4);
+        sum = _mm_packs_epi32 (sum, sum);
+        sum = _mm_packus_epi16 (sum, sum);
+        *(guint32 *) (d + x) = (guint32) _mm_cvtsi128_si32 (sum);
+      }
+    }
+#endif
+    for (; x < dst_width; x++) {
+      guint acc = 0;
+
+      for (i = 0; i < 4; i++) {
+        const guint8 *p = s + i * src_stride + 4 * x;
+        acc += p[0] + p[1] + p[2] + p[3];
+      }
+      d[x] = (acc + 8) >> 4;
+    }
+  }
+}
+
+void
+gst_kvazaar_downscale_4x4_u16 (guint8 * dst, gint dst_stride,
+    const guint16 * src, gint src_stride, gint dst_width, gint dst_height,
+    gint shift)
+{
+  gint x, y, i;
+
+  for (y = 0; y < dst_height; y++) {
+    const guint16 *s = src + 4 * y * src_stride;
+    guint8 *d = dst + y * dst_stride;
+
+    for (x = 0; x < dst_width; x++) {
+      guint acc = 0;
+
+      for (i = 0; i < 4; i++) {
+        const guint16 *p = s + i * src_stride + 4 * x;
+        acc += p[0] + p[1] + p[2] + p[3];
+      }
+      d[x] = MIN (((acc + 8) >> 4) >> shift, 255);
+    }
+  }
+}
+
+/*
+ * Halve a plane in both directions. The vertical pairs are averaged first,
+ * then the horizontal ones, both rounding up like pavgb.
+ */
+void
+gst_kvazaar_downscale_2x2_u8 (guint8 * dst, gint dst_stride,
+    const guint8 * src, gint src_stride, gint dst_width, gint dst_height)
+{
+  gint x, y;
+
+  for (y = 0; y < dst_height; y++) {
+    const guint8 *s0 = src + 2 * y * src_stride;
+    const guint8 *s1 = s0 + src_stride;
+    guint8 *d = dst + y * dst_stride;
+
+    x = 0;
+#ifdef __SSE2__
+    {
+      const __m128i even = _mm_set1_epi16 (0xff);
+      const __m128i one = _mm_set1_epi16 (1);
+
+      /* 2 rows of 32 pixels give 16 output pixels */
+      for (; x + 16 <= dst_width; x += 16) {
+        __m128i a = _mm_avg_epu8 (_mm_loadu_si128 ((const __m128i *)
+                (s0 + 2 * x)), _mm_loadu_si128 ((const __m128i *)
+                (s1 + 2 * x)));
+        __m128i b = _mm_avg_epu8 (_mm_loadu_si128 ((const __m128i *)
+                (s0 + 2 * x + 16)), _mm_loadu_si128 ((const __m128i *)
+                (s1 + 2 * x + 16)));
+        __m128i sa = _mm_add_epi16 (_mm_and_si128 (a, even),
+            _mm_srli_epi16 (a, 8));
+        __m128i sb = _mm_add_epi16 (_mm_and_si128 (b, even),
+            _mm_srli_epi16 (b, 8));
+
+        sa = _mm_srli_epi16 (_mm_add_epi16 (sa, one), 1);
+        sb = _mm_srli_epi16 (_mm_add_epi16 (sb, one), 1);
+        _mm_storeu_si128 ((__m128i *) (d + x), _mm_packus_epi16 (sa, sb));
+      }
+    }
+#endif
+    for (; x < dst_width; x++) {
+      guint l = (s0[2 * x] + s1[2 * x] + 1) >> 1;
+      guint r = (s0[2 * x + 1] + s1[2 * x + 1] + 1) >> 1;
+
+      d[x] = (l + r + 1) >> 1;
+    }
+  }
+}
+
+/*
+ * Resample a plane with bilinear interpolation, in 16.16 fixed point with
+ * 8 bits weights. Meant for ratios up to 2, larger ones should be halved
+ * first.
+ */
+void
+gst_kvazaar_scale_bilinear_u8 (guint8 * dst, gint dst_stride, gint dst_width,
+    gint dst_height, const guint8 * src, gint src_stride, gint src_width,
+    gint src_height)
+{
+  guint32 x_step = ((guint64) src_width << 16) / dst_width;
+  guint32 y_step = ((guint64) src_height << 16) / dst_height;
+  gint x, y;
+
+  for (y = 0; y < dst_height; y++) {
+    /* Sample at the center of the destination pixel */
+    gint64 sy = (gint64) y * y_step + y_step / 2 - 0x8000;
+    gint y0, y1;
+    guint fy;
+    const guint8 *r0, *r1;
+    guint8 *d = dst + y * dst_stride;
+
+    sy = CLAMP (sy, 0, ((gint64) src_height - 1) << 16);
+    y0 = sy >> 16;
+    y1 = MIN (y0 + 1, src_height - 1);
+    fy = (sy >> 8) & 0xff;
+    r0 = src + y0 * src_stride;
+    r1 = src + y1 * src_stride;
+
+    for (x = 0; x < dst_width; x++) {
+      gint64 sx = (gint64) x * x_step + x_step / 2 - 0x8000;
+      gint x0, x1;
+      guint fx, top, bottom;
+
+      sx = CLAMP (sx, 0, ((gint64) src_width - 1) << 16);
+      x0 = sx >> 16;
+      x1 = MIN (x0 + 1, src_width - 1);
+      fx = (sx >> 8) & 0xff;
+
+      top = r0[x0] * (256 - fx) + r0[x1] * fx;
+      bottom = r1[x0] * (256 - fx) + r1[x1] * fx;
+      d[x] = (top * (256 - fy) + bottom * fy + 32768) >> 16;
+    }
+  }
+}
+
+/*
+ * Sum of absolute differences of two width x height blocks.
+ */
+guint32
+gst_kvazaar_sad_u8 (const guint8 * a, gint a_stride, const guint8 * b,
+    gint b_stride, gint width, gint height)
+{
+  guint32 sad = 0;
+  gint x, y;
+
+  for (y = 0; y < height; y++) {
+    const guint8 *pa = a + y * a_stride;
+    const guint8 *pb = b + y * b_stride;
+
+    x = 0;
+#ifdef __SSE2__
+    {
+      __m128i acc = _mm_setzero_si128 ();
+
+      for (; x + 16 <= width; x += 16)
+        acc = _mm_add_epi64 (acc, _mm_sad_epu8 (
+                _mm_loadu_si128 ((const __m128i *) (pa + x)),
+                _mm_loadu_si128 ((const __m128i *) (pb + x))));
+      sad += _mm_cvtsi128_si32 (acc) +
+          _mm_cvtsi128_si32 (_mm_srli_si128 (acc, 8));
+    }
+#endif
+    for (; x < width; x++)
+      sad += ABS (pa[x] - pb[x]);
+  }
+
+  return sad;
+}
+
+/*
+ * Sum and sum of squares of a block, for mean and variance.
+ */
+void
+gst_kvazaar_block_sums_u8 (const guint8 * src, gint stride, gint width,
+    gint height, guint32 * sum, guint64 * sqsum)
+{
+  guint32 s = 0;
+  guint64 sq = 0;
+  gint x, y;
+
+  for (y = 0; y < height; y++) {
+    const guint8 *p = src + y * stride;
+
+    x = 0;
+#ifdef __SSE2__
+    {
+      const __m128i zero = _mm_setzero_si128 ();
+      __m128i acc = zero;
+      __m128i acc_sq = zero;
+      guint32 sq_lanes[4];
+
+      for (; x + 16 <= width; x += 16) {
+        __m128i v = _mm_loadu_si128 ((const __m128i *) (p + x));
+        __m128i lo = _mm_unpacklo_epi8 (v, zero);
+        __m128i hi = _mm_unpackhi_epi8 (v, zero);
+
+        acc = _mm_add_epi64 (acc, _mm_sad_epu8 (v, zero));
+        acc_sq = _mm_add_epi32 (acc_sq, _mm_madd_epi16 (lo, lo));
+        acc_sq = _mm_add_epi32 (acc_sq, _mm_madd_epi16 (hi, hi));
+      }
+      s += _mm_cvtsi128_si32 (acc) +
+          _mm_cvtsi128_si32 (_mm_srli_si128 (acc, 8));
+      _mm_storeu_si128 ((__m128i *) sq_lanes, acc_sq);
+      sq += (guint64) sq_lanes[0] + sq_lanes[1] + sq_lanes[2] + sq_lanes[3];
+    }
+#endif
+    for (; x < width; x++) {
+      s += p[x];
+      sq += p[x] * p[x];
+    }
+  }
+
+  *sum = s;
+  *sqsum = sq;
+}
+
+/*
+ * Luma histogram in GST_KVAZAAR_HIST_BINS bins. Four partial histograms are
+ * filled in turn so that consecutive equal samples do not serialize on the
+ * same counter.
+ */
+void
+gst_kvazaar_histogram_u8 (const guint8 * src, gint stride, gint width,
+    gint height, guint32 * hist)
+{
+  guint32 part[4][GST_KVAZAAR_HIST_BINS];
+  const gint shift = 2;         /* 256 levels in 64 bins */
+  gint x, y, i;
+
+  memset (part, 0, sizeof (part));
+
+  for (y = 0; y < height; y++) {
+    const guint8 *p = src + y * stride;
+
+    for (x = 0; x + 4 <= width; x += 4) {
+      part[0][p[x] >> shift]++;
+      part[1][p[x + 1] >> shift]++;
+      part[2][p[x + 2] >> shift]++;
+      part[3][p[x + 3] >> shift]++;
+    }
+    for (; x < width; x++)
+      part[0][p[x] >> shift]++;
+  }
+
+  for (i = 0; i < GST_KVAZAAR_HIST_BINS; i++)
+    hist[i] = part[0][i] + part[1][i] + part[2][i] + part[3][i];
+}
+
+/*
+ * Tell if two blocks differ by more than max_sad. The SAD is checked after
+ * every row so that changed blocks are usually left after a few rows.
+ */
+gboolean
+gst_kvazaar_block_changed_u8 (const guint8 * a, gint a_stride,
+    const guint8 * b, gint b_stride, gint width, gint height, guint32 max_sad)
+{
+  guint32 sad = 0;
+  gint y;
+
+  for (y = 0; y < height; y++) {
+    sad += gst_kvazaar_sad_u8 (a + y * a_stride, a_stride, b + y * b_stride,
+        b_stride, width, 1);
+    if (sad > max_sad)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/*
+ * Same for samples above 8 bits, strides are in samples. The samples fit in
+ * signed 16 bits up to a depth of 15.
+ */
+gboolean
+gst_kvazaar_block_changed_u16 (const guint16 * a, gint a_stride,
+    const guint16 * b, gint b_stride, gint width, gint height, guint32 max_sad)
+{
+  guint32 sad = 0;
+  gint x, y;
+
+  for (y = 0; y < height; y++) {
+    const guint16 *pa = a + y * a_stride;
+    const guint16 *pb = b + y * b_stride;
+
+    x = 0;
+#ifdef __SSE2__
+    {
+      const __m128i one = _mm_set1_epi16 (1);
+      __m128i acc = _mm_setzero_si128 ();
+      guint32 lanes[4];
+
+      for (; x + 8 <= width; x += 8) {
+        __m128i va = _mm_loadu_si128 ((const __m128i *) (pa + x));
+        __m128i vb = _mm_loadu_si128 ((const __m128i *) (pb + x));
+        __m128i diff = _mm_sub_epi16 (_mm_max_epi16 (va, vb),
+            _mm_min_epi16 (va, vb));
+        /* pairs of differences summed into 32 bits lanes */
+        acc = _mm_add_epi32 (acc, _mm_madd_epi16 (diff, one));
+      }
+      _mm_storeu_si128 ((__m128i *) lanes, acc);
+      sad += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+#endif
+    for (; x < width; x++)
+      sad += ABS (pa[x] - pb[x]);
+    if (sad > max_sad)
+      return TRUE;
+  }
+
+  return FALSE;
+}
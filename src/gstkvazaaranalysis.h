@@ -0,0 +1,73 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GST_KVAZAAR_ANALYSIS_H__
+#define __GST_KVAZAAR_ANALYSIS_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Pictures are analysed on a luma thumbnail downscaled by this factor, a CTU
+ * then covers a 16x16 block */
+#define GST_KVAZAAR_THUMB_SCALE 4
+
+/* Bins of the luma histograms */
+#define GST_KVAZAAR_HIST_BINS 64
+
+typedef struct _GstKvazaarThumbnail GstKvazaarThumbnail;
+
+struct _GstKvazaarThumbnail
+{
+  gint width;
+  gint height;
+  gint stride;
+  guint8 *data;
+};
+
+GstKvazaarThumbnail *gst_kvazaar_thumbnail_new (gint pic_width,
+    gint pic_height);
+void gst_kvazaar_thumbnail_free (GstKvazaarThumbnail * thumb);
+void gst_kvazaar_thumbnail_fill (GstKvazaarThumbnail * thumb,
+    const guint8 * luma, gint stride, gint depth);
+
+void gst_kvazaar_downscale_4x4_u8 (guint8 * dst, gint dst_stride,
+    const guint8 * src, gint src_stride, gint dst_width, gint dst_height);
+void gst_kvazaar_downscale_4x4_u16 (guint8 * dst, gint dst_stride,
+    const guint16 * src, gint src_stride, gint dst_width, gint dst_height,
+    gint shift);
+void gst_kvazaar_downscale_2x2_u8 (guint8 * dst, gint dst_stride,
+    const guint8 * src, gint src_stride, gint dst_width, gint dst_height);
+void gst_kvazaar_scale_bilinear_u8 (guint8 * dst, gint dst_stride,
+    gint dst_width, gint dst_height, const guint8 * src, gint src_stride,
+    gint src_width, gint src_height);
+
+guint32 gst_kvazaar_sad_u8 (const guint8 * a, gint a_stride,
+    const guint8 * b, gint b_stride, gint width, gint height);
+void gst_kvazaar_block_sums_u8 (const guint8 * src, gint stride,
+    gint width, gint height, guint32 * sum, guint64 * sqsum);
+void gst_kvazaar_histogram_u8 (const guint8 * src, gint stride,
+    gint width, gint height, guint32 * hist);
+
+gboolean gst_kvazaar_block_changed_u8 (const guint8 * a, gint a_stride,
+    const guint8 * b, gint b_stride, gint width, gint height, guint32 max_sad);
+gboolean gst_kvazaar_block_changed_u16 (const guint16 * a, gint a_stride,
+    const guint16 * b, gint b_stride, gint width, gint height, guint32 max_sad);
+
+G_END_DECLS
+#endif /* __GST_KVAZAAR_ANALYSIS_H__ */
@@ -0,0 +1,958 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * kvazaarbatch encodes many independent streams, one per request sink pad
+ * and its source pad, on a fixed set of worker threads.
+ *
+ * Buffers and serialized events of a stream are queued on its sink pad. A
+ * stream with pending work is pushed to the worker pool, where one worker
+ * at a time runs a batch of its queue through its single-threaded Kvazaar
+ * instance, then gives the other streams their turn. The streaming threads
+ * only queue, so neither they nor Kvazaar own threads per stream.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gstkvazaarbatch.h"
+#include "gstkvazaarcommon.h"
+
+#include <stdio.h>
+#include <string.h>
+
+GST_DEBUG_CATEGORY_STATIC (kvazaar_batch_debug);
+#define GST_CAT_DEFAULT kvazaar_batch_debug
+
+enum
+{
+  PROP_0,
+  PROP_WORKERS,
+  PROP_MAX_QUEUED,
+  PROP_OPTION_STRING
+};
+
+enum
+{
+  PROP_PAD_0,
+  PROP_PAD_BITRATE,
+  PROP_PAD_QP,
+  PROP_PAD_OPTION_STRING,
+  PROP_PAD_FRAMES,
+  PROP_PAD_BYTES,
+  PROP_PAD_ENCODE_TIME
+};
+
+#define PROP_WORKERS_DEFAULT        0
+#define PROP_MAX_QUEUED_DEFAULT     4
+#define PROP_PAD_BITRATE_DEFAULT    0
+#define PROP_PAD_QP_DEFAULT         32
+
+/* Items of a stream worked on before the other streams get a turn */
+#define BATCH_SIZE                  8
+
+static GstStaticPadTemplate sink_factory = GST_STATIC_PAD_TEMPLATE ("sink_%u",
+    GST_PAD_SINK,
+    GST_PAD_REQUEST,
+    GST_STATIC_CAPS ("video/x-raw, "
+        "format = (string) I420, "
+        "framerate = (fraction) [0, MAX], "
+        "width = (int) [ 16, MAX ], " "height = (int) [ 16, MAX ]")
+    );
+
+static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src_%u",
+    GST_PAD_SRC,
+    GST_PAD_SOMETIMES,
+    GST_STATIC_CAPS ("video/x-h265, "
+        "framerate = (fraction) [0/1, MAX], "
+        "width = (int) [ 16, MAX ], " "height = (int) [ 16, MAX ], "
+        "stream-format = (string) byte-stream, "
+        "alignment = (string) au, " "profile = (string) main")
+    );
+
+#define gst_kvazaar_batch_parent_class parent_class
+G_DEFINE_TYPE_WITH_CODE (GstKvazaarBatch, gst_kvazaar_batch,
+    GST_TYPE_ELEMENT, G_IMPLEMENT_INTERFACE (GST_TYPE_CHILD_PROXY,
+        gst_kvazaar_child_proxy_sink_pads_init));
+
+G_DEFINE_TYPE (GstKvazaarBatchPad, gst_kvazaar_batch_pad, GST_TYPE_PAD);
+
+/*
+ * Close the Kvazaar instance of a stream.
+ */
+static void
+gst_kvazaar_batch_pad_close (GstKvazaarBatchPad * pad)
+{
+  gst_kvazaar_close (pad->api, &pad->enc, &pad->config);
+}
+
+/*
+ * Drop the queued items of a stream, with its lock.
+ */
+static void
+gst_kvazaar_batch_pad_clear_queue (GstKvazaarBatchPad * pad)
+{
+  GstMiniObject *item;
+
+  while ((item = g_queue_pop_head (&pad->queue)))
+    gst_mini_object_unref (item);
+  pad->queued_buffers = 0;
+}
+
+static void
+gst_kvazaar_batch_pad_finalize (GObject * object)
+{
+  GstKvazaarBatchPad *pad = GST_KVAZAAR_BATCH_PAD (object);
+
+  gst_kvazaar_batch_pad_close (pad);
+  gst_kvazaar_batch_pad_clear_queue (pad);
+  g_string_free (pad->kvz_opts, TRUE);
+  g_mutex_clear (&pad->lock);
+  g_cond_clear (&pad->cond);
+
+  G_OBJECT_CLASS (gst_kvazaar_batch_pad_parent_class)->finalize (object);
+}
+
+static void
+gst_kvazaar_batch_pad_set_property (GObject * object, guint prop_id,
+    const GValue * value, GParamSpec * pspec)
+{
+  GstKvazaarBatchPad *pad = GST_KVAZAAR_BATCH_PAD (object);
+
+  GST_OBJECT_LOCK (pad);
+  switch (prop_id) {
+    case PROP_PAD_BITRATE:
+      pad->bitrate = g_value_get_uint (value);
+      break;
+    case PROP_PAD_QP:
+      pad->qp = g_value_get_int (value);
+      break;
+    case PROP_PAD_OPTION_STRING:
+      g_string_assign (pad->kvz_opts,
+          g_value_get_string (value) ? g_value_get_string (value) : "");
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+  GST_OBJECT_UNLOCK (pad);
+}
+
+static void
+gst_kvazaar_batch_pad_get_property (GObject * object, guint prop_id,
+    GValue * value, GParamSpec * pspec)
+{
+  GstKvazaarBatchPad *pad = GST_KVAZAAR_BATCH_PAD (object);
+
+  GST_OBJECT_LOCK (pad);
+  switch (prop_id) {
+    case PROP_PAD_BITRATE:
+      g_value_set_uint (value, pad->bitrate);
+      break;
+    case PROP_PAD_QP:
+      g_value_set_int (value, pad->qp);
+      break;
+    case PROP_PAD_OPTION_STRING:
+      g_value_set_string (value, pad->kvz_opts->str);
+      break;
+    case PROP_PAD_FRAMES:
+      g_value_set_uint64 (value, pad->frames);
+      break;
+    case PROP_PAD_BYTES:
+      g_value_set_uint64 (value, pad->bytes);
+      break;
+    case PROP_PAD_ENCODE_TIME:
+      g_value_set_uint64 (value,
+          pad->frames ? pad->encode_time / pad->frames : 0);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+  GST_OBJECT_UNLOCK (pad);
+}
+
+static void
+gst_kvazaar_batch_pad_class_init (GstKvazaarBatchPadClass * klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->set_property = gst_kvazaar_batch_pad_set_property;
+  gobject_class->get_property = gst_kvazaar_batch_pad_get_property;
+  gobject_class->finalize = gst_kvazaar_batch_pad_finalize;
+
+  g_object_class_install_property (gobject_class, PROP_PAD_BITRATE,
+      g_param_spec_uint ("bitrate", "Bitrate",
+          "Bitrate of the stream in kbit/sec (0 = constant QP)", 0,
+          G_MAXINT / 1000, PROP_PAD_BITRATE_DEFAULT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_PAD_QP,
+      g_param_spec_int ("qp", "Quantization parameter",
+          "QP of the stream in constant QP mode", 0, 51, PROP_PAD_QP_DEFAULT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_PAD_OPTION_STRING,
+      g_param_spec_string ("option-string", "Option string",
+          "Kvazaar options of the stream, applied after the ones of the "
+          "element", NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_PAD_FRAMES,
+      g_param_spec_uint64 ("frames", "Frames",
+          "Pictures encoded on the stream", 0, G_MAXUINT64, 0,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_PAD_BYTES,
+      g_param_spec_uint64 ("bytes", "Bytes",
+          "Bytes output on the stream", 0, G_MAXUINT64, 0,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_PAD_ENCODE_TIME,
+      g_param_spec_uint64 ("encode-time", "Encode time",
+          "Mean time of the encode calls of the stream in microseconds", 0,
+          G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+}
+
+static void
+gst_kvazaar_batch_pad_init (GstKvazaarBatchPad * pad)
+{
+  pad->bitrate = PROP_PAD_BITRATE_DEFAULT;
+  pad->qp = PROP_PAD_QP_DEFAULT;
+  pad->kvz_opts = g_string_new (NULL);
+  g_mutex_init (&pad->lock);
+  g_cond_init (&pad->cond);
+  g_queue_init (&pad->queue);
+  pad->last_flow = GST_FLOW_OK;
+}
+
+/*
+ * Open the Kvazaar instance of a stream for its current input, and set the
+ * caps of its source pad.
+ */
+static gboolean
+gst_kvazaar_batch_pad_open (GstKvazaarBatch * batch, GstKvazaarBatchPad * pad)
+{
+  GstVideoInfo *info = &pad->info;
+  kvz_config *config;
+  GstCaps *caps;
+  gchar *bad_option = NULL;
+
+  config = gst_kvazaar_config_new (pad->api, GST_ELEMENT (batch),
+      info->width, info->height, info->fps_n, info->fps_d);
+  if (!config)
+    return FALSE;
+
+  /* The workers are the only threads, Kvazaar runs in the calling one */
+  config->threads = 0;
+  config->owf = 0;
+
+  GST_OBJECT_LOCK (batch);
+  if (batch->kvz_opts->len && !gst_kvazaar_parse_options (pad->api, config,
+          batch->kvz_opts->str, &bad_option)) {
+    GST_WARNING_OBJECT (pad, "Error parsing option '%s' of the element",
+        bad_option);
+    g_free (bad_option);
+  }
+  GST_OBJECT_UNLOCK (batch);
+
+  GST_OBJECT_LOCK (pad);
+  config->target_bitrate = pad->bitrate * 1000;
+  config->qp = pad->qp;
+  if (pad->kvz_opts->len && !gst_kvazaar_parse_options (pad->api, config,
+          pad->kvz_opts->str, &bad_option)) {
+    GST_WARNING_OBJECT (pad, "Error parsing option '%s'", bad_option);
+    g_free (bad_option);
+  }
+  GST_OBJECT_UNLOCK (pad);
+
+  pad->enc = pad->api->encoder_open (config);
+  if (!pad->enc) {
+    GST_ELEMENT_ERROR (batch, STREAM, ENCODE,
+        ("Can not initialize Kvazaar encoder."),
+        ("stream %s, %dx%d", GST_PAD_NAME (pad), info->width, info->height));
+    pad->api->config_destroy (config);
+    return FALSE;
+  }
+  pad->config = config;
+
+  GST_INFO_OBJECT (pad, "opened %dx%d", info->width, info->height);
+
+  caps = gst_kvazaar_output_caps (info->width, info->height, info->fps_n,
+      info->fps_d, info->par_n, info->par_d);
+  gst_pad_push_event (pad->srcpad, gst_event_new_caps (caps));
+  gst_caps_unref (caps);
+
+  return TRUE;
+}
+
+/*
+ * Give a picture to the encoder of a stream (NULL to drain it) and push the
+ * access unit it outputs, if any. Tell in len if there was one.
+ */
+static GstFlowReturn
+gst_kvazaar_batch_pad_encode (GstKvazaarBatch * batch,
+    GstKvazaarBatchPad * pad, kvz_picture * pic, guint32 * len)
+{
+  kvz_data_chunk *chunks = NULL;
+  kvz_picture *img_rec = NULL, *img_src = NULL;
+  kvz_frame_info info_out;
+  GstBuffer *buf;
+  gint64 start;
+
+  *len = 0;
+  start = g_get_monotonic_time ();
+  if (!pad->api->encoder_encode (pad->enc, pic, &chunks, len, &img_rec,
+          &img_src, &info_out)) {
+    GST_ELEMENT_ERROR (batch, STREAM, ENCODE,
+        ("Encode Kvazaar frame failed."), ("stream %s", GST_PAD_NAME (pad)));
+    return GST_FLOW_ERROR;
+  }
+
+  GST_OBJECT_LOCK (pad);
+  pad->encode_time += g_get_monotonic_time () - start;
+  if (*len) {
+    pad->frames++;
+    pad->bytes += *len;
+  }
+  GST_OBJECT_UNLOCK (pad);
+
+  if (!*len) {
+    pad->api->chunk_free (chunks);
+    return GST_FLOW_OK;
+  }
+
+  buf = gst_kvazaar_output_buffer (pad->api, chunks, *len, img_rec, img_src,
+      &info_out, pad->info.fps_n, pad->info.fps_d);
+  if (!buf)
+    return GST_FLOW_ERROR;
+
+  return gst_pad_push (pad->srcpad, buf);
+}
+
+/*
+ * Output the pictures held by the encoder of a stream when send is set, and
+ * close it.
+ */
+static GstFlowReturn
+gst_kvazaar_batch_pad_drain (GstKvazaarBatch * batch,
+    GstKvazaarBatchPad * pad, gboolean send)
+{
+  GstFlowReturn ret = GST_FLOW_OK;
+  guint32 len;
+
+  if (pad->enc && send) {
+    do {
+      ret = gst_kvazaar_batch_pad_encode (batch, pad, NULL, &len);
+    } while (ret == GST_FLOW_OK && len > 0);
+  }
+  gst_kvazaar_batch_pad_close (pad);
+
+  return ret;
+}
+
+/*
+ * Copy the planes of an input picture into a Kvazaar picture.
+ */
+static void
+gst_kvazaar_batch_copy_picture (kvz_picture * pic, GstVideoFrame * vframe)
+{
+  kvz_pixel *dst[3] = { pic->y, pic->u, pic->v };
+  gint c, y;
+
+  for (c = 0; c < 3; c++) {
+    const guint8 *src = GST_VIDEO_FRAME_COMP_DATA (vframe, c);
+    gint src_stride = GST_VIDEO_FRAME_COMP_STRIDE (vframe, c);
+    gint stride = c ? pic->stride / 2 : pic->stride;
+    gint width = MIN (GST_VIDEO_FRAME_COMP_WIDTH (vframe, c), stride);
+    gint height = MIN (GST_VIDEO_FRAME_COMP_HEIGHT (vframe, c),
+        c ? pic->height / 2 : pic->height);
+
+    for (y = 0; y < height; y++)
+      memcpy (dst[c] + y * stride, src + y * src_stride, width);
+  }
+}
+
+static GstFlowReturn
+gst_kvazaar_batch_pad_encode_buffer (GstKvazaarBatch * batch,
+    GstKvazaarBatchPad * pad, GstBuffer * buffer)
+{
+  GstVideoFrame vframe;
+  kvz_picture *pic;
+  GstFlowReturn ret;
+  guint32 len;
+
+  if (!pad->enc && pad->have_info && !gst_kvazaar_batch_pad_open (batch, pad))
+    return GST_FLOW_NOT_NEGOTIATED;
+  if (!pad->enc) {
+    GST_ELEMENT_ERROR (batch, CORE, NEGOTIATION, (NULL),
+        ("stream %s got a buffer before its caps", GST_PAD_NAME (pad)));
+    return GST_FLOW_NOT_NEGOTIATED;
+  }
+
+  if (!gst_video_frame_map (&vframe, &pad->info, buffer, GST_MAP_READ)) {
+    GST_ELEMENT_ERROR (batch, STREAM, FORMAT, ("Failed to map frame."),
+        (NULL));
+    return GST_FLOW_ERROR;
+  }
+
+  pic = pad->api->picture_alloc (pad->info.width, pad->info.height);
+  if (!pic) {
+    gst_video_frame_unmap (&vframe);
+    return GST_FLOW_ERROR;
+  }
+  gst_kvazaar_batch_copy_picture (pic, &vframe);
+  gst_video_frame_unmap (&vframe);
+
+  pic->pts = GST_BUFFER_PTS (buffer);
+  pic->dts = GST_BUFFER_DTS (buffer);
+
+  ret = gst_kvazaar_batch_pad_encode (batch, pad, pic, &len);
+  pad->api->picture_free (pic);
+
+  return ret;
+}
+
+static GstFlowReturn
+gst_kvazaar_batch_pad_process_event (GstKvazaarBatch * batch,
+    GstKvazaarBatchPad * pad, GstEvent * event)
+{
+  GstFlowReturn ret = GST_FLOW_OK;
+  GstCaps *caps;
+
+  switch (GST_EVENT_TYPE (event)) {
+    case GST_EVENT_CAPS:
+      gst_event_parse_caps (event, &caps);
+      ret = gst_kvazaar_batch_pad_drain (batch, pad, TRUE);
+      pad->have_info = gst_video_info_from_caps (&pad->info, caps);
+      if (!pad->have_info || !gst_kvazaar_batch_pad_open (batch, pad))
+        ret = GST_FLOW_NOT_NEGOTIATED;
+      gst_event_unref (event);
+      return ret;
+    case GST_EVENT_EOS:
+      ret = gst_kvazaar_batch_pad_drain (batch, pad, TRUE);
+      break;
+    default:
+      break;
+  }
+
+  gst_pad_push_event (pad->srcpad, event);
+
+  return ret;
+}
+
+/*
+ * Let a worker run the queue of a stream, with its lock.
+ */
+static void
+gst_kvazaar_batch_schedule (GstKvazaarBatch * batch, GstKvazaarBatchPad * pad)
+{
+  if (pad->scheduled || !batch->pool)
+    return;
+
+  pad->scheduled = TRUE;
+  g_thread_pool_push (batch->pool, gst_object_ref (pad), NULL);
+}
+
+/*
+ * Worker: run a batch of the queue of a stream, then either give the
+ * stream back to the pool when more is queued, or unschedule it. A stream
+ * stays scheduled meanwhile, so a single worker runs it at a time and its
+ * order is kept.
+ */
+static void
+gst_kvazaar_batch_work (gpointer data, gpointer user_data)
+{
+  GstKvazaarBatchPad *pad = data;
+  GstKvazaarBatch *batch = user_data;
+  guint n;
+
+  for (n = 0; n < BATCH_SIZE; n++) {
+    GstMiniObject *item;
+    GstFlowReturn ret;
+
+    g_mutex_lock (&pad->lock);
+    item = g_queue_pop_head (&pad->queue);
+    if (!item) {
+      pad->scheduled = FALSE;
+      g_cond_broadcast (&pad->cond);
+      g_mutex_unlock (&pad->lock);
+      gst_object_unref (pad);
+      return;
+    }
+    if (GST_IS_BUFFER (item))
+      pad->queued_buffers--;
+    g_cond_broadcast (&pad->cond);
+    g_mutex_unlock (&pad->lock);
+
+    if (GST_IS_BUFFER (item)) {
+      ret = gst_kvazaar_batch_pad_encode_buffer (batch, pad,
+          GST_BUFFER_CAST (item));
+      gst_buffer_unref (GST_BUFFER_CAST (item));
+    } else {
+      ret = gst_kvazaar_batch_pad_process_event (batch, pad,
+          GST_EVENT_CAST (item));
+    }
+
+    if (ret != GST_FLOW_OK) {
+      g_mutex_lock (&pad->lock);
+      pad->last_flow = ret;
+      g_cond_broadcast (&pad->cond);
+      g_mutex_unlock (&pad->lock);
+    }
+  }
+
+  /* The pool is freed only once every stream is flushing, so it is not
+   * pushed to then */
+  g_mutex_lock (&pad->lock);
+  if (pad->flushing || !pad->queue.length) {
+    pad->scheduled = FALSE;
+    g_cond_broadcast (&pad->cond);
+    g_mutex_unlock (&pad->lock);
+    gst_object_unref (pad);
+    return;
+  }
+  g_thread_pool_push (batch->pool, pad, NULL);
+  g_mutex_unlock (&pad->lock);
+}
+
+static GstFlowReturn
+gst_kvazaar_batch_chain (GstPad * sinkpad, GstObject * parent,
+    GstBuffer * buffer)
+{
+  GstKvazaarBatch *batch = GST_KVAZAAR_BATCH (parent);
+  GstKvazaarBatchPad *pad = GST_KVAZAAR_BATCH_PAD (sinkpad);
+  GstFlowReturn ret;
+  guint max_queued;
+
+  GST_OBJECT_LOCK (batch);
+  max_queued = batch->max_queued;
+  GST_OBJECT_UNLOCK (batch);
+
+  g_mutex_lock (&pad->lock);
+  while (!pad->flushing && pad->last_flow == GST_FLOW_OK &&
+      pad->queued_buffers >= max_queued)
+    g_cond_wait (&pad->cond, &pad->lock);
+
+  ret = pad->flushing ? GST_FLOW_FLUSHING : pad->last_flow;
+  if (ret == GST_FLOW_OK || ret == GST_FLOW_NOT_LINKED) {
+    g_queue_push_tail (&pad->queue, buffer);
+    pad->queued_buffers++;
+    gst_kvazaar_batch_schedule (batch, pad);
+  } else {
+    gst_buffer_unref (buffer);
+  }
+  g_mutex_unlock (&pad->lock);
+
+  return ret;
+}
+
+/*
+ * Stop a stream: drop its queue and wake its streaming thread.
+ */
+static void
+gst_kvazaar_batch_pad_set_flushing (GstKvazaarBatchPad * pad)
+{
+  g_mutex_lock (&pad->lock);
+  pad->flushing = TRUE;
+  gst_kvazaar_batch_pad_clear_queue (pad);
+  g_cond_broadcast (&pad->cond);
+  g_mutex_unlock (&pad->lock);
+}
+
+/*
+ * Wait for the worker of a stopped stream to be done, once downstream does
+ * not block it anymore.
+ */
+static void
+gst_kvazaar_batch_pad_wait_idle (GstKvazaarBatchPad * pad)
+{
+  g_mutex_lock (&pad->lock);
+  while (pad->scheduled)
+    g_cond_wait (&pad->cond, &pad->lock);
+  g_mutex_unlock (&pad->lock);
+}
+
+static void
+gst_kvazaar_batch_pad_reset (GstKvazaarBatchPad * pad)
+{
+  g_mutex_lock (&pad->lock);
+  pad->flushing = FALSE;
+  pad->last_flow = GST_FLOW_OK;
+  g_mutex_unlock (&pad->lock);
+}
+
+static gboolean
+gst_kvazaar_batch_sink_event (GstPad * sinkpad, GstObject * parent,
+    GstEvent * event)
+{
+  GstKvazaarBatch *batch = GST_KVAZAAR_BATCH (parent);
+  GstKvazaarBatchPad *pad = GST_KVAZAAR_BATCH_PAD (sinkpad);
+  gboolean res = TRUE;
+
+  switch (GST_EVENT_TYPE (event)) {
+    case GST_EVENT_FLUSH_START:
+      gst_kvazaar_batch_pad_set_flushing (pad);
+      res = gst_pad_push_event (pad->srcpad, event);
+      gst_kvazaar_batch_pad_wait_idle (pad);
+      return res;
+    case GST_EVENT_FLUSH_STOP:
+      /* The worker is done with the stream since flush-start, the encoder
+       * is opened again with the next buffer */
+      gst_kvazaar_batch_pad_drain (batch, pad, FALSE);
+      gst_kvazaar_batch_pad_reset (pad);
+      return gst_pad_push_event (pad->srcpad, event);
+    default:
+      break;
+  }
+
+  if (!GST_EVENT_IS_SERIALIZED (event))
+    return gst_pad_event_default (sinkpad, parent, event);
+
+  /* In order with the buffers */
+  g_mutex_lock (&pad->lock);
+  if (pad->flushing) {
+    gst_event_unref (event);
+    res = FALSE;
+  } else {
+    g_queue_push_tail (&pad->queue, event);
+    gst_kvazaar_batch_schedule (batch, pad);
+  }
+  g_mutex_unlock (&pad->lock);
+
+  return res;
+}
+
+static gboolean
+gst_kvazaar_batch_sink_query (GstPad * sinkpad, GstObject * parent,
+    GstQuery * query)
+{
+  GstKvazaarBatchPad *pad = GST_KVAZAAR_BATCH_PAD (sinkpad);
+  GstCaps *caps, *filter;
+
+  switch (GST_QUERY_TYPE (query)) {
+    case GST_QUERY_CAPS:
+      gst_query_parse_caps (query, &filter);
+      caps = gst_pad_get_pad_template_caps (sinkpad);
+      if (filter) {
+        GstCaps *tmp = gst_caps_intersect_full (filter, caps,
+            GST_CAPS_INTERSECT_FIRST);
+
+        gst_caps_unref (caps);
+        caps = tmp;
+      }
+      gst_query_set_caps_result (query, caps);
+      gst_caps_unref (caps);
+      return TRUE;
+    case GST_QUERY_ALLOCATION:
+      /* Input is copied, any memory will do */
+      return FALSE;
+    case GST_QUERY_DRAIN:
+      g_mutex_lock (&pad->lock);
+      while (pad->scheduled && !pad->flushing)
+        g_cond_wait (&pad->cond, &pad->lock);
+      g_mutex_unlock (&pad->lock);
+      return TRUE;
+    default:
+      break;
+  }
+
+  return gst_pad_query_default (sinkpad, parent, query);
+}
+
+/*
+ * The two pads of a stream are only linked to each other.
+ */
+static GstIterator *
+gst_kvazaar_batch_iterate_internal_links (GstPad * pad, GstObject * parent)
+{
+  GstPad *other;
+  GValue val = G_VALUE_INIT;
+  GstIterator *it;
+
+  if (GST_PAD_DIRECTION (pad) == GST_PAD_SINK)
+    other = GST_KVAZAAR_BATCH_PAD (pad)->srcpad;
+  else
+    other = gst_pad_get_element_private (pad);
+  if (!other)
+    return NULL;
+
+  g_value_init (&val, GST_TYPE_PAD);
+  g_value_set_object (&val, other);
+  it = gst_iterator_new_single (GST_TYPE_PAD, &val);
+  g_value_unset (&val);
+
+  return it;
+}
+
+static GstPad *
+gst_kvazaar_batch_request_new_pad (GstElement * element,
+    GstPadTemplate * templ, const gchar * req_name, const GstCaps * caps)
+{
+  GstKvazaarBatch *batch = GST_KVAZAAR_BATCH (element);
+  GstKvazaarBatchPad *pad;
+  GstPad *srcpad;
+  gchar *name;
+  guint index;
+
+  GST_OBJECT_LOCK (batch);
+  if (!req_name || sscanf (req_name, "sink_%u", &index) != 1)
+    index = batch->pad_count;
+  batch->pad_count = MAX (batch->pad_count, index + 1);
+  GST_OBJECT_UNLOCK (batch);
+
+  name = g_strdup_printf ("sink_%u", index);
+  pad = g_object_new (GST_TYPE_KVAZAAR_BATCH_PAD, "name", name,
+      "direction", GST_PAD_SINK, "template", templ, NULL);
+  g_free (name);
+  pad->api = batch->api;
+  gst_pad_set_chain_function (GST_PAD (pad),
+      GST_DEBUG_FUNCPTR (gst_kvazaar_batch_chain));
+  gst_pad_set_event_function (GST_PAD (pad),
+      GST_DEBUG_FUNCPTR (gst_kvazaar_batch_sink_event));
+  gst_pad_set_query_function (GST_PAD (pad),
+      GST_DEBUG_FUNCPTR (gst_kvazaar_batch_sink_query));
+  gst_pad_set_iterate_internal_links_function (GST_PAD (pad),
+      GST_DEBUG_FUNCPTR (gst_kvazaar_batch_iterate_internal_links));
+
+  name = g_strdup_printf ("src_%u", index);
+  srcpad = gst_pad_new_from_static_template (&src_factory, name);
+  g_free (name);
+  gst_pad_set_element_private (srcpad, pad);
+  gst_pad_set_iterate_internal_links_function (srcpad,
+      GST_DEBUG_FUNCPTR (gst_kvazaar_batch_iterate_internal_links));
+  gst_pad_use_fixed_caps (srcpad);
+  pad->srcpad = srcpad;
+
+  if (GST_STATE (element) >= GST_STATE_PAUSED) {
+    gst_pad_set_active (srcpad, TRUE);
+    gst_pad_set_active (GST_PAD (pad), TRUE);
+  }
+
+  if (!gst_element_add_pad (element, GST_PAD (pad))) {
+    gst_object_unref (srcpad);
+    return NULL;
+  }
+  gst_element_add_pad (element, srcpad);
+  gst_child_proxy_child_added (GST_CHILD_PROXY (element), G_OBJECT (pad),
+      GST_OBJECT_NAME (pad));
+
+  return GST_PAD (pad);
+}
+
+static void
+gst_kvazaar_batch_release_pad (GstElement * element, GstPad * sinkpad)
+{
+  GstKvazaarBatchPad *pad = GST_KVAZAAR_BATCH_PAD (sinkpad);
+  GstPad *srcpad = pad->srcpad;
+
+  gst_kvazaar_batch_pad_set_flushing (pad);
+  gst_pad_set_active (srcpad, FALSE);
+  gst_kvazaar_batch_pad_wait_idle (pad);
+  gst_child_proxy_child_removed (GST_CHILD_PROXY (element), G_OBJECT (pad),
+      GST_OBJECT_NAME (pad));
+
+  gst_element_remove_pad (element, srcpad);
+  gst_element_remove_pad (element, sinkpad);
+}
+
+/*
+ * Apply func to every stream.
+ */
+static void
+gst_kvazaar_batch_foreach_pad (GstKvazaarBatch * batch,
+    void (*func) (GstKvazaarBatchPad * pad))
+{
+  GList *pads, *l;
+
+  GST_OBJECT_LOCK (batch);
+  pads = g_list_copy_deep (GST_ELEMENT (batch)->sinkpads,
+      (GCopyFunc) gst_object_ref, NULL);
+  GST_OBJECT_UNLOCK (batch);
+
+  for (l = pads; l; l = l->next)
+    func (l->data);
+  g_list_free_full (pads, gst_object_unref);
+}
+
+static GstStateChangeReturn
+gst_kvazaar_batch_change_state (GstElement * element,
+    GstStateChange transition)
+{
+  GstKvazaarBatch *batch = GST_KVAZAAR_BATCH (element);
+  GstStateChangeReturn ret;
+  GError *err = NULL;
+  guint workers;
+
+  switch (transition) {
+    case GST_STATE_CHANGE_READY_TO_PAUSED:
+      GST_OBJECT_LOCK (batch);
+      workers = batch->workers ? batch->workers : g_get_num_processors ();
+      GST_OBJECT_UNLOCK (batch);
+      batch->pool = g_thread_pool_new (gst_kvazaar_batch_work, batch,
+          workers, TRUE, &err);
+      if (!batch->pool) {
+        GST_ELEMENT_ERROR (batch, RESOURCE, FAILED,
+            ("Failed to start the workers."), ("%s", err->message));
+        g_error_free (err);
+        return GST_STATE_CHANGE_FAILURE;
+      }
+      GST_INFO_OBJECT (batch, "started %u workers", workers);
+      gst_kvazaar_batch_foreach_pad (batch, gst_kvazaar_batch_pad_reset);
+      break;
+    case GST_STATE_CHANGE_PAUSED_TO_READY:
+      /* Unblock the streaming threads before the pads are deactivated, the
+       * workers are waited for with the pool */
+      gst_kvazaar_batch_foreach_pad (batch, gst_kvazaar_batch_pad_set_flushing);
+      break;
+    default:
+      break;
+  }
+
+  ret = GST_ELEMENT_CLASS (parent_class)->change_state (element, transition);
+
+  switch (transition) {
+    case GST_STATE_CHANGE_PAUSED_TO_READY:
+      if (batch->pool)
+        g_thread_pool_free (batch->pool, FALSE, TRUE);
+      batch->pool = NULL;
+      gst_kvazaar_batch_foreach_pad (batch, gst_kvazaar_batch_pad_close);
+      break;
+    default:
+      break;
+  }
+
+  return ret;
+}
+
+static void
+gst_kvazaar_batch_set_property (GObject * object, guint prop_id,
+    const GValue * value, GParamSpec * pspec)
+{
+  GstKvazaarBatch *batch = GST_KVAZAAR_BATCH (object);
+
+  GST_OBJECT_LOCK (batch);
+  switch (prop_id) {
+    case PROP_WORKERS:
+      batch->workers = g_value_get_uint (value);
+      break;
+    case PROP_MAX_QUEUED:
+      batch->max_queued = g_value_get_uint (value);
+      break;
+    case PROP_OPTION_STRING:
+      g_string_assign (batch->kvz_opts,
+          g_value_get_string (value) ? g_value_get_string (value) : "");
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+  GST_OBJECT_UNLOCK (batch);
+}
+
+static void
+gst_kvazaar_batch_get_property (GObject * object, guint prop_id,
+    GValue * value, GParamSpec * pspec)
+{
+  GstKvazaarBatch *batch = GST_KVAZAAR_BATCH (object);
+
+  GST_OBJECT_LOCK (batch);
+  switch (prop_id) {
+    case PROP_WORKERS:
+      g_value_set_uint (value, batch->workers);
+      break;
+    case PROP_MAX_QUEUED:
+      g_value_set_uint (value, batch->max_queued);
+      break;
+    case PROP_OPTION_STRING:
+      g_value_set_string (value, batch->kvz_opts->str);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+  GST_OBJECT_UNLOCK (batch);
+}
+
+static void
+gst_kvazaar_batch_finalize (GObject * object)
+{
+  GstKvazaarBatch *batch = GST_KVAZAAR_BATCH (object);
+
+  g_string_free (batch->kvz_opts, TRUE);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
+static void
+gst_kvazaar_batch_class_init (GstKvazaarBatchClass * klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+
+  GST_DEBUG_CATEGORY_INIT (kvazaar_batch_debug, "kvazaarbatch", 0,
+      "HEVC/H.265 multi-stream encoding element");
+
+  gobject_class->set_property = gst_kvazaar_batch_set_property;
+  gobject_class->get_property = gst_kvazaar_batch_get_property;
+  gobject_class->finalize = gst_kvazaar_batch_finalize;
+
+  element_class->request_new_pad =
+      GST_DEBUG_FUNCPTR (gst_kvazaar_batch_request_new_pad);
+  element_class->release_pad = GST_DEBUG_FUNCPTR (gst_kvazaar_batch_release_pad);
+  element_class->change_state =
+      GST_DEBUG_FUNCPTR (gst_kvazaar_batch_change_state);
+
+  g_object_class_install_property (gobject_class, PROP_WORKERS,
+      g_param_spec_uint ("workers", "Workers",
+          "Threads encoding all the streams (0 = number of processors)",
+          0, G_MAXINT, PROP_WORKERS_DEFAULT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_QUEUED,
+      g_param_spec_uint ("max-queued", "Max queued",
+          "Buffers waiting for a worker per stream before blocking its "
+          "streaming thread", 1, 64, PROP_MAX_QUEUED_DEFAULT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_OPTION_STRING,
+      g_param_spec_string ("option-string", "Option string",
+          "Kvazaar options of every stream, as name=value separated by "
+          "coma (for instance preset=ultrafast,gop=0)",
+          NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  gst_element_class_add_static_pad_template (element_class, &sink_factory);
+  gst_element_class_add_static_pad_template (element_class, &src_factory);
+
+  gst_element_class_set_static_metadata (element_class,
+      "Kvazaar HEVC/H.265 multi-stream encoder", "Codec/Encoder/Video",
+      "Encodes many independent streams on a shared set of workers",
+      "Alexandre Esse <alexandre.esse.dev@gmail.com>");
+}
+
+static void
+gst_kvazaar_batch_init (GstKvazaarBatch * batch)
+{
+  batch->api = kvz_api_get (KVZ_BIT_DEPTH);
+  if (!batch->api)
+    batch->api = kvz_api_get (0);
+
+  batch->workers = PROP_WORKERS_DEFAULT;
+  batch->max_queued = PROP_MAX_QUEUED_DEFAULT;
+  batch->kvz_opts = g_string_new (NULL);
+}
@@ -0,0 +1,111 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GST_KVAZAAR_BATCH_H__
+#define __GST_KVAZAAR_BATCH_H__
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <kvazaar.h>
+
+G_BEGIN_DECLS
+#define GST_TYPE_KVAZAAR_BATCH \
+  (gst_kvazaar_batch_get_type())
+#define GST_KVAZAAR_BATCH(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_KVAZAAR_BATCH,GstKvazaarBatch))
+#define GST_IS_KVAZAAR_BATCH(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_KVAZAAR_BATCH))
+#define GST_TYPE_KVAZAAR_BATCH_PAD \
+  (gst_kvazaar_batch_pad_get_type())
+#define GST_KVAZAAR_BATCH_PAD(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_KVAZAAR_BATCH_PAD,GstKvazaarBatchPad))
+typedef struct _GstKvazaarBatch GstKvazaarBatch;
+typedef struct _GstKvazaarBatchClass GstKvazaarBatchClass;
+typedef struct _GstKvazaarBatchPad GstKvazaarBatchPad;
+typedef struct _GstKvazaarBatchPadClass GstKvazaarBatchPadClass;
+
+/*
+ * Sink pad of one stream, with its source pad, its Kvazaar instance and the
+ * buffers and serialized events waiting for a worker.
+ */
+struct _GstKvazaarBatchPad
+{
+  GstPad pad;
+
+  /*< private > */
+  GstPad *srcpad;
+  const kvz_api *api;
+
+  /* properties, object lock */
+  guint    bitrate;          /* in kbit/s, 0: constant QP */
+  gint     qp;
+  GString  *kvz_opts;        /* on top of the option string of the element */
+
+  /* statistics, object lock */
+  guint64  frames;
+  guint64  bytes;
+  guint64  encode_time;      /* in us, all frames */
+
+  /* queue of the stream, lock */
+  GMutex   lock;
+  GCond    cond;
+  GQueue   queue;            /* GstBuffer and GstEvent in stream order */
+  guint    queued_buffers;
+  gboolean scheduled;        /* in the worker pool or being worked on */
+  gboolean flushing;
+  GstFlowReturn last_flow;
+
+  /* worker only */
+  kvz_encoder *enc;
+  kvz_config *config;
+  GstVideoInfo info;
+  gboolean have_info;
+};
+
+struct _GstKvazaarBatchPadClass
+{
+  GstPadClass parent_class;
+};
+
+struct _GstKvazaarBatch
+{
+  GstElement element;
+
+  /*< private > */
+  const kvz_api *api;
+
+  /* properties */
+  guint    workers;          /* 0: number of processors */
+  guint    max_queued;       /* buffers waiting per stream */
+  GString  *kvz_opts;
+
+  /* fixed set of threads encoding all streams */
+  GThreadPool *pool;
+  guint    pad_count;
+};
+
+struct _GstKvazaarBatchClass
+{
+  GstElementClass parent_class;
+};
+
+GType gst_kvazaar_batch_get_type (void);
+GType gst_kvazaar_batch_pad_get_type (void);
+
+G_END_DECLS
+#endif /* __GST_KVAZAAR_BATCH_H__ */
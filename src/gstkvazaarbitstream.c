@@ -0,0 +1,149 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Annex B byte stream helpers for the output of Kvazaar.
+ *
+ * The scans look at 16 bytes at once with SSE2 when the compiler targets it
+ * (always the case on x86_64); most of a coded slice has no zero byte.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gstkvazaarbitstream.h"
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Find the next Annex B start code at or after from. A leading zero byte of
+ * a 4 bytes start code is included. Returns size if there is none.
+ */
+gsize
+gst_kvazaar_next_start_code (const guint8 * data, gsize size, gsize from)
+{
+  gsize i = from;
+
+#ifdef __SSE2__
+  {
+    const __m128i zero = _mm_setzero_si128 ();
+    const __m128i one = _mm_set1_epi8 (1);
+
+    /* 00 00 01 at i: compare three shifted loads */
+    for (; i + 18 <= size; i += 16) {
+      __m128i b0 = _mm_loadu_si128 ((const __m128i *) (data + i));
+      __m128i b1 = _mm_loadu_si128 ((const __m128i *) (data + i + 1));
+      __m128i b2 = _mm_loadu_si128 ((const __m128i *) (data + i + 2));
+      gint mask = _mm_movemask_epi8 (_mm_and_si128 (_mm_and_si128
+              (_mm_cmpeq_epi8 (b0, zero), _mm_cmpeq_epi8 (b1, zero)),
+              _mm_cmpeq_epi8 (b2, one)));
+
+      if (mask) {
+        i += g_bit_nth_lsf (mask, -1);
+        return (i > from && data[i - 1] == 0x00) ? i - 1 : i;
+      }
+    }
+  }
+#endif
+
+  for (; i + 3 <= size; i++) {
+    if (data[i + 2] > 1) {
+      i += 2;
+      continue;
+    }
+    if (data[i] == 0x00 && data[i + 1] == 0x00 && data[i + 2] == 0x01)
+      return (i > from && data[i - 1] == 0x00) ? i - 1 : i;
+  }
+
+  return size;
+}
+
+/*
+ * Extract the first NAL unit of a byte stream starting with a 4 bytes start
+ * code into out, which holds at least size bytes. The emulation prevention
+ * bytes (0x03 after 0x00 0x00) are removed and the NAL unit ends at the next
+ * 4 bytes start code. Returns its size.
+ */
+gsize
+gst_kvazaar_bytestream_to_nal (const guint8 * data, gsize size, guint8 * out)
+{
+  gsize i, j;
+  guint zeros = 0;
+
+  for (i = 4, j = 0; i < size; i++) {
+#ifdef __SSE2__
+    /* A block without a zero byte after a non-zero one is copied as is */
+    if (zeros == 0) {
+      while (i + 16 <= size && _mm_movemask_epi8 (_mm_cmpeq_epi8
+              (_mm_loadu_si128 ((const __m128i *) (data + i)),
+                  _mm_setzero_si128 ())) == 0) {
+        memcpy (out + j, data + i, 16);
+        i += 16;
+        j += 16;
+      }
+      if (i == size)
+        break;
+    }
+#endif
+    if (data[i] == 0x00) {
+      zeros++;
+    } else if (data[i] == 0x03 && zeros == 2) {
+      zeros = 0;
+      continue;
+    } else if (data[i] == 0x01 && zeros == 3) {
+      return j - 3;
+    } else {
+      zeros = 0;
+    }
+    out[j++] = data[i];
+  }
+
+  return j;
+}
+
+/*
+ * Copy the data chunks of an access unit of size bytes into a new buffer,
+ * mapping it once.
+ */
+GstBuffer *
+gst_kvazaar_chunks_to_buffer (const kvz_data_chunk * chunks, gsize size)
+{
+  GstBuffer *buf = gst_buffer_new_allocate (NULL, size, NULL);
+  const kvz_data_chunk *chunk;
+  GstMapInfo map;
+  gsize offset = 0;
+
+  if (!gst_buffer_map (buf, &map, GST_MAP_WRITE)) {
+    gst_buffer_unref (buf);
+    return NULL;
+  }
+
+  for (chunk = chunks; chunk != NULL; chunk = chunk->next) {
+    g_assert (offset + chunk->len <= size);
+    memcpy (map.data + offset, chunk->data, chunk->len);
+    offset += chunk->len;
+  }
+  gst_buffer_unmap (buf, &map);
+
+  return buf;
+}
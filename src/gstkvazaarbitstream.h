@@ -0,0 +1,36 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GST_KVAZAAR_BITSTREAM_H__
+#define __GST_KVAZAAR_BITSTREAM_H__
+
+#include <gst/gst.h>
+#include <kvazaar.h>
+
+G_BEGIN_DECLS
+
+gsize gst_kvazaar_next_start_code (const guint8 * data, gsize size,
+    gsize from);
+gsize gst_kvazaar_bytestream_to_nal (const guint8 * data, gsize size,
+    guint8 * out);
+
+GstBuffer *gst_kvazaar_chunks_to_buffer (const kvz_data_chunk * chunks,
+    gsize size);
+
+G_END_DECLS
+#endif /* __GST_KVAZAAR_BITSTREAM_H__ */
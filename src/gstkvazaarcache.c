@@ -0,0 +1,298 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Process-wide cache of opened Kvazaar encoders, ready to encode.
+ *
+ * Opening an encoder allocates its picture buffers and starts its threads,
+ * which the first frame of a stream would wait for. Kvazaar can not restart
+ * a stream, so an encoder that coded pictures is closed, and a new one with
+ * the same configuration is opened in the background in its place. An
+ * element that opens an encoder with the same key takes it from here. Those
+ * not taken within their timeout are closed.
+ *
+ * A flushing element hands its encoder over as it is. It is closed on the
+ * cache thread, then the frames it may still read are released.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gstkvazaarcache.h"
+
+typedef struct
+{
+  gchar *key;
+  const kvz_api *api;
+  kvz_config *config;
+  kvz_encoder *enc;
+  /* used encoder to close, then its frames to release */
+  kvz_encoder *closing;
+  GDestroyNotify release;
+  gpointer release_data;
+  guint timeout;                /* in ms */
+  gint64 deadline;              /* monotonic time it is closed at */
+} CacheEntry;
+
+static GMutex cache_lock;
+static GCond cache_cond;
+/* opened entries, oldest first */
+static GQueue cache_ready = G_QUEUE_INIT;
+/* entries to open, or to close and then open */
+static GQueue cache_pending = G_QUEUE_INIT;
+static gboolean cache_running;
+
+static void
+cache_entry_free (CacheEntry * entry)
+{
+  if (entry->closing)
+    entry->api->encoder_close (entry->closing);
+  if (entry->release)
+    entry->release (entry->release_data);
+  if (entry->enc)
+    entry->api->encoder_close (entry->enc);
+  entry->api->config_destroy (entry->config);
+  g_free (entry->key);
+  g_slice_free (CacheEntry, entry);
+}
+
+/*
+ * Number of entries of a key, opened or to open.
+ */
+static guint
+cache_count_key (const gchar * key)
+{
+  guint count = 0;
+  GList *l;
+
+  for (l = cache_ready.head; l; l = l->next)
+    if (!g_strcmp0 (((CacheEntry *) l->data)->key, key))
+      count++;
+  for (l = cache_pending.head; l; l = l->next)
+    if (!g_strcmp0 (((CacheEntry *) l->data)->key, key))
+      count++;
+
+  return count;
+}
+
+/*
+ * Open the pending entries and close the expired ones, then leave when
+ * nothing is left.
+ */
+static gpointer
+cache_thread (gpointer data)
+{
+  g_mutex_lock (&cache_lock);
+  while (cache_ready.length || cache_pending.length) {
+    CacheEntry *entry;
+    GList *l, *next;
+    GSList *expired = NULL;
+    gint64 now = g_get_monotonic_time ();
+    gint64 wakeup = G_MAXINT64;
+
+    entry = g_queue_pop_head (&cache_pending);
+    if (entry) {
+      g_mutex_unlock (&cache_lock);
+      if (entry->closing) {
+        entry->api->encoder_close (entry->closing);
+        entry->closing = NULL;
+      }
+      if (entry->release) {
+        entry->release (entry->release_data);
+        entry->release = NULL;
+      }
+      if (entry->key)
+        entry->enc = entry->api->encoder_open (entry->config);
+      g_mutex_lock (&cache_lock);
+      if (!entry->enc) {
+        if (entry->key)
+          GST_WARNING ("Can not open a Kvazaar encoder for the cache");
+        g_mutex_unlock (&cache_lock);
+        cache_entry_free (entry);
+        g_mutex_lock (&cache_lock);
+        continue;
+      }
+      entry->deadline = g_get_monotonic_time () +
+          entry->timeout * G_TIME_SPAN_MILLISECOND;
+      g_queue_push_tail (&cache_ready, entry);
+      continue;
+    }
+
+    for (l = cache_ready.head; l; l = next) {
+      next = l->next;
+      entry = l->data;
+      if (entry->deadline <= now) {
+        g_queue_delete_link (&cache_ready, l);
+        expired = g_slist_prepend (expired, entry);
+      } else {
+        wakeup = MIN (wakeup, entry->deadline);
+      }
+    }
+
+    if (expired) {
+      g_mutex_unlock (&cache_lock);
+      GST_DEBUG ("closing %u idle Kvazaar encoders", g_slist_length (expired));
+      g_slist_free_full (expired, (GDestroyNotify) cache_entry_free);
+      g_mutex_lock (&cache_lock);
+      continue;
+    }
+
+    if (wakeup != G_MAXINT64)
+      g_cond_wait_until (&cache_cond, &cache_lock, wakeup);
+  }
+  cache_running = FALSE;
+  g_mutex_unlock (&cache_lock);
+
+  return NULL;
+}
+
+/*
+ * Start the cache thread or tell it there is something new. Called with the
+ * lock.
+ */
+static void
+cache_wake (void)
+{
+  if (!cache_running) {
+    cache_running = TRUE;
+    g_thread_unref (g_thread_new ("kvazaar-cache", cache_thread, NULL));
+  } else {
+    g_cond_signal (&cache_cond);
+  }
+}
+
+/*
+ * Take an opened encoder of this key, with the configuration it was opened
+ * with, which must live as long as the encoder. Return FALSE when there is
+ * none.
+ */
+gboolean
+gst_kvazaar_encoder_cache_take (const gchar * key, kvz_config ** config,
+    kvz_encoder ** enc)
+{
+  CacheEntry *entry = NULL;
+  GList *l;
+
+  g_return_val_if_fail (key != NULL, FALSE);
+
+  g_mutex_lock (&cache_lock);
+  /* the newest one, the others expire first */
+  for (l = cache_ready.tail; l; l = l->prev) {
+    if (!g_strcmp0 (((CacheEntry *) l->data)->key, key)) {
+      entry = l->data;
+      g_queue_delete_link (&cache_ready, l);
+      break;
+    }
+  }
+  g_mutex_unlock (&cache_lock);
+
+  if (!entry)
+    return FALSE;
+
+  *config = entry->config;
+  *enc = entry->enc;
+  g_free (entry->key);
+  g_slice_free (CacheEntry, entry);
+
+  return TRUE;
+}
+
+/*
+ * Give an unused encoder and its configuration to the cache, or only the
+ * configuration to open one with in the background when enc is NULL. It is
+ * closed after timeout ms if not taken. Both are freed right away when the
+ * timeout is 0 or the cache is full for this key, and FALSE is returned.
+ */
+gboolean
+gst_kvazaar_encoder_cache_put (const kvz_api * api, const gchar * key,
+    kvz_config * config, kvz_encoder * enc, guint timeout)
+{
+  CacheEntry *entry, *evicted = NULL;
+
+  g_return_val_if_fail (api != NULL, FALSE);
+  g_return_val_if_fail (key != NULL, FALSE);
+  g_return_val_if_fail (config != NULL, FALSE);
+
+  entry = g_slice_new0 (CacheEntry);
+  entry->key = g_strdup (key);
+  entry->api = api;
+  entry->config = config;
+  entry->enc = enc;
+  entry->timeout = timeout;
+
+  g_mutex_lock (&cache_lock);
+  if (!timeout || cache_count_key (key) >= GST_KVAZAAR_CACHE_MAX_PER_KEY) {
+    g_mutex_unlock (&cache_lock);
+    cache_entry_free (entry);
+    return FALSE;
+  }
+
+  /* The oldest encoder makes room */
+  if (cache_ready.length + cache_pending.length >=
+      GST_KVAZAAR_CACHE_MAX_ENCODERS)
+    evicted = g_queue_pop_head (&cache_ready);
+  if (cache_ready.length + cache_pending.length >=
+      GST_KVAZAAR_CACHE_MAX_ENCODERS) {
+    g_mutex_unlock (&cache_lock);
+    cache_entry_free (entry);
+    return FALSE;
+  }
+
+  if (enc) {
+    entry->deadline = g_get_monotonic_time () +
+        timeout * G_TIME_SPAN_MILLISECOND;
+    g_queue_push_tail (&cache_ready, entry);
+  } else {
+    g_queue_push_tail (&cache_pending, entry);
+  }
+  cache_wake ();
+  g_mutex_unlock (&cache_lock);
+
+  if (evicted)
+    cache_entry_free (evicted);
+
+  return TRUE;
+}
+
+/*
+ * Close an encoder on the cache thread, then call release with release_data,
+ * for what the encoder may read until it is closed, and destroy the
+ * configuration. Nothing is waited for.
+ */
+void
+gst_kvazaar_encoder_cache_close (const kvz_api * api, kvz_config * config,
+    kvz_encoder * enc, GDestroyNotify release, gpointer release_data)
+{
+  CacheEntry *entry;
+
+  g_return_if_fail (api != NULL);
+  g_return_if_fail (config != NULL);
+
+  entry = g_slice_new0 (CacheEntry);
+  entry->api = api;
+  entry->config = config;
+  entry->closing = enc;
+  entry->release = release;
+  entry->release_data = release_data;
+
+  g_mutex_lock (&cache_lock);
+  g_queue_push_tail (&cache_pending, entry);
+  cache_wake ();
+  g_mutex_unlock (&cache_lock);
+}
@@ -0,0 +1,42 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GST_KVAZAAR_CACHE_H__
+#define __GST_KVAZAAR_CACHE_H__
+
+#include <gst/gst.h>
+#include <kvazaar.h>
+
+G_BEGIN_DECLS
+
+/* Opened encoders kept at once, over all configurations */
+#define GST_KVAZAAR_CACHE_MAX_ENCODERS 8
+/* and for one configuration */
+#define GST_KVAZAAR_CACHE_MAX_PER_KEY 2
+
+gboolean gst_kvazaar_encoder_cache_take (const gchar * key,
+    kvz_config ** config, kvz_encoder ** enc);
+gboolean gst_kvazaar_encoder_cache_put (const kvz_api * api,
+    const gchar * key, kvz_config * config, kvz_encoder * enc,
+    guint timeout);
+void gst_kvazaar_encoder_cache_close (const kvz_api * api,
+    kvz_config * config, kvz_encoder * enc, GDestroyNotify release,
+    gpointer release_data);
+
+G_END_DECLS
+#endif /* __GST_KVAZAAR_CACHE_H__ */
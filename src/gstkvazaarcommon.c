@@ -0,0 +1,248 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Kvazaar instances of the elements that run one per pad, kvazaarladder and
+ * kvazaarbatch: configuration, output packaging and pad children.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gstkvazaarcommon.h"
+#include "gstkvazaarbitstream.h"
+
+/*
+ * A configuration with the defaults of Kvazaar for a picture size and frame
+ * rate, without the PSNR of every picture that nothing reads. Posts an error
+ * on element and returns NULL on failure.
+ */
+kvz_config *
+gst_kvazaar_config_new (const kvz_api * api, GstElement * element,
+    gint width, gint height, gint fps_n, gint fps_d)
+{
+  kvz_config *config = api->config_alloc ();
+
+  if (!config || !api->config_init (config)) {
+    GST_ELEMENT_ERROR (element, LIBRARY, INIT,
+        ("Failed to init config structure."), (NULL));
+    if (config)
+      api->config_destroy (config);
+    return NULL;
+  }
+
+  config->width = width;
+  config->height = height;
+  config->framerate_num = fps_n;
+  config->framerate_denom = fps_d;
+  config->calc_psnr = 0;
+
+  return config;
+}
+
+/*
+ * Parse a "name=value,..." string of Kvazaar options into config. On
+ * failure, the first option Kvazaar rejects is returned in bad_option, to
+ * free.
+ */
+gboolean
+gst_kvazaar_parse_options (const kvz_api * api, kvz_config * config,
+    const gchar * options, gchar ** bad_option)
+{
+  gchar **tokens = g_strsplit (options, ",", -1);
+  gboolean res = TRUE;
+  gint i;
+
+  for (i = 0; tokens[i] && res; i++) {
+    gchar **pair;
+
+    if (!*tokens[i])
+      continue;
+    pair = g_strsplit (tokens[i], "=", 2);
+    if (!api->config_parse (config, pair[0], pair[1])) {
+      *bad_option = g_strdup (tokens[i]);
+      res = FALSE;
+    }
+    g_strfreev (pair);
+  }
+  g_strfreev (tokens);
+
+  return res;
+}
+
+/*
+ * Close a Kvazaar instance and free its configuration, if any.
+ */
+void
+gst_kvazaar_close (const kvz_api * api, kvz_encoder ** enc,
+    kvz_config ** config)
+{
+  if (*enc)
+    api->encoder_close (*enc);
+  *enc = NULL;
+  if (*config)
+    api->config_destroy (*config);
+  *config = NULL;
+}
+
+/*
+ * Number of pictures a Kvazaar instance of this configuration may hold
+ * before returning an access unit: the overlapping frames and the GOP
+ * reordering depth.
+ */
+gint
+gst_kvazaar_config_get_delay (const kvz_config * config)
+{
+  gint delay;
+
+  /* owf < 0 lets Kvazaar pick, keep the historical estimate then */
+  if (config->owf < 0)
+    return 5;
+
+  delay = config->owf;
+  if (config->gop_len > 0 && !config->gop_lowdelay)
+    delay += config->gop_len - 1;
+
+  return delay;
+}
+
+/*
+ * Buffer of an access unit output by Kvazaar, with its timestamps and key
+ * frame flag. The chunks and pictures are freed.
+ */
+GstBuffer *
+gst_kvazaar_output_buffer (const kvz_api * api, kvz_data_chunk * chunks,
+    guint32 len, kvz_picture * img_rec, kvz_picture * img_src,
+    const kvz_frame_info * info, gint fps_n, gint fps_d)
+{
+  GstBuffer *buf = gst_kvazaar_chunks_to_buffer (chunks, len);
+
+  api->chunk_free (chunks);
+
+  if (buf) {
+    GST_BUFFER_PTS (buf) = img_src ? img_src->pts : GST_CLOCK_TIME_NONE;
+    GST_BUFFER_DTS (buf) = img_rec && img_rec->dts >= 0 ? img_rec->dts :
+        GST_CLOCK_TIME_NONE;
+    if (fps_n > 0)
+      GST_BUFFER_DURATION (buf) =
+          gst_util_uint64_scale_int (GST_SECOND, fps_d, fps_n);
+    if (info->nal_unit_type < KVZ_NAL_BLA_W_LP ||
+        info->nal_unit_type > KVZ_NAL_CRA_NUT)
+      GST_BUFFER_FLAG_SET (buf, GST_BUFFER_FLAG_DELTA_UNIT);
+  }
+
+  api->picture_free (img_rec);
+  api->picture_free (img_src);
+
+  return buf;
+}
+
+/*
+ * Caps of the Annex B output of a Kvazaar instance.
+ */
+GstCaps *
+gst_kvazaar_output_caps (gint width, gint height, gint fps_n, gint fps_d,
+    gint par_n, gint par_d)
+{
+  return gst_caps_new_simple ("video/x-h265",
+      "stream-format", G_TYPE_STRING, "byte-stream",
+      "alignment", G_TYPE_STRING, "au",
+      "profile", G_TYPE_STRING, "main",
+      "width", G_TYPE_INT, width, "height", G_TYPE_INT, height,
+      "framerate", GST_TYPE_FRACTION, fps_n, fps_d,
+      "pixel-aspect-ratio", GST_TYPE_FRACTION, par_n, par_d, NULL);
+}
+
+/*
+ * Child proxy over the pads of one direction, so that they can be set up
+ * from gst-launch as element::pad::property=value.
+ */
+static GObject *
+gst_kvazaar_child_proxy_get_pad (GstChildProxy * proxy, guint index,
+    GstPadDirection direction)
+{
+  GstElement *element = GST_ELEMENT (proxy);
+  GObject *obj;
+
+  GST_OBJECT_LOCK (element);
+  obj = g_list_nth_data (direction == GST_PAD_SRC ? element->srcpads :
+      element->sinkpads, index);
+  if (obj)
+    gst_object_ref (obj);
+  GST_OBJECT_UNLOCK (element);
+
+  return obj;
+}
+
+static guint
+gst_kvazaar_child_proxy_count_pads (GstChildProxy * proxy,
+    GstPadDirection direction)
+{
+  GstElement *element = GST_ELEMENT (proxy);
+  guint count;
+
+  GST_OBJECT_LOCK (element);
+  count = direction == GST_PAD_SRC ? element->numsrcpads :
+      element->numsinkpads;
+  GST_OBJECT_UNLOCK (element);
+
+  return count;
+}
+
+static GObject *
+gst_kvazaar_child_proxy_get_src_pad (GstChildProxy * proxy, guint index)
+{
+  return gst_kvazaar_child_proxy_get_pad (proxy, index, GST_PAD_SRC);
+}
+
+static guint
+gst_kvazaar_child_proxy_count_src_pads (GstChildProxy * proxy)
+{
+  return gst_kvazaar_child_proxy_count_pads (proxy, GST_PAD_SRC);
+}
+
+static GObject *
+gst_kvazaar_child_proxy_get_sink_pad (GstChildProxy * proxy, guint index)
+{
+  return gst_kvazaar_child_proxy_get_pad (proxy, index, GST_PAD_SINK);
+}
+
+static guint
+gst_kvazaar_child_proxy_count_sink_pads (GstChildProxy * proxy)
+{
+  return gst_kvazaar_child_proxy_count_pads (proxy, GST_PAD_SINK);
+}
+
+void
+gst_kvazaar_child_proxy_src_pads_init (gpointer g_iface, gpointer iface_data)
+{
+  GstChildProxyInterface *iface = g_iface;
+
+  iface->get_child_by_index = gst_kvazaar_child_proxy_get_src_pad;
+  iface->get_children_count = gst_kvazaar_child_proxy_count_src_pads;
+}
+
+void
+gst_kvazaar_child_proxy_sink_pads_init (gpointer g_iface, gpointer iface_data)
+{
+  GstChildProxyInterface *iface = g_iface;
+
+  iface->get_child_by_index = gst_kvazaar_child_proxy_get_sink_pad;
+  iface->get_children_count = gst_kvazaar_child_proxy_count_sink_pads;
+}
@@ -0,0 +1,49 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GST_KVAZAAR_COMMON_H__
+#define __GST_KVAZAAR_COMMON_H__
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <kvazaar.h>
+
+G_BEGIN_DECLS
+
+kvz_config *gst_kvazaar_config_new (const kvz_api * api, GstElement * element,
+    gint width, gint height, gint fps_n, gint fps_d);
+gboolean gst_kvazaar_parse_options (const kvz_api * api, kvz_config * config,
+    const gchar * options, gchar ** bad_option);
+void gst_kvazaar_close (const kvz_api * api, kvz_encoder ** enc,
+    kvz_config ** config);
+gint gst_kvazaar_config_get_delay (const kvz_config * config);
+
+GstBuffer *gst_kvazaar_output_buffer (const kvz_api * api,
+    kvz_data_chunk * chunks, guint32 len, kvz_picture * img_rec,
+    kvz_picture * img_src, const kvz_frame_info * info, gint fps_n,
+    gint fps_d);
+GstCaps *gst_kvazaar_output_caps (gint width, gint height, gint fps_n,
+    gint fps_d, gint par_n, gint par_d);
+
+void gst_kvazaar_child_proxy_src_pads_init (gpointer g_iface,
+    gpointer iface_data);
+void gst_kvazaar_child_proxy_sink_pads_init (gpointer g_iface,
+    gpointer iface_data);
+
+G_END_DECLS
+#endif /* __GST_KVAZAAR_COMMON_H__ */
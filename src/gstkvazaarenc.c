@@ -29,6 +29,13 @@
 #endif
 
 #include "gstkvazaarenc.h"
+#include "gstkvazaarmetaprivate.h"
+#include "gstkvazaarladder.h"
+#include "gstkvazaarbatch.h"
+#include "gstkvazaartrace.h"
+#include "gstkvazaarbitstream.h"
+#include "gstkvazaarcache.h"
+#include "gstkvazaarcommon.h"
 
 #include <gst/pbutils/pbutils.h>
 #include <gst/video/video.h>
@@ -37,6 +44,7 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <math.h>
 
 GST_DEBUG_CATEGORY_STATIC (kvazaar_enc_debug);
 #define GST_CAT_DEFAULT kvazaar_enc_debug
@@ -57,6 +65,7 @@ enum
   PROP_NO_PSNR,
   PROP_NO_INFO,
   PROP_PRESET,
+  PROP_TUNE,
 #ifdef HAS_CRYPTO
   PROP_CRYPTO,
   PROP_KEY,
@@ -83,7 +92,34 @@ enum
   PROP_ME_EARLY_TERM,
   PROP_GOP,
   PROP_ROI,
-  PROP_KVZ_OPTS
+  PROP_KVZ_OPTS,
+  PROP_SLICE_MAX_SIZE,
+  PROP_VBV_BUFSIZE,
+  PROP_VBV_MAXRATE,
+  PROP_VBV_FULLNESS,
+  PROP_LOOKAHEAD,
+  PROP_AQ_STRENGTH,
+  PROP_SCENECUT,
+  PROP_MIN_KEYINT,
+  PROP_ROI_META_WEIGHTS,
+  PROP_ROI_FILE,
+  PROP_STATIC_DQP,
+  PROP_STATIC_THRESHOLD,
+  PROP_STATIC_STATS,
+  PROP_DUPLICATE_POLICY,
+  PROP_MAX_DUPLICATES,
+  PROP_QOS_DEGRADATION,
+  PROP_QOS_LEVEL,
+  PROP_REALTIME,
+  PROP_REALTIME_TARGET,
+  PROP_MAX_TEMPORAL_LAYER,
+  PROP_FRAME_STATS,
+  PROP_STATS,
+  PROP_RECORD_LOCATION,
+  PROP_QUALITY_INTERVAL,
+  PROP_QUALITY_METRICS,
+  PROP_EXPECTED_CAPS,
+  PROP_ENCODER_CACHE_TIMEOUT
 };
 
 typedef enum {
@@ -115,6 +151,33 @@ static const GEnumValue preset_types[] = {
   { 0, NULL, NULL },
 };
 
+typedef enum {
+  GST_KVAZAAR_ENC_TUNE_NONE,
+  GST_KVAZAAR_ENC_TUNE_ZEROLATENCY
+} GstKvazaarencTune;
+
+static const GEnumValue tune_types[] = {
+  { GST_KVAZAAR_ENC_TUNE_NONE,        "No tuning",                 "none" },
+  { GST_KVAZAAR_ENC_TUNE_ZEROLATENCY, "Zero latency (low-delay P, "
+        "one frame in flight)",                                    "zerolatency" },
+  { 0, NULL, NULL },
+};
+
+typedef enum {
+  GST_KVAZAAR_ENC_DUPLICATE_NONE,
+  GST_KVAZAAR_ENC_DUPLICATE_DROP,
+  GST_KVAZAAR_ENC_DUPLICATE_SKIP
+} GstKvazaarencDuplicatePolicy;
+
+static const GEnumValue duplicate_policy_types[] = {
+  { GST_KVAZAAR_ENC_DUPLICATE_NONE, "Encode duplicates as any frame", "none" },
+  { GST_KVAZAAR_ENC_DUPLICATE_DROP, "Drop duplicates, extending the duration "
+        "of the previous frame",                                    "drop" },
+  { GST_KVAZAAR_ENC_DUPLICATE_SKIP, "Encode duplicates at the highest QP "
+        "so that they code as skips",                               "skip" },
+  { 0, NULL, NULL },
+};
+
 typedef enum {
   GST_KVAZAAR_PROGRESSIVE,
   GST_KVAZAAR_TFF,
@@ -169,6 +232,7 @@ static GEnumValue sao_types[] = {
 #define PROP_INTRA_PERIOD_DEFAULT   0
 #define PROP_VPS_PERIOD_DEFAULT     0
 #define PROP_PRESET_DEFAULT         GST_KVAZAAR_ENC_NO_PRESET
+#define PROP_TUNE_DEFAULT           GST_KVAZAAR_ENC_TUNE_NONE
 #define PROP_KEY_DEFAULT "16,213,27,56,255,127,242,112,97,126,197,204,25,59,38,30"
 #define PROP_REF_FRAMES_DEFAULT     0
 #define PROP_PU_DEPTH_INTRA_DEFAULT ""
@@ -179,6 +243,115 @@ static GEnumValue sao_types[] = {
 #define PROP_CU_SPLIT_TERM_DEFAULT  -1
 #define PROP_ME_EARLY_TERM_DEFAULT  -1
 #define PROP_GOP_DEFAULT            "lp-g4d3t1"
+#define PROP_SLICE_MAX_SIZE_DEFAULT 0
+#define PROP_VBV_BUFSIZE_DEFAULT    0
+#define PROP_VBV_MAXRATE_DEFAULT    0
+
+/* The rate guard starts raising QP when the buffer is half full and reaches
+ * VBV_MAX_DQP when it is full */
+#define VBV_GUARD_THRESHOLD         0.5
+#define VBV_MAX_DQP                 12
+
+#define PROP_LOOKAHEAD_DEFAULT      0
+#define PROP_AQ_STRENGTH_DEFAULT    1.0
+#define PROP_SCENECUT_DEFAULT       0
+#define PROP_MIN_KEYINT_DEFAULT     25
+
+/* A scene cut also needs this mean absolute difference between the luma
+ * thumbnails, so that a histogram shift alone (fade, flash) is not enough */
+#define SCENECUT_MIN_MAD            8.0
+
+/* Name of the GstVideoRegionOfInterestMeta parameter that can carry the
+ * delta QP of a single region */
+#define ROI_META_PARAM_NAME         "roi/kvazaar"
+#define ROI_META_ANY_TYPE           "*"
+
+#define PROP_STATIC_DQP_DEFAULT       0
+#define PROP_STATIC_THRESHOLD_DEFAULT 1.0
+
+/* Regions of interest of this type are damage rectangles of a screen
+ * capture, the only areas that changed since the previous frame */
+#define DAMAGE_ROI_TYPE             "damage"
+
+#define PROP_DUPLICATE_POLICY_DEFAULT GST_KVAZAAR_ENC_DUPLICATE_NONE
+#define PROP_MAX_DUPLICATES_DEFAULT   0
+
+#define PROP_QOS_DEGRADATION_DEFAULT  FALSE
+
+/* The decimate step leaves out one input frame in this many */
+#define QOS_DECIMATION              4
+/* Consecutive late frames before stepping up, and frames on time with some
+ * spare encode time before stepping down */
+#define QOS_LATE_FRAMES             8
+#define QOS_RECOVER_FRAMES          60
+#define QOS_RECOVER_LOAD            0.8
+/* Weight of the last encode call in the moving average */
+#define QOS_ENCODE_TIME_WEIGHT      0.1
+/* Presets skipped by the fast-preset step */
+#define QOS_PRESET_STEP             2
+
+/* Preset that stands for the Kvazaar defaults when stepping presets */
+#define BASE_PRESET                 GST_KVAZAAR_ENC_MEDIUM
+
+#define PROP_REALTIME_DEFAULT         FALSE
+#define PROP_REALTIME_TARGET_DEFAULT  0.8
+
+/* The realtime mode keeps the load within this fraction of the target, and
+ * measures an effort for this many pictures before changing it again */
+#define REALTIME_TOLERANCE          0.1
+#define REALTIME_MIN_FRAMES         16
+
+/* HEVC has up to 7 temporal sub-layers */
+#define MAX_TEMPORAL_ID             6
+#define PROP_MAX_TEMPORAL_LAYER_DEFAULT MAX_TEMPORAL_ID
+
+/* Outputs of the per-frame statistics */
+typedef enum {
+  GST_KVAZAAR_ENC_FRAME_STATS_MESSAGE = (1 << 0),
+  GST_KVAZAAR_ENC_FRAME_STATS_META    = (1 << 1),
+} GstKvazaarencFrameStats;
+
+#define PROP_FRAME_STATS_DEFAULT    0
+
+/* Quality of one output picture in 30 is measured, PSNR only */
+#define PROP_QUALITY_INTERVAL_DEFAULT 30
+#define PROP_QUALITY_METRICS_DEFAULT GST_KVAZAAR_QUALITY_PSNR
+
+/* Opened encoders are not kept by default */
+#define PROP_ENCODER_CACHE_TIMEOUT_DEFAULT 0
+
+/* Degradation steps when late, each one keeps those below it */
+typedef enum {
+  GST_KVAZAAR_ENC_QOS_NONE,
+  GST_KVAZAAR_ENC_QOS_DECIMATE,
+  GST_KVAZAAR_ENC_QOS_FAST_SEARCH,
+  GST_KVAZAAR_ENC_QOS_FAST_PRESET,
+  GST_KVAZAAR_ENC_QOS_DROP
+} GstKvazaarencQosLevel;
+
+static const GEnumValue qos_level_types[] = {
+  { GST_KVAZAAR_ENC_QOS_NONE,        "Not degraded",               "none" },
+  { GST_KVAZAAR_ENC_QOS_DECIMATE,    "Leave out one input frame in "
+        G_STRINGIFY (QOS_DECIMATION),                              "decimate" },
+  { GST_KVAZAAR_ENC_QOS_FAST_SEARCH, "No RDO and half-pel motion "
+        "search",                                               "fast-search" },
+  { GST_KVAZAAR_ENC_QOS_FAST_PRESET, "Faster preset from the next "
+        "GOP",                                                  "fast-preset" },
+  { GST_KVAZAAR_ENC_QOS_DROP,        "Drop the frames already late "
+        "downstream",                                              "drop" },
+  { 0, NULL, NULL },
+};
+
+/* Part of a degradation level that is set up when opening the encoder */
+#define QOS_CONFIG_LEVEL(level) \
+  ((level) < GST_KVAZAAR_ENC_QOS_FAST_SEARCH ? GST_KVAZAAR_ENC_QOS_NONE : \
+  MIN ((level), GST_KVAZAAR_ENC_QOS_FAST_PRESET))
+
+typedef struct
+{
+  GQuark roi_type;
+  gint dqp;
+} RoiWeight;
 
 #define KVAZAAR_PARAM_BAD_NAME  (-1)
 #define KVAZAAR_PARAM_BAD_VALUE (-2)
@@ -197,6 +370,50 @@ gst_kvazaar_enc_preset_get_type (void)
   return kvazaarenc_preset_type;
 }
 
+#define GST_KVAZAAR_ENC_TUNE_TYPE (gst_kvazaar_enc_tune_get_type())
+static GType
+gst_kvazaar_enc_tune_get_type (void)
+{
+  static GType kvazaarenc_tune_type = 0;
+
+  if (!kvazaarenc_tune_type) {
+    kvazaarenc_tune_type =
+      g_enum_register_static ("GstKvazaarencTune", tune_types);
+  }
+
+  return kvazaarenc_tune_type;
+}
+
+#define GST_KVAZAAR_ENC_DUPLICATE_POLICY_TYPE \
+  (gst_kvazaar_enc_duplicate_policy_get_type())
+static GType
+gst_kvazaar_enc_duplicate_policy_get_type (void)
+{
+  static GType kvazaarenc_duplicate_policy_type = 0;
+
+  if (!kvazaarenc_duplicate_policy_type) {
+    kvazaarenc_duplicate_policy_type =
+      g_enum_register_static ("GstKvazaarencDuplicatePolicy",
+          duplicate_policy_types);
+  }
+
+  return kvazaarenc_duplicate_policy_type;
+}
+
+#define GST_KVAZAAR_ENC_QOS_LEVEL_TYPE (gst_kvazaar_enc_qos_level_get_type())
+static GType
+gst_kvazaar_enc_qos_level_get_type (void)
+{
+  static GType kvazaarenc_qos_level_type = 0;
+
+  if (!kvazaarenc_qos_level_type) {
+    kvazaarenc_qos_level_type =
+      g_enum_register_static ("GstKvazaarencQosLevel", qos_level_types);
+  }
+
+  return kvazaarenc_qos_level_type;
+}
+
 #ifdef HAS_CRYPTO
 #define GST_KVAZAAR_ENC_CRYPTO_TYPE (gst_kvazaar_enc_crypto_get_type())
 static GType
@@ -224,6 +441,48 @@ gst_kvazaar_enc_crypto_get_type (void)
 }
 #endif
 
+#define GST_KVAZAAR_ENC_FRAME_STATS_TYPE (gst_kvazaar_enc_frame_stats_get_type())
+static GType
+gst_kvazaar_enc_frame_stats_get_type (void)
+{
+  static GType kvazaarenc_frame_stats_type = 0;
+
+  if (!kvazaarenc_frame_stats_type) {
+    static GFlagsValue frame_stats_types[] = {
+      { GST_KVAZAAR_ENC_FRAME_STATS_MESSAGE, "Element message", "message" },
+      { GST_KVAZAAR_ENC_FRAME_STATS_META,    "Buffer meta",     "meta" },
+      { 0, NULL, NULL },
+    };
+
+    kvazaarenc_frame_stats_type =
+    g_flags_register_static ("GstKvazaarencFrameStats", frame_stats_types);
+  }
+
+  return kvazaarenc_frame_stats_type;
+}
+
+#define GST_KVAZAAR_ENC_QUALITY_METRICS_TYPE \
+  (gst_kvazaar_enc_quality_metrics_get_type())
+static GType
+gst_kvazaar_enc_quality_metrics_get_type (void)
+{
+  static GType kvazaarenc_quality_metrics_type = 0;
+
+  if (!kvazaarenc_quality_metrics_type) {
+    static GFlagsValue quality_metrics_types[] = {
+      { GST_KVAZAAR_QUALITY_PSNR, "PSNR of each plane", "psnr" },
+      { GST_KVAZAAR_QUALITY_SSIM, "SSIM of the luma plane", "ssim" },
+      { 0, NULL, NULL },
+    };
+
+    kvazaarenc_quality_metrics_type =
+    g_flags_register_static ("GstKvazaarencQualityMetrics",
+        quality_metrics_types);
+  }
+
+  return kvazaarenc_quality_metrics_type;
+}
+
 #define GST_KVAZAAR_ENC_SOURCE_SCAN_TYPE_TYPE (gst_kvazaar_enc_source_scan_type_get_type())
 static GType
 gst_kvazaar_enc_source_scan_type_get_type (void)
@@ -381,6 +640,13 @@ static GstStaticPadTemplate sink_factory = GST_STATIC_PAD_TEMPLATE ("sink",
         "width = (int) [ 4, MAX ], " "height = (int) [ 4, MAX ]")
     );
 
+/* Pushing single NAL units relies on sub-frame finishing */
+#if GST_CHECK_VERSION (1, 18, 0)
+#define ALIGNMENTS "{ au, nal }"
+#else
+#define ALIGNMENTS "au"
+#endif
+
 static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src",
     GST_PAD_SRC,
     GST_PAD_ALWAYS,
@@ -388,10 +654,37 @@ static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src",
         "framerate = (fraction) [0/1, MAX], "
         "width = (int) [ 4, MAX ], " "height = (int) [ 4, MAX ], "
         "stream-format = (string) byte-stream, "
-        "alignment = (string) au, " "profile = (string) { main }")
+        "alignment = (string) " ALIGNMENTS ", " "profile = (string) { main }")
+    );
+
+/* Reconstructed pictures, in the sample size of the Kvazaar build */
+#if KVZ_BIT_DEPTH == 8
+#define RECON_FORMAT GST_VIDEO_FORMAT_I420
+#define RECON_FORMAT_STR "I420"
+#elif G_BYTE_ORDER == G_LITTLE_ENDIAN
+#define RECON_FORMAT GST_VIDEO_FORMAT_I420_10LE
+#define RECON_FORMAT_STR "I420_10LE"
+#else
+#define RECON_FORMAT GST_VIDEO_FORMAT_I420_10BE
+#define RECON_FORMAT_STR "I420_10BE"
+#endif
+
+static GstStaticPadTemplate recon_factory = GST_STATIC_PAD_TEMPLATE ("recon",
+    GST_PAD_SRC,
+    GST_PAD_REQUEST,
+    GST_STATIC_CAPS ("video/x-raw, "
+        "format = (string) " RECON_FORMAT_STR ", "
+        "framerate = (fraction) [0/1, MAX], "
+        "width = (int) [ 4, MAX ], " "height = (int) [ 4, MAX ]")
     );
 
 static void gst_kvazaar_enc_finalize (GObject * object);
+static GstPad *gst_kvazaar_enc_request_new_pad (GstElement * element,
+    GstPadTemplate * templ, const gchar * req_name, const GstCaps * caps);
+static void gst_kvazaar_enc_release_pad (GstElement * element, GstPad * pad);
+static gboolean gst_kvazaar_enc_sink_event (GstVideoEncoder * encoder,
+    GstEvent * event);
+static GstPad *gst_kvazaar_enc_get_recon_pad (GstKvazaarEnc * encoder);
 static gboolean gst_kvazaar_enc_flush (GstVideoEncoder * encoder);
 
 static GstFlowReturn gst_kvazaar_enc_finish (GstVideoEncoder * encoder);
@@ -403,11 +696,26 @@ static GstFlowReturn gst_kvazaar_enc_encode_frame (GstKvazaarEnc * encoder, kvz_
 
 static gboolean gst_kvazaar_enc_set_format (GstVideoEncoder * video_enc,
     GstVideoCodecState * state);
+static gboolean gst_kvazaar_enc_src_event (GstVideoEncoder * encoder,
+    GstEvent * event);
 static gboolean gst_kvazaar_enc_propose_allocation (GstVideoEncoder * encoder,
     GstQuery * query);
 static gboolean gst_kvazaar_enc_init_encoder (GstKvazaarEnc * encoder);
+static gboolean gst_kvazaar_enc_open_encoder (GstKvazaarEnc * encoder,
+    GstVideoInfo * info);
 static void gst_kvazaar_enc_close_encoder (GstKvazaarEnc * encoder);
-
+static void gst_kvazaar_enc_close_encoder_at_stop (GstKvazaarEnc * encoder);
+static void gst_kvazaar_enc_release_preopen (GstKvazaarEnc * encoder);
+static void gst_kvazaar_enc_start_spare (GstKvazaarEnc * encoder,
+    const gchar * key, kvz_config * config);
+static gboolean gst_kvazaar_enc_take_spare (GstKvazaarEnc * encoder,
+    kvz_config ** config, kvz_encoder ** enc);
+static void gst_kvazaar_enc_release_spare (GstKvazaarEnc * encoder);
+static kvz_config *gst_kvazaar_enc_take_config (GstKvazaarEnc * encoder);
+static gchar *gst_kvazaar_enc_get_config_key (GstKvazaarEnc * encoder);
+
+static gboolean gst_kvazaar_enc_open (GstVideoEncoder * encoder);
+static gboolean gst_kvazaar_enc_close (GstVideoEncoder * encoder);
 static gboolean gst_kvazaar_enc_start (GstVideoEncoder * encoder);
 static gboolean gst_kvazaar_enc_stop (GstVideoEncoder * encoder);
 
@@ -567,6 +875,50 @@ parse_kvazaar_options (GstKvazaarEnc * encoder, char * array)
   return 0;
 }
 
+/*
+ * Parse the delta QP of each region of interest type.
+ *
+ * A weight must be of form "<roi-type>=<dqp>", weights are separated by
+ * coma. The type "*" matches every region without a weight of its own.
+ *
+ * returns 1 on success, 0 on failure.
+ */
+static int
+parse_roi_weights (const char *array, GArray * weights)
+{
+  gchar **tokens = g_strsplit (array, ",", -1);
+  gchar **token;
+  RoiWeight weight;
+  int ret = 1;
+
+  g_array_set_size (weights, 0);
+
+  for (token = tokens; *token; token++) {
+    gchar **pair;
+
+    g_strstrip (*token);
+    if (**token == '\0')
+      continue;
+
+    pair = g_strsplit (*token, "=", 2);
+    if (!pair[1] || !parse_int (g_strstrip (pair[1]), &weight.dqp, -51, 51)) {
+      GST_ERROR ("Invalid ROI weight '%s'", *token);
+      g_strfreev (pair);
+      ret = 0;
+      break;
+    }
+    weight.roi_type = g_quark_from_string (g_strstrip (pair[0]));
+    g_array_append_val (weights, weight);
+    g_strfreev (pair);
+  }
+
+  if (!ret)
+    g_array_set_size (weights, 0);
+
+  g_strfreev (tokens);
+  return ret;
+}
+
 static void
 set_value (GValue * val, gint count, ...)
 {
@@ -707,9 +1059,15 @@ gst_kvazaar_enc_class_init (GstKvazaarEncClass * klass)
   gobject_class->get_property = gst_kvazaar_enc_get_property;
   gobject_class->finalize = gst_kvazaar_enc_finalize;
 
+  element_class->request_new_pad =
+      GST_DEBUG_FUNCPTR (gst_kvazaar_enc_request_new_pad);
+  element_class->release_pad = GST_DEBUG_FUNCPTR (gst_kvazaar_enc_release_pad);
+
   gstencoder_class->set_format = GST_DEBUG_FUNCPTR (gst_kvazaar_enc_set_format);
   gstencoder_class->handle_frame =
       GST_DEBUG_FUNCPTR (gst_kvazaar_enc_handle_frame);
+  gstencoder_class->open = GST_DEBUG_FUNCPTR (gst_kvazaar_enc_open);
+  gstencoder_class->close = GST_DEBUG_FUNCPTR (gst_kvazaar_enc_close);
   gstencoder_class->start = GST_DEBUG_FUNCPTR (gst_kvazaar_enc_start);
   gstencoder_class->stop = GST_DEBUG_FUNCPTR (gst_kvazaar_enc_stop);
   gstencoder_class->flush = GST_DEBUG_FUNCPTR (gst_kvazaar_enc_flush);
@@ -718,6 +1076,8 @@ gst_kvazaar_enc_class_init (GstKvazaarEncClass * klass)
   gstencoder_class->sink_query = GST_DEBUG_FUNCPTR (gst_kvazaar_enc_sink_query);
   gstencoder_class->propose_allocation =
       GST_DEBUG_FUNCPTR (gst_kvazaar_enc_propose_allocation);
+  gstencoder_class->src_event = GST_DEBUG_FUNCPTR (gst_kvazaar_enc_src_event);
+  gstencoder_class->sink_event = GST_DEBUG_FUNCPTR (gst_kvazaar_enc_sink_event);
 
   g_object_class_install_property (gobject_class, PROP_BITRATE,
       g_param_spec_uint ("bitrate", "Bitrate", "Bitrate in kbit/sec", 0,
@@ -748,6 +1108,14 @@ gst_kvazaar_enc_class_init (GstKvazaarEncClass * klass)
           GST_KVAZAAR_ENC_PRESET_TYPE, PROP_PRESET_DEFAULT,
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+  g_object_class_install_property (gobject_class, PROP_TUNE,
+      g_param_spec_enum ("tune", "Tune",
+          "Tune the encoder for a use case, applied on top of the preset. "
+          "zerolatency: low-delay P GOP, no frame overlap, every input frame "
+          "produces its access unit before the next one is accepted",
+          GST_KVAZAAR_ENC_TUNE_TYPE, PROP_TUNE_DEFAULT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
 #ifdef HAS_CRYPTO
   g_object_class_install_property (gobject_class, PROP_CRYPTO,
       g_param_spec_flags ("crypto", "Crypto mode",
@@ -764,7 +1132,8 @@ gst_kvazaar_enc_class_init (GstKvazaarEncClass * klass)
 
   g_object_class_install_property (gobject_class, PROP_NO_PSNR,
       g_param_spec_boolean ("no-psnr", "No PSNR",
-        "Don't calculate PSNR for frames", FALSE, G_PARAM_READWRITE));
+        "Don't measure the quality of the encoded pictures", FALSE,
+        G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING));
 
   g_object_class_install_property (gobject_class, PROP_NO_INFO,
       g_param_spec_boolean ("no-info", "No info", "Don't add encoder info SEI",
@@ -772,7 +1141,8 @@ gst_kvazaar_enc_class_init (GstKvazaarEncClass * klass)
 
   g_object_class_install_property (gobject_class, PROP_SOURCE_SCAN_TYPE,
       g_param_spec_enum ("source-scan-type", "Source scan type",
-          "Set source scan type",
+          "Field order of the source when the caps do not give it, "
+          "interlaced sources are coded as field pictures",
           GST_KVAZAAR_ENC_SOURCE_SCAN_TYPE_TYPE, GST_KVAZAAR_PROGRESSIVE,
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
@@ -902,8 +1272,194 @@ gst_kvazaar_enc_class_init (GstKvazaarEncClass * klass)
           NULL,
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+  g_object_class_install_property (gobject_class, PROP_SLICE_MAX_SIZE,
+      g_param_spec_uint ("slice-max-size", "Slice max size",
+          "Byte budget for a slice NAL unit, e.g. to fit the RTP MTU "
+          "(0 = disabled). Enables one slice per CTU row and reports "
+          "slices exceeding the budget",
+          0, G_MAXINT, PROP_SLICE_MAX_SIZE_DEFAULT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_VBV_BUFSIZE,
+      g_param_spec_uint ("vbv-bufsize", "VBV buffer size",
+          "Size of the sender buffer in kbit (0 = disabled). QP is raised "
+          "before the buffer overflows", 0, G_MAXINT, PROP_VBV_BUFSIZE_DEFAULT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_VBV_MAXRATE,
+      g_param_spec_uint ("vbv-maxrate", "VBV max rate",
+          "Rate in kbit/sec at which the sender buffer drains (0 = disabled)",
+          0, G_MAXINT, PROP_VBV_MAXRATE_DEFAULT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_VBV_FULLNESS,
+      g_param_spec_double ("vbv-fullness", "VBV fullness",
+          "Current fullness of the sender buffer in percent", 0, G_MAXDOUBLE,
+          0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_LOOKAHEAD,
+      g_param_spec_uint ("lookahead", "Lookahead",
+          "Number of frames analysed ahead to derive per-CTU adaptive QP "
+          "(0 = disabled). Adds as many frames of latency", 0, 64,
+          PROP_LOOKAHEAD_DEFAULT, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_AQ_STRENGTH,
+      g_param_spec_double ("aq-strength", "AQ strength",
+          "Strength of the adaptive QP derived by the lookahead", 0, 3,
+          PROP_AQ_STRENGTH_DEFAULT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_SCENECUT,
+      g_param_spec_uint ("scenecut", "Scene cut",
+          "Sensitivity of the scene change detection, a detected cut starts "
+          "a new intra period with a key frame (0 = disabled)", 0, 100,
+          PROP_SCENECUT_DEFAULT, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MIN_KEYINT,
+      g_param_spec_uint ("min-keyint", "Minimum key frame interval",
+          "Minimum number of frames between key frames inserted on scene "
+          "changes", 1, G_MAXINT, PROP_MIN_KEYINT_DEFAULT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_ROI_META_WEIGHTS,
+      g_param_spec_string ("roi-meta-weights", "ROI meta weights",
+          "Delta QP applied to the regions of interest attached to the "
+          "buffers, by region type: \"<type>=<dqp>,...\", \"*\" matches any "
+          "type. A \"" ROI_META_PARAM_NAME "\" parameter with a \"delta-qp\" "
+          "field overrides it for a single region.",
+          NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_ROI_FILE,
+      g_param_spec_string ("roi-file", "ROI file",
+          "ROI sequence file with a delta QP map per frame number or PTS, "
+          "see kvazaar-roi-convert",
+          NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_STATIC_DQP,
+      g_param_spec_uint ("static-dqp", "Static region delta QP",
+          "Delta QP of the CTUs that did not change since the previous frame, "
+          "so that they code as cheap skips (0 = disabled)", 0, 51,
+          PROP_STATIC_DQP_DEFAULT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_STATIC_THRESHOLD,
+      g_param_spec_double ("static-threshold", "Static region threshold",
+          "Mean absolute luma difference (8 bits scale) under which a CTU is "
+          "considered unchanged", 0, 255, PROP_STATIC_THRESHOLD_DEFAULT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_STATIC_STATS,
+      g_param_spec_boxed ("static-stats", "Static region statistics",
+          "Statistics of the static region detection since the start",
+          GST_TYPE_STRUCTURE, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_DUPLICATE_POLICY,
+      g_param_spec_enum ("duplicate-policy", "Duplicate policy",
+          "What to do with input frames identical to the previous one",
+          GST_KVAZAAR_ENC_DUPLICATE_POLICY_TYPE, PROP_DUPLICATE_POLICY_DEFAULT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_DUPLICATES,
+      g_param_spec_uint ("max-duplicates", "Max duplicates",
+          "Longest run of duplicates handled by duplicate-policy, the next "
+          "one is encoded normally (0 = unlimited)", 0, G_MAXINT,
+          PROP_MAX_DUPLICATES_DEFAULT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_QOS_DEGRADATION,
+      g_param_spec_boolean ("qos-degradation", "QoS degradation",
+          "Degrade the encoding in steps when late downstream or slower than "
+          "real time, and recover once on time again. Each step change posts "
+          "a kvazaarenc-qos element message",
+          PROP_QOS_DEGRADATION_DEFAULT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_QOS_LEVEL,
+      g_param_spec_enum ("qos-level", "QoS level",
+          "Current degradation step of qos-degradation",
+          GST_KVAZAAR_ENC_QOS_LEVEL_TYPE, GST_KVAZAAR_ENC_QOS_NONE,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_REALTIME,
+      g_param_spec_boolean ("realtime", "Realtime",
+          "Adjust the preset, RDO and fractional motion search at GOP "
+          "boundaries to hold the encode time near realtime-target. The "
+          "preset property is the highest one used (medium if not set)",
+          PROP_REALTIME_DEFAULT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_REALTIME_TARGET,
+      g_param_spec_double ("realtime-target", "Realtime target",
+          "Fraction of the frame interval the realtime mode aims to spend "
+          "encoding each frame", 0.1, 1.0, PROP_REALTIME_TARGET_DEFAULT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_TEMPORAL_LAYER,
+      g_param_spec_uint ("max-temporal-layer", "Max temporal layer",
+          "Drop the encoded pictures of the temporal layers above this one. "
+          "Output buffers carry their temporal ID in a GstKvazaarTemporalMeta",
+          0, MAX_TEMPORAL_ID, PROP_MAX_TEMPORAL_LAYER_DEFAULT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+          GST_PARAM_MUTABLE_PLAYING));
+
+  g_object_class_install_property (gobject_class, PROP_FRAME_STATS,
+      g_param_spec_flags ("frame-stats", "Frame statistics",
+          "Report how each access unit was encoded in a "
+          "\"kvazaarenc-frame-stats\" element message and/or a "
+          "GstKvazaarFrameStatsMeta. The quality measures are posted in "
+          "\"kvazaarenc-quality\" messages, and the meta carries the last one",
+          GST_KVAZAAR_ENC_FRAME_STATS_TYPE, PROP_FRAME_STATS_DEFAULT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+          GST_PARAM_MUTABLE_PLAYING));
+
+  g_object_class_install_property (gobject_class, PROP_STATS,
+      g_param_spec_boxed ("stats", "Statistics",
+          "Rolling statistics of the last output access units: encode rate, "
+          "bitrate, latency percentiles and key frame sizes, and the last "
+          "quality measure",
+          GST_TYPE_STRUCTURE, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_RECORD_LOCATION,
+      g_param_spec_string ("record-location", "Record location",
+          "Record the input frames, caps and property changes to this file, "
+          "to encode them again with kvazaar-replay",
+          NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+          GST_PARAM_MUTABLE_READY));
+
+  g_object_class_install_property (gobject_class, PROP_QUALITY_INTERVAL,
+      g_param_spec_uint ("quality-interval", "Quality interval",
+          "Measure the quality of one encoded picture in this many, on a "
+          "worker thread, from the picture reconstructed by Kvazaar "
+          "(0: never)", 0, G_MAXUINT, PROP_QUALITY_INTERVAL_DEFAULT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+          GST_PARAM_MUTABLE_PLAYING));
+
+  g_object_class_install_property (gobject_class, PROP_QUALITY_METRICS,
+      g_param_spec_flags ("quality-metrics", "Quality metrics",
+          "Metrics of the measured pictures",
+          GST_KVAZAAR_ENC_QUALITY_METRICS_TYPE, PROP_QUALITY_METRICS_DEFAULT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+          GST_PARAM_MUTABLE_PLAYING));
+
+  g_object_class_install_property (gobject_class, PROP_EXPECTED_CAPS,
+      g_param_spec_boxed ("expected-caps", "Expected caps",
+          "Fixed input caps to open the encoder with when going to READY, "
+          "so that it is ready for the first frame",
+          GST_TYPE_CAPS, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+          GST_PARAM_MUTABLE_READY));
+
+  g_object_class_install_property (gobject_class, PROP_ENCODER_CACHE_TIMEOUT,
+      g_param_spec_uint ("encoder-cache-timeout", "Encoder cache timeout",
+          "Keep an opened encoder of the same settings for this many ms "
+          "after the encoder is closed, for the next stream of any "
+          "kvazaarenc of the process (0: disabled)", 0, G_MAXUINT,
+          PROP_ENCODER_CACHE_TIMEOUT_DEFAULT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+          GST_PARAM_MUTABLE_PLAYING));
+
   gst_element_class_add_static_pad_template (element_class, &sink_factory);
   gst_element_class_add_static_pad_template (element_class, &src_factory);
+  gst_element_class_add_static_pad_template (element_class, &recon_factory);
 
   gst_element_class_set_static_metadata (element_class,
       "Kvazaar HEVC/H.265 video encoder", "Codec/Encoder/Video", "HEVC/H.265 encoder",
@@ -936,6 +1492,7 @@ gst_kvazaar_enc_init (GstKvazaarEnc * encoder)
   encoder->no_psnr = FALSE;
   encoder->no_info = FALSE;
   encoder->preset = PROP_PRESET_DEFAULT;
+  encoder->tune = PROP_TUNE_DEFAULT;
 #ifdef HAS_CRYPTO
   encoder->crypto = KVZ_CRYPTO_OFF;
   encoder->key = g_string_new (PROP_KEY_DEFAULT);
@@ -974,6 +1531,32 @@ gst_kvazaar_enc_init (GstKvazaarEnc * encoder)
   encoder->roi = g_string_new (NULL);
   encoder->roi_set = FALSE;
   encoder->kvz_opts = g_string_new (NULL);
+  encoder->slice_max_size = PROP_SLICE_MAX_SIZE_DEFAULT;
+  encoder->nal_aligned = FALSE;
+  encoder->vbv_bufsize = PROP_VBV_BUFSIZE_DEFAULT;
+  encoder->vbv_maxrate = PROP_VBV_MAXRATE_DEFAULT;
+  encoder->lookahead = PROP_LOOKAHEAD_DEFAULT;
+  encoder->lookahead_set = FALSE;
+  encoder->aq_strength = PROP_AQ_STRENGTH_DEFAULT;
+  encoder->scenecut = PROP_SCENECUT_DEFAULT;
+  encoder->min_keyint = PROP_MIN_KEYINT_DEFAULT;
+  encoder->roi_meta_weights = g_string_new (NULL);
+  encoder->roi_weights = g_array_new (FALSE, FALSE, sizeof (RoiWeight));
+  encoder->roi_file = g_string_new (NULL);
+  encoder->record_location = g_string_new (NULL);
+  encoder->static_dqp = PROP_STATIC_DQP_DEFAULT;
+  encoder->static_threshold = PROP_STATIC_THRESHOLD_DEFAULT;
+  g_queue_init (&encoder->static_pool);
+  encoder->duplicate_policy = PROP_DUPLICATE_POLICY_DEFAULT;
+  encoder->max_duplicates = PROP_MAX_DUPLICATES_DEFAULT;
+  encoder->qos_degradation = PROP_QOS_DEGRADATION_DEFAULT;
+  encoder->realtime = PROP_REALTIME_DEFAULT;
+  encoder->realtime_target = PROP_REALTIME_TARGET_DEFAULT;
+  encoder->max_temporal_layer = PROP_MAX_TEMPORAL_LAYER_DEFAULT;
+  encoder->frame_stats = PROP_FRAME_STATS_DEFAULT;
+  encoder->quality_interval = PROP_QUALITY_INTERVAL_DEFAULT;
+  encoder->quality_metrics = PROP_QUALITY_METRICS_DEFAULT;
+  encoder->cache_timeout = PROP_ENCODER_CACHE_TIMEOUT_DEFAULT;
 
   encoder->systeme_frame_number_offset = 0;
   GST_DEBUG ("source scan type %u", encoder->kvazaarconfig->source_scan_type);
@@ -983,6 +1566,10 @@ typedef struct
 {
   GstVideoCodecFrame *frame;
   GstVideoFrame vframe;
+  gboolean mapped;              /* FALSE once vframe went to the quality worker */
+  GstKvazaarQpMap *static_map;  /* delta QP of the unchanged CTUs */
+  gboolean duplicate;           /* same as the previous frame, code as skip */
+  gint64 queue_time;            /* monotonic, for the output latency */
 } FrameData;
 
 static FrameData *
@@ -998,151 +1585,725 @@ gst_kvazaar_enc_queue_frame (GstKvazaarEnc * enc, GstVideoCodecFrame * frame,
   fdata = g_slice_new (FrameData);
   fdata->frame = gst_video_codec_frame_ref (frame);
   fdata->vframe = vframe;
+  fdata->mapped = TRUE;
+  fdata->static_map = NULL;
+  fdata->duplicate = FALSE;
+  fdata->queue_time = g_get_monotonic_time ();
 
   enc->pending_frames = g_list_prepend (enc->pending_frames, fdata);
 
   return fdata;
 }
 
-static void
-gst_kvazaar_enc_dequeue_frame (GstKvazaarEnc * enc, GstVideoCodecFrame * frame)
+static FrameData *
+gst_kvazaar_enc_get_frame_data (GstKvazaarEnc * enc,
+    GstVideoCodecFrame * frame)
 {
   GList *l;
 
   for (l = enc->pending_frames; l; l = l->next) {
     FrameData *fdata = l->data;
 
-    if (fdata->frame != frame)
-      continue;
-
-    gst_video_frame_unmap (&fdata->vframe);
-    gst_video_codec_frame_unref (fdata->frame);
-    g_slice_free (FrameData, fdata);
-
-    enc->pending_frames = g_list_delete_link (enc->pending_frames, l);
-    return;
+    if (fdata->frame == frame)
+      return fdata;
   }
+
+  return NULL;
 }
 
-static void
-gst_kvazaar_enc_dequeue_all_frames (GstKvazaarEnc * enc)
+/*
+ * Per-frame CTU maps are recycled, maps of an older picture size are
+ * dropped.
+ */
+static GstKvazaarQpMap *
+gst_kvazaar_enc_acquire_map (GstKvazaarEnc * enc)
 {
-  GList *l;
+  GstKvazaarQpMap *map = g_queue_pop_head (&enc->static_pool);
 
-  for (l = enc->pending_frames; l; l = l->next) {
-    FrameData *fdata = l->data;
+  if (!map)
+    map = gst_kvazaar_qp_map_new (enc->qp_map->width, enc->qp_map->height);
 
-    gst_video_frame_unmap (&fdata->vframe);
-    gst_video_codec_frame_unref (fdata->frame);
-    g_slice_free (FrameData, fdata);
-  }
-  g_list_free (enc->pending_frames);
-  enc->pending_frames = NULL;
+  return map;
 }
 
-static gboolean
-gst_kvazaar_enc_start (GstVideoEncoder * encoder)
+static void
+gst_kvazaar_enc_release_map (GstKvazaarEnc * enc, GstKvazaarQpMap * map)
 {
+  if (!map)
+    return;
 
-  return TRUE;
+  if (enc->qp_map && map->width == enc->qp_map->width &&
+      map->height == enc->qp_map->height)
+    g_queue_push_head (&enc->static_pool, map);
+  else
+    gst_kvazaar_qp_map_free (map);
 }
 
 /*
- * Flush encoder frames and close encoder.
+ * End the trace of a frame dropped without being finished.
  */
-static gboolean
-gst_kvazaar_enc_stop (GstVideoEncoder * encoder)
+static void
+gst_kvazaar_enc_trace_drop (GstKvazaarEnc * enc, GstVideoCodecFrame * frame)
 {
-  GstKvazaarEnc *kvazaarenc = GST_KVAZAAR_ENC (encoder);
-
-  GST_DEBUG_OBJECT (encoder, "stop encoder");
+  gint64 trace_start = GST_KVAZAAR_TRACE_START ();
 
-  gst_kvazaar_enc_flush_frames (kvazaarenc, FALSE);
-  gst_kvazaar_enc_close_encoder (kvazaarenc);
-  gst_kvazaar_enc_dequeue_all_frames (kvazaarenc);
+  if (!trace_start)
+    return;
 
-  if (kvazaarenc->input_state)
-    gst_video_codec_state_unref (kvazaarenc->input_state);
-  kvazaarenc->input_state = NULL;
+  gst_kvazaar_trace_span (GST_OBJECT (enc), "drop",
+      frame->system_frame_number, trace_start);
+  gst_kvazaar_trace_frame_end (GST_OBJECT (enc), frame->system_frame_number);
+}
 
-  return TRUE;
+static void
+gst_kvazaar_enc_free_frame_data (GstKvazaarEnc * enc, FrameData * fdata)
+{
+  if (fdata->mapped)
+    gst_video_frame_unmap (&fdata->vframe);
+  gst_video_codec_frame_unref (fdata->frame);
+  gst_kvazaar_enc_release_map (enc, fdata->static_map);
+  g_slice_free (FrameData, fdata);
 }
 
 /*
- * Flush encoder frames and restart encoder.
+ * Move the mapping of the input frame out of its frame data, for the quality
+ * worker. FALSE if the frame is not pending.
  */
 static gboolean
-gst_kvazaar_enc_flush (GstVideoEncoder * encoder)
+gst_kvazaar_enc_take_mapping (GstKvazaarEnc * enc, GstVideoCodecFrame * frame,
+    GstVideoFrame * vframe)
 {
-  GstKvazaarEnc *kvazaarenc = GST_KVAZAAR_ENC (encoder);
+  FrameData *fdata = gst_kvazaar_enc_get_frame_data (enc, frame);
 
-  GST_DEBUG_OBJECT (encoder, "flushing encoder");
-
-  gst_kvazaar_enc_flush_frames (kvazaarenc, FALSE);
-  gst_kvazaar_enc_close_encoder (kvazaarenc);
-  gst_kvazaar_enc_dequeue_all_frames (kvazaarenc);
+  if (!fdata || !fdata->mapped)
+    return FALSE;
 
-  gst_kvazaar_enc_init_encoder (kvazaarenc);
+  *vframe = fdata->vframe;
+  fdata->mapped = FALSE;
 
   return TRUE;
 }
 
 static void
-gst_kvazaar_enc_finalize (GObject * object)
+gst_kvazaar_enc_dequeue_frame (GstKvazaarEnc * enc, GstVideoCodecFrame * frame)
 {
-  GstKvazaarEnc *encoder = GST_KVAZAAR_ENC (object);
-
-  if (encoder->input_state)
-    gst_video_codec_state_unref (encoder->input_state);
-  encoder->input_state = NULL;
+  FrameData *fdata = gst_kvazaar_enc_get_frame_data (enc, frame);
 
-  gst_kvazaar_enc_close_encoder (encoder);
+  if (!fdata)
+    return;
 
-  G_OBJECT_CLASS (parent_class)->finalize (object);
+  enc->pending_frames = g_list_remove (enc->pending_frames, fdata);
+  gst_kvazaar_enc_free_frame_data (enc, fdata);
 }
 
 /*
- * GstVideoFormat to Kvazaar format. Set data to the corresponding number of
- * planes.
+ * Free frames handed over with the encoder that read them, away from the
+ * element: the maps are not recycled.
  */
-static gint
-gst_kvazaar_enc_gst_to_kvazaar_video_format (GstVideoFormat format, gint * data)
+static void
+gst_kvazaar_enc_free_frame_list (GList * frames)
 {
-  switch (format) {
-    case GST_VIDEO_FORMAT_I420:
-    case GST_VIDEO_FORMAT_YV12:
-    case GST_VIDEO_FORMAT_I420_10LE:
-    case GST_VIDEO_FORMAT_I420_10BE:
-      if (data)
-        *data = 3;
-      return KVZ_FORMAT_P420;
-    default:
-      g_return_val_if_reached (GST_VIDEO_FORMAT_UNKNOWN);
+  GList *l;
+
+  for (l = frames; l; l = l->next) {
+    FrameData *fdata = l->data;
+
+    if (fdata->mapped)
+      gst_video_frame_unmap (&fdata->vframe);
+    gst_video_codec_frame_unref (fdata->frame);
+    gst_kvazaar_qp_map_free (fdata->static_map);
+    g_slice_free (FrameData, fdata);
   }
+  g_list_free (frames);
 }
 
-/*
- * Initialize Kvazaar encoder.
- * The encoder is created based on a kvz_config struct.
- */
-static gboolean
-gst_kvazaar_enc_init_encoder (GstKvazaarEnc * encoder)
+static void
+gst_kvazaar_enc_dequeue_all_frames (GstKvazaarEnc * enc)
 {
-  GstVideoInfo *info;
+  GList *l;
 
-  if (!encoder->input_state) {
-    GST_DEBUG_OBJECT (encoder, "Have no input state yet");
-    return FALSE;
+  for (l = enc->pending_frames; l; l = l->next) {
+    FrameData *fdata = l->data;
+
+    gst_kvazaar_enc_trace_drop (enc, fdata->frame);
+    gst_kvazaar_enc_free_frame_data (enc, fdata);
   }
+  g_list_free (enc->pending_frames);
+  enc->pending_frames = NULL;
+}
 
-  info = &encoder->input_state->info;
+static GstFlowReturn gst_kvazaar_enc_encode_picture (GstKvazaarEnc * encoder,
+    GstVideoCodecFrame * frame, kvz_picture * pic, GstKvazaarQpMap * aq);
 
-  /* Make sure that the encoder is closed */
-  gst_kvazaar_enc_close_encoder (encoder);
+/*
+ * Empty the lookahead, either encoding the pictures it holds or dropping
+ * them.
+ */
+static GstFlowReturn
+gst_kvazaar_enc_drain_lookahead (GstKvazaarEnc * encoder, gboolean send)
+{
+  GstFlowReturn ret = GST_FLOW_OK;
+  gpointer frame, pic;
 
-  GST_OBJECT_LOCK (encoder);
+  if (!encoder->lookahead_queue)
+    return GST_FLOW_OK;
 
-  /* Set up encoder parameters */
+  while (gst_kvazaar_lookahead_pop (encoder->lookahead_queue, TRUE,
+          encoder->aq_strength, send ? encoder->aq_map : NULL, &frame, &pic)) {
+    if (send && ret == GST_FLOW_OK) {
+      ret = gst_kvazaar_enc_encode_picture (encoder, frame, pic,
+          encoder->aq_map);
+    } else {
+      gst_kvazaar_enc_trace_drop (encoder, frame);
+      encoder->api->picture_free (pic);
+      gst_video_codec_frame_unref (frame);
+    }
+  }
+
+  gst_kvazaar_lookahead_free (encoder->lookahead_queue);
+  encoder->lookahead_queue = NULL;
+
+  return ret;
+}
+
+/*
+ * Highest effort of the realtime mode, the preset property bounds it.
+ */
+static gint
+gst_kvazaar_enc_get_max_effort (GstKvazaarEnc * encoder)
+{
+  gint preset = encoder->preset == GST_KVAZAAR_ENC_NO_PRESET ? BASE_PRESET :
+      encoder->preset;
+
+  return 2 * (preset - GST_KVAZAAR_ENC_ULTRAFAST) + 1;
+}
+
+/*
+ * Efforts of the realtime mode go by two per preset, the lower one with a
+ * reduced RDO and fractional motion search.
+ */
+static gint
+gst_kvazaar_enc_effort_to_preset (gint effort, gboolean * reduced_search)
+{
+  *reduced_search = effort % 2 == 0;
+
+  return GST_KVAZAAR_ENC_ULTRAFAST + effort / 2;
+}
+
+/*
+ * Reset the state that follows the stream rather than the encoder instance.
+ */
+static void
+gst_kvazaar_enc_reset_stream_state (GstKvazaarEnc * encoder)
+{
+  GST_OBJECT_LOCK (encoder);
+  encoder->vbv_fullness = 0;
+  encoder->vbv_dqp = 0;
+  encoder->qos_jitter = 0;
+  encoder->qos_earliest = GST_CLOCK_TIME_NONE;
+  GST_OBJECT_UNLOCK (encoder);
+
+  encoder->systeme_frame_number_offset = 0;
+  encoder->scene_valid = FALSE;
+  encoder->scene_distance = 0;
+  gst_buffer_replace (&encoder->static_prev, NULL);
+  gst_buffer_replace (&encoder->dup_prev, NULL);
+  encoder->dup_run = 0;
+  encoder->qos_late_count = 0;
+  encoder->qos_on_time_count = 0;
+}
+
+static void
+gst_kvazaar_enc_stop_recording (GstKvazaarEnc * encoder)
+{
+  GstKvazaarRecorder *recorder;
+
+  GST_OBJECT_LOCK (encoder);
+  recorder = encoder->recorder;
+  encoder->recorder = NULL;
+  GST_OBJECT_UNLOCK (encoder);
+
+  gst_kvazaar_recorder_free (recorder);
+}
+
+static gboolean
+gst_kvazaar_enc_start (GstVideoEncoder * encoder)
+{
+  GstKvazaarEnc *kvazaarenc = GST_KVAZAAR_ENC (encoder);
+  GstKvazaarQuality *quality;
+  GError *err = NULL;
+
+  gst_kvazaar_enc_reset_stream_state (kvazaarenc);
+
+  GST_OBJECT_LOCK (kvazaarenc);
+  kvazaarenc->static_frames = 0;
+  kvazaarenc->static_damage_frames = 0;
+  kvazaarenc->static_ctus = 0;
+  kvazaarenc->static_total_ctus = 0;
+  kvazaarenc->static_time = 0;
+  kvazaarenc->qos_level = GST_KVAZAAR_ENC_QOS_NONE;
+  GST_OBJECT_UNLOCK (kvazaarenc);
+  kvazaarenc->dup_frames = 0;
+  kvazaarenc->qos_encode_time = 0;
+  kvazaarenc->qos_decimation_count = 0;
+  kvazaarenc->qos_dropped = 0;
+
+  /* The realtime mode starts from the preset and comes down if needed */
+  kvazaarenc->rt_effort = gst_kvazaar_enc_get_max_effort (kvazaarenc);
+  kvazaarenc->rt_frames = 0;
+  kvazaarenc->rt_prev_effort = -1;
+  kvazaarenc->max_temporal_id = 0;
+  kvazaarenc->stats_frames = 0;
+  kvazaarenc->stats_keyframes = 0;
+  memset (kvazaarenc->rt_cost, 0, sizeof (kvazaarenc->rt_cost));
+
+  if (kvazaarenc->roi_file->len) {
+    kvazaarenc->roi_seq =
+        gst_kvazaar_roi_file_open (kvazaarenc->roi_file->str, &err);
+    if (!kvazaarenc->roi_seq) {
+      GST_ELEMENT_ERROR (encoder, RESOURCE, OPEN_READ,
+          ("Can not open ROI file."), ("%s", err->message));
+      g_error_free (err);
+      return FALSE;
+    }
+    GST_INFO_OBJECT (encoder, "%u ROI maps indexed by %s in %s",
+        gst_kvazaar_roi_file_get_count (kvazaarenc->roi_seq),
+        gst_kvazaar_roi_file_is_pts (kvazaarenc->roi_seq) ? "PTS" :
+        "frame number", kvazaarenc->roi_file->str);
+  }
+
+  if (kvazaarenc->record_location->len) {
+    /* The crypto key is left out */
+    static const gchar *const skip[] = { "record-location", "key", NULL };
+    GstKvazaarRecorder *recorder;
+
+    recorder = gst_kvazaar_recorder_new (kvazaarenc->record_location->str,
+        &err);
+    if (!recorder) {
+      GST_ELEMENT_ERROR (encoder, RESOURCE, OPEN_WRITE,
+          ("Can not create recording."), ("%s", err->message));
+      g_error_free (err);
+      return FALSE;
+    }
+    gst_kvazaar_recorder_write_properties (recorder, G_OBJECT (encoder),
+        skip);
+
+    GST_OBJECT_LOCK (kvazaarenc);
+    kvazaarenc->recorder = recorder;
+    GST_OBJECT_UNLOCK (kvazaarenc);
+    GST_INFO_OBJECT (encoder, "recording to %s",
+        kvazaarenc->record_location->str);
+  }
+
+  quality = gst_kvazaar_quality_new (kvazaarenc->api,
+      GST_ELEMENT (encoder), &err);
+  if (!quality) {
+    GST_ELEMENT_ERROR (encoder, RESOURCE, FAILED,
+        ("Failed to start the quality worker."), ("%s", err->message));
+    g_error_free (err);
+    return FALSE;
+  }
+
+  GST_OBJECT_LOCK (kvazaarenc);
+  kvazaarenc->quality = quality;
+  kvazaarenc->quality_count = 0;
+  /* sticky events of the recon pad are gone since its deactivation */
+  kvazaarenc->recon_stream_started = FALSE;
+  kvazaarenc->recon_need_caps = TRUE;
+  kvazaarenc->recon_need_segment = TRUE;
+  GST_OBJECT_UNLOCK (kvazaarenc);
+
+  return TRUE;
+}
+
+/*
+ * Flush encoder frames and close encoder.
+ */
+static gboolean
+gst_kvazaar_enc_stop (GstVideoEncoder * encoder)
+{
+  GstKvazaarEnc *kvazaarenc = GST_KVAZAAR_ENC (encoder);
+
+  GST_DEBUG_OBJECT (encoder, "stop encoder");
+
+  gst_kvazaar_enc_drain_lookahead (kvazaarenc, FALSE);
+  gst_kvazaar_enc_flush_frames (kvazaarenc, FALSE);
+  gst_kvazaar_enc_close_encoder_at_stop (kvazaarenc);
+  gst_kvazaar_enc_release_spare (kvazaarenc);
+  gst_kvazaar_enc_dequeue_all_frames (kvazaarenc);
+  gst_kvazaar_trace_flush ();
+
+  gst_kvazaar_thumbnail_free (kvazaarenc->scene_thumb[0]);
+  gst_kvazaar_thumbnail_free (kvazaarenc->scene_thumb[1]);
+  kvazaarenc->scene_thumb[0] = kvazaarenc->scene_thumb[1] = NULL;
+
+  gst_kvazaar_roi_file_close (kvazaarenc->roi_seq);
+  kvazaarenc->roi_seq = NULL;
+
+  gst_kvazaar_enc_stop_recording (kvazaarenc);
+
+  if (kvazaarenc->quality) {
+    GstKvazaarQuality *quality;
+    guint64 measured, skipped;
+
+    GST_OBJECT_LOCK (kvazaarenc);
+    quality = kvazaarenc->quality;
+    kvazaarenc->quality = NULL;
+    GST_OBJECT_UNLOCK (kvazaarenc);
+
+    gst_kvazaar_quality_get_counts (quality, &measured, &skipped);
+    gst_kvazaar_quality_free (quality);
+    if (measured || skipped)
+      GST_INFO_OBJECT (encoder, "quality of %" G_GUINT64_FORMAT " pictures "
+          "measured, %" G_GUINT64_FORMAT " skipped", measured, skipped);
+  }
+
+  gst_buffer_replace (&kvazaarenc->static_prev, NULL);
+  gst_buffer_replace (&kvazaarenc->dup_prev, NULL);
+  if (kvazaarenc->dup_frames)
+    GST_INFO_OBJECT (encoder, "%" G_GUINT64_FORMAT " duplicate frames",
+        kvazaarenc->dup_frames);
+  if (kvazaarenc->qos_dropped)
+    GST_INFO_OBJECT (encoder, "%" G_GUINT64_FORMAT " frames dropped by QoS",
+        kvazaarenc->qos_dropped);
+  g_queue_foreach (&kvazaarenc->static_pool, (GFunc) gst_kvazaar_qp_map_free,
+      NULL);
+  g_queue_clear (&kvazaarenc->static_pool);
+  if (kvazaarenc->static_frames)
+    GST_INFO_OBJECT (encoder, "%.1f%% static CTUs in %" G_GUINT64_FORMAT
+        " frames, %" G_GUINT64_FORMAT " with damage rectangles, analysis "
+        "%" GST_TIME_FORMAT, 100.0 * kvazaarenc->static_ctus /
+        MAX (kvazaarenc->static_total_ctus, 1), kvazaarenc->static_frames,
+        kvazaarenc->static_damage_frames,
+        GST_TIME_ARGS (kvazaarenc->static_time));
+
+  if (kvazaarenc->input_state)
+    gst_video_codec_state_unref (kvazaarenc->input_state);
+  kvazaarenc->input_state = NULL;
+
+  return TRUE;
+}
+
+/*
+ * Hand the encoder over to the cache thread without waiting for it to
+ * finish its pictures. It is closed there, then the pending frames it may
+ * still read are released.
+ */
+static void
+gst_kvazaar_enc_retire_encoder (GstKvazaarEnc * encoder)
+{
+  GList *frames = encoder->pending_frames;
+  kvz_config *config;
+  GList *l;
+
+  encoder->pending_frames = NULL;
+  g_free (encoder->kvazaarenc_key);
+  encoder->kvazaarenc_key = NULL;
+
+  /* The frames are freed away from the element, their trace ends here */
+  for (l = frames; l; l = l->next)
+    gst_kvazaar_enc_trace_drop (encoder, ((FrameData *) l->data)->frame);
+
+  GST_OBJECT_LOCK (encoder);
+  config = gst_kvazaar_enc_take_config (encoder);
+  GST_OBJECT_UNLOCK (encoder);
+
+  if (config) {
+    gst_kvazaar_encoder_cache_close (encoder->api, config,
+        encoder->kvazaarenc, (GDestroyNotify) gst_kvazaar_enc_free_frame_list,
+        frames);
+  } else {
+    if (encoder->kvazaarenc)
+      encoder->api->encoder_close (encoder->kvazaarenc);
+    gst_kvazaar_enc_free_frame_list (frames);
+  }
+  encoder->kvazaarenc = NULL;
+}
+
+/*
+ * Drop the encoder frames and restart on the spare encoder, opened in the
+ * background after the previous one.
+ */
+static gboolean
+gst_kvazaar_enc_flush (GstVideoEncoder * encoder)
+{
+  GstKvazaarEnc *kvazaarenc = GST_KVAZAAR_ENC (encoder);
+
+  GST_DEBUG_OBJECT (encoder, "flushing encoder");
+
+  gst_kvazaar_enc_drain_lookahead (kvazaarenc, FALSE);
+  gst_kvazaar_enc_retire_encoder (kvazaarenc);
+  gst_kvazaar_enc_reset_stream_state (kvazaarenc);
+
+  gst_kvazaar_enc_init_encoder (kvazaarenc);
+
+  return TRUE;
+}
+
+static void
+gst_kvazaar_enc_finalize (GObject * object)
+{
+  GstKvazaarEnc *encoder = GST_KVAZAAR_ENC (object);
+
+  if (encoder->input_state)
+    gst_video_codec_state_unref (encoder->input_state);
+  encoder->input_state = NULL;
+
+  gst_kvazaar_enc_close_encoder (encoder);
+  gst_kvazaar_enc_release_preopen (encoder);
+  gst_kvazaar_enc_release_spare (encoder);
+  gst_caps_replace (&encoder->expected_caps, NULL);
+
+  gst_kvazaar_qp_map_free (encoder->qp_map);
+  encoder->qp_map = NULL;
+  gst_kvazaar_qp_map_free (encoder->aq_map);
+  encoder->aq_map = NULL;
+  gst_kvazaar_qp_map_free (encoder->roi_map);
+  encoder->roi_map = NULL;
+  g_array_free (encoder->roi_weights, TRUE);
+  g_string_free (encoder->roi_meta_weights, TRUE);
+  g_string_free (encoder->roi_file, TRUE);
+  g_string_free (encoder->record_location, TRUE);
+  g_queue_foreach (&encoder->static_pool, (GFunc) gst_kvazaar_qp_map_free,
+      NULL);
+  g_queue_clear (&encoder->static_pool);
+  g_free (encoder->dqps);
+  encoder->dqps = NULL;
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
+/*
+ * GstVideoFormat to Kvazaar format. Set data to the corresponding number of
+ * planes.
+ */
+static gint
+gst_kvazaar_enc_gst_to_kvazaar_video_format (GstVideoFormat format, gint * data)
+{
+  switch (format) {
+    case GST_VIDEO_FORMAT_I420:
+    case GST_VIDEO_FORMAT_YV12:
+    case GST_VIDEO_FORMAT_I420_10LE:
+    case GST_VIDEO_FORMAT_I420_10BE:
+      if (data)
+        *data = 3;
+      return KVZ_FORMAT_P420;
+    default:
+      g_return_val_if_reached (GST_VIDEO_FORMAT_UNKNOWN);
+  }
+}
+
+/*
+ * Hand the Kvazaar configuration over and replace it by a default one.
+ * Return NULL and keep it when a default one can not be made.
+ */
+static kvz_config *
+gst_kvazaar_enc_take_config (GstKvazaarEnc * encoder)
+{
+  kvz_config *config = encoder->api->config_alloc ();
+  kvz_config *old;
+
+  if (!config || !encoder->api->config_init (config)) {
+    GST_WARNING_OBJECT (encoder, "Failed to init config structure");
+    if (config)
+      encoder->api->config_destroy (config);
+    return NULL;
+  }
+
+  /* The static ROI map belongs to the element */
+  old = encoder->kvazaarconfig;
+  if (old->roi.dqps == encoder->dqps)
+    old->roi.dqps = NULL;
+  encoder->kvazaarconfig = config;
+
+  return old;
+}
+
+/*
+ * Replace the Kvazaar configuration by a default one.
+ */
+static void
+gst_kvazaar_enc_reset_config (GstKvazaarEnc * encoder)
+{
+  kvz_config *config = gst_kvazaar_enc_take_config (encoder);
+
+  if (config)
+    encoder->api->config_destroy (config);
+}
+
+/*
+ * Use an encoder opened by someone else, with the configuration it was
+ * opened with, which is the same as the one of the element.
+ */
+static void
+gst_kvazaar_enc_adopt_encoder (GstKvazaarEnc * encoder, kvz_config * config,
+    kvz_encoder * enc)
+{
+  GST_OBJECT_LOCK (encoder);
+  /* The static ROI map belongs to the element */
+  if (encoder->kvazaarconfig->roi.dqps == encoder->dqps)
+    encoder->kvazaarconfig->roi.dqps = NULL;
+  encoder->api->config_destroy (encoder->kvazaarconfig);
+  encoder->kvazaarconfig = config;
+  GST_OBJECT_UNLOCK (encoder);
+
+  encoder->kvazaarenc = enc;
+}
+
+/*
+ * Key of the Kvazaar configuration in the encoder cache: the input, what
+ * QoS and the realtime mode changed, and every setting. NULL when the
+ * configuration points to the static ROI map of the element.
+ */
+static gchar *
+gst_kvazaar_enc_get_config_key (GstKvazaarEnc * encoder)
+{
+  /* Those do not change the configuration */
+  static const gchar *const skip[] = { "qos", "expected-caps", "encoder-cache-timeout", "record-location",
+    "frame-stats", "quality-interval", "quality-metrics", "no-psnr",
+    "max-temporal-layer", NULL
+  };
+  kvz_config *config = encoder->kvazaarconfig;
+  GParamSpec **specs;
+  GString *str;
+  gchar *key;
+  guint i, n;
+
+  if (config->roi.dqps)
+    return NULL;
+
+  str = g_string_new (NULL);
+  g_string_append_printf (str, "%d %dx%d %d/%d %d qos=%d rt=%d",
+      config->input_format, config->width, config->height,
+      config->framerate_num, config->framerate_denom,
+      config->source_scan_type, encoder->qos_config_level,
+      encoder->realtime ? encoder->rt_config_effort : -1);
+
+  specs = g_object_class_list_properties (G_OBJECT_GET_CLASS (encoder), &n);
+  for (i = 0; i < n; i++) {
+    GValue value = G_VALUE_INIT;
+    const gchar *const *s;
+    gchar *serialized;
+
+    if ((specs[i]->flags & G_PARAM_READWRITE) != G_PARAM_READWRITE ||
+        specs[i]->owner_type == GST_TYPE_OBJECT)
+      continue;
+    for (s = skip; *s; s++)
+      if (g_strcmp0 (*s, specs[i]->name) == 0)
+        break;
+    if (*s)
+      continue;
+
+    g_value_init (&value, specs[i]->value_type);
+    g_object_get_property (G_OBJECT (encoder), specs[i]->name, &value);
+    serialized = gst_value_serialize (&value);
+    g_string_append_printf (str, ";%s=%s", specs[i]->name,
+        serialized ? serialized : "");
+    g_free (serialized);
+    g_value_unset (&value);
+  }
+  g_free (specs);
+
+  /* The crypto key does not stay around in the cache */
+  key = g_compute_checksum_for_string (G_CHECKSUM_SHA256, str->str, str->len);
+  g_string_free (str, TRUE);
+
+  return key;
+}
+
+/*
+ * Scan type the encoder is opened with: the field order of interlaced caps,
+ * else the source-scan-type property, for sources that do not signal it.
+ */
+static gint32
+gst_kvazaar_enc_get_scan_type (GstKvazaarEnc * encoder, GstVideoInfo * info)
+{
+  if (GST_VIDEO_INFO_IS_INTERLACED (info)) {
+#if GST_CHECK_VERSION (1, 12, 0)
+    if (GST_VIDEO_INFO_FIELD_ORDER (info) ==
+        GST_VIDEO_FIELD_ORDER_BOTTOM_FIELD_FIRST)
+      return KVZ_INTERLACING_BFF;
+    if (GST_VIDEO_INFO_FIELD_ORDER (info) ==
+        GST_VIDEO_FIELD_ORDER_TOP_FIELD_FIRST)
+      return KVZ_INTERLACING_TFF;
+#endif
+    if (encoder->source_scan_type == GST_KVAZAAR_BFF)
+      return KVZ_INTERLACING_BFF;
+    return KVZ_INTERLACING_TFF;
+  }
+
+  switch (encoder->source_scan_type) {
+    case GST_KVAZAAR_TFF:
+      return KVZ_INTERLACING_TFF;
+    case GST_KVAZAAR_BFF:
+      return KVZ_INTERLACING_BFF;
+    default:
+      return KVZ_INTERLACING_NONE;
+  }
+}
+
+/*
+ * Field order of an input picture, for Kvazaar to split it into fields.
+ * Buffer flags take over from the configured order when the caps do not
+ * give one, and progressive pictures of mixed content keep it too, as the
+ * stream can not switch.
+ */
+static enum kvz_interlacing
+gst_kvazaar_enc_get_field_order (GstKvazaarEnc * encoder,
+    GstVideoFrame * vframe)
+{
+  enum kvz_interlacing order = encoder->kvazaarconfig->source_scan_type;
+
+  if (order == KVZ_INTERLACING_NONE || !GST_VIDEO_FRAME_IS_INTERLACED (vframe))
+    return order;
+#if GST_CHECK_VERSION (1, 12, 0)
+  if (GST_VIDEO_INFO_FIELD_ORDER (&vframe->info) !=
+      GST_VIDEO_FIELD_ORDER_UNKNOWN)
+    return order;
+#endif
+
+  return GST_VIDEO_FRAME_IS_TFF (vframe) ? KVZ_INTERLACING_TFF :
+      KVZ_INTERLACING_BFF;
+}
+
+/*
+ * Initialize Kvazaar encoder.
+ * The encoder is created based on a kvz_config struct.
+ */
+static gboolean
+gst_kvazaar_enc_init_encoder (GstKvazaarEnc * encoder)
+{
+  if (!encoder->input_state) {
+    GST_DEBUG_OBJECT (encoder, "Have no input state yet");
+    return FALSE;
+  }
+
+  if (!gst_kvazaar_enc_open_encoder (encoder, &encoder->input_state->info)) {
+    GST_ELEMENT_ERROR (encoder, STREAM, ENCODE,
+        ("Can not initialize Kvazaar encoder."), (NULL));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/*
+ * Configure Kvazaar for input of this info: the element settings go into
+ * kvazaarconfig. Called with the object lock.
+ */
+static void
+gst_kvazaar_enc_configure (GstKvazaarEnc * encoder, GstVideoInfo * info)
+{
+  gint preset, qos_level;
+  gboolean reduced_search = FALSE;
+
+  /* What a degraded encoder changed is undone from the defaults, the
+   * properties are applied again on top */
+  qos_level = QOS_CONFIG_LEVEL (encoder->qos_level);
+  if (encoder->qos_config_level > qos_level)
+    gst_kvazaar_enc_reset_config (encoder);
+
+  /* Set up encoder parameters */
 
   /* First, set up parameters that would not be overwritten by preset */
 
@@ -1152,12 +2313,17 @@ gst_kvazaar_enc_init_encoder (GstKvazaarEnc * encoder)
   encoder->kvazaarconfig->framerate_denom = info->fps_d;
   encoder->kvazaarconfig->width = info->width;
   encoder->kvazaarconfig->height = info->height;
+  /* Kvazaar codes each field as a picture, with the field VUI and SEI */
+  encoder->kvazaarconfig->source_scan_type =
+      gst_kvazaar_enc_get_scan_type (encoder, info);
   encoder->kvazaarconfig->qp = encoder->qp;
   encoder->kvazaarconfig->target_bitrate = encoder->bitrate;
   //* TEST
   encoder->kvazaarconfig->intra_period = encoder->intra_period;
   encoder->kvazaarconfig->vps_period = encoder->vps_period;
-  encoder->kvazaarconfig->calc_psnr = encoder->no_psnr ? 0 : 1 ;
+  /* PSNR is measured on a sample of the output by the quality worker, not
+   * for every picture in the encoding threads */
+  encoder->kvazaarconfig->calc_psnr = 0;
   encoder->kvazaarconfig->add_encoder_info = encoder->no_info ? 0 : 1 ;
 #ifdef HAS_CRYPTO
   encoder->kvazaarconfig->crypto_features = encoder->crypto;
@@ -1176,11 +2342,36 @@ gst_kvazaar_enc_init_encoder (GstKvazaarEnc * encoder)
    * overwrite the previous parameters if no preset is set. */
 
   //* TEST
-  if (encoder->preset != GST_KVAZAAR_ENC_NO_PRESET)
+  preset = encoder->preset;
+  if (encoder->realtime) {
+    preset = gst_kvazaar_enc_effort_to_preset (encoder->rt_effort,
+        &reduced_search);
+    encoder->rt_config_effort = encoder->rt_effort;
+  }
+  if (qos_level >= GST_KVAZAAR_ENC_QOS_FAST_PRESET)
+    preset = MAX ((preset == GST_KVAZAAR_ENC_NO_PRESET ? BASE_PRESET :
+            preset) - QOS_PRESET_STEP, GST_KVAZAAR_ENC_ULTRAFAST);
+  if (preset != GST_KVAZAAR_ENC_NO_PRESET)
     encoder->api->config_parse (encoder->kvazaarconfig, "preset",
-        preset_types[encoder->preset].value_nick);
+        preset_types[preset].value_nick);
+  if (reduced_search) {
+    encoder->kvazaarconfig->rdo = MAX (encoder->kvazaarconfig->rdo - 1, 0);
+    encoder->kvazaarconfig->fme_level =
+        MAX (encoder->kvazaarconfig->fme_level - 1, 0);
+  }
   // END TEST */
 
+  /* Tuning goes on top of the preset, explicit properties below still
+   * override it. */
+  if (encoder->tune == GST_KVAZAAR_ENC_TUNE_ZEROLATENCY) {
+    /* Low-delay P-only: no reordering, so each picture can be output as soon
+     * as it is coded */
+    encoder->api->config_parse (encoder->kvazaarconfig, "gop", "0");
+    encoder->kvazaarconfig->bipred = 0;
+    /* Only one access unit in flight */
+    encoder->kvazaarconfig->owf = 0;
+  }
+
   /* Finally, set parameters that must be overwrite preset if specified */
 
   //* TEST
@@ -1229,18 +2420,49 @@ gst_kvazaar_enc_init_encoder (GstKvazaarEnc * encoder)
     encoder->api->config_parse (encoder->kvazaarconfig, "gop",
         encoder->gop->str);
 
-  if (encoder->roi_set)
+  /* Smallest slices Kvazaar can make are CTU rows, which needs WPP */
+  if (encoder->slice_max_size > 0) {
+    encoder->kvazaarconfig->wpp = 1;
+    encoder->api->config_parse (encoder->kvazaarconfig, "slices", "wpp");
+  }
+
+  if (encoder->roi_set && !encoder->dqps)
   {
     //encoder->dqps = (int8_t *) g_malloc (sizeof (int8_t *) * 9);
     GST_DEBUG ("Got ROI string: %s", encoder->roi->str);
 
-    parse_roi_array (encoder->roi->str, &encoder->roi_width, &encoder->roi_height,
-        &encoder->dqps, -51, 51);
-    GST_DEBUG ("%d %d %d", encoder->roi_width, encoder->roi_height, encoder->dqps[0]);
+    g_free (encoder->dqps);
+    encoder->dqps = NULL;
+    if (parse_roi_array (encoder->roi->str, &encoder->roi_width,
+            &encoder->roi_height, &encoder->dqps, -51, 51)) {
+      GST_DEBUG ("%d %d %d", encoder->roi_width, encoder->roi_height,
+          encoder->dqps[0]);
+    }
+  }
+#ifndef HAVE_KVZ_PICTURE_ROI
+  /* Otherwise the static map is applied with every picture */
+  if (encoder->dqps) {
     encoder->kvazaarconfig->roi.width = encoder->roi_width;
     encoder->kvazaarconfig->roi.height = encoder->roi_height;
     encoder->kvazaarconfig->roi.dqps = encoder->dqps;
   }
+#endif
+
+  /* Use Kvazaar's own VBV when this build has it, the element rate guard
+   * runs in any case */
+  if (encoder->vbv_bufsize && encoder->vbv_maxrate) {
+    gchar *bufsize = g_strdup_printf ("%u", encoder->vbv_bufsize);
+    gchar *maxrate = g_strdup_printf ("%u", encoder->vbv_maxrate);
+
+    if (!encoder->api->config_parse (encoder->kvazaarconfig, "vbv-bufsize",
+            bufsize)
+        || !encoder->api->config_parse (encoder->kvazaarconfig, "vbv-maxrate",
+            maxrate))
+      GST_INFO_OBJECT (encoder, "Kvazaar has no VBV settings, "
+          "relying on the element rate guard");
+    g_free (bufsize);
+    g_free (maxrate);
+  }
   // END TEST */
 
   /* Parse Kvazaar option string property */
@@ -1250,16 +2472,83 @@ gst_kvazaar_enc_init_encoder (GstKvazaarEnc * encoder)
     GST_ERROR ("Error parsing option string");
   }
 
-  encoder->reconfig = FALSE;
+  /* The fast search of a degraded encoder goes over everything else */
+  if (qos_level >= GST_KVAZAAR_ENC_QOS_FAST_SEARCH) {
+    encoder->api->config_parse (encoder->kvazaarconfig, "rdo", "0");
+    encoder->api->config_parse (encoder->kvazaarconfig, "subme", "1");
+  }
+  encoder->qos_config_level = qos_level;
+}
 
-  /* good start, will be corrected if needed */
-  encoder->dts_offset = 0;
+/*
+ * Configuration for a spare encoder, with the same settings as kvazaarconfig.
+ * Called with the object lock.
+ */
+static kvz_config *
+gst_kvazaar_enc_configure_spare (GstKvazaarEnc * encoder, GstVideoInfo * info)
+{
+  kvz_config *used = encoder->kvazaarconfig;
+  kvz_config *config = encoder->api->config_alloc ();
 
-  GST_OBJECT_UNLOCK (encoder);
+  if (!config || !encoder->api->config_init (config)) {
+    GST_WARNING_OBJECT (encoder, "Failed to init config structure");
+    if (config)
+      encoder->api->config_destroy (config);
+    return NULL;
+  }
 
-  /*		Print all parameters values		*/
-  GST_DEBUG ("intra period %d", encoder->kvazaarconfig->intra_period);
-  GST_DEBUG ("qp %d", encoder->kvazaarconfig->qp);
+  encoder->kvazaarconfig = config;
+  gst_kvazaar_enc_configure (encoder, info);
+  encoder->kvazaarconfig = used;
+
+  return config;
+}
+
+/*
+ * Configure Kvazaar for input of this info and open an encoder, or take the
+ * pre-opened, the spare or a cached one of the same configuration. A spare
+ * of the new configuration is then opened in the background.
+ */
+static gboolean
+gst_kvazaar_enc_open_encoder (GstKvazaarEnc * encoder, GstVideoInfo * info)
+{
+  gchar *key = NULL;
+  kvz_config *config, *spare = NULL;
+  kvz_encoder *enc;
+
+  /* Make sure that the encoder is closed */
+  gst_kvazaar_enc_close_encoder (encoder);
+
+  GST_OBJECT_LOCK (encoder);
+
+  gst_kvazaar_enc_configure (encoder, info);
+  /* The static ROI map belongs to the element, it is not shared */
+  if (!encoder->kvazaarconfig->roi.dqps)
+    spare = gst_kvazaar_enc_configure_spare (encoder, info);
+
+  gst_kvazaar_qp_map_free (encoder->qp_map);
+  encoder->qp_map = gst_kvazaar_qp_map_new_for_size (info->width,
+      info->height);
+  gst_kvazaar_qp_map_free (encoder->aq_map);
+  encoder->aq_map = gst_kvazaar_qp_map_new_for_size (info->width,
+      info->height);
+  gst_kvazaar_qp_map_free (encoder->roi_map);
+  encoder->roi_map = gst_kvazaar_qp_map_new_for_size (info->width,
+      info->height);
+
+  encoder->reconfig = FALSE;
+
+  /* A new Kvazaar instance starts with an IRAP picture */
+  encoder->frames_since_keyframe = 0;
+
+  /* good start, will be corrected if needed */
+  encoder->dts_offset = 0;
+
+  GST_OBJECT_UNLOCK (encoder);
+
+  /*		Print all parameters values		*/
+  GST_DEBUG ("intra period %d", encoder->kvazaarconfig->intra_period);
+  GST_DEBUG ("qp %d", encoder->kvazaarconfig->qp);
   GST_DEBUG ("vps_period %d", encoder->kvazaarconfig->vps_period);
   GST_DEBUG ("width %d", encoder->kvazaarconfig->width);
   GST_DEBUG ("height %d", encoder->kvazaarconfig->height);
@@ -1337,13 +2626,42 @@ gst_kvazaar_enc_init_encoder (GstKvazaarEnc * encoder)
   GST_DEBUG ("erp_aqp %d", encoder->kvazaarconfig->erp_aqp);
   // */
 
+  key = gst_kvazaar_enc_get_config_key (encoder);
+
   /* Open Kvazaar encoder */
-  encoder->kvazaarenc = encoder->api->encoder_open (encoder->kvazaarconfig);
+  if (key && !g_strcmp0 (key, encoder->preopen_key)) {
+    GST_INFO_OBJECT (encoder, "Using the encoder opened at READY");
+    gst_kvazaar_enc_adopt_encoder (encoder, encoder->preopen_config,
+        encoder->preopen_enc);
+    encoder->preopen_config = NULL;
+    encoder->preopen_enc = NULL;
+    g_free (encoder->preopen_key);
+    encoder->preopen_key = NULL;
+  } else if (key && !g_strcmp0 (key, encoder->spare_key) &&
+      gst_kvazaar_enc_take_spare (encoder, &config, &enc)) {
+    GST_INFO_OBJECT (encoder, "Using the spare encoder");
+    gst_kvazaar_enc_adopt_encoder (encoder, config, enc);
+  } else if (key && gst_kvazaar_encoder_cache_take (key, &config, &enc)) {
+    GST_INFO_OBJECT (encoder, "Using a cached encoder");
+    gst_kvazaar_enc_adopt_encoder (encoder, config, enc);
+  } else {
+    encoder->kvazaarenc = encoder->api->encoder_open (encoder->kvazaarconfig);
+  }
   if (!encoder->kvazaarenc) {
-    GST_ELEMENT_ERROR (encoder, STREAM, ENCODE,
-        ("Can not initialize Kvazaar encoder."), (NULL));
+    if (spare)
+      encoder->api->config_destroy (spare);
+    g_free (key);
     return FALSE;
   }
+  encoder->kvazaarenc_key = key;
+
+  /* A spare of other settings is of no use anymore */
+  if (spare && g_strcmp0 (key, encoder->spare_key)) {
+    gst_kvazaar_enc_release_spare (encoder);
+    gst_kvazaar_enc_start_spare (encoder, key, spare);
+  } else if (spare) {
+    encoder->api->config_destroy (spare);
+  }
 
   encoder->push_header = TRUE;
 
@@ -1361,44 +2679,199 @@ gst_kvazaar_enc_close_encoder (GstKvazaarEnc * encoder)
     encoder->api->encoder_close (encoder->kvazaarenc);
     encoder->kvazaarenc = NULL;
   }
+  g_free (encoder->kvazaarenc_key);
+  encoder->kvazaarenc_key = NULL;
 }
 
 /*
- * Parse a byte stream to a nal.
- *
- * This function removes 0x03 from the start code 0x 00 00 03 in the byte
- * stream. It only returns the first nal by detecting the start code
- * 0x 00 00 00 01.
- */
-static kvz_data_chunk *
-gst_kvazaar_enc_bytestream_to_nal (kvz_data_chunk * input)
-{
-  kvz_data_chunk *output;
-  int i, j, zeros;
-
-  output = g_malloc (sizeof (kvz_data_chunk));
-  output->len = input->len - 4;
-
-  zeros = 0;
-  for (i = 4, j = 0; i < input->len; (i++, j++)) {
-    if (input->data[i] == 0x00) {
-      zeros++;
-    } else if (input->data[i] == 0x03 && zeros == 2) {
-      zeros = 0;
-      j--;
-      output->len--;
-      continue;
-    } else if (input->data[i] == 0x01 && zeros == 3) {
-      j -= 3;
-      output->len = j;
-      break;
-    } else {
-      zeros = 0;
-    }
-    output->data[j] = input->data[i];
+ * Close the encoder at the end of the stream. Kvazaar can not start over,
+ * so with the cache a new encoder of the same configuration is opened in
+ * the background for the next stream. Reopens within a stream do not do
+ * that, their next configuration is usually another one.
+ */
+static void
+gst_kvazaar_enc_close_encoder_at_stop (GstKvazaarEnc * encoder)
+{
+  gchar *key = encoder->kvazaarenc_key;
+  kvz_config *config = NULL;
+  guint timeout;
+
+  encoder->kvazaarenc_key = NULL;
+  gst_kvazaar_enc_close_encoder (encoder);
+  if (!key)
+    return;
+
+  GST_OBJECT_LOCK (encoder);
+  timeout = encoder->cache_timeout;
+  if (timeout)
+    config = gst_kvazaar_enc_take_config (encoder);
+  GST_OBJECT_UNLOCK (encoder);
+
+  if (config)
+    gst_kvazaar_encoder_cache_put (encoder->api, key, config, NULL, timeout);
+  g_free (key);
+}
+
+/*
+ * Open an encoder for expected-caps when going to READY.
+ */
+static gboolean
+gst_kvazaar_enc_open (GstVideoEncoder * video_enc)
+{
+  GstKvazaarEnc *encoder = GST_KVAZAAR_ENC (video_enc);
+  GstVideoInfo info;
+  GstCaps *caps = NULL;
+  kvz_config *config;
+
+  GST_OBJECT_LOCK (encoder);
+  if (encoder->expected_caps)
+    caps = gst_caps_ref (encoder->expected_caps);
+  GST_OBJECT_UNLOCK (encoder);
+
+  if (!caps)
+    return TRUE;
+
+  if (!gst_caps_is_fixed (caps) || !gst_video_info_from_caps (&info, caps)) {
+    GST_WARNING_OBJECT (encoder, "Can not open an encoder for expected caps "
+        "%" GST_PTR_FORMAT, caps);
+    gst_caps_unref (caps);
+    return TRUE;
+  }
+  gst_caps_unref (caps);
+
+  /* As start sets them, for the same configuration */
+  GST_OBJECT_LOCK (encoder);
+  encoder->qos_level = GST_KVAZAAR_ENC_QOS_NONE;
+  GST_OBJECT_UNLOCK (encoder);
+  encoder->rt_effort = gst_kvazaar_enc_get_max_effort (encoder);
+
+  gst_kvazaar_enc_release_preopen (encoder);
+  if (!gst_kvazaar_enc_open_encoder (encoder, &info)) {
+    GST_WARNING_OBJECT (encoder, "Can not open an encoder for expected caps, "
+        "it is opened with the first frame");
+    return TRUE;
+  }
+
+  /* A static ROI map belongs to the element, it is not kept aside */
+  if (!encoder->kvazaarenc_key)
+    encoder->kvazaarenc_key = gst_kvazaar_enc_get_config_key (encoder);
+  if (!encoder->kvazaarenc_key) {
+    gst_kvazaar_enc_close_encoder (encoder);
+    return TRUE;
+  }
+
+  GST_OBJECT_LOCK (encoder);
+  config = gst_kvazaar_enc_take_config (encoder);
+  GST_OBJECT_UNLOCK (encoder);
+  if (!config) {
+    gst_kvazaar_enc_close_encoder (encoder);
+    return TRUE;
+  }
+
+  GST_DEBUG_OBJECT (encoder, "encoder opened for %dx%d %s", info.width,
+      info.height, GST_VIDEO_INFO_NAME (&info));
+  encoder->preopen_config = config;
+  encoder->preopen_enc = encoder->kvazaarenc;
+  encoder->preopen_key = encoder->kvazaarenc_key;
+  encoder->kvazaarenc = NULL;
+  encoder->kvazaarenc_key = NULL;
+
+  return TRUE;
+}
+
+/*
+ * Give the encoder opened at READY to the cache if it was not used, and
+ * close its spare.
+ */
+static gboolean
+gst_kvazaar_enc_close (GstVideoEncoder * video_enc)
+{
+  gst_kvazaar_enc_release_preopen (GST_KVAZAAR_ENC (video_enc));
+  gst_kvazaar_enc_release_spare (GST_KVAZAAR_ENC (video_enc));
+
+  return TRUE;
+}
+
+static void
+gst_kvazaar_enc_release_preopen (GstKvazaarEnc * encoder)
+{
+  guint timeout;
+
+  if (!encoder->preopen_enc)
+    return;
+
+  GST_OBJECT_LOCK (encoder);
+  timeout = encoder->cache_timeout;
+  GST_OBJECT_UNLOCK (encoder);
+
+  gst_kvazaar_encoder_cache_put (encoder->api, encoder->preopen_key,
+      encoder->preopen_config, encoder->preopen_enc, timeout);
+  encoder->preopen_config = NULL;
+  encoder->preopen_enc = NULL;
+  g_free (encoder->preopen_key);
+  encoder->preopen_key = NULL;
+}
+
+static gpointer
+gst_kvazaar_enc_open_spare (gpointer data)
+{
+  GstKvazaarEnc *encoder = data;
+
+  return encoder->api->encoder_open (encoder->spare_config);
+}
+
+/*
+ * Open an encoder of this configuration in the background, for the next
+ * flush to restart on. It belongs to the element, whatever the cache does.
+ */
+static void
+gst_kvazaar_enc_start_spare (GstKvazaarEnc * encoder, const gchar * key,
+    kvz_config * config)
+{
+  encoder->spare_config = config;
+  encoder->spare_key = g_strdup (key);
+  encoder->spare_thread = g_thread_new ("kvazaar-spare",
+      gst_kvazaar_enc_open_spare, encoder);
+}
+
+/*
+ * Take the spare encoder, waiting for it if it is still opening. Return
+ * FALSE when there is none or it could not be opened.
+ */
+static gboolean
+gst_kvazaar_enc_take_spare (GstKvazaarEnc * encoder, kvz_config ** config,
+    kvz_encoder ** enc)
+{
+  if (!encoder->spare_thread)
+    return FALSE;
+
+  *enc = g_thread_join (encoder->spare_thread);
+  *config = encoder->spare_config;
+  encoder->spare_thread = NULL;
+  encoder->spare_config = NULL;
+  g_free (encoder->spare_key);
+  encoder->spare_key = NULL;
+
+  if (!*enc) {
+    GST_WARNING_OBJECT (encoder, "Can not open a spare Kvazaar encoder");
+    encoder->api->config_destroy (*config);
+    return FALSE;
   }
 
-  return output;
+  return TRUE;
+}
+
+/*
+ * Close the spare encoder on the cache thread.
+ */
+static void
+gst_kvazaar_enc_release_spare (GstKvazaarEnc * encoder)
+{
+  kvz_config *config;
+  kvz_encoder *enc;
+
+  if (gst_kvazaar_enc_take_spare (encoder, &config, &enc))
+    gst_kvazaar_encoder_cache_close (encoder->api, config, enc, NULL, NULL);
 }
 
 /*
@@ -1409,8 +2882,10 @@ gst_kvazaar_enc_set_level_tier_and_profile (GstKvazaarEnc * encoder, GstCaps * c
 {
   int header_return;
   gboolean ret = TRUE;
-  kvz_data_chunk *data_k, *vps_data;
+  kvz_data_chunk *data_k;
   guint32 size_data;
+  guint8 *vps;
+  gsize vps_len;
 
   GST_DEBUG_OBJECT (encoder, "set profile, level and tier");
 
@@ -1424,17 +2899,19 @@ gst_kvazaar_enc_set_level_tier_and_profile (GstKvazaarEnc * encoder, GstCaps * c
   GST_DEBUG_OBJECT (encoder, "%d lenght of data in header", size_data);
 
   /* Get the VPS nal from the header */
-  vps_data = gst_kvazaar_enc_bytestream_to_nal (data_k);
+  vps = g_malloc (data_k->len);
+  vps_len = gst_kvazaar_bytestream_to_nal (data_k->data, data_k->len, vps);
 
-  GST_MEMDUMP ("VPS", vps_data->data, vps_data->len);
+  GST_MEMDUMP ("VPS", vps, vps_len);
 
-  if (!gst_codec_utils_h265_caps_set_level_tier_and_profile (caps,
-        vps_data->data + 6, vps_data->len - 6)) {
+  if (vps_len <= 6 || !gst_codec_utils_h265_caps_set_level_tier_and_profile (
+        caps, vps + 6, vps_len - 6)) {
     GST_ELEMENT_ERROR (encoder, STREAM, ENCODE, ("Encode Kvazaar failed."),
         ("Failed to find correct level, tier or profile in VPS"));
     ret = FALSE;
   }
 
+  g_free (vps);
   encoder->api->chunk_free (data_k);
   return ret;
 }
@@ -1489,13 +2966,31 @@ gst_kvazaar_enc_set_src_caps (GstKvazaarEnc * encoder, GstCaps * caps)
   GstStructure *structure;
   GstVideoCodecState *state;
   GstTagList *tags;
+  GstCaps *allowed_caps;
+  const gchar *alignment = "au";
+
+  /* Only output single NAL units if downstream asks for it */
+  encoder->nal_aligned = FALSE;
+  allowed_caps =
+      gst_pad_get_allowed_caps (GST_VIDEO_ENCODER_SRC_PAD (encoder));
+  if (allowed_caps && !gst_caps_is_empty (allowed_caps)) {
+    allowed_caps = gst_caps_make_writable (allowed_caps);
+    allowed_caps = gst_caps_fixate (allowed_caps);
+    structure = gst_caps_get_structure (allowed_caps, 0);
+    if (!g_strcmp0 (gst_structure_get_string (structure, "alignment"), "nal")) {
+      alignment = "nal";
+      encoder->nal_aligned = TRUE;
+    }
+  }
+  if (allowed_caps)
+    gst_caps_unref (allowed_caps);
 
   outcaps = gst_caps_new_empty_simple ("video/x-h265");
   structure = gst_caps_get_structure (outcaps, 0);
 
   gst_structure_set (structure, "stream-format", G_TYPE_STRING, "byte-stream",
       NULL);
-  gst_structure_set (structure, "alignment", G_TYPE_STRING, "au", NULL);
+  gst_structure_set (structure, "alignment", G_TYPE_STRING, alignment, NULL);
 
 
   if (!gst_kvazaar_enc_set_level_tier_and_profile (encoder, outcaps)) {
@@ -1520,6 +3015,30 @@ gst_kvazaar_enc_set_src_caps (GstKvazaarEnc * encoder, GstCaps * caps)
 
 
 
+/*
+ * Number of frames analysed ahead, zerolatency disables the lookahead unless
+ * it has been set explicitly.
+ */
+static guint
+gst_kvazaar_enc_get_lookahead_depth (GstKvazaarEnc * encoder)
+{
+  if (encoder->tune == GST_KVAZAAR_ENC_TUNE_ZEROLATENCY &&
+      !encoder->lookahead_set)
+    return 0;
+
+  return encoder->lookahead;
+}
+
+/*
+ * Number of frames the encoder may hold before returning an access unit.
+ */
+static gint
+gst_kvazaar_enc_get_delayed_frames (GstKvazaarEnc * encoder)
+{
+  return gst_kvazaar_enc_get_lookahead_depth (encoder) +
+      gst_kvazaar_config_get_delay (encoder->kvazaarconfig);
+}
+
 static void
 gst_kvazaar_enc_set_latency (GstKvazaarEnc * encoder)
 {
@@ -1527,8 +3046,9 @@ gst_kvazaar_enc_set_latency (GstKvazaarEnc * encoder)
   gint max_delayed_frames;
   GstClockTime latency;
 
-  /* FIXME get a real value from the encoder, this is currently not exposed */
-    max_delayed_frames = 5;
+  /* Kvazaar does not expose its delay, derive it from the frames it may keep
+   * in flight (overlapping frames) and the GOP reordering depth. */
+  max_delayed_frames = gst_kvazaar_enc_get_delayed_frames (encoder);
 
   if (info->fps_n) {
     latency = gst_util_uint64_scale_ceil (GST_SECOND * info->fps_d,
@@ -1575,6 +3095,24 @@ gst_kvazaar_enc_set_format (GstVideoEncoder * video_enc,
   GstKvazaarEnc *encoder = GST_KVAZAAR_ENC (video_enc);
   GstVideoInfo *info = &state->info;
 
+  if (encoder->recorder)
+    gst_kvazaar_recorder_write_caps (encoder->recorder, state->caps);
+  encoder->recon_need_caps = TRUE;
+
+  /* Kvazaar splits interleaved frames into fields itself */
+  if (GST_VIDEO_INFO_INTERLACE_MODE (info) == GST_VIDEO_INTERLACE_MODE_FIELDS
+#if GST_CHECK_VERSION (1, 16, 0)
+      || GST_VIDEO_INFO_INTERLACE_MODE (info) ==
+      GST_VIDEO_INTERLACE_MODE_ALTERNATE
+#endif
+      ) {
+    GST_ELEMENT_ERROR (encoder, STREAM, FORMAT, (NULL),
+        ("Interlace mode %s is not supported, fields have to be interleaved",
+            gst_video_interlace_mode_to_string (GST_VIDEO_INFO_INTERLACE_MODE
+                (info))));
+    return FALSE;
+  }
+
   /* If the encoder is initialized, do not reinitialize it again if not
    * necessary */
   if (encoder->kvazaarenc) {
@@ -1583,14 +3121,19 @@ gst_kvazaar_enc_set_format (GstVideoEncoder * video_enc,
     if (info->finfo->format == old->finfo->format
         && info->width == old->width && info->height == old->height
         && info->fps_n == old->fps_n && info->fps_d == old->fps_d
-        && info->par_n == old->par_n && info->par_d == old->par_d) {
+        && info->par_n == old->par_n && info->par_d == old->par_d
+        && gst_kvazaar_enc_get_scan_type (encoder, info) ==
+        encoder->kvazaarconfig->source_scan_type) {
       gst_video_codec_state_unref (encoder->input_state);
       encoder->input_state = gst_video_codec_state_ref (state);
       return TRUE;
     }
     /* clear out pending frames */
+    gst_kvazaar_enc_drain_lookahead (encoder, TRUE);
     gst_kvazaar_enc_flush_frames (encoder, TRUE);
   }
+  gst_buffer_replace (&encoder->static_prev, NULL);
+  gst_buffer_replace (&encoder->dup_prev, NULL);
 
   if (encoder->input_state)
     gst_video_codec_state_unref (encoder->input_state);
@@ -1604,195 +3147,1573 @@ gst_kvazaar_enc_set_format (GstVideoEncoder * video_enc,
     return FALSE;
   }
 
-  gst_kvazaar_enc_set_latency (encoder);
+  gst_kvazaar_enc_set_latency (encoder);
+
+  return TRUE;
+}
+
+static GstFlowReturn
+gst_kvazaar_enc_finish (GstVideoEncoder * encoder)
+{
+  GstPad *recon_pad;
+
+  GST_DEBUG_OBJECT (encoder, "finish encoder");
+
+  if (GST_KVAZAAR_ENC (encoder)->recorder)
+    gst_kvazaar_recorder_write_eos (GST_KVAZAAR_ENC (encoder)->recorder);
+
+  gst_kvazaar_enc_drain_lookahead (GST_KVAZAAR_ENC (encoder), TRUE);
+  gst_kvazaar_enc_flush_frames (GST_KVAZAAR_ENC (encoder), TRUE);
+  gst_kvazaar_enc_flush_frames (GST_KVAZAAR_ENC (encoder), TRUE);
+
+  recon_pad = gst_kvazaar_enc_get_recon_pad (GST_KVAZAAR_ENC (encoder));
+  if (recon_pad) {
+    gst_pad_push_event (recon_pad, gst_event_new_eos ());
+    gst_object_unref (recon_pad);
+  }
+
+  return GST_FLOW_OK;
+}
+
+static gboolean
+gst_kvazaar_enc_propose_allocation (GstVideoEncoder * encoder, GstQuery * query)
+{
+  gst_query_add_allocation_meta (query, GST_VIDEO_META_API_TYPE, NULL);
+  gst_query_add_allocation_meta (query,
+      GST_VIDEO_REGION_OF_INTEREST_META_API_TYPE, NULL);
+
+  return GST_VIDEO_ENCODER_CLASS (parent_class)->propose_allocation (encoder,
+      query);
+}
+
+/*
+ * Keep the lateness from the QoS events of downstream for the degradation.
+ */
+static gboolean
+gst_kvazaar_enc_src_event (GstVideoEncoder * video_enc, GstEvent * event)
+{
+  GstKvazaarEnc *encoder = GST_KVAZAAR_ENC (video_enc);
+
+  if (GST_EVENT_TYPE (event) == GST_EVENT_QOS) {
+    GstQOSType type;
+    gdouble proportion;
+    GstClockTimeDiff diff;
+    GstClockTime timestamp;
+
+    gst_event_parse_qos (event, &type, &proportion, &diff, &timestamp);
+
+    GST_OBJECT_LOCK (encoder);
+    encoder->qos_jitter = diff;
+    /* Aim past the lateness when late, like the sinks do */
+    if (!GST_CLOCK_TIME_IS_VALID (timestamp))
+      encoder->qos_earliest = GST_CLOCK_TIME_NONE;
+    else if (diff > 0)
+      encoder->qos_earliest = timestamp + 2 * diff;
+    else
+      encoder->qos_earliest = timestamp + diff;
+    GST_OBJECT_UNLOCK (encoder);
+
+    GST_LOG_OBJECT (encoder, "QoS proportion %f, jitter %" G_GINT64_FORMAT
+        ", timestamp %" GST_TIME_FORMAT, proportion, diff,
+        GST_TIME_ARGS (timestamp));
+  }
+
+  return GST_VIDEO_ENCODER_CLASS (parent_class)->src_event (video_enc, event);
+}
+
+/*
+ * The recon request pad, with a reference, or NULL.
+ */
+static GstPad *
+gst_kvazaar_enc_get_recon_pad (GstKvazaarEnc * encoder)
+{
+  GstPad *pad = NULL;
+
+  GST_OBJECT_LOCK (encoder);
+  if (encoder->recon_pad)
+    pad = gst_object_ref (encoder->recon_pad);
+  GST_OBJECT_UNLOCK (encoder);
+
+  return pad;
+}
+
+static GstPad *
+gst_kvazaar_enc_request_new_pad (GstElement * element,
+    GstPadTemplate * templ, const gchar * req_name, const GstCaps * caps)
+{
+  GstKvazaarEnc *encoder = GST_KVAZAAR_ENC (element);
+  GstPad *pad;
+
+  pad = gst_pad_new_from_template (templ, "recon");
+  gst_pad_use_fixed_caps (pad);
+
+  GST_OBJECT_LOCK (encoder);
+  if (encoder->recon_pad) {
+    GST_OBJECT_UNLOCK (encoder);
+    GST_WARNING_OBJECT (encoder, "there is a recon pad already");
+    gst_object_unref (pad);
+    return NULL;
+  }
+  encoder->recon_pad = pad;
+  encoder->recon_stream_started = FALSE;
+  encoder->recon_need_caps = TRUE;
+  encoder->recon_need_segment = TRUE;
+  GST_OBJECT_UNLOCK (encoder);
+
+  if (!gst_element_add_pad (element, pad)) {
+    GST_OBJECT_LOCK (encoder);
+    encoder->recon_pad = NULL;
+    GST_OBJECT_UNLOCK (encoder);
+    return NULL;
+  }
+
+  return pad;
+}
+
+static void
+gst_kvazaar_enc_release_pad (GstElement * element, GstPad * pad)
+{
+  GstKvazaarEnc *encoder = GST_KVAZAAR_ENC (element);
+
+  GST_OBJECT_LOCK (encoder);
+  if (encoder->recon_pad == pad)
+    encoder->recon_pad = NULL;
+  GST_OBJECT_UNLOCK (encoder);
+
+  gst_element_remove_pad (element, pad);
+}
+
+/*
+ * Send the stream start, caps and segment of the recon pad that are due
+ * before a picture.
+ */
+static void
+gst_kvazaar_enc_recon_events (GstKvazaarEnc * encoder, GstPad * pad,
+    const kvz_picture * pic)
+{
+  GstVideoInfo *in = &encoder->input_state->info;
+  gint fields = encoder->kvazaarconfig->source_scan_type ? 2 : 1;
+  /* Kvazaar pads the picture to whole CUs */
+  gint width = MIN (pic->width, GST_VIDEO_INFO_WIDTH (in));
+  gint height = MIN (pic->height, GST_VIDEO_INFO_HEIGHT (in) / fields);
+  GstVideoInfo *info = &encoder->recon_info;
+
+  if (!encoder->recon_stream_started) {
+    gchar *stream_id = gst_pad_create_stream_id (pad, GST_ELEMENT (encoder),
+        "recon");
+
+    gst_pad_push_event (pad, gst_event_new_stream_start (stream_id));
+    g_free (stream_id);
+    encoder->recon_stream_started = TRUE;
+  }
+
+  if (encoder->recon_need_caps || width != GST_VIDEO_INFO_WIDTH (info) ||
+      height != GST_VIDEO_INFO_HEIGHT (info)) {
+    GstCaps *caps;
+    GstQuery *query;
+
+    gst_video_info_set_format (info, RECON_FORMAT, width, height);
+    /* fields of interlaced input come as pictures of their own */
+    GST_VIDEO_INFO_FPS_N (info) = GST_VIDEO_INFO_FPS_N (in) * fields;
+    GST_VIDEO_INFO_FPS_D (info) = GST_VIDEO_INFO_FPS_D (in);
+    GST_VIDEO_INFO_PAR_N (info) = GST_VIDEO_INFO_PAR_N (in);
+    GST_VIDEO_INFO_PAR_D (info) = GST_VIDEO_INFO_PAR_D (in);
+
+    caps = gst_video_info_to_caps (info);
+    GST_DEBUG_OBJECT (pad, "caps %" GST_PTR_FORMAT, caps);
+    gst_pad_push_event (pad, gst_event_new_caps (caps));
+
+    query = gst_query_new_allocation (caps, FALSE);
+    encoder->recon_video_meta = gst_pad_peer_query (pad, query) &&
+        gst_query_find_allocation_meta (query, GST_VIDEO_META_API_TYPE, NULL);
+    gst_query_unref (query);
+    gst_caps_unref (caps);
+
+    encoder->recon_need_caps = FALSE;
+    encoder->recon_need_segment = TRUE;
+  }
+
+  if (encoder->recon_need_segment) {
+    gst_pad_push_event (pad, gst_event_new_segment (&GST_VIDEO_ENCODER
+            (encoder)->input_segment));
+    encoder->recon_need_segment = FALSE;
+  }
+}
+
+typedef struct
+{
+  const kvz_api *api;
+  kvz_picture *pic;
+} ReconPicture;
+
+static void
+gst_kvazaar_enc_recon_release (gpointer data)
+{
+  ReconPicture *recon = data;
+
+  recon->api->picture_free (recon->pic);
+  g_slice_free (ReconPicture, recon);
+}
+
+/*
+ * Wrap a reconstructed picture in a buffer with the timestamps of its frame,
+ * without a copy. Kvazaar gets the picture back when the buffer is freed.
+ */
+static GstBuffer *
+gst_kvazaar_enc_wrap_recon (GstKvazaarEnc * encoder, kvz_picture * pic,
+    GstVideoCodecFrame * frame)
+{
+  GstVideoInfo *info = &encoder->recon_info;
+  ReconPicture *recon = g_slice_new (ReconPicture);
+  gsize offset[GST_VIDEO_MAX_PLANES] = { 0, };
+  gint stride[GST_VIDEO_MAX_PLANES] = { 0, };
+  gsize size;
+  GstBuffer *buf;
+
+  recon->api = encoder->api;
+  recon->pic = pic;
+
+  /* The planes of a Kvazaar picture are in one allocation */
+  offset[1] = (pic->u - pic->y) * sizeof (kvz_pixel);
+  offset[2] = (pic->v - pic->y) * sizeof (kvz_pixel);
+  stride[0] = pic->stride * sizeof (kvz_pixel);
+  stride[1] = stride[2] = stride[0] / 2;
+  size = offset[2] + stride[2] * (pic->height / 2);
+
+  buf = gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY, pic->y, size,
+      0, size, recon, gst_kvazaar_enc_recon_release);
+  gst_buffer_add_video_meta_full (buf, GST_VIDEO_FRAME_FLAG_NONE,
+      GST_VIDEO_INFO_FORMAT (info), GST_VIDEO_INFO_WIDTH (info),
+      GST_VIDEO_INFO_HEIGHT (info), 3, offset, stride);
+  GST_BUFFER_PTS (buf) = frame->pts;
+  GST_BUFFER_DURATION (buf) = frame->duration;
+
+  return buf;
+}
+
+/*
+ * Push a reconstructed picture. Its flow does not stop the encoding, the
+ * encoded output goes on whatever happens downstream of the recon pad.
+ */
+static void
+gst_kvazaar_enc_push_recon (GstKvazaarEnc * encoder, GstPad * pad,
+    GstBuffer * buf)
+{
+  GstVideoInfo *info = &encoder->recon_info;
+  GstFlowReturn ret;
+
+  if (!encoder->recon_video_meta) {
+    /* Downstream expects the default layout of the caps */
+    GstBuffer *copy = gst_buffer_new_allocate (NULL, GST_VIDEO_INFO_SIZE (info),
+        NULL);
+    GstVideoFrame src, dst;
+
+    if (gst_video_frame_map (&src, info, buf, GST_MAP_READ)) {
+      if (gst_video_frame_map (&dst, info, copy, GST_MAP_WRITE)) {
+        gst_video_frame_copy (&dst, &src);
+        gst_video_frame_unmap (&dst);
+      }
+      gst_video_frame_unmap (&src);
+    }
+    gst_buffer_copy_into (copy, buf, GST_BUFFER_COPY_TIMESTAMPS, 0, -1);
+    gst_buffer_unref (buf);
+    buf = copy;
+  }
+
+  ret = gst_pad_push (pad, buf);
+  if (ret != GST_FLOW_OK && ret != GST_FLOW_NOT_LINKED &&
+      ret != GST_FLOW_FLUSHING)
+    GST_WARNING_OBJECT (pad, "pushing the reconstructed picture failed: %s",
+        gst_flow_get_name (ret));
+}
+
+/*
+ * Forward flushes to the recon pad, and resend its segment after a new one.
+ */
+static gboolean
+gst_kvazaar_enc_sink_event (GstVideoEncoder * video_enc, GstEvent * event)
+{
+  GstKvazaarEnc *encoder = GST_KVAZAAR_ENC (video_enc);
+  GstPad *pad = gst_kvazaar_enc_get_recon_pad (encoder);
+
+  switch (GST_EVENT_TYPE (event)) {
+    case GST_EVENT_FLUSH_START:
+    case GST_EVENT_FLUSH_STOP:
+      if (pad)
+        gst_pad_push_event (pad, gst_event_ref (event));
+      encoder->recon_need_segment = TRUE;
+      break;
+    case GST_EVENT_SEGMENT:
+      encoder->recon_need_segment = TRUE;
+      break;
+    default:
+      break;
+  }
+  if (pad)
+    gst_object_unref (pad);
+
+  return GST_VIDEO_ENCODER_CLASS (parent_class)->sink_event (video_enc, event);
+}
+
+static void
+gst_kvazaar_enc_reconfig (GstKvazaarEnc * encoder)
+{
+  encoder->kvazaarconfig->target_bitrate = encoder->bitrate;
+  encoder->reconfig = TRUE;
+}
+
+/*
+ * Account an output access unit in the sender buffer model and derive the
+ * QP offset for the next pictures from its fullness.
+ */
+static void
+gst_kvazaar_enc_update_vbv (GstKvazaarEnc * encoder, guint32 size)
+{
+  GstVideoInfo *info = &encoder->input_state->info;
+  gdouble bufsize, drain, fullness, ratio;
+  gint dqp = 0;
+
+  if (!encoder->vbv_bufsize || !encoder->vbv_maxrate)
+    return;
+
+  bufsize = encoder->vbv_bufsize * 1000.0;
+  if (info->fps_n)
+    drain = encoder->vbv_maxrate * 1000.0 * info->fps_d / info->fps_n;
+  else
+    drain = encoder->vbv_maxrate * 1000.0 / 25;
+
+  fullness = MAX (encoder->vbv_fullness + size * 8.0 - drain, 0);
+  if (fullness > bufsize)
+    GST_WARNING_OBJECT (encoder, "VBV overflow: %.0f bits in a %.0f bits "
+        "buffer", fullness, bufsize);
+
+  ratio = fullness / bufsize;
+  if (ratio > VBV_GUARD_THRESHOLD)
+    dqp = MIN ((gint) ((ratio - VBV_GUARD_THRESHOLD) /
+            (1 - VBV_GUARD_THRESHOLD) * VBV_MAX_DQP + 0.5), VBV_MAX_DQP);
+
+  if (dqp != encoder->vbv_dqp)
+    GST_DEBUG_OBJECT (encoder, "VBV at %.1f%%, delta QP %d", ratio * 100, dqp);
+
+  GST_OBJECT_LOCK (encoder);
+  encoder->vbv_fullness = fullness;
+  encoder->vbv_dqp = dqp;
+  GST_OBJECT_UNLOCK (encoder);
+}
+
+/*
+ * Temporal ID of an access unit, from the header of its first slice NAL
+ * unit. Also tell if the picture is a sub-layer non-reference one.
+ */
+static gboolean
+gst_kvazaar_enc_get_temporal_id (GstBuffer * au, guint * temporal_id,
+    gboolean * non_reference)
+{
+  GstMapInfo map;
+  gsize pos;
+  gboolean found = FALSE;
+
+  if (!gst_buffer_map (au, &map, GST_MAP_READ))
+    return FALSE;
+
+  pos = gst_kvazaar_next_start_code (map.data, map.size, 0);
+  while (pos < map.size) {
+    guint nal_type;
+
+    /* Skip the start code */
+    while (pos < map.size && map.data[pos] == 0x00)
+      pos++;
+    pos++;
+    if (pos + 2 > map.size)
+      break;
+
+    nal_type = (map.data[pos] >> 1) & 0x3f;
+    /* VCL NAL unit types are below 32, the even ones up to 14 are
+     * sub-layer non-reference pictures */
+    if (nal_type < 32) {
+      *temporal_id = (map.data[pos + 1] & 0x07) - 1;
+      *non_reference = nal_type <= 14 && nal_type % 2 == 0;
+      found = TRUE;
+      break;
+    }
+    pos = gst_kvazaar_next_start_code (map.data, map.size, pos);
+  }
+  gst_buffer_unmap (au, &map);
+
+  return found;
+}
+
+/*
+ * Split an access unit into NAL units and push all of them but the last one
+ * as sub-frames. The last NAL unit is left in frame->output_buffer so the
+ * caller can finish the frame as usual.
+ */
+static GstFlowReturn
+gst_kvazaar_enc_push_nal_units (GstKvazaarEnc * encoder,
+    GstVideoCodecFrame * frame, GstBuffer * au)
+{
+  GstFlowReturn ret = GST_FLOW_OK;
+  GstMapInfo map;
+  gsize start, next;
+
+  if (!gst_buffer_map (au, &map, GST_MAP_READ)) {
+    frame->output_buffer = au;
+    return GST_FLOW_OK;
+  }
+
+  start = 0;
+  next = gst_kvazaar_next_start_code (map.data, map.size, start + 3);
+  while (next < map.size) {
+    if (encoder->slice_max_size && next - start > encoder->slice_max_size)
+      GST_DEBUG_OBJECT (encoder, "NAL unit of %" G_GSIZE_FORMAT " bytes "
+          "exceeds slice-max-size", next - start);
+
+#if GST_CHECK_VERSION (1, 18, 0)
+    frame->output_buffer = gst_buffer_copy_region (au, GST_BUFFER_COPY_MEMORY |
+        GST_BUFFER_COPY_META | GST_BUFFER_COPY_FLAGS, start, next - start);
+    ret = gst_video_encoder_finish_subframe (GST_VIDEO_ENCODER (encoder),
+        frame);
+    if (ret != GST_FLOW_OK)
+      break;
+#endif
+    start = next;
+    next = gst_kvazaar_next_start_code (map.data, map.size, start + 3);
+  }
+  gst_buffer_unmap (au, &map);
+
+  frame->output_buffer = gst_buffer_copy_region (au, GST_BUFFER_COPY_MEMORY |
+      GST_BUFFER_COPY_META | GST_BUFFER_COPY_FLAGS, start,
+      gst_buffer_get_size (au) - start);
+  gst_buffer_unref (au);
+
+  return ret;
+}
+
+/*
+ * Find the frame of an output picture. Kvazaar hands back the source
+ * picture, which carries the pts of the input frame. Without a usable pts,
+ * fall back to the frame number derived from the POC.
+ */
+static GstVideoCodecFrame *
+gst_kvazaar_enc_find_frame (GstKvazaarEnc * encoder, kvz_picture * src,
+    guint32 frame_num)
+{
+  GList *l;
+
+  if (src && GST_CLOCK_TIME_IS_VALID ((GstClockTime) src->pts)) {
+    for (l = encoder->pending_frames; l; l = l->next) {
+      FrameData *fdata = l->data;
+
+      if (fdata->frame->pts == (GstClockTime) src->pts)
+        return gst_video_codec_frame_ref (fdata->frame);
+    }
+  }
+
+  return gst_video_encoder_get_frame (GST_VIDEO_ENCODER (encoder), frame_num);
+}
+
+/*
+ * Finish a frame, which ends its trace.
+ */
+static GstFlowReturn
+gst_kvazaar_enc_finish_frame (GstKvazaarEnc * encoder,
+    GstVideoCodecFrame * frame)
+{
+  gint64 trace_start = GST_KVAZAAR_TRACE_START ();
+  guint32 number = frame->system_frame_number;
+  GstFlowReturn ret;
+
+  ret = gst_video_encoder_finish_frame (GST_VIDEO_ENCODER (encoder), frame);
+
+  if (trace_start) {
+    gst_kvazaar_trace_span (GST_OBJECT (encoder), "finish_frame", number,
+        trace_start);
+    gst_kvazaar_trace_frame_end (GST_OBJECT (encoder), number);
+  }
+
+  return ret;
+}
+
+static const gchar *
+gst_kvazaar_enc_slice_type_name (gint slice_type)
+{
+  switch (slice_type) {
+    case KVZ_SLICE_I:
+      return "I";
+    case KVZ_SLICE_P:
+      return "P";
+    default:
+      return "B";
+  }
+}
+
+/*
+ * Add an output access unit to the rolling statistics, and report it as
+ * asked by frame-stats.
+ */
+static void
+gst_kvazaar_enc_record_stats (GstKvazaarEnc * encoder,
+    GstVideoCodecFrame * frame, GstBuffer * buf, const kvz_frame_info * info,
+    GstClockTime encode_time)
+{
+  GstKvazaarQualityResult quality;
+  gboolean have_quality = FALSE;
+  FrameData *fdata = gst_kvazaar_enc_get_frame_data (encoder, frame);
+  gint64 now = g_get_monotonic_time ();
+  GstClockTime latency = GST_CLOCK_TIME_NONE;
+  guint size = gst_buffer_get_size (buf);
+  gboolean keyframe = GST_VIDEO_CODEC_FRAME_IS_SYNC_POINT (frame);
+  GstKvazaarEncStat *stat;
+  guint flags;
+
+  if (fdata)
+    latency = (now - fdata->queue_time) * GST_USECOND;
+
+  GST_OBJECT_LOCK (encoder);
+  stat = &encoder->stats[encoder->stats_frames % GST_KVAZAAR_ENC_STATS_WINDOW];
+  stat->output_time = now;
+  stat->pts = frame->pts;
+  stat->size = size;
+  stat->latency = latency;
+  encoder->stats_frames++;
+  if (keyframe) {
+    encoder->stats_keyframe_sizes[encoder->stats_keyframes %
+        GST_KVAZAAR_ENC_STATS_KEYFRAMES] = size;
+    encoder->stats_keyframes++;
+  }
+  flags = encoder->frame_stats;
+  GST_OBJECT_UNLOCK (encoder);
+
+  if ((flags & GST_KVAZAAR_ENC_FRAME_STATS_META) && encoder->quality)
+    have_quality = gst_kvazaar_quality_get_last (encoder->quality, &quality);
+
+  if (flags & GST_KVAZAAR_ENC_FRAME_STATS_META) {
+    GstKvazaarFrameStatsMeta *meta =
+        gst_buffer_add_kvazaar_frame_stats_meta (buf);
+
+    meta->encode_time = encode_time;
+    meta->latency = latency;
+    meta->size = size;
+    meta->qp = info->qp;
+    meta->slice_type = info->slice_type;
+    meta->nal_unit_type = info->nal_unit_type;
+    meta->poc = info->poc;
+    if (have_quality) {
+      meta->quality_frame_number = quality.frame_number;
+      meta->have_psnr = (quality.metrics & GST_KVAZAAR_QUALITY_PSNR) != 0;
+      memcpy (meta->psnr, quality.psnr, sizeof (meta->psnr));
+      meta->have_ssim = (quality.metrics & GST_KVAZAAR_QUALITY_SSIM) != 0;
+      meta->ssim = quality.ssim;
+    }
+  }
+
+  if (flags & GST_KVAZAAR_ENC_FRAME_STATS_MESSAGE) {
+    GstStructure *st = gst_structure_new ("kvazaarenc-frame-stats",
+        "frame-number", G_TYPE_UINT, frame->system_frame_number,
+        "pts", G_TYPE_UINT64, frame->pts,
+        "size", G_TYPE_UINT, size,
+        "qp", G_TYPE_INT, info->qp,
+        "slice-type", G_TYPE_STRING,
+        gst_kvazaar_enc_slice_type_name (info->slice_type),
+        "nal-unit-type", G_TYPE_INT, info->nal_unit_type,
+        "poc", G_TYPE_INT, info->poc,
+        "keyframe", G_TYPE_BOOLEAN, keyframe,
+        "encode-time", G_TYPE_UINT64, encode_time,
+        "latency", G_TYPE_UINT64, latency, NULL);
+
+    gst_element_post_message (GST_ELEMENT (encoder),
+        gst_message_new_element (GST_OBJECT (encoder), st));
+  }
+}
+
+static gint
+gst_kvazaar_enc_compare_time (gconstpointer a, gconstpointer b)
+{
+  GstClockTime ta = *(const GstClockTime *) a;
+  GstClockTime tb = *(const GstClockTime *) b;
+
+  return ta < tb ? -1 : ta > tb;
+}
+
+static gint
+gst_kvazaar_enc_compare_size (gconstpointer a, gconstpointer b)
+{
+  return (gint) (*(const guint *) a > *(const guint *) b) -
+      (gint) (*(const guint *) a < *(const guint *) b);
+}
+
+/*
+ * Rolling statistics of the last output access units, with the object
+ * lock. The encode rate is in wall time, the bitrate over the PTS span.
+ */
+static GstStructure *
+gst_kvazaar_enc_get_stats (GstKvazaarEnc * encoder)
+{
+  GstClockTime latencies[GST_KVAZAAR_ENC_STATS_WINDOW];
+  guint sizes[GST_KVAZAAR_ENC_STATS_KEYFRAMES];
+  guint n = MIN (encoder->stats_frames, GST_KVAZAAR_ENC_STATS_WINDOW);
+  guint k = MIN (encoder->stats_keyframes, GST_KVAZAAR_ENC_STATS_KEYFRAMES);
+  guint i, n_latencies = 0;
+  gint64 first_time = G_MAXINT64, last_time = 0;
+  GstClockTime first_pts = GST_CLOCK_TIME_NONE, last_pts = 0;
+  guint64 bytes = 0;
+  gdouble fps = 0, kbps = 0;
+  GstClockTime p50 = 0, p99 = 0;
+  GstStructure *st;
+
+  for (i = 0; i < n; i++) {
+    GstKvazaarEncStat *stat = &encoder->stats[i];
+
+    first_time = MIN (first_time, stat->output_time);
+    last_time = MAX (last_time, stat->output_time);
+    if (GST_CLOCK_TIME_IS_VALID (stat->pts)) {
+      first_pts = MIN (first_pts, stat->pts);
+      last_pts = MAX (last_pts, stat->pts);
+    }
+    bytes += stat->size;
+    if (GST_CLOCK_TIME_IS_VALID (stat->latency))
+      latencies[n_latencies++] = stat->latency;
+  }
+
+  if (n > 1 && last_time > first_time)
+    fps = (n - 1) * (gdouble) G_USEC_PER_SEC / (last_time - first_time);
+  /* The last access unit lasts as long as the average one */
+  if (n > 1 && GST_CLOCK_TIME_IS_VALID (first_pts) && last_pts > first_pts)
+    kbps = bytes * 8.0 * (n - 1) / n / 1000 /
+        ((gdouble) (last_pts - first_pts) / GST_SECOND);
+
+  if (n_latencies) {
+    qsort (latencies, n_latencies, sizeof (GstClockTime),
+        gst_kvazaar_enc_compare_time);
+    p50 = latencies[n_latencies / 2];
+    p99 = latencies[MIN (n_latencies * 99 / 100, n_latencies - 1)];
+  }
+
+  memcpy (sizes, encoder->stats_keyframe_sizes, k * sizeof (guint));
+  qsort (sizes, k, sizeof (guint), gst_kvazaar_enc_compare_size);
+
+  st = gst_structure_new ("kvazaarenc-stats",
+      "frames", G_TYPE_UINT64, encoder->stats_frames,
+      "window", G_TYPE_UINT, n,
+      "fps", G_TYPE_DOUBLE, fps,
+      "bitrate", G_TYPE_DOUBLE, kbps,
+      "latency-p50", G_TYPE_UINT64, p50,
+      "latency-p99", G_TYPE_UINT64, p99,
+      "keyframes", G_TYPE_UINT64, encoder->stats_keyframes,
+      "keyframe-size-min", G_TYPE_UINT, k ? sizes[0] : 0,
+      "keyframe-size-median", G_TYPE_UINT, k ? sizes[k / 2] : 0,
+      "keyframe-size-max", G_TYPE_UINT, k ? sizes[k - 1] : 0, NULL);
+
+  /* last quality measure, and the pictures measured and skipped so far */
+  if (encoder->quality) {
+    GstKvazaarQualityResult quality;
+    guint64 measured, skipped;
+
+    gst_kvazaar_quality_get_counts (encoder->quality, &measured, &skipped);
+    gst_structure_set (st, "quality-frames", G_TYPE_UINT64, measured,
+        "quality-skipped", G_TYPE_UINT64, skipped, NULL);
+    if (gst_kvazaar_quality_get_last (encoder->quality, &quality)) {
+      if (quality.metrics & GST_KVAZAAR_QUALITY_PSNR)
+        gst_structure_set (st, "psnr-y", G_TYPE_DOUBLE, quality.psnr[0],
+            "psnr-u", G_TYPE_DOUBLE, quality.psnr[1],
+            "psnr-v", G_TYPE_DOUBLE, quality.psnr[2], NULL);
+      if (quality.metrics & GST_KVAZAAR_QUALITY_SSIM)
+        gst_structure_set (st, "ssim", G_TYPE_DOUBLE, quality.ssim, NULL);
+    }
+  }
+
+  return st;
+}
+
+/*
+ * Give the input frame to the encoder, and send the frame returned by the
+ * encoder if any.
+ */
+static GstFlowReturn
+gst_kvazaar_enc_encode_frame (GstKvazaarEnc * encoder, kvz_picture * cur_in_img,
+    GstVideoCodecFrame * input_frame, guint32 * len_out, gboolean send)
+{
+  GstVideoCodecFrame *frame = NULL;
+  kvz_picture *img_rec = NULL;
+  kvz_picture *img_src = NULL;
+  GstBuffer *out_buf = NULL;
+  kvz_frame_info info_out;
+  kvz_data_chunk *chunks_out;
+  int encoder_return;
+  guint32 out_frame_num, intra_period; // Picture order count
+  gint fields;
+  GstFlowReturn ret = GST_FLOW_OK;
+  gint64 start_time = 0;
+  guint temporal_id, max_temporal_layer;
+  gboolean non_reference;
+  GstClockTime encode_time = GST_CLOCK_TIME_NONE;
+  guint quality_interval, quality_metrics = 0;
+  gboolean sample = FALSE;
+  GstPad *recon_pad;
+  GstBuffer *recon_buf = NULL;
+  GstVideoFrame src_frame;
+  gint64 trace_start, in_number;
+
+  if (G_UNLIKELY (encoder->kvazaarenc == NULL)) {
+    if (input_frame)
+      gst_video_codec_frame_unref (input_frame);
+    return GST_FLOW_NOT_NEGOTIATED;
+  }
+
+  /* if (cur_in_img && input_frame) {
+    if (GST_VIDEO_CODEC_FRAME_IS_FORCE_KEYFRAME (input_frame)) {
+      GST_INFO_OBJECT (encoder, "Forcing key frame");
+      info_out.slice_type = KVZ_SLICE_B;
+    }
+  }*/
+
+  if ((cur_in_img && (encoder->qos_degradation || encoder->realtime)) ||
+      encoder->frame_stats)
+    start_time = g_get_monotonic_time ();
+  in_number = input_frame ? input_frame->system_frame_number : -1;
+  trace_start = GST_KVAZAAR_TRACE_START ();
+
+  encoder_return = encoder->api->encoder_encode (encoder->kvazaarenc,
+      cur_in_img, &chunks_out, len_out, &img_rec, &img_src, &info_out);
+
+  if (trace_start)
+    gst_kvazaar_trace_span (GST_OBJECT (encoder), "encoder_encode", in_number,
+        trace_start);
+  if (start_time)
+    encode_time = (g_get_monotonic_time () - start_time) * GST_USECOND;
+  if (start_time && cur_in_img)
+    encoder->qos_encode_time += QOS_ENCODE_TIME_WEIGHT *
+        (encode_time - encoder->qos_encode_time);
+
+  GST_DEBUG_OBJECT (encoder, "encoder result (%d) with lenght data = %u ",
+      encoder_return, *len_out);
+
+  if (encoder_return < 0) {
+    GST_ELEMENT_ERROR (encoder, STREAM, ENCODE, ("Encode Kvazaar frame failed."),
+        ("kvazaar_encoder_encode return code=%d", encoder_return));
+    ret = GST_FLOW_ERROR;
+    /* Make sure we finish this frame */
+    frame = input_frame;
+    goto out;
+  }
+
+  GST_DEBUG_OBJECT (encoder, "Frame info: QP=%d", info_out.qp);
+
+  /*GST_LOG_OBJECT (encoder,
+      "img_rec dts %" G_GINT64_FORMAT " img_rec pts %" G_GINT64_FORMAT,
+      (gint64) img_rec.dts, (gint64) img_rec.pts);
+  */
+  //*
+  if (input_frame)
+    gst_video_codec_frame_unref (input_frame);
+  // */
+
+  if (!*len_out)
+  {
+    ret = GST_FLOW_OK;
+    /* In zerolatency mode every input is expected to be output right away,
+     * an option-string overriding owf or gop breaks that */
+    if (cur_in_img && encoder->tune == GST_KVAZAAR_ENC_TUNE_ZEROLATENCY)
+      GST_WARNING_OBJECT (encoder, "zerolatency: frame is buffered by the "
+          "encoder, check owf and gop options");
+    else
+      GST_LOG_OBJECT (encoder, "no output yet");
+    goto out;
+  }
+
+  /* Determine system frame number based on poc. Kvazaar codes each field
+   * of interlaced input as a picture of its own and outputs them together
+   * with the POC of the first one, so a frame counts two POCs, and the
+   * intra period is in fields. */
+  fields = encoder->kvazaarconfig->source_scan_type ? 2 : 1;
+  out_frame_num = GPOINTER_TO_INT (info_out.poc) / fields;
+  intra_period = encoder->kvazaarconfig->intra_period / fields;
+
+  /* If encoder->kvazaarconfig->intra_period is none 0, we need to keep track of
+   * the frame number.*/
+  if (intra_period > 0)
+  {
+    if (out_frame_num == 0 && input_frame &&
+        GPOINTER_TO_INT (input_frame->system_frame_number) >= intra_period)
+      encoder->systeme_frame_number_offset += intra_period;
+  }
+  out_frame_num += encoder->systeme_frame_number_offset;
+
+  frame = gst_kvazaar_enc_find_frame (encoder, img_src, out_frame_num);
+
+  /* One output picture in quality_interval is handed to the quality worker
+   * with its source, the others are freed here */
+  if (frame && send && img_src && img_rec && encoder->quality) {
+    GST_OBJECT_LOCK (encoder);
+    quality_interval = encoder->no_psnr ? 0 : encoder->quality_interval;
+    quality_metrics = encoder->quality_metrics;
+    GST_OBJECT_UNLOCK (encoder);
+
+    sample = quality_interval && quality_metrics &&
+        encoder->quality_count++ % quality_interval == 0;
+    /* The planes of the source picture are those of the input frame, which
+     * is finished before the worker is done with them */
+    if (sample)
+      sample = gst_kvazaar_enc_take_mapping (encoder, frame, &src_frame);
+  }
+  if (img_src && !sample) {
+    encoder->api->picture_free (img_src);
+    img_src = NULL;
+  }
+
+  if (frame && info_out.nal_unit_type >= KVZ_NAL_BLA_W_LP &&
+      info_out.nal_unit_type <= KVZ_NAL_CRA_NUT)
+    GST_VIDEO_CODEC_FRAME_SET_SYNC_POINT (frame);
+  //g_assert (frame || !send);
+
+  GST_DEBUG_OBJECT (encoder,
+      "output picture ready POC=%d system=%d frame found %d",
+      GPOINTER_TO_INT (info_out.poc),
+      out_frame_num, frame != NULL);
+
+  if (!send || !frame) {
+    GST_LOG_OBJECT (encoder, "not sending (%d) or frame not found (%d)", send,
+        frame != NULL);
+    if (img_rec)
+      encoder->api->picture_free (img_rec);
+    ret = GST_FLOW_OK;
+    goto out;
+  }
+
+  trace_start = GST_KVAZAAR_TRACE_START ();
+
+  if (chunks_out != NULL)
+    out_buf = gst_kvazaar_chunks_to_buffer (chunks_out, *len_out);
+
+  encoder->api->chunk_free (chunks_out);
+
+  /* Tag the temporal layer, the layers above max-temporal-layer are
+   * dropped. A non-reference picture of the highest layer seen is not
+   * needed by any other one. */
+  if (out_buf && gst_kvazaar_enc_get_temporal_id (out_buf, &temporal_id,
+          &non_reference)) {
+    GST_OBJECT_LOCK (encoder);
+    max_temporal_layer = encoder->max_temporal_layer;
+    GST_OBJECT_UNLOCK (encoder);
+
+    encoder->max_temporal_id = MAX (encoder->max_temporal_id, temporal_id);
+    if (temporal_id > max_temporal_layer) {
+      GST_LOG_OBJECT (encoder, "dropping frame %u of temporal layer %u",
+          frame->system_frame_number, temporal_id);
+      gst_buffer_unref (out_buf);
+      out_buf = NULL;
+    } else {
+      gst_buffer_add_kvazaar_temporal_meta (out_buf, temporal_id);
+      if (non_reference && temporal_id >= MIN (encoder->max_temporal_id,
+              max_temporal_layer))
+        GST_BUFFER_FLAG_SET (out_buf, GST_BUFFER_FLAG_DROPPABLE);
+    }
+  }
+
+  if (out_buf) {
+    gst_kvazaar_enc_update_vbv (encoder, *len_out);
+    gst_kvazaar_enc_record_stats (encoder, frame, out_buf, &info_out,
+        encode_time);
+  }
+
+  if (encoder->nal_aligned && out_buf)
+    ret = gst_kvazaar_enc_push_nal_units (encoder, frame, out_buf);
+  else
+    frame->output_buffer = out_buf;
+
+  /* I think that Kvazaar already outputs header on his own, so we might not
+   * need to push it manually */
+  /*
+  if (encoder->push_header) {
+    GstBuffer *header;
+
+    header = gst_kvazaar_enc_get_header_buffer (encoder);
+    frame->output_buffer = gst_buffer_append (header, frame->output_buffer);
+    encoder->push_header = FALSE;
+  }
+  // */
+
+  //GST_DEBUG (" output pts %" G_GINT64_FORMAT " output dts %" G_GINT64_FORMAT,
+      //(gint64) img_rec->pts, (gint64) img_rec->dts);
+
+  frame->dts = img_rec->dts;
+
+  if (trace_start)
+    gst_kvazaar_trace_span (GST_OBJECT (encoder), "output",
+        frame->system_frame_number, trace_start);
+
+  if (cur_in_img)
+    encoder->api->picture_free (cur_in_img);
+
+  /* The reconstructed picture is shared by the recon pad and the quality
+   * worker, the last one done with it gives it back */
+  recon_pad = gst_kvazaar_enc_get_recon_pad (encoder);
+  if (recon_pad) {
+    gst_kvazaar_enc_recon_events (encoder, recon_pad, img_rec);
+    recon_buf = gst_kvazaar_enc_wrap_recon (encoder, img_rec, frame);
+  }
+  if (sample)
+    gst_kvazaar_quality_push (encoder->quality, img_src, &src_frame, img_rec,
+        recon_buf, frame->system_frame_number, frame->pts, quality_metrics,
+        (encoder->frame_stats & GST_KVAZAAR_ENC_FRAME_STATS_MESSAGE) != 0);
+  else if (!recon_buf)
+    encoder->api->picture_free (img_rec);
+  if (recon_pad) {
+    gst_kvazaar_enc_push_recon (encoder, recon_pad, recon_buf);
+    gst_object_unref (recon_pad);
+  }
+
+out:
+  if (frame) {
+    GstFlowReturn finish_ret;
+
+    gst_kvazaar_enc_dequeue_frame (encoder, frame);
+    finish_ret = gst_kvazaar_enc_finish_frame (encoder, frame);
+    if (ret == GST_FLOW_OK)
+      ret = finish_ret;
+  }
+
+  return ret;
+}
+
+/*
+ * Delta QP of a region of interest: its own parameter if any, else the
+ * weight of its type.
+ */
+static gboolean
+gst_kvazaar_enc_get_roi_dqp (GstKvazaarEnc * encoder,
+    GstVideoRegionOfInterestMeta * roi, gint * dqp)
+{
+  GQuark any_type = g_quark_from_static_string (ROI_META_ANY_TYPE);
+  gboolean found = FALSE;
+  guint i;
+
+#if GST_CHECK_VERSION (1, 14, 0)
+  GstStructure *s =
+      gst_video_region_of_interest_meta_get_param (roi, ROI_META_PARAM_NAME);
+
+  if (s && gst_structure_get_int (s, "delta-qp", dqp))
+    return TRUE;
+#endif
+
+  for (i = 0; i < encoder->roi_weights->len; i++) {
+    RoiWeight *w = &g_array_index (encoder->roi_weights, RoiWeight, i);
+
+    if (w->roi_type == roi->roi_type) {
+      *dqp = w->dqp;
+      return TRUE;
+    }
+    if (w->roi_type == any_type) {
+      *dqp = w->dqp;
+      found = TRUE;
+    }
+  }
+
+  return found;
+}
+
+/*
+ * Rasterize the regions of interest attached to the input buffer into the
+ * CTU grid. Returns FALSE when no region applies to this picture.
+ */
+static gboolean
+gst_kvazaar_enc_fill_roi_map (GstKvazaarEnc * encoder,
+    GstVideoCodecFrame * frame, GstKvazaarQpMap * roi_map)
+{
+  GstVideoRegionOfInterestMeta *roi;
+  GstMeta *meta;
+  gpointer state = NULL;
+  guint n_roi = 0;
+  gint dqp;
+
+  if (!roi_map || !frame->input_buffer)
+    return FALSE;
+
+  while ((meta = gst_buffer_iterate_meta (frame->input_buffer, &state))) {
+    if (meta->info->api != GST_VIDEO_REGION_OF_INTEREST_META_API_TYPE)
+      continue;
+
+    roi = (GstVideoRegionOfInterestMeta *) meta;
+    if (roi->roi_type == g_quark_from_static_string (DAMAGE_ROI_TYPE) ||
+        !gst_kvazaar_enc_get_roi_dqp (encoder, roi, &dqp) || !dqp)
+      continue;
+
+    if (!n_roi)
+      gst_kvazaar_qp_map_clear (roi_map);
+    gst_kvazaar_qp_map_merge_rect (roi_map, roi->x, roi->y, roi->w, roi->h,
+        dqp);
+    n_roi++;
+  }
+
+  if (n_roi)
+    GST_LOG_OBJECT (encoder, "%u regions of interest in frame %u", n_roi,
+        frame->system_frame_number);
+
+  return n_roi > 0;
+}
+
+/*
+ * Mark the CTUs left unchanged since the previous input frame. The damage
+ * rectangles of the buffer are used when it has some, otherwise the luma
+ * of both frames is compared.
+ */
+static void
+gst_kvazaar_enc_detect_static (GstKvazaarEnc * encoder, FrameData * fdata)
+{
+  GstVideoFrame *cur = &fdata->vframe;
+  GstVideoFrame prev;
+  GstKvazaarQpMap *map;
+  GstVideoRegionOfInterestMeta *roi;
+  GstMeta *meta;
+  GQuark damage = g_quark_from_static_string (DAMAGE_ROI_TYPE);
+  gpointer state = NULL;
+  gboolean has_damage = FALSE;
+  gint depth = GST_VIDEO_FRAME_COMP_DEPTH (cur, 0);
+  gint width = GST_VIDEO_FRAME_WIDTH (cur);
+  gint height = GST_VIDEO_FRAME_HEIGHT (cur);
+  gdouble sample_threshold;
+  guint n_static = 0;
+  gint64 start = g_get_monotonic_time ();
+  gint x, y, i;
+
+  if (!encoder->qp_map)
+    return;
+
+  map = gst_kvazaar_enc_acquire_map (encoder);
+  gst_kvazaar_qp_map_clear (map);
+
+  /* Changed CTUs are set to 1 first */
+  while ((meta = gst_buffer_iterate_meta (fdata->frame->input_buffer,
+              &state))) {
+    if (meta->info->api != GST_VIDEO_REGION_OF_INTEREST_META_API_TYPE)
+      continue;
+
+    roi = (GstVideoRegionOfInterestMeta *) meta;
+    if (roi->roi_type != damage)
+      continue;
+
+    gst_kvazaar_qp_map_merge_rect (map, roi->x, roi->y, roi->w, roi->h, 1);
+    has_damage = TRUE;
+  }
+
+  if (!has_damage) {
+    if (!encoder->static_prev ||
+        !gst_video_frame_map (&prev, &cur->info, encoder->static_prev,
+            GST_MAP_READ))
+      goto done;
+
+    sample_threshold = encoder->static_threshold * (1 << MAX (depth - 8, 0));
+
+    for (y = 0; y < map->height; y++) {
+      for (x = 0; x < map->width; x++) {
+        gint px = x * GST_KVAZAAR_CTU_SIZE;
+        gint py = y * GST_KVAZAAR_CTU_SIZE;
+        gint w = MIN (GST_KVAZAAR_CTU_SIZE, width - px);
+        gint h = MIN (GST_KVAZAAR_CTU_SIZE, height - py);
+        gint a_stride = GST_VIDEO_FRAME_COMP_STRIDE (cur, 0);
+        gint b_stride = GST_VIDEO_FRAME_COMP_STRIDE (&prev, 0);
+        const guint8 *a = GST_VIDEO_FRAME_COMP_DATA (cur, 0);
+        const guint8 *b = GST_VIDEO_FRAME_COMP_DATA (&prev, 0);
+        /* Edge CTUs are cropped, the bound is for the samples compared */
+        guint32 max_sad = sample_threshold * w * h;
+        gboolean changed;
+
+        if (depth > 8)
+          changed = gst_kvazaar_block_changed_u16 ((const guint16 *) (a +
+                  py * a_stride) + px, a_stride / 2,
+              (const guint16 *) (b + py * b_stride) + px, b_stride / 2, w, h,
+              max_sad);
+        else
+          changed = gst_kvazaar_block_changed_u8 (a + py * a_stride + px,
+              a_stride, b + py * b_stride + px, b_stride, w, h, max_sad);
+
+        map->dqps[y * map->width + x] = changed;
+      }
+    }
+    gst_video_frame_unmap (&prev);
+  }
+
+  /* Turn the change mask into the delta QP */
+  for (i = 0; i < map->width * map->height; i++) {
+    if (map->dqps[i]) {
+      map->dqps[i] = 0;
+    } else {
+      map->dqps[i] = encoder->static_dqp;
+      n_static++;
+    }
+  }
+
+  GST_LOG_OBJECT (encoder, "frame %u: %u of %d CTUs static%s",
+      fdata->frame->system_frame_number, n_static, map->width * map->height,
+      has_damage ? " (damage rectangles)" : "");
+
+done:
+  gst_buffer_replace (&encoder->static_prev, fdata->frame->input_buffer);
+
+  GST_OBJECT_LOCK (encoder);
+  encoder->static_frames++;
+  if (has_damage)
+    encoder->static_damage_frames++;
+  encoder->static_ctus += n_static;
+  encoder->static_total_ctus += map->width * map->height;
+  encoder->static_time += (g_get_monotonic_time () - start) * GST_USECOND;
+  GST_OBJECT_UNLOCK (encoder);
+
+  if (n_static)
+    fdata->static_map = map;
+  else
+    gst_kvazaar_enc_release_map (encoder, map);
+}
+
+/*
+ * Guess if Kvazaar codes the next picture as intra, from the intra period.
+ */
+static gboolean
+gst_kvazaar_enc_next_is_intra (GstKvazaarEnc * encoder)
+{
+  gint intra_period = encoder->kvazaarconfig->intra_period;
+
+  if (encoder->frames_since_keyframe <= 1)
+    return TRUE;
+
+  return intra_period > 0 &&
+      (encoder->frames_since_keyframe - 1) % intra_period == 0;
+}
+
+/*
+ * Build the delta QP map of the picture from every source that is enabled
+ * and hand it to Kvazaar with the picture.
+ */
+static void
+gst_kvazaar_enc_set_picture_qp (GstKvazaarEnc * encoder,
+    GstVideoCodecFrame * frame, kvz_picture * pic, GstKvazaarQpMap * aq)
+{
+  GstKvazaarQpMap *map = encoder->qp_map;
+  FrameData *fdata;
+
+  if (!map)
+    return;
+
+  gst_kvazaar_qp_map_clear (map);
+#ifdef HAVE_KVZ_PICTURE_ROI
+  if (encoder->dqps)
+    gst_kvazaar_qp_map_add_scaled (map, encoder->roi_width,
+        encoder->roi_height, encoder->dqps);
+#endif
+  if (encoder->roi_seq) {
+    GstKvazaarRoiFile *file = encoder->roi_seq;
+    const gint8 *dqps = NULL;
+    gint width, height;
+
+    if (!gst_kvazaar_roi_file_is_pts (file))
+      dqps = gst_kvazaar_roi_file_lookup (file, frame->system_frame_number,
+          &width, &height);
+    else if (GST_CLOCK_TIME_IS_VALID (frame->pts))
+      dqps = gst_kvazaar_roi_file_lookup (file, frame->pts, &width, &height);
+    if (dqps)
+      gst_kvazaar_qp_map_add_scaled (map, width, height, dqps);
+  }
+  gst_kvazaar_qp_map_add (map, encoder->vbv_dqp);
+  if (aq)
+    gst_kvazaar_qp_map_add_scaled (map, aq->width, aq->height, aq->dqps);
+  if (gst_kvazaar_enc_fill_roi_map (encoder, frame, encoder->roi_map))
+    gst_kvazaar_qp_map_add_scaled (map, encoder->roi_map->width,
+        encoder->roi_map->height, encoder->roi_map->dqps);
+
+  /* The static bias is left out of intra pictures, their quality carries
+   * over to every following skipped CTU */
+  fdata = gst_kvazaar_enc_get_frame_data (encoder, frame);
+  if (fdata && fdata->duplicate)
+    gst_kvazaar_qp_map_add (map, GST_KVAZAAR_QP_MAP_MAX_DQP);
+  if (fdata && fdata->static_map && !gst_kvazaar_enc_next_is_intra (encoder))
+    gst_kvazaar_qp_map_add_scaled (map, fdata->static_map->width,
+        fdata->static_map->height, fdata->static_map->dqps);
+
+  if (gst_kvazaar_qp_map_is_zero (map))
+    return;
+
+#ifdef HAVE_KVZ_PICTURE_ROI
+  pic->roi.width = map->width;
+  pic->roi.height = map->height;
+  pic->roi.roi_array = gst_kvazaar_qp_map_dup_dqps (map);
+#else
+  if (!encoder->picture_qp_warned) {
+    GST_WARNING_OBJECT (encoder, "Kvazaar has no per-picture ROI, "
+        "dynamic QP offsets are ignored");
+    encoder->picture_qp_warned = TRUE;
+  }
+#endif
+}
+
+/*
+ * Kvazaar can not be asked for an IRAP picture. A key frame is forced by
+ * draining the encoder and opening a new one, which starts with an IRAP and
+ * restarts the intra period.
+ */
+static gboolean
+gst_kvazaar_enc_force_keyframe (GstKvazaarEnc * encoder,
+    GstVideoCodecFrame * frame)
+{
+  GST_INFO_OBJECT (encoder, "Forcing key frame at frame %u",
+      frame->system_frame_number);
+
+  gst_kvazaar_enc_flush_frames (encoder, TRUE);
+  if (!gst_kvazaar_enc_init_encoder (encoder))
+    return FALSE;
+
+  /* POC restarts from 0 at this frame */
+  encoder->systeme_frame_number_offset = frame->system_frame_number;
+
+  return TRUE;
+}
+
+/*
+ * Compare the picture with the previous one and tell if it starts a new
+ * scene. Both a luma histogram change and a picture difference are needed.
+ */
+static gboolean
+gst_kvazaar_enc_detect_scenecut (GstKvazaarEnc * encoder,
+    GstVideoFrame * vframe)
+{
+  GstVideoInfo *info = &vframe->info;
+  GstKvazaarThumbnail *cur, *prev;
+  guint32 hist[GST_KVAZAAR_HIST_BINS];
+  guint64 hist_diff = 0;
+  gdouble mad, distance, threshold;
+  gint i;
+
+  if (!encoder->scene_thumb[0] ||
+      encoder->scene_thumb[0]->width != MAX (info->width /
+          GST_KVAZAAR_THUMB_SCALE, 1) ||
+      encoder->scene_thumb[0]->height != MAX (info->height /
+          GST_KVAZAAR_THUMB_SCALE, 1)) {
+    gst_kvazaar_thumbnail_free (encoder->scene_thumb[0]);
+    gst_kvazaar_thumbnail_free (encoder->scene_thumb[1]);
+    encoder->scene_thumb[0] = gst_kvazaar_thumbnail_new (info->width,
+        info->height);
+    encoder->scene_thumb[1] = gst_kvazaar_thumbnail_new (info->width,
+        info->height);
+    encoder->scene_valid = FALSE;
+  }
+
+  /* Swap the thumbnails, the previous picture is kept in scene_thumb[1] */
+  prev = encoder->scene_thumb[0];
+  cur = encoder->scene_thumb[1];
+  encoder->scene_thumb[0] = cur;
+  encoder->scene_thumb[1] = prev;
+
+  gst_kvazaar_thumbnail_fill (cur, GST_VIDEO_FRAME_PLANE_DATA (vframe, 0),
+      GST_VIDEO_FRAME_COMP_STRIDE (vframe, 0),
+      GST_VIDEO_INFO_COMP_DEPTH (info, 0));
+  gst_kvazaar_histogram_u8 (cur->data, cur->stride, cur->width, cur->height,
+      hist);
+
+  if (!encoder->scene_valid) {
+    memcpy (encoder->scene_hist, hist, sizeof (hist));
+    encoder->scene_valid = TRUE;
+    return FALSE;
+  }
+
+  for (i = 0; i < GST_KVAZAAR_HIST_BINS; i++)
+    hist_diff += ABS ((gint64) hist[i] - (gint64) encoder->scene_hist[i]);
+  memcpy (encoder->scene_hist, hist, sizeof (hist));
 
-  return TRUE;
-}
+  /* Histogram distance in [0, 1], and mean absolute difference */
+  distance = hist_diff / (2.0 * cur->width * cur->height);
+  mad = gst_kvazaar_sad_u8 (cur->data, cur->stride, prev->data, prev->stride,
+      cur->width, cur->height) / (gdouble) (cur->width * cur->height);
 
-static GstFlowReturn
-gst_kvazaar_enc_finish (GstVideoEncoder * encoder)
-{
-  GST_DEBUG_OBJECT (encoder, "finish encoder");
+  /* Sensitivity 100 cuts on a 10% histogram change, 1 on a full one */
+  threshold = 0.1 + 0.9 * (100 - encoder->scenecut) / 100.0;
 
-  gst_kvazaar_enc_flush_frames (GST_KVAZAAR_ENC (encoder), TRUE);
-  gst_kvazaar_enc_flush_frames (GST_KVAZAAR_ENC (encoder), TRUE);
-  return GST_FLOW_OK;
+  GST_LOG_OBJECT (encoder, "scene histogram distance %.3f (threshold %.3f), "
+      "mad %.1f", distance, threshold, mad);
+
+  return distance > threshold && mad > SCENECUT_MIN_MAD;
 }
 
+/*
+ * Tell if the next picture starts a GOP, where reopening the encoder costs
+ * the least: at the intra period, else at the end of a reordering group.
+ */
 static gboolean
-gst_kvazaar_enc_propose_allocation (GstVideoEncoder * encoder, GstQuery * query)
+gst_kvazaar_enc_at_gop_boundary (GstKvazaarEnc * encoder)
 {
-  gst_query_add_allocation_meta (query, GST_VIDEO_META_API_TYPE, NULL);
+  gint intra_period = encoder->kvazaarconfig->intra_period;
+  gint gop_len = encoder->kvazaarconfig->gop_len;
 
-  return GST_VIDEO_ENCODER_CLASS (parent_class)->propose_allocation (encoder,
-      query);
+  if (intra_period > 0)
+    return encoder->frames_since_keyframe % intra_period == 0;
+  if (gop_len > 0)
+    return encoder->frames_since_keyframe % gop_len == 0;
+
+  return TRUE;
 }
 
-static void
-gst_kvazaar_enc_reconfig (GstKvazaarEnc * encoder)
+/*
+ * Duration of a frame at the input frame rate, or of this frame when the
+ * rate is variable.
+ */
+static GstClockTime
+gst_kvazaar_enc_get_frame_period (GstKvazaarEnc * encoder,
+    GstVideoCodecFrame * frame)
 {
-  encoder->kvazaarconfig->target_bitrate = encoder->bitrate;
-  encoder->reconfig = TRUE;
+  GstVideoInfo *info = &encoder->input_state->info;
+
+  if (info->fps_n > 0 && info->fps_d > 0)
+    return gst_util_uint64_scale_int (GST_SECOND, info->fps_d, info->fps_n);
+
+  return frame->duration;
 }
 
 /*
- * Give the input frame to the encoder, and send the frame returned by the
- * encoder if any.
+ * Step the degradation level up after a run of late frames, and down after a
+ * longer run of frames on time with some encode time to spare.
  */
-static GstFlowReturn
-gst_kvazaar_enc_encode_frame (GstKvazaarEnc * encoder, kvz_picture * cur_in_img,
-    GstVideoCodecFrame * input_frame, guint32 * len_out, gboolean send)
+static void
+gst_kvazaar_enc_qos_update (GstKvazaarEnc * encoder, GstClockTime period)
 {
-  GstVideoCodecFrame *frame = NULL;
-  kvz_picture *img_rec = NULL;
-  GstBuffer *out_buf = NULL;
-  kvz_frame_info info_out;
-  kvz_data_chunk *chunks_out;
-  int offset;
-  int encoder_return;
-  guint32 out_frame_num, intra_period; // Picture order count
-  GstFlowReturn ret = GST_FLOW_OK;
-  gboolean update_latency = FALSE;
+  GstClockTimeDiff jitter;
+  gboolean late, on_time;
+  gint level, prev_level;
 
-  if (G_UNLIKELY (encoder->kvazaarenc == NULL)) {
-    if (input_frame)
-      gst_video_codec_frame_unref (input_frame);
-    return GST_FLOW_NOT_NEGOTIATED;
+  GST_OBJECT_LOCK (encoder);
+  jitter = encoder->qos_jitter;
+  prev_level = level = encoder->qos_level;
+  GST_OBJECT_UNLOCK (encoder);
+
+  late = jitter > 0 || (GST_CLOCK_TIME_IS_VALID (period) &&
+      encoder->qos_encode_time > period);
+  on_time = jitter <= 0 && (!GST_CLOCK_TIME_IS_VALID (period) ||
+      encoder->qos_encode_time < QOS_RECOVER_LOAD * period);
+
+  encoder->qos_late_count = late ? encoder->qos_late_count + 1 : 0;
+  encoder->qos_on_time_count = on_time ? encoder->qos_on_time_count + 1 : 0;
+
+  if (encoder->qos_late_count >= QOS_LATE_FRAMES &&
+      level < GST_KVAZAAR_ENC_QOS_DROP) {
+    level++;
+    encoder->qos_late_count = 0;
+  } else if (encoder->qos_on_time_count >= QOS_RECOVER_FRAMES &&
+      level > GST_KVAZAAR_ENC_QOS_NONE) {
+    level--;
+    encoder->qos_on_time_count = 0;
   }
 
+  if (level == prev_level)
+    return;
+
   GST_OBJECT_LOCK (encoder);
-  if (encoder->reconfig) {
-    // kvazaar_encoder_reconfig is not yet implemented thus we shut down and re-create encoder
-    gst_kvazaar_enc_init_encoder (encoder);
-    update_latency = TRUE;
-  }
+  encoder->qos_level = level;
+  GST_OBJECT_UNLOCK (encoder);
 
- /* if (cur_in_img && input_frame) {
-    if (GST_VIDEO_CODEC_FRAME_IS_FORCE_KEYFRAME (input_frame)) {
-      GST_INFO_OBJECT (encoder, "Forcing key frame");
-      info_out.slice_type = KVZ_SLICE_B;
-    }
-  }*/
+  GST_INFO_OBJECT (encoder, "QoS level %s -> %s, jitter %" G_GINT64_FORMAT
+      ", encode time %.0f ns, frame period %" G_GUINT64_FORMAT " ns",
+      qos_level_types[prev_level].value_nick, qos_level_types[level].value_nick,
+      jitter, encoder->qos_encode_time, period);
+
+  gst_element_post_message (GST_ELEMENT (encoder),
+      gst_message_new_element (GST_OBJECT (encoder),
+          gst_structure_new ("kvazaarenc-qos",
+              "level", GST_KVAZAAR_ENC_QOS_LEVEL_TYPE, level,
+              "previous-level", GST_KVAZAAR_ENC_QOS_LEVEL_TYPE, prev_level,
+              "jitter", G_TYPE_INT64, jitter,
+              "encode-time", G_TYPE_UINT64,
+              (guint64) encoder->qos_encode_time,
+              "frame-period", G_TYPE_UINT64, period, NULL)));
+}
+
+/*
+ * Tell if the frame is left out at the current degradation level. Key frames
+ * are always encoded.
+ */
+static gboolean
+gst_kvazaar_enc_qos_drop (GstKvazaarEnc * encoder, GstVideoCodecFrame * frame,
+    GstClockTime period)
+{
+  GstClockTime running_time, earliest;
+  gint level;
+
+  GST_OBJECT_LOCK (encoder);
+  level = encoder->qos_level;
+  earliest = encoder->qos_earliest;
   GST_OBJECT_UNLOCK (encoder);
 
-  if (G_UNLIKELY (update_latency))
-    gst_kvazaar_enc_set_latency (encoder);
+  if (level < GST_KVAZAAR_ENC_QOS_DECIMATE ||
+      GST_VIDEO_CODEC_FRAME_IS_FORCE_KEYFRAME (frame))
+    return FALSE;
 
-  encoder_return = encoder->api->encoder_encode (encoder->kvazaarenc,
-      cur_in_img, &chunks_out, len_out, &img_rec, NULL, &info_out);
+  if (++encoder->qos_decimation_count % QOS_DECIMATION == 0)
+    return TRUE;
 
-  GST_DEBUG_OBJECT (encoder, "encoder result (%d) with lenght data = %u ",
-      encoder_return, *len_out);
+  if (level < GST_KVAZAAR_ENC_QOS_DROP || !GST_CLOCK_TIME_IS_VALID (earliest))
+    return FALSE;
 
-  if (encoder_return < 0) {
-    GST_ELEMENT_ERROR (encoder, STREAM, ENCODE, ("Encode Kvazaar frame failed."),
-        ("kvazaar_encoder_encode return code=%d", encoder_return));
-    ret = GST_FLOW_ERROR;
-    /* Make sure we finish this frame */
-    frame = input_frame;
-    goto out;
-  }
+  /* Too late downstream even if it was encoded right away */
+  running_time =
+      gst_segment_to_running_time (&GST_VIDEO_ENCODER (encoder)->input_segment,
+      GST_FORMAT_TIME, frame->pts);
+  if (!GST_CLOCK_TIME_IS_VALID (running_time))
+    return FALSE;
+  if (GST_CLOCK_TIME_IS_VALID (period))
+    running_time += period;
 
-  GST_DEBUG_OBJECT (encoder, "Frame info: QP=%d", info_out.qp);
+  return running_time < earliest;
+}
 
-  /*GST_LOG_OBJECT (encoder,
-      "img_rec dts %" G_GINT64_FORMAT " img_rec pts %" G_GINT64_FORMAT,
-      (gint64) img_rec.dts, (gint64) img_rec.pts);
-  */
-  //*
-  if (input_frame)
-    gst_video_codec_frame_unref (input_frame);
-  // */
+/*
+ * Move the effort of the realtime mode towards the target load at the GOP
+ * boundaries. The cost of each effort step is learnt from the loads before
+ * and after a change, so that a step known to miss the target is only taken
+ * again when the content got easier.
+ */
+static void
+gst_kvazaar_enc_realtime_update (GstKvazaarEnc * encoder,
+    GstVideoCodecFrame * frame)
+{
+  GstClockTime period = gst_kvazaar_enc_get_frame_period (encoder, frame);
+  gdouble target = encoder->realtime_target;
+  gdouble load, cost;
+  gint effort = encoder->rt_effort;
+
+  encoder->rt_frames++;
+  if (!GST_CLOCK_TIME_IS_VALID (period) || period == 0 ||
+      encoder->rt_frames < REALTIME_MIN_FRAMES ||
+      !gst_kvazaar_enc_at_gop_boundary (encoder))
+    return;
 
-  if (!*len_out)
-  {
-    ret = GST_FLOW_OK;
-    GST_LOG_OBJECT (encoder, "no output yet");
-    goto out;
-  }
+  load = encoder->qos_encode_time / period;
 
-  /* Determine system frame number based on poc */
-  out_frame_num = GPOINTER_TO_INT (info_out.poc);
-  intra_period = encoder->kvazaarconfig->intra_period;
+  /* First measure since the last change */
+  if (encoder->rt_prev_effort == effort - 1 && encoder->rt_prev_load > 0)
+    encoder->rt_cost[effort - 1] = load / encoder->rt_prev_load;
+  else if (encoder->rt_prev_effort == effort + 1 && load > 0)
+    encoder->rt_cost[effort] = encoder->rt_prev_load / load;
+  encoder->rt_prev_effort = -1;
 
-  /* If encoder->kvazaarconfig->intra_period is none 0, we need to keep track of
-   * the frame number.*/
-  if (intra_period > 0)
-  {
-    if (out_frame_num == 0 && input_frame &&
-        GPOINTER_TO_INT (input_frame->system_frame_number) >= intra_period)
-      encoder->systeme_frame_number_offset += intra_period;
-    out_frame_num += encoder->systeme_frame_number_offset;
-  }
+  cost = MAX (encoder->rt_cost[effort], 1.0);
+  if (load > target * (1 + REALTIME_TOLERANCE) && effort > 0)
+    effort--;
+  else if (load < target * (1 - REALTIME_TOLERANCE) &&
+      effort < gst_kvazaar_enc_get_max_effort (encoder) &&
+      load * cost <= target)
+    effort++;
 
-  frame = gst_video_encoder_get_frame (GST_VIDEO_ENCODER (encoder), out_frame_num);
-  //g_assert (frame || !send);
+  GST_LOG_OBJECT (encoder, "realtime load %.2f at effort %d", load,
+      encoder->rt_effort);
 
-  GST_DEBUG_OBJECT (encoder,
-      "output picture ready POC=%d system=%d frame found %d",
-      GPOINTER_TO_INT (info_out.poc),
-      out_frame_num, frame != NULL);
+  if (effort == encoder->rt_effort)
+    return;
 
-  if (!send || !frame) {
-    GST_LOG_OBJECT (encoder, "not sending (%d) or frame not found (%d)", send,
-        frame != NULL);
-    ret = GST_FLOW_OK;
-    goto out;
-  }
+  GST_INFO_OBJECT (encoder, "realtime load %.2f (target %.2f), effort %d -> "
+      "%d", load, target, encoder->rt_effort, effort);
 
-  offset = 0;
+  encoder->rt_prev_effort = encoder->rt_effort;
+  encoder->rt_prev_load = load;
+  encoder->rt_effort = effort;
+  encoder->rt_frames = 0;
+}
 
-  if (chunks_out != NULL)
-  {
-    kvz_data_chunk *chunk;
-    out_buf = gst_buffer_new_allocate (NULL, *len_out, NULL);
-    for (chunk = chunks_out; chunk != NULL; chunk = chunk->next)
-    {
-      g_assert (offset + chunk->len <= *len_out);
-      gst_buffer_fill (out_buf, offset, chunk->data, chunk->len);
-      offset += chunk->len;
-    }
+/*
+ * Set up the QP of a picture and give it to the encoder.
+ */
+static GstFlowReturn
+gst_kvazaar_enc_encode_picture (GstKvazaarEnc * encoder,
+    GstVideoCodecFrame * frame, kvz_picture * pic, GstKvazaarQpMap * aq)
+{
+  guint32 len_out;
+  gboolean restart;
+
+  if (encoder->realtime)
+    gst_kvazaar_enc_realtime_update (encoder, frame);
+
+  /* Kvazaar can not be reconfigured, it is drained and reopened. Property
+   * changes apply right away, the QoS and realtime settings at the next
+   * GOP where the IRAP comes at no extra cost. */
+  GST_OBJECT_LOCK (encoder);
+  restart = encoder->reconfig;
+  GST_OBJECT_UNLOCK (encoder);
+  if (!restart && gst_kvazaar_enc_at_gop_boundary (encoder))
+    restart = QOS_CONFIG_LEVEL (encoder->qos_level) !=
+        encoder->qos_config_level ||
+        (encoder->realtime && encoder->rt_effort != encoder->rt_config_effort);
+
+  /* Key frames requested upstream or on scene changes. A fresh encoder
+   * already starts with one. */
+  if (((GST_VIDEO_CODEC_FRAME_IS_FORCE_KEYFRAME (frame) &&
+              encoder->frames_since_keyframe > 0) || restart) &&
+      !gst_kvazaar_enc_force_keyframe (encoder, frame)) {
+    encoder->api->picture_free (pic);
+    gst_video_codec_frame_unref (frame);
+    return GST_FLOW_ERROR;
   }
+  if (restart)
+    gst_kvazaar_enc_set_latency (encoder);
+  encoder->frames_since_keyframe++;
 
-  encoder->api->chunk_free (chunks_out);
+  gst_kvazaar_enc_set_picture_qp (encoder, frame, pic, aq);
 
-  frame->output_buffer = out_buf;
+  return gst_kvazaar_enc_encode_frame (encoder, pic, frame, &len_out, TRUE);
+}
 
-  /* I think that Kvazaar already outputs header on his own, so we might not
-   * need to push it manually */
-  /*
-  if (encoder->push_header) {
-    GstBuffer *header;
+/*
+ * Tell if the input buffer holds the same picture as the previous one. The
+ * comparison stops at the first difference.
+ */
+static gboolean
+gst_kvazaar_enc_is_duplicate (GstKvazaarEnc * encoder, GstBuffer * buf)
+{
+  GstMapInfo cur, prev;
+  gboolean same = FALSE;
 
-    header = gst_kvazaar_enc_get_header_buffer (encoder);
-    frame->output_buffer = gst_buffer_append (header, frame->output_buffer);
-    encoder->push_header = FALSE;
+  if (!encoder->dup_prev)
+    return FALSE;
+  if (encoder->dup_prev == buf)
+    return TRUE;
+
+  if (!gst_buffer_map (buf, &cur, GST_MAP_READ))
+    return FALSE;
+  if (gst_buffer_map (encoder->dup_prev, &prev, GST_MAP_READ)) {
+    same = cur.data == prev.data ||
+        (cur.size == prev.size && memcmp (cur.data, prev.data, cur.size) == 0);
+    gst_buffer_unmap (encoder->dup_prev, &prev);
   }
-  // */
+  gst_buffer_unmap (buf, &cur);
 
-  //GST_DEBUG (" output pts %" G_GINT64_FORMAT " output dts %" G_GINT64_FORMAT,
-      //(gint64) img_rec->pts, (gint64) img_rec->dts);
+  return same;
+}
 
-  frame->dts = img_rec->dts;
+/*
+ * Drop a duplicate frame, the previous frame lasts until the end of this one
+ * if it was not pushed yet.
+ */
+static GstFlowReturn
+gst_kvazaar_enc_drop_duplicate (GstKvazaarEnc * encoder,
+    GstVideoCodecFrame * frame)
+{
+  FrameData *last = encoder->pending_frames ?
+      encoder->pending_frames->data : NULL;
 
-  if (cur_in_img)
-    encoder->api->picture_free (cur_in_img);
-  encoder->api->picture_free (img_rec);
+  /* pending_frames starts with the last queued frame */
+  if (last && last->frame->system_frame_number == encoder->dup_last_number &&
+      GST_CLOCK_TIME_IS_VALID (last->frame->pts) &&
+      GST_CLOCK_TIME_IS_VALID (frame->pts) &&
+      GST_CLOCK_TIME_IS_VALID (frame->duration) &&
+      frame->pts > last->frame->pts)
+    last->frame->duration = frame->pts + frame->duration - last->frame->pts;
 
-out:
-  if (frame) {
-    gst_kvazaar_enc_dequeue_frame (encoder, frame);
-    ret = gst_video_encoder_finish_frame (GST_VIDEO_ENCODER (encoder), frame);
-  }
+  GST_LOG_OBJECT (encoder, "Dropping duplicate frame %u (run of %u)",
+      frame->system_frame_number, encoder->dup_run);
 
-  return ret;
+  return gst_kvazaar_enc_finish_frame (encoder, frame);
 }
 
 /*
  * Handle input frame.
  */
-static GstFlowReturn gst_kvazaar_enc_handle_frame (GstVideoEncoder * video_enc,
- GstVideoCodecFrame * frame)
+static GstFlowReturn
+gst_kvazaar_enc_submit_frame (GstVideoEncoder * video_enc,
+    GstVideoCodecFrame * frame)
 {
   GstKvazaarEnc *encoder = GST_KVAZAAR_ENC (video_enc);
   GstVideoInfo *info = &encoder->input_state->info;
@@ -1800,8 +4721,11 @@ static GstFlowReturn gst_kvazaar_enc_handle_frame (GstVideoEncoder * video_enc,
   kvz_picture *cur_in_img = NULL;
   FrameData *fdata;
   gint nplanes = 0;
-  guint32 len_out;
   gint chroma_format;
+  guint lookahead;
+  gpointer la_frame, la_pic;
+  gboolean duplicate;
+  gint64 trace_start;
 
   /*Retrieve the chroma format of the source*/
   chroma_format =
@@ -1810,6 +4734,37 @@ static GstFlowReturn gst_kvazaar_enc_handle_frame (GstVideoEncoder * video_enc,
   if (nplanes != 3)
     goto invalid_format;
 
+  if (encoder->qos_degradation) {
+    GstClockTime period = gst_kvazaar_enc_get_frame_period (encoder, frame);
+
+    gst_kvazaar_enc_qos_update (encoder, period);
+    if (gst_kvazaar_enc_qos_drop (encoder, frame, period)) {
+      GST_LOG_OBJECT (encoder, "QoS dropping frame %u",
+          frame->system_frame_number);
+      encoder->qos_dropped++;
+      return gst_kvazaar_enc_finish_frame (encoder, frame);
+    }
+  }
+
+  /* Runs of identical frames, key frames are never left out and a run
+   * longer than max-duplicates is broken by a normal frame */
+  duplicate = FALSE;
+  if (encoder->duplicate_policy != GST_KVAZAAR_ENC_DUPLICATE_NONE) {
+    duplicate = !GST_VIDEO_CODEC_FRAME_IS_FORCE_KEYFRAME (frame) &&
+        gst_kvazaar_enc_is_duplicate (encoder, frame->input_buffer) &&
+        (!encoder->max_duplicates ||
+        encoder->dup_run < encoder->max_duplicates);
+    encoder->dup_run = duplicate ? encoder->dup_run + 1 : 0;
+    gst_buffer_replace (&encoder->dup_prev, frame->input_buffer);
+
+    if (duplicate) {
+      encoder->dup_frames++;
+      if (encoder->duplicate_policy == GST_KVAZAAR_ENC_DUPLICATE_DROP)
+        return gst_kvazaar_enc_drop_duplicate (encoder, frame);
+    }
+  }
+  encoder->dup_last_number = frame->system_frame_number;
+
   /*Allocate a kvz picture for the input image*/
   cur_in_img =
     encoder->api->picture_alloc_csp (chroma_format,info->width, info->height );
@@ -1817,9 +4772,14 @@ static GstFlowReturn gst_kvazaar_enc_handle_frame (GstVideoEncoder * video_enc,
   if (G_UNLIKELY (encoder->kvazaarenc == NULL))
     goto not_inited;
 
+  trace_start = GST_KVAZAAR_TRACE_START ();
   fdata = gst_kvazaar_enc_queue_frame (encoder, frame, info);
   if (!fdata)
     goto invalid_frame;
+  if (trace_start)
+    gst_kvazaar_trace_span (GST_OBJECT (encoder), "map",
+        frame->system_frame_number, trace_start);
+  fdata->duplicate = duplicate;
 
   //for (int i = 0; i < nplanes; i++) {
     //cur_in_img->data[i] = GST_VIDEO_FRAME_PLANE_DATA (&fdata->vframe, i);
@@ -1828,13 +4788,33 @@ static GstFlowReturn gst_kvazaar_enc_handle_frame (GstVideoEncoder * video_enc,
   cur_in_img->u = GST_VIDEO_FRAME_PLANE_DATA (&fdata->vframe, 1);
   cur_in_img->v = GST_VIDEO_FRAME_PLANE_DATA (&fdata->vframe, 2);
 
-  cur_in_img->stride = GST_VIDEO_FRAME_COMP_STRIDE (&fdata->vframe, 0);
+  /* In pixels, which are 16 bits wide with 10-bit input */
+  cur_in_img->stride =
+      GST_VIDEO_FRAME_COMP_STRIDE (&fdata->vframe, 0) / sizeof (kvz_pixel);
 
   cur_in_img->pts = frame->pts;
   cur_in_img->dts = frame->dts;
   cur_in_img->width = info->width;
   cur_in_img->height = info->height;
-  cur_in_img->interlacing = info->interlace_mode;
+  cur_in_img->interlacing =
+      gst_kvazaar_enc_get_field_order (encoder, &fdata->vframe);
+
+  /* Frames since the last key frame are counted at the input, where the
+   * detection runs, so that the spacing holds with a lookahead too */
+  if (encoder->scenecut) {
+    encoder->scene_distance++;
+    if (gst_kvazaar_enc_detect_scenecut (encoder, &fdata->vframe) &&
+        encoder->scene_distance >= encoder->min_keyint) {
+      GST_DEBUG_OBJECT (encoder, "Scene cut at frame %u",
+          frame->system_frame_number);
+      GST_VIDEO_CODEC_FRAME_SET_FORCE_KEYFRAME (frame);
+    }
+    if (GST_VIDEO_CODEC_FRAME_IS_FORCE_KEYFRAME (frame))
+      encoder->scene_distance = 0;
+  }
+
+  if (encoder->static_dqp && !duplicate)
+    gst_kvazaar_enc_detect_static (encoder, fdata);
 
   /* Interlacing / Width,Height / Chroma format */
   /*
@@ -1843,7 +4823,27 @@ static GstFlowReturn gst_kvazaar_enc_handle_frame (GstVideoEncoder * video_enc,
   GST_DEBUG ("chroma format %d", chroma_format);
   // */
 
-  ret = gst_kvazaar_enc_encode_frame (encoder, cur_in_img, frame, &len_out, TRUE);
+  lookahead = gst_kvazaar_enc_get_lookahead_depth (encoder);
+  if (!lookahead)
+    return gst_kvazaar_enc_encode_picture (encoder, frame, cur_in_img, NULL);
+
+  /* Pictures wait in the lookahead until enough following ones have been
+   * analysed */
+  if (!encoder->lookahead_queue)
+    encoder->lookahead_queue = gst_kvazaar_lookahead_new (lookahead,
+        info->width, info->height);
+
+  gst_kvazaar_lookahead_push (encoder->lookahead_queue, frame, cur_in_img,
+      GST_VIDEO_FRAME_PLANE_DATA (&fdata->vframe, 0),
+      GST_VIDEO_FRAME_COMP_STRIDE (&fdata->vframe, 0),
+      GST_VIDEO_INFO_COMP_DEPTH (info, 0));
+
+  ret = GST_FLOW_OK;
+  while (ret == GST_FLOW_OK &&
+      gst_kvazaar_lookahead_pop (encoder->lookahead_queue, FALSE,
+          encoder->aq_strength, encoder->aq_map, &la_frame, &la_pic))
+    ret = gst_kvazaar_enc_encode_picture (encoder, la_frame, la_pic,
+        encoder->aq_map);
 
   return ret;
 
@@ -1866,6 +4866,40 @@ not_inited:
   }
 }
 
+/*
+ * Trace a frame from here until it is finished, which may be from another
+ * thread or call.
+ */
+static GstFlowReturn
+gst_kvazaar_enc_handle_frame (GstVideoEncoder * video_enc,
+    GstVideoCodecFrame * frame)
+{
+  GstKvazaarEnc *encoder = GST_KVAZAAR_ENC (video_enc);
+  gint64 trace_start = GST_KVAZAAR_TRACE_START ();
+  guint32 number = frame->system_frame_number;
+  GstFlowReturn ret;
+
+  if (trace_start)
+    gst_kvazaar_trace_frame_begin (GST_OBJECT (video_enc), number);
+
+  if (encoder->recorder && !gst_kvazaar_recorder_write_frame
+      (encoder->recorder, frame->input_buffer,
+          GST_VIDEO_CODEC_FRAME_IS_FORCE_KEYFRAME (frame))) {
+    GST_ELEMENT_WARNING (encoder, RESOURCE, WRITE,
+        ("Recording stopped."), ("Can not write to %s",
+            encoder->record_location->str));
+    gst_kvazaar_enc_stop_recording (encoder);
+  }
+
+  ret = gst_kvazaar_enc_submit_frame (video_enc, frame);
+
+  if (trace_start)
+    gst_kvazaar_trace_span (GST_OBJECT (video_enc), "handle_frame", number,
+        trace_start);
+
+  return ret;
+}
+
 static void
 gst_kvazaar_enc_set_property (GObject * object, guint prop_id,
     const GValue * value, GParamSpec * pspec)
@@ -1882,6 +4916,15 @@ gst_kvazaar_enc_set_property (GObject * object, guint prop_id,
       !(pspec->flags & GST_PARAM_MUTABLE_PLAYING))
     goto wrong_state;
 
+  /* Changes while recording are replayed between the same frames */
+  if (encoder->recorder && prop_id != PROP_RECORD_LOCATION
+#ifdef HAS_CRYPTO
+      && prop_id != PROP_KEY
+#endif
+      )
+    gst_kvazaar_recorder_write_property (encoder->recorder, pspec->name,
+        value);
+
   switch (prop_id) {
     case PROP_BITRATE:
       encoder->bitrate = g_value_get_uint (value);
@@ -1896,14 +4939,19 @@ gst_kvazaar_enc_set_property (GObject * object, guint prop_id,
       encoder->vps_period = g_value_get_int (value);
       break;
     case PROP_NO_PSNR:
+      /* Applied to the output, the encoder goes on as it is */
       encoder->no_psnr = g_value_get_boolean (value);
-      break;
+      GST_OBJECT_UNLOCK (encoder);
+      return;
     case PROP_NO_INFO:
       encoder->no_info = g_value_get_boolean (value);
       break;
     case PROP_PRESET:
       encoder->preset = g_value_get_enum (value);
       break;
+    case PROP_TUNE:
+      encoder->tune = g_value_get_enum (value);
+      break;
 #ifdef HAS_CRYPTO
     case PROP_CRYPTO:
       encoder->crypto = g_value_get_flags (value);
@@ -1988,10 +5036,101 @@ gst_kvazaar_enc_set_property (GObject * object, guint prop_id,
     case PROP_ROI:
       g_string_assign (encoder->roi, g_value_get_string (value));
       encoder->roi_set = TRUE;
+      /* parsed again on the next encoder init */
+      g_free (encoder->dqps);
+      encoder->dqps = NULL;
+      encoder->kvazaarconfig->roi.width = 0;
+      encoder->kvazaarconfig->roi.height = 0;
+      encoder->kvazaarconfig->roi.dqps = NULL;
       break;
     case PROP_KVZ_OPTS:
       g_string_assign (encoder->kvz_opts, g_value_get_string (value));
       break;
+    case PROP_SLICE_MAX_SIZE:
+      encoder->slice_max_size = g_value_get_uint (value);
+      break;
+    case PROP_VBV_BUFSIZE:
+      encoder->vbv_bufsize = g_value_get_uint (value);
+      break;
+    case PROP_VBV_MAXRATE:
+      encoder->vbv_maxrate = g_value_get_uint (value);
+      break;
+    case PROP_LOOKAHEAD:
+      encoder->lookahead = g_value_get_uint (value);
+      encoder->lookahead_set = TRUE;
+      break;
+    case PROP_AQ_STRENGTH:
+      encoder->aq_strength = g_value_get_double (value);
+      break;
+    case PROP_SCENECUT:
+      encoder->scenecut = g_value_get_uint (value);
+      break;
+    case PROP_MIN_KEYINT:
+      encoder->min_keyint = g_value_get_uint (value);
+      break;
+    case PROP_ROI_META_WEIGHTS:
+      g_string_assign (encoder->roi_meta_weights,
+          g_value_get_string (value) ? g_value_get_string (value) : "");
+      if (!parse_roi_weights (encoder->roi_meta_weights->str,
+              encoder->roi_weights))
+        GST_WARNING_OBJECT (encoder, "Ignoring ROI meta weights \"%s\"",
+            encoder->roi_meta_weights->str);
+      break;
+    case PROP_ROI_FILE:
+      g_string_assign (encoder->roi_file,
+          g_value_get_string (value) ? g_value_get_string (value) : "");
+      break;
+    case PROP_RECORD_LOCATION:
+      g_string_assign (encoder->record_location,
+          g_value_get_string (value) ? g_value_get_string (value) : "");
+      GST_OBJECT_UNLOCK (encoder);
+      return;
+    case PROP_STATIC_DQP:
+      encoder->static_dqp = g_value_get_uint (value);
+      break;
+    case PROP_STATIC_THRESHOLD:
+      encoder->static_threshold = g_value_get_double (value);
+      break;
+    case PROP_DUPLICATE_POLICY:
+      encoder->duplicate_policy = g_value_get_enum (value);
+      break;
+    case PROP_MAX_DUPLICATES:
+      encoder->max_duplicates = g_value_get_uint (value);
+      break;
+    case PROP_QOS_DEGRADATION:
+      encoder->qos_degradation = g_value_get_boolean (value);
+      break;
+    case PROP_REALTIME:
+      encoder->realtime = g_value_get_boolean (value);
+      break;
+    case PROP_REALTIME_TARGET:
+      encoder->realtime_target = g_value_get_double (value);
+      break;
+    case PROP_MAX_TEMPORAL_LAYER:
+      /* Applied to the output, the encoder goes on as it is */
+      encoder->max_temporal_layer = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (encoder);
+      return;
+    case PROP_FRAME_STATS:
+      encoder->frame_stats = g_value_get_flags (value);
+      GST_OBJECT_UNLOCK (encoder);
+      return;
+    case PROP_QUALITY_INTERVAL:
+      encoder->quality_interval = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (encoder);
+      return;
+    case PROP_QUALITY_METRICS:
+      encoder->quality_metrics = g_value_get_flags (value);
+      GST_OBJECT_UNLOCK (encoder);
+      return;
+    case PROP_EXPECTED_CAPS:
+      gst_caps_replace (&encoder->expected_caps, g_value_get_boxed (value));
+      GST_OBJECT_UNLOCK (encoder);
+      return;
+    case PROP_ENCODER_CACHE_TIMEOUT:
+      encoder->cache_timeout = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (encoder);
+      return;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -2039,6 +5178,9 @@ gst_kvazaar_enc_get_property (GObject * object, guint prop_id,
     case PROP_PRESET:
       g_value_set_enum (value, encoder->preset);
       break;
+    case PROP_TUNE:
+      g_value_set_enum (value, encoder->tune);
+      break;
 #ifdef HAS_CRYPTO
     case PROP_CRYPTO:
       g_value_set_flags (value, encoder->crypto);
@@ -2116,6 +5258,95 @@ gst_kvazaar_enc_get_property (GObject * object, guint prop_id,
     case PROP_KVZ_OPTS:
       g_value_set_string (value, encoder->kvz_opts->str);
       break;
+    case PROP_SLICE_MAX_SIZE:
+      g_value_set_uint (value, encoder->slice_max_size);
+      break;
+    case PROP_VBV_BUFSIZE:
+      g_value_set_uint (value, encoder->vbv_bufsize);
+      break;
+    case PROP_VBV_MAXRATE:
+      g_value_set_uint (value, encoder->vbv_maxrate);
+      break;
+    case PROP_LOOKAHEAD:
+      g_value_set_uint (value, encoder->lookahead);
+      break;
+    case PROP_AQ_STRENGTH:
+      g_value_set_double (value, encoder->aq_strength);
+      break;
+    case PROP_SCENECUT:
+      g_value_set_uint (value, encoder->scenecut);
+      break;
+    case PROP_MIN_KEYINT:
+      g_value_set_uint (value, encoder->min_keyint);
+      break;
+    case PROP_ROI_META_WEIGHTS:
+      g_value_set_string (value, encoder->roi_meta_weights->str);
+      break;
+    case PROP_ROI_FILE:
+      g_value_set_string (value, encoder->roi_file->str);
+      break;
+    case PROP_RECORD_LOCATION:
+      g_value_set_string (value, encoder->record_location->str);
+      break;
+    case PROP_STATIC_DQP:
+      g_value_set_uint (value, encoder->static_dqp);
+      break;
+    case PROP_STATIC_THRESHOLD:
+      g_value_set_double (value, encoder->static_threshold);
+      break;
+    case PROP_DUPLICATE_POLICY:
+      g_value_set_enum (value, encoder->duplicate_policy);
+      break;
+    case PROP_MAX_DUPLICATES:
+      g_value_set_uint (value, encoder->max_duplicates);
+      break;
+    case PROP_QOS_DEGRADATION:
+      g_value_set_boolean (value, encoder->qos_degradation);
+      break;
+    case PROP_QOS_LEVEL:
+      g_value_set_enum (value, encoder->qos_level);
+      break;
+    case PROP_REALTIME:
+      g_value_set_boolean (value, encoder->realtime);
+      break;
+    case PROP_REALTIME_TARGET:
+      g_value_set_double (value, encoder->realtime_target);
+      break;
+    case PROP_MAX_TEMPORAL_LAYER:
+      g_value_set_uint (value, encoder->max_temporal_layer);
+      break;
+    case PROP_FRAME_STATS:
+      g_value_set_flags (value, encoder->frame_stats);
+      break;
+    case PROP_QUALITY_INTERVAL:
+      g_value_set_uint (value, encoder->quality_interval);
+      break;
+    case PROP_QUALITY_METRICS:
+      g_value_set_flags (value, encoder->quality_metrics);
+      break;
+    case PROP_EXPECTED_CAPS:
+      g_value_set_boxed (value, encoder->expected_caps);
+      break;
+    case PROP_ENCODER_CACHE_TIMEOUT:
+      g_value_set_uint (value, encoder->cache_timeout);
+      break;
+    case PROP_STATS:
+      g_value_take_boxed (value, gst_kvazaar_enc_get_stats (encoder));
+      break;
+    case PROP_STATIC_STATS:
+      g_value_take_boxed (value, gst_structure_new ("kvazaarenc-static-stats",
+              "frames", G_TYPE_UINT64, encoder->static_frames,
+              "damage-frames", G_TYPE_UINT64, encoder->static_damage_frames,
+              "ctus", G_TYPE_UINT64, encoder->static_total_ctus,
+              "static-ctus", G_TYPE_UINT64, encoder->static_ctus,
+              "static-ratio", G_TYPE_DOUBLE, encoder->static_total_ctus ?
+              (gdouble) encoder->static_ctus / encoder->static_total_ctus : 0.0,
+              "analysis-time", G_TYPE_UINT64, encoder->static_time, NULL));
+      break;
+    case PROP_VBV_FULLNESS:
+      g_value_set_double (value, encoder->vbv_bufsize ?
+          encoder->vbv_fullness * 100 / (encoder->vbv_bufsize * 1000.0) : 0);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -2126,9 +5357,18 @@ gst_kvazaar_enc_get_property (GObject * object, guint prop_id,
 static gboolean
 plugin_init (GstPlugin * plugin)
 {
+  gst_kvazaar_trace_init ();
+
   GST_DEBUG_CATEGORY_INIT (kvazaar_enc_debug, "kvazaarenc", 0,
       "HEVC/H.265 encoding element");
 
+  if (!gst_element_register (plugin, "kvazaarladder", GST_RANK_NONE,
+          GST_TYPE_KVAZAAR_LADDER))
+    return FALSE;
+  if (!gst_element_register (plugin, "kvazaarbatch", GST_RANK_NONE,
+          GST_TYPE_KVAZAAR_BATCH))
+    return FALSE;
+
   return gst_element_register (plugin, "kvazaarenc",
       GST_RANK_SECONDARY, GST_TYPE_KVAZAAR_ENC);
 }
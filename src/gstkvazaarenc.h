@@ -29,6 +29,13 @@
 #include <gst/video/gstvideoencoder.h>
 #include <kvazaar.h>
 
+#include "gstkvazaarqpmap.h"
+#include "gstkvazaarlookahead.h"
+#include "gstkvazaaranalysis.h"
+#include "gstkvazaarroifile.h"
+#include "gstkvazaarrecord.h"
+#include "gstkvazaarquality.h"
+
 G_BEGIN_DECLS
 #define GST_TYPE_KVAZAAR_ENC \
   (gst_kvazaar_enc_get_type())
@@ -40,6 +47,26 @@ G_BEGIN_DECLS
   (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_KVAZAAR_ENC))
 #define GST_IS_KVAZAAR_ENC_CLASS(klass) \
   (G_TYPE_CHECK_CLASS_TYPE((klass),GST_TYPE_KVAZAAR_ENC))
+
+/* Efforts of the realtime mode, two per preset */
+#define GST_KVAZAAR_ENC_MAX_EFFORTS 20
+
+/* Output access units of the rolling statistics, and key frames of the key
+ * frame sizes */
+#define GST_KVAZAAR_ENC_STATS_WINDOW 128
+#define GST_KVAZAAR_ENC_STATS_KEYFRAMES 16
+
+/*
+ * An output access unit in the rolling statistics.
+ */
+typedef struct
+{
+  gint64   output_time;      /* monotonic, in us */
+  GstClockTime pts;
+  guint    size;
+  GstClockTime latency;
+} GstKvazaarEncStat;
+
 typedef struct _GstKvazaarEnc GstKvazaarEnc;
 typedef struct _GstKvazaarEncClass GstKvazaarEncClass;
 
@@ -50,6 +77,8 @@ struct _GstKvazaarEnc
   /*< private > */
   kvz_encoder *kvazaarenc;
   kvz_config *kvazaarconfig;
+  /* cache key of the open encoder, NULL when it is not cached */
+  gchar   *kvazaarenc_key;
   GstClockTime dts_offset;
   gboolean push_header;
   const kvz_api *api;
@@ -67,6 +96,7 @@ struct _GstKvazaarEnc
   gboolean no_psnr;          /* Print PSNR in CLI ? */
   gboolean no_info;          /* Add SEI info ? */
   gint     preset;           /* Use preset */
+  gint     tune;             /* Tune for a use case, on top of preset */
 #ifdef HAS_CRYPTO
   gint     crypto;           /* Crypto mode */
   GString  *key;             /* Crypto key as a string */
@@ -93,8 +123,31 @@ struct _GstKvazaarEnc
   gint cu_split_termination; /* CU split search termination condition */
   gint me_early_termination; /* ME early termination condition */
   GString  *gop;             /* String that defines a GOP structure */
-  GString  *roi;             /* Name of the file describing a ROI */
+  GString  *roi;             /* Static delta QP map, see Kvazaar manual */
   GString  *kvz_opts;       /* Options string to pass to Kvazaar config_parse */
+  guint    slice_max_size;   /* Byte budget per slice NAL (0: disabled) */
+  guint    vbv_bufsize;      /* Sender buffer size in kbit (0: disabled) */
+  guint    vbv_maxrate;      /* Sender buffer drain rate in kbit/s */
+  guint    lookahead;        /* Frames analysed ahead for adaptive QP */
+  gdouble  aq_strength;      /* Strength of the adaptive QP */
+  guint    scenecut;         /* Scene change sensitivity (0: disabled) */
+  guint    min_keyint;       /* Min frames between scene change key frames */
+  GString  *roi_meta_weights; /* Delta QP of the ROI metas by type */
+  GString  *roi_file;        /* ROI sequence file with per-frame maps */
+  guint    static_dqp;       /* Delta QP of unchanged CTUs (0: disabled) */
+  gdouble  static_threshold; /* Mean abs difference of an unchanged CTU */
+  gint     duplicate_policy; /* Handling of frames equal to the previous */
+  guint    max_duplicates;   /* Longest run of handled duplicates */
+  gboolean qos_degradation;  /* Degrade the encoding when late */
+  gboolean realtime;         /* Adapt the preset to the encode time */
+  gdouble  realtime_target;  /* Encode time per frame interval to aim at */
+  guint    max_temporal_layer; /* Highest temporal layer output */
+  guint    frame_stats;      /* Outputs of the per-frame statistics */
+  GString  *record_location; /* Recording of the input for kvazaar-replay */
+  guint    quality_interval; /* Measure one output picture in this many */
+  guint    quality_metrics;  /* GstKvazaarQualityMetrics to measure */
+  GstCaps  *expected_caps;   /* Input caps to open the encoder with at READY */
+  guint    cache_timeout;    /* ms opened encoders are kept for reuse */
   /*gint input_fps;*/
   /*GString *input_res;*/
   /*GString *input_format;*/
@@ -118,10 +171,118 @@ struct _GstKvazaarEnc
   gboolean amp_set;               /* true if amp has been set by user */
   gboolean gop_set;               /* true if gop has been set by user */
   gboolean roi_set;               /* true if roi has been set by user */
+  gboolean lookahead_set;         /* true if lookahead has been set by user */
 
   /* input description */
   GstVideoCodecState *input_state;
 
+  /* delta QP map handed to Kvazaar with each picture */
+  GstKvazaarQpMap *qp_map;
+  gboolean picture_qp_warned;
+
+  /* pictures waiting for analysis, and the adaptive QP of the next one */
+  GstKvazaarLookahead *lookahead_queue;
+  GstKvazaarQpMap *aq_map;
+
+  /* regions of interest of the input buffer, rasterized per picture */
+  GArray   *roi_weights;
+  GstKvazaarQpMap *roi_map;
+
+  /* per-frame delta QP maps of roi_file, mapped while streaming */
+  GstKvazaarRoiFile *roi_seq;
+
+  /* recording to record_location, between start and stop */
+  GstKvazaarRecorder *recorder;
+
+  /* reconstructed pictures on the recon request pad, in the layout of
+   * Kvazaar when downstream takes video metas */
+  GstPad   *recon_pad;
+  gboolean recon_stream_started;
+  gboolean recon_need_caps;
+  gboolean recon_need_segment;
+  gboolean recon_video_meta;
+  GstVideoInfo recon_info;
+
+  /* encoder opened at READY from expected_caps, until the caps come */
+  kvz_encoder *preopen_enc;
+  kvz_config *preopen_config;
+  gchar   *preopen_key;
+
+  /* encoder of the current settings opened in the background for the next
+   * flush, returned by spare_thread */
+  GThread  *spare_thread;
+  kvz_config *spare_config;
+  gchar   *spare_key;
+
+  /* quality worker between start and stop, and output pictures since the
+   * last sample */
+  GstKvazaarQuality *quality;
+  guint    quality_count;
+
+  /* static region detection against the previous input buffer, with
+   * recycled per-frame maps and statistics */
+  GstBuffer *static_prev;
+  GQueue   static_pool;
+  guint64  static_frames;
+  guint64  static_damage_frames;
+  guint64  static_ctus;
+  guint64  static_total_ctus;
+  GstClockTime static_time;
+
+  /* duplicate frame detection */
+  GstBuffer *dup_prev;
+  guint    dup_run;
+  guint32  dup_last_number;  /* last frame given to the encoder */
+  guint64  dup_frames;
+
+  /* QoS degradation: lateness reported downstream, own encode time and the
+   * current step */
+  GstClockTimeDiff qos_jitter;
+  GstClockTime qos_earliest;  /* running time downstream is already at */
+  gdouble  qos_encode_time;  /* moving average of encode calls, in ns */
+  gint     qos_level;
+  gint     qos_config_level; /* part of qos_level the encoder was opened with */
+  guint    qos_late_count;
+  guint    qos_on_time_count;
+  guint    qos_decimation_count;
+  guint64  qos_dropped;
+
+  /* realtime mode: effort the encoder runs at, and learnt cost of each
+   * effort step */
+  gint     rt_effort;
+  gint     rt_config_effort;
+  guint    rt_frames;        /* pictures encoded at rt_effort */
+  gint     rt_prev_effort;   /* before the last change, -1 once measured */
+  gdouble  rt_prev_load;
+  gdouble  rt_cost[GST_KVAZAAR_ENC_MAX_EFFORTS];
+
+  /* scene change detection on the previous input picture */
+  GstKvazaarThumbnail *scene_thumb[2];
+  guint32  scene_hist[GST_KVAZAAR_HIST_BINS];
+  gboolean scene_valid;
+  guint    scene_distance;   /* input frames since the last key frame */
+
+  /* pictures given to the current Kvazaar instance, in input order: its
+   * IRAPs are at multiples of the intra period, whatever the delay of the
+   * output */
+  guint    frames_since_keyframe;
+
+  /* sender buffer model of the rate guard */
+  gdouble  vbv_fullness;     /* in bits */
+  gint     vbv_dqp;          /* QP offset applied to the next pictures */
+
+  /* last output access units, and sizes of the last key frames */
+  GstKvazaarEncStat stats[GST_KVAZAAR_ENC_STATS_WINDOW];
+  guint64  stats_frames;
+  guint    stats_keyframe_sizes[GST_KVAZAAR_ENC_STATS_KEYFRAMES];
+  guint64  stats_keyframes;
+
+  /* highest temporal ID output so far */
+  guint    max_temporal_id;
+
+  /* push each NAL unit as soon as the AU is available (alignment=nal) */
+  gboolean nal_aligned;
+
   /* configuration changed  while playing */
   gboolean reconfig;
 
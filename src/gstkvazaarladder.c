@@ -0,0 +1,962 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * kvazaarladder encodes one raw video input into several renditions of an
+ * adaptive bitrate ladder, one per request source pad.
+ *
+ * The input is halved once per level with the shared scaling kernels, each
+ * rendition is then resampled from the smallest level that is still larger.
+ * All renditions get the same GOP and are restarted together, so their IRAP
+ * pictures stay aligned.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gstkvazaarladder.h"
+#include "gstkvazaaranalysis.h"
+#include "gstkvazaarcommon.h"
+
+#include <string.h>
+
+GST_DEBUG_CATEGORY_STATIC (kvazaar_ladder_debug);
+#define GST_CAT_DEFAULT kvazaar_ladder_debug
+
+enum
+{
+  PROP_0,
+  PROP_THREADS,
+  PROP_INTRA_PERIOD,
+  PROP_OPTION_STRING
+};
+
+enum
+{
+  PROP_PAD_0,
+  PROP_PAD_WIDTH,
+  PROP_PAD_HEIGHT,
+  PROP_PAD_BITRATE
+};
+
+#define PROP_THREADS_DEFAULT        0
+#define PROP_INTRA_PERIOD_DEFAULT   64
+#define PROP_PAD_BITRATE_DEFAULT    0
+
+/* Smallest rendition */
+#define MIN_SIZE                    16
+
+static GstStaticPadTemplate sink_factory = GST_STATIC_PAD_TEMPLATE ("sink",
+    GST_PAD_SINK,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS ("video/x-raw, "
+        "format = (string) I420, "
+        "framerate = (fraction) [0, MAX], "
+        "width = (int) [ 16, MAX ], " "height = (int) [ 16, MAX ]")
+    );
+
+static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src_%u",
+    GST_PAD_SRC,
+    GST_PAD_REQUEST,
+    GST_STATIC_CAPS ("video/x-h265, "
+        "framerate = (fraction) [0/1, MAX], "
+        "width = (int) [ 16, MAX ], " "height = (int) [ 16, MAX ], "
+        "stream-format = (string) byte-stream, "
+        "alignment = (string) au, " "profile = (string) main")
+    );
+
+#define gst_kvazaar_ladder_parent_class parent_class
+G_DEFINE_TYPE_WITH_CODE (GstKvazaarLadder, gst_kvazaar_ladder,
+    GST_TYPE_ELEMENT, G_IMPLEMENT_INTERFACE (GST_TYPE_CHILD_PROXY,
+        gst_kvazaar_child_proxy_src_pads_init));
+
+G_DEFINE_TYPE (GstKvazaarLadderPad, gst_kvazaar_ladder_pad, GST_TYPE_PAD);
+
+static void
+gst_kvazaar_ladder_pad_finalize (GObject * object)
+{
+  GstKvazaarLadderPad *pad = GST_KVAZAAR_LADDER_PAD (object);
+
+  gst_kvazaar_close (pad->api, &pad->enc, &pad->config);
+
+  G_OBJECT_CLASS (gst_kvazaar_ladder_pad_parent_class)->finalize (object);
+}
+
+static void
+gst_kvazaar_ladder_pad_set_property (GObject * object, guint prop_id,
+    const GValue * value, GParamSpec * pspec)
+{
+  GstKvazaarLadderPad *pad = GST_KVAZAAR_LADDER_PAD (object);
+
+  GST_OBJECT_LOCK (pad);
+  switch (prop_id) {
+    case PROP_PAD_WIDTH:
+      pad->width = g_value_get_uint (value);
+      break;
+    case PROP_PAD_HEIGHT:
+      pad->height = g_value_get_uint (value);
+      break;
+    case PROP_PAD_BITRATE:
+      pad->bitrate = g_value_get_uint (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+  /* Taken into account at the next restart of all renditions */
+  pad->reconfig = TRUE;
+  GST_OBJECT_UNLOCK (pad);
+}
+
+static void
+gst_kvazaar_ladder_pad_get_property (GObject * object, guint prop_id,
+    GValue * value, GParamSpec * pspec)
+{
+  GstKvazaarLadderPad *pad = GST_KVAZAAR_LADDER_PAD (object);
+
+  GST_OBJECT_LOCK (pad);
+  switch (prop_id) {
+    case PROP_PAD_WIDTH:
+      g_value_set_uint (value, pad->width);
+      break;
+    case PROP_PAD_HEIGHT:
+      g_value_set_uint (value, pad->height);
+      break;
+    case PROP_PAD_BITRATE:
+      g_value_set_uint (value, pad->bitrate);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+  GST_OBJECT_UNLOCK (pad);
+}
+
+static void
+gst_kvazaar_ladder_pad_class_init (GstKvazaarLadderPadClass * klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->set_property = gst_kvazaar_ladder_pad_set_property;
+  gobject_class->get_property = gst_kvazaar_ladder_pad_get_property;
+  gobject_class->finalize = gst_kvazaar_ladder_pad_finalize;
+
+  g_object_class_install_property (gobject_class, PROP_PAD_WIDTH,
+      g_param_spec_uint ("width", "Width",
+          "Width of the rendition (0 = from height and the input aspect "
+          "ratio, or the input width)", 0, G_MAXINT, 0,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+          GST_PARAM_MUTABLE_PLAYING));
+
+  g_object_class_install_property (gobject_class, PROP_PAD_HEIGHT,
+      g_param_spec_uint ("height", "Height",
+          "Height of the rendition (0 = from width and the input aspect "
+          "ratio, or the input height)", 0, G_MAXINT, 0,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+          GST_PARAM_MUTABLE_PLAYING));
+
+  g_object_class_install_property (gobject_class, PROP_PAD_BITRATE,
+      g_param_spec_uint ("bitrate", "Bitrate",
+          "Bitrate of the rendition in kbit/sec (0 = constant QP)", 0,
+          G_MAXINT / 1000, PROP_PAD_BITRATE_DEFAULT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+          GST_PARAM_MUTABLE_PLAYING));
+}
+
+static void
+gst_kvazaar_ladder_pad_init (GstKvazaarLadderPad * pad)
+{
+  pad->bitrate = PROP_PAD_BITRATE_DEFAULT;
+}
+
+/*
+ * Free the halved input levels.
+ */
+static void
+gst_kvazaar_ladder_free_levels (GstKvazaarLadder * ladder)
+{
+  gint i;
+
+  for (i = 0; i < GST_KVAZAAR_LADDER_MAX_LEVELS; i++) {
+    GstKvazaarLadderLevel *level = &ladder->levels[i];
+
+    g_free (level->planes[0]);
+    memset (level, 0, sizeof (*level));
+  }
+}
+
+/*
+ * Allocate the halved input levels, as long as they are not smaller than
+ * the smallest rendition. Sizes stay even so that the chroma planes halve
+ * exactly too.
+ */
+static void
+gst_kvazaar_ladder_alloc_levels (GstKvazaarLadder * ladder)
+{
+  gint width = GST_VIDEO_INFO_WIDTH (&ladder->info);
+  gint height = GST_VIDEO_INFO_HEIGHT (&ladder->info);
+  gint i;
+
+  gst_kvazaar_ladder_free_levels (ladder);
+
+  for (i = 0; i < GST_KVAZAAR_LADDER_MAX_LEVELS; i++) {
+    GstKvazaarLadderLevel *level = &ladder->levels[i];
+    gsize luma_size;
+
+    width = GST_ROUND_DOWN_2 (width / 2);
+    height = GST_ROUND_DOWN_2 (height / 2);
+    if (width < MIN_SIZE || height < MIN_SIZE)
+      break;
+
+    level->width = width;
+    level->height = height;
+    level->stride[0] = width;
+    level->stride[1] = level->stride[2] = width / 2;
+    luma_size = (gsize) width * height;
+    level->planes[0] = g_malloc (luma_size * 3 / 2);
+    level->planes[1] = level->planes[0] + luma_size;
+    level->planes[2] = level->planes[1] + luma_size / 4;
+  }
+}
+
+/*
+ * Size of a rendition, never larger than the input.
+ */
+static void
+gst_kvazaar_ladder_pad_get_size (GstKvazaarLadder * ladder,
+    GstKvazaarLadderPad * pad, gint * out_width, gint * out_height)
+{
+  gint in_width = GST_VIDEO_INFO_WIDTH (&ladder->info);
+  gint in_height = GST_VIDEO_INFO_HEIGHT (&ladder->info);
+  gint width, height;
+
+  GST_OBJECT_LOCK (pad);
+  width = pad->width;
+  height = pad->height;
+  GST_OBJECT_UNLOCK (pad);
+
+  if (!width && !height) {
+    width = in_width;
+    height = in_height;
+  } else if (!width) {
+    width = gst_util_uint64_scale_int (height, in_width, in_height);
+  } else if (!height) {
+    height = gst_util_uint64_scale_int (width, in_height, in_width);
+  }
+
+  *out_width = CLAMP (GST_ROUND_DOWN_2 (width), MIN_SIZE,
+      GST_ROUND_DOWN_2 (in_width));
+  *out_height = CLAMP (GST_ROUND_DOWN_2 (height), MIN_SIZE,
+      GST_ROUND_DOWN_2 (in_height));
+}
+
+/*
+ * Open the Kvazaar instance of a rendition with its share of the thread
+ * budget, and announce its stream on the pad.
+ */
+static gboolean
+gst_kvazaar_ladder_pad_open (GstKvazaarLadder * ladder,
+    GstKvazaarLadderPad * pad, guint threads)
+{
+  GstVideoInfo *info = &ladder->info;
+  kvz_config *config;
+  GstCaps *caps;
+  GstClockTime latency;
+  gboolean latency_changed;
+  gint width, height, par_n, par_d;
+  guint bitrate;
+  gchar *bad_option = NULL;
+
+  gst_kvazaar_close (pad->api, &pad->enc, &pad->config);
+  gst_kvazaar_ladder_pad_get_size (ladder, pad, &width, &height);
+
+  GST_OBJECT_LOCK (pad);
+  bitrate = pad->bitrate;
+  pad->reconfig = FALSE;
+  GST_OBJECT_UNLOCK (pad);
+
+  config = gst_kvazaar_config_new (ladder->api, GST_ELEMENT (ladder), width,
+      height, info->fps_n, info->fps_d);
+  if (!config)
+    return FALSE;
+
+  config->target_bitrate = bitrate * 1000;
+  config->threads = threads;
+
+  /* The same GOP for every rendition keeps their IRAPs aligned */
+  GST_OBJECT_LOCK (ladder);
+  config->intra_period = ladder->intra_period;
+  if (ladder->kvz_opts->len && !gst_kvazaar_parse_options (ladder->api,
+          config, ladder->kvz_opts->str, &bad_option)) {
+    GST_WARNING_OBJECT (ladder, "Error parsing option '%s'", bad_option);
+    g_free (bad_option);
+  }
+  GST_OBJECT_UNLOCK (ladder);
+
+  pad->enc = ladder->api->encoder_open (config);
+  if (!pad->enc) {
+    GST_ELEMENT_ERROR (ladder, STREAM, ENCODE,
+        ("Can not initialize Kvazaar encoder."),
+        ("rendition %s, %dx%d", GST_PAD_NAME (pad), width, height));
+    ladder->api->config_destroy (config);
+    return FALSE;
+  }
+  pad->config = config;
+  pad->out_width = width;
+  pad->out_height = height;
+
+  /* Kvazaar holds that many pictures before returning an access unit */
+  if (info->fps_n)
+    latency = gst_util_uint64_scale_ceil (GST_SECOND * info->fps_d,
+        gst_kvazaar_config_get_delay (config), info->fps_n);
+  else
+    latency = gst_util_uint64_scale_ceil (GST_SECOND,
+        gst_kvazaar_config_get_delay (config), 25);
+  GST_OBJECT_LOCK (pad);
+  latency_changed = pad->latency != latency;
+  pad->latency = latency;
+  GST_OBJECT_UNLOCK (pad);
+  if (latency_changed)
+    gst_element_post_message (GST_ELEMENT (ladder),
+        gst_message_new_latency (GST_OBJECT (ladder)));
+
+  GST_INFO_OBJECT (pad, "%dx%d at %u kbit/s with %u threads", width, height,
+      bitrate, threads);
+
+  if (!pad->stream_started) {
+    gchar *stream_id = gst_pad_create_stream_id (GST_PAD (pad),
+        GST_ELEMENT (ladder), GST_PAD_NAME (pad));
+
+    gst_pad_push_event (GST_PAD (pad), gst_event_new_stream_start (stream_id));
+    g_free (stream_id);
+    pad->stream_started = TRUE;
+  }
+
+  /* Keep the display aspect ratio of the input */
+  if (!gst_util_fraction_multiply (MAX (info->par_n, 1), MAX (info->par_d, 1),
+          info->width * height, info->height * width, &par_n, &par_d))
+    par_n = par_d = 1;
+
+  caps = gst_kvazaar_output_caps (width, height, info->fps_n, info->fps_d,
+      par_n, par_d);
+  gst_pad_push_event (GST_PAD (pad), gst_event_new_caps (caps));
+  gst_caps_unref (caps);
+
+  pad->need_segment = TRUE;
+
+  return TRUE;
+}
+
+/*
+ * Give a picture to the encoder of a rendition (NULL to drain it) and push
+ * the access unit it outputs, if any. Tell in len if there was one.
+ */
+static GstFlowReturn
+gst_kvazaar_ladder_pad_encode (GstKvazaarLadder * ladder,
+    GstKvazaarLadderPad * pad, kvz_picture * pic, guint32 * len)
+{
+  GstVideoInfo *info = &ladder->info;
+  kvz_data_chunk *chunks = NULL;
+  kvz_picture *img_rec = NULL, *img_src = NULL;
+  kvz_frame_info info_out;
+  GstBuffer *buf;
+  GstFlowReturn ret;
+
+  *len = 0;
+  if (!ladder->api->encoder_encode (pad->enc, pic, &chunks, len, &img_rec,
+          &img_src, &info_out)) {
+    GST_ELEMENT_ERROR (ladder, STREAM, ENCODE,
+        ("Encode Kvazaar frame failed."), ("rendition %s",
+            GST_PAD_NAME (pad)));
+    return GST_FLOW_ERROR;
+  }
+
+  if (!*len) {
+    ladder->api->chunk_free (chunks);
+    return GST_FLOW_OK;
+  }
+
+  buf = gst_kvazaar_output_buffer (ladder->api, chunks, *len, img_rec,
+      img_src, &info_out, info->fps_n, info->fps_d);
+  if (!buf)
+    return GST_FLOW_ERROR;
+
+  if (pad->need_segment) {
+    gst_pad_push_event (GST_PAD (pad), gst_event_new_segment (&ladder->segment));
+    pad->need_segment = FALSE;
+  }
+
+  ret = gst_pad_push (GST_PAD (pad), buf);
+
+  return gst_flow_combiner_update_pad_flow (ladder->flow_combiner,
+      GST_PAD (pad), ret);
+}
+
+/*
+ * References to the current rendition pads.
+ */
+static GList *
+gst_kvazaar_ladder_get_pads (GstKvazaarLadder * ladder)
+{
+  GList *pads;
+
+  GST_OBJECT_LOCK (ladder);
+  pads = g_list_copy_deep (GST_ELEMENT (ladder)->srcpads,
+      (GCopyFunc) gst_object_ref, NULL);
+  GST_OBJECT_UNLOCK (ladder);
+
+  return pads;
+}
+
+/*
+ * Drain every rendition, pushing the pending access units when send is set,
+ * and close the encoders.
+ */
+static GstFlowReturn
+gst_kvazaar_ladder_drain (GstKvazaarLadder * ladder, gboolean send)
+{
+  GList *pads = gst_kvazaar_ladder_get_pads (ladder);
+  GList *l;
+  GstFlowReturn ret = GST_FLOW_OK;
+
+  for (l = pads; l; l = l->next) {
+    GstKvazaarLadderPad *pad = l->data;
+    GstFlowReturn pad_ret = GST_FLOW_OK;
+    guint32 len;
+
+    if (!pad->enc)
+      continue;
+
+    if (send) {
+      do {
+        pad_ret = gst_kvazaar_ladder_pad_encode (ladder, pad, NULL, &len);
+      } while (pad_ret == GST_FLOW_OK && len > 0);
+    }
+    gst_kvazaar_close (pad->api, &pad->enc, &pad->config);
+    if (pad_ret != GST_FLOW_OK)
+      ret = pad_ret;
+  }
+  g_list_free_full (pads, gst_object_unref);
+
+  return ret;
+}
+
+/*
+ * (Re)open every rendition with its share of the thread budget, by number
+ * of pixels.
+ */
+static gboolean
+gst_kvazaar_ladder_open (GstKvazaarLadder * ladder, GList * pads)
+{
+  GList *l;
+  guint64 total = 0;
+  guint budget;
+
+  GST_OBJECT_LOCK (ladder);
+  budget = ladder->threads ? ladder->threads : g_get_num_processors ();
+  GST_OBJECT_UNLOCK (ladder);
+
+  for (l = pads; l; l = l->next) {
+    gint width, height;
+
+    gst_kvazaar_ladder_pad_get_size (ladder, l->data, &width, &height);
+    total += (guint64) width * height;
+  }
+
+  for (l = pads; l; l = l->next) {
+    gint width, height;
+    guint threads;
+
+    gst_kvazaar_ladder_pad_get_size (ladder, l->data, &width, &height);
+    threads = MAX (gst_util_uint64_scale_round (budget,
+            (guint64) width * height, MAX (total, 1)), 1);
+    if (!gst_kvazaar_ladder_pad_open (ladder, l->data, threads))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/*
+ * Resample the input into the picture of a rendition, from the smallest
+ * halved level that is at least as large. Levels are computed on first use
+ * for each input picture.
+ */
+static void
+gst_kvazaar_ladder_scale (GstKvazaarLadder * ladder, GstVideoFrame * vframe,
+    kvz_picture * pic)
+{
+  const guint8 *planes[3];
+  gint strides[3], widths[3], heights[3];
+  kvz_pixel *dst[3] = { pic->y, pic->u, pic->v };
+  gint i, c;
+
+  for (c = 0; c < 3; c++) {
+    planes[c] = GST_VIDEO_FRAME_COMP_DATA (vframe, c);
+    strides[c] = GST_VIDEO_FRAME_COMP_STRIDE (vframe, c);
+    widths[c] = GST_VIDEO_FRAME_COMP_WIDTH (vframe, c);
+    heights[c] = GST_VIDEO_FRAME_COMP_HEIGHT (vframe, c);
+  }
+
+  for (i = 0; i < GST_KVAZAAR_LADDER_MAX_LEVELS; i++) {
+    GstKvazaarLadderLevel *level = &ladder->levels[i];
+
+    if (!level->width || level->width < pic->width ||
+        level->height < pic->height)
+      break;
+
+    for (c = 0; c < 3; c++) {
+      gint width = c ? level->width / 2 : level->width;
+      gint height = c ? level->height / 2 : level->height;
+
+      if (!level->valid)
+        gst_kvazaar_downscale_2x2_u8 (level->planes[c], level->stride[c],
+            planes[c], strides[c], width, height);
+      planes[c] = level->planes[c];
+      strides[c] = level->stride[c];
+      widths[c] = width;
+      heights[c] = height;
+    }
+    level->valid = TRUE;
+  }
+
+  for (c = 0; c < 3; c++) {
+    gint stride = c ? pic->stride / 2 : pic->stride;
+    gint width = c ? pic->width / 2 : pic->width;
+    gint height = c ? pic->height / 2 : pic->height;
+    gint y;
+
+    if (width == widths[c] && height == heights[c]) {
+      for (y = 0; y < height; y++)
+        memcpy (dst[c] + y * stride, planes[c] + y * strides[c], width);
+    } else {
+      gst_kvazaar_scale_bilinear_u8 (dst[c], stride, width, height, planes[c],
+          strides[c], widths[c], heights[c]);
+    }
+  }
+}
+
+static GstFlowReturn
+gst_kvazaar_ladder_chain (GstPad * sinkpad, GstObject * parent,
+    GstBuffer * buffer)
+{
+  GstKvazaarLadder *ladder = GST_KVAZAAR_LADDER (parent);
+  GstVideoFrame vframe;
+  GList *pads, *l;
+  GstFlowReturn ret = GST_FLOW_NOT_LINKED;
+  gboolean restart;
+  gint i;
+
+  if (!ladder->have_info) {
+    gst_buffer_unref (buffer);
+    return GST_FLOW_NOT_NEGOTIATED;
+  }
+
+  pads = gst_kvazaar_ladder_get_pads (ladder);
+  if (!pads) {
+    gst_buffer_unref (buffer);
+    return GST_FLOW_NOT_LINKED;
+  }
+
+  /* A key frame request, a new rendition or changed settings restart all
+   * renditions on this picture, so that they all start with an IRAP */
+  GST_OBJECT_LOCK (ladder);
+  restart = ladder->force_keyframe;
+  ladder->force_keyframe = FALSE;
+  GST_OBJECT_UNLOCK (ladder);
+  for (l = pads; l && !restart; l = l->next) {
+    GstKvazaarLadderPad *pad = l->data;
+
+    GST_OBJECT_LOCK (pad);
+    restart = !pad->enc || pad->reconfig;
+    GST_OBJECT_UNLOCK (pad);
+  }
+  if (restart) {
+    GST_DEBUG_OBJECT (ladder, "restarting all renditions at %"
+        GST_TIME_FORMAT, GST_TIME_ARGS (GST_BUFFER_PTS (buffer)));
+    ret = gst_kvazaar_ladder_drain (ladder, TRUE);
+    if (ret != GST_FLOW_OK && ret != GST_FLOW_NOT_LINKED)
+      goto done;
+    if (!gst_kvazaar_ladder_open (ladder, pads)) {
+      ret = GST_FLOW_NOT_NEGOTIATED;
+      goto done;
+    }
+  }
+
+  if (!gst_video_frame_map (&vframe, &ladder->info, buffer, GST_MAP_READ)) {
+    GST_ELEMENT_ERROR (ladder, STREAM, FORMAT, ("Failed to map frame."),
+        (NULL));
+    ret = GST_FLOW_ERROR;
+    goto done;
+  }
+
+  for (i = 0; i < GST_KVAZAAR_LADDER_MAX_LEVELS; i++)
+    ladder->levels[i].valid = FALSE;
+
+  ret = GST_FLOW_OK;
+  for (l = pads; l && ret == GST_FLOW_OK; l = l->next) {
+    GstKvazaarLadderPad *pad = l->data;
+    kvz_picture *pic;
+    guint32 len;
+
+    pic = ladder->api->picture_alloc (pad->out_width, pad->out_height);
+    if (!pic) {
+      ret = GST_FLOW_ERROR;
+      break;
+    }
+    gst_kvazaar_ladder_scale (ladder, &vframe, pic);
+    pic->pts = GST_BUFFER_PTS (buffer);
+    pic->dts = GST_BUFFER_DTS (buffer);
+
+    ret = gst_kvazaar_ladder_pad_encode (ladder, pad, pic, &len);
+    ladder->api->picture_free (pic);
+  }
+
+  gst_video_frame_unmap (&vframe);
+
+done:
+  g_list_free_full (pads, gst_object_unref);
+  gst_buffer_unref (buffer);
+
+  return ret;
+}
+
+static gboolean
+gst_kvazaar_ladder_set_caps (GstKvazaarLadder * ladder, GstCaps * caps)
+{
+  GstVideoInfo info;
+
+  if (!gst_video_info_from_caps (&info, caps))
+    return FALSE;
+
+  /* The renditions restart with the new input */
+  gst_kvazaar_ladder_drain (ladder, TRUE);
+
+  ladder->info = info;
+  ladder->have_info = TRUE;
+  gst_kvazaar_ladder_alloc_levels (ladder);
+
+  return TRUE;
+}
+
+static gboolean
+gst_kvazaar_ladder_sink_event (GstPad * pad, GstObject * parent,
+    GstEvent * event)
+{
+  GstKvazaarLadder *ladder = GST_KVAZAAR_LADDER (parent);
+  GList *pads, *l;
+  GstCaps *caps;
+  gboolean res;
+
+  switch (GST_EVENT_TYPE (event)) {
+    case GST_EVENT_STREAM_START:
+      /* Each rendition starts its own stream */
+      gst_event_unref (event);
+      return TRUE;
+    case GST_EVENT_CAPS:
+      gst_event_parse_caps (event, &caps);
+      res = gst_kvazaar_ladder_set_caps (ladder, caps);
+      gst_event_unref (event);
+      return res;
+    case GST_EVENT_SEGMENT:
+      /* Sent on each rendition before its next buffer, after its caps */
+      gst_event_copy_segment (event, &ladder->segment);
+      pads = gst_kvazaar_ladder_get_pads (ladder);
+      for (l = pads; l; l = l->next)
+        GST_KVAZAAR_LADDER_PAD (l->data)->need_segment = TRUE;
+      g_list_free_full (pads, gst_object_unref);
+      gst_event_unref (event);
+      return TRUE;
+    case GST_EVENT_CUSTOM_DOWNSTREAM:
+      if (gst_video_event_is_force_key_unit (event)) {
+        GST_OBJECT_LOCK (ladder);
+        ladder->force_keyframe = TRUE;
+        GST_OBJECT_UNLOCK (ladder);
+        gst_event_unref (event);
+        return TRUE;
+      }
+      break;
+    case GST_EVENT_EOS:
+      gst_kvazaar_ladder_drain (ladder, TRUE);
+      break;
+    case GST_EVENT_FLUSH_STOP:
+      gst_kvazaar_ladder_drain (ladder, FALSE);
+      gst_flow_combiner_reset (ladder->flow_combiner);
+      break;
+    default:
+      break;
+  }
+
+  return gst_pad_event_default (pad, parent, event);
+}
+
+static gboolean
+gst_kvazaar_ladder_src_event (GstPad * pad, GstObject * parent,
+    GstEvent * event)
+{
+  GstKvazaarLadder *ladder = GST_KVAZAAR_LADDER (parent);
+
+  /* A key frame asked on one rendition is made on all of them */
+  if (gst_video_event_is_force_key_unit (event)) {
+    GST_OBJECT_LOCK (ladder);
+    ladder->force_keyframe = TRUE;
+    GST_OBJECT_UNLOCK (ladder);
+    gst_event_unref (event);
+    return TRUE;
+  }
+
+  return gst_pad_event_default (pad, parent, event);
+}
+
+static gboolean
+gst_kvazaar_ladder_src_query (GstPad * pad, GstObject * parent,
+    GstQuery * query)
+{
+  GstKvazaarLadder *ladder = GST_KVAZAAR_LADDER (parent);
+
+  /* Upstream latency and the pictures held by the encoder of the
+   * rendition */
+  if (GST_QUERY_TYPE (query) == GST_QUERY_LATENCY) {
+    GstClockTime min, max, latency;
+    gboolean live;
+
+    if (!gst_pad_peer_query (ladder->sinkpad, query))
+      return FALSE;
+
+    gst_query_parse_latency (query, &live, &min, &max);
+    GST_OBJECT_LOCK (pad);
+    latency = GST_KVAZAAR_LADDER_PAD (pad)->latency;
+    GST_OBJECT_UNLOCK (pad);
+    min += latency;
+    if (GST_CLOCK_TIME_IS_VALID (max))
+      max += latency;
+    gst_query_set_latency (query, live, min, max);
+
+    return TRUE;
+  }
+
+  return gst_pad_query_default (pad, parent, query);
+}
+
+static GstPad *
+gst_kvazaar_ladder_request_new_pad (GstElement * element,
+    GstPadTemplate * templ, const gchar * req_name, const GstCaps * caps)
+{
+  GstKvazaarLadder *ladder = GST_KVAZAAR_LADDER (element);
+  GstKvazaarLadderPad *pad;
+  gchar *name;
+
+  GST_OBJECT_LOCK (ladder);
+  name = req_name ? g_strdup (req_name) :
+      g_strdup_printf ("src_%u", ladder->pad_count);
+  ladder->pad_count++;
+  GST_OBJECT_UNLOCK (ladder);
+
+  pad = g_object_new (GST_TYPE_KVAZAAR_LADDER_PAD, "name", name,
+      "direction", GST_PAD_SRC, "template", templ, NULL);
+  g_free (name);
+
+  pad->api = ladder->api;
+  gst_pad_set_event_function (GST_PAD (pad),
+      GST_DEBUG_FUNCPTR (gst_kvazaar_ladder_src_event));
+  gst_pad_set_query_function (GST_PAD (pad),
+      GST_DEBUG_FUNCPTR (gst_kvazaar_ladder_src_query));
+  gst_pad_use_fixed_caps (GST_PAD (pad));
+
+  gst_flow_combiner_add_pad (ladder->flow_combiner, GST_PAD (pad));
+  if (!gst_element_add_pad (element, GST_PAD (pad))) {
+    gst_flow_combiner_remove_pad (ladder->flow_combiner, GST_PAD (pad));
+    return NULL;
+  }
+  gst_child_proxy_child_added (GST_CHILD_PROXY (element), G_OBJECT (pad),
+      GST_OBJECT_NAME (pad));
+
+  return GST_PAD (pad);
+}
+
+static void
+gst_kvazaar_ladder_release_pad (GstElement * element, GstPad * pad)
+{
+  GstKvazaarLadder *ladder = GST_KVAZAAR_LADDER (element);
+
+  gst_child_proxy_child_removed (GST_CHILD_PROXY (element), G_OBJECT (pad),
+      GST_OBJECT_NAME (pad));
+  gst_flow_combiner_remove_pad (ladder->flow_combiner, pad);
+  gst_element_remove_pad (element, pad);
+}
+
+static GstStateChangeReturn
+gst_kvazaar_ladder_change_state (GstElement * element,
+    GstStateChange transition)
+{
+  GstKvazaarLadder *ladder = GST_KVAZAAR_LADDER (element);
+  GstStateChangeReturn ret;
+
+  switch (transition) {
+    case GST_STATE_CHANGE_READY_TO_PAUSED:
+      gst_segment_init (&ladder->segment, GST_FORMAT_TIME);
+      gst_flow_combiner_reset (ladder->flow_combiner);
+      ladder->force_keyframe = FALSE;
+      break;
+    default:
+      break;
+  }
+
+  ret = GST_ELEMENT_CLASS (parent_class)->change_state (element, transition);
+
+  switch (transition) {
+    case GST_STATE_CHANGE_PAUSED_TO_READY:
+      gst_kvazaar_ladder_drain (ladder, FALSE);
+      gst_kvazaar_ladder_free_levels (ladder);
+      ladder->have_info = FALSE;
+      break;
+    default:
+      break;
+  }
+
+  return ret;
+}
+
+static void
+gst_kvazaar_ladder_set_property (GObject * object, guint prop_id,
+    const GValue * value, GParamSpec * pspec)
+{
+  GstKvazaarLadder *ladder = GST_KVAZAAR_LADDER (object);
+
+  GST_OBJECT_LOCK (ladder);
+  switch (prop_id) {
+    case PROP_THREADS:
+      ladder->threads = g_value_get_uint (value);
+      break;
+    case PROP_INTRA_PERIOD:
+      ladder->intra_period = g_value_get_int (value);
+      break;
+    case PROP_OPTION_STRING:
+      g_string_assign (ladder->kvz_opts,
+          g_value_get_string (value) ? g_value_get_string (value) : "");
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+  GST_OBJECT_UNLOCK (ladder);
+}
+
+static void
+gst_kvazaar_ladder_get_property (GObject * object, guint prop_id,
+    GValue * value, GParamSpec * pspec)
+{
+  GstKvazaarLadder *ladder = GST_KVAZAAR_LADDER (object);
+
+  GST_OBJECT_LOCK (ladder);
+  switch (prop_id) {
+    case PROP_THREADS:
+      g_value_set_uint (value, ladder->threads);
+      break;
+    case PROP_INTRA_PERIOD:
+      g_value_set_int (value, ladder->intra_period);
+      break;
+    case PROP_OPTION_STRING:
+      g_value_set_string (value, ladder->kvz_opts->str);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+  GST_OBJECT_UNLOCK (ladder);
+}
+
+static void
+gst_kvazaar_ladder_finalize (GObject * object)
+{
+  GstKvazaarLadder *ladder = GST_KVAZAAR_LADDER (object);
+
+  gst_kvazaar_ladder_free_levels (ladder);
+  gst_flow_combiner_free (ladder->flow_combiner);
+  g_string_free (ladder->kvz_opts, TRUE);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
+static void
+gst_kvazaar_ladder_class_init (GstKvazaarLadderClass * klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+
+  GST_DEBUG_CATEGORY_INIT (kvazaar_ladder_debug, "kvazaarladder", 0,
+      "HEVC/H.265 bitrate ladder encoding element");
+
+  gobject_class->set_property = gst_kvazaar_ladder_set_property;
+  gobject_class->get_property = gst_kvazaar_ladder_get_property;
+  gobject_class->finalize = gst_kvazaar_ladder_finalize;
+
+  element_class->request_new_pad =
+      GST_DEBUG_FUNCPTR (gst_kvazaar_ladder_request_new_pad);
+  element_class->release_pad = GST_DEBUG_FUNCPTR (gst_kvazaar_ladder_release_pad);
+  element_class->change_state =
+      GST_DEBUG_FUNCPTR (gst_kvazaar_ladder_change_state);
+
+  g_object_class_install_property (gobject_class, PROP_THREADS,
+      g_param_spec_uint ("threads", "Threads",
+          "Worker threads shared by all renditions in proportion to their "
+          "size (0 = number of processors)", 0, G_MAXINT,
+          PROP_THREADS_DEFAULT, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_INTRA_PERIOD,
+      g_param_spec_int ("intra-period", "Intra period",
+          "Period of intra pictures of every rendition (0 = only first "
+          "picture is intra)", 0, 64, PROP_INTRA_PERIOD_DEFAULT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_OPTION_STRING,
+      g_param_spec_string ("option-string", "Option string",
+          "Kvazaar options of every rendition, as name=value separated by "
+          "coma (for instance preset=veryfast,gop=8)",
+          NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  gst_element_class_add_static_pad_template (element_class, &sink_factory);
+  gst_element_class_add_static_pad_template (element_class, &src_factory);
+
+  gst_element_class_set_static_metadata (element_class,
+      "Kvazaar HEVC/H.265 bitrate ladder encoder", "Codec/Encoder/Video",
+      "Encodes renditions of several sizes and bitrates with aligned IRAPs",
+      "Alexandre Esse <alexandre.esse.dev@gmail.com>");
+}
+
+static void
+gst_kvazaar_ladder_init (GstKvazaarLadder * ladder)
+{
+  ladder->api = kvz_api_get (KVZ_BIT_DEPTH);
+  if (!ladder->api)
+    ladder->api = kvz_api_get (0);
+
+  ladder->sinkpad = gst_pad_new_from_static_template (&sink_factory, "sink");
+  gst_pad_set_chain_function (ladder->sinkpad,
+      GST_DEBUG_FUNCPTR (gst_kvazaar_ladder_chain));
+  gst_pad_set_event_function (ladder->sinkpad,
+      GST_DEBUG_FUNCPTR (gst_kvazaar_ladder_sink_event));
+  gst_element_add_pad (GST_ELEMENT (ladder), ladder->sinkpad);
+
+  ladder->threads = PROP_THREADS_DEFAULT;
+  ladder->intra_period = PROP_INTRA_PERIOD_DEFAULT;
+  ladder->kvz_opts = g_string_new (NULL);
+  ladder->flow_combiner = gst_flow_combiner_new ();
+  gst_segment_init (&ladder->segment, GST_FORMAT_TIME);
+}
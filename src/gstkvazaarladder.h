@@ -0,0 +1,125 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GST_KVAZAAR_LADDER_H__
+#define __GST_KVAZAAR_LADDER_H__
+
+#include <gst/gst.h>
+#include <gst/base/gstflowcombiner.h>
+#include <gst/video/video.h>
+#include <kvazaar.h>
+
+G_BEGIN_DECLS
+#define GST_TYPE_KVAZAAR_LADDER \
+  (gst_kvazaar_ladder_get_type())
+#define GST_KVAZAAR_LADDER(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_KVAZAAR_LADDER,GstKvazaarLadder))
+#define GST_IS_KVAZAAR_LADDER(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_KVAZAAR_LADDER))
+#define GST_TYPE_KVAZAAR_LADDER_PAD \
+  (gst_kvazaar_ladder_pad_get_type())
+#define GST_KVAZAAR_LADDER_PAD(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_KVAZAAR_LADDER_PAD,GstKvazaarLadderPad))
+typedef struct _GstKvazaarLadder GstKvazaarLadder;
+typedef struct _GstKvazaarLadderClass GstKvazaarLadderClass;
+typedef struct _GstKvazaarLadderPad GstKvazaarLadderPad;
+typedef struct _GstKvazaarLadderPadClass GstKvazaarLadderPadClass;
+
+/* Times the input is halved at most for the renditions */
+#define GST_KVAZAAR_LADDER_MAX_LEVELS 4
+
+/*
+ * Source pad of one rendition, with the Kvazaar instance encoding it.
+ */
+struct _GstKvazaarLadderPad
+{
+  GstPad pad;
+
+  /*< private > */
+  const kvz_api *api;
+
+  /* properties */
+  guint    width;            /* 0: from height and the input aspect ratio */
+  guint    height;           /* 0: from width and the input aspect ratio */
+  guint    bitrate;          /* in kbit/s, 0: constant QP */
+  gboolean reconfig;         /* properties changed since the encoder opened */
+  GstClockTime latency;      /* of the encoder, under the object lock */
+
+  /* streaming thread only */
+  kvz_encoder *enc;
+  kvz_config *config;
+  gint     out_width;
+  gint     out_height;
+  gboolean stream_started;
+  gboolean need_segment;
+};
+
+struct _GstKvazaarLadderPadClass
+{
+  GstPadClass parent_class;
+};
+
+/*
+ * Input halved one more time than the previous level, computed once per
+ * picture for all renditions that are scaled from it.
+ */
+typedef struct
+{
+  gint     width;            /* luma, 0: level not used */
+  gint     height;
+  gint     stride[3];
+  guint8   *planes[3];
+  gboolean valid;            /* holds the current picture */
+} GstKvazaarLadderLevel;
+
+struct _GstKvazaarLadder
+{
+  GstElement element;
+
+  /*< private > */
+  GstPad *sinkpad;
+  const kvz_api *api;
+
+  /* properties */
+  guint    threads;          /* budget of all renditions, 0: processors */
+  gint     intra_period;
+  GString  *kvz_opts;
+
+  /* input description */
+  GstVideoInfo info;
+  gboolean have_info;
+  GstSegment segment;
+
+  GstKvazaarLadderLevel levels[GST_KVAZAAR_LADDER_MAX_LEVELS];
+  GstFlowCombiner *flow_combiner;
+
+  /* restart every rendition at the next picture */
+  gboolean force_keyframe;
+  guint    pad_count;
+};
+
+struct _GstKvazaarLadderClass
+{
+  GstElementClass parent_class;
+};
+
+GType gst_kvazaar_ladder_get_type (void);
+GType gst_kvazaar_ladder_pad_get_type (void);
+
+G_END_DECLS
+#endif /* __GST_KVAZAAR_LADDER_H__ */
@@ -0,0 +1,301 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Lookahead and adaptive QP.
+ *
+ * Pictures are held for a few frames before they are given to Kvazaar. In
+ * the meantime the spatial complexity (variance) of every CTU and its
+ * temporal activity (SAD to the next picture) are measured on a downscaled
+ * luma. When a picture leaves the lookahead, these give a delta QP per CTU:
+ * busy textures and fast motion mask coding noise and get a higher QP,
+ * flat and steady areas where artifacts show and which are referenced for
+ * long get a lower one.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gstkvazaarlookahead.h"
+#include "gstkvazaaranalysis.h"
+
+#include <math.h>
+#include <string.h>
+
+/* Bounds of the adaptive QP offset */
+#define AQ_MAX_DQP 8
+/* Weight of the temporal term against the spatial one */
+#define AQ_TEMPORAL_WEIGHT 0.5
+
+/* Thumbnail pixels per CTU side */
+#define THUMB_CTU_SIZE (GST_KVAZAAR_CTU_SIZE / GST_KVAZAAR_THUMB_SCALE)
+
+typedef struct
+{
+  gpointer frame;
+  gpointer picture;
+  GstKvazaarThumbnail *thumb;
+  gfloat *energy;       /* per CTU log2 of the variance */
+  gfloat *activity;     /* per CTU mean absolute difference to the next
+                         * picture */
+  gboolean has_activity;
+} LookaheadEntry;
+
+struct _GstKvazaarLookahead
+{
+  guint depth;
+  gint pic_width;
+  gint pic_height;
+  gint ctu_width;
+  gint ctu_height;
+
+  GQueue queue;
+  /* Entries are recycled, the lookahead allocates only while filling up */
+  GQueue free_entries;
+};
+
+static LookaheadEntry *
+lookahead_entry_new (GstKvazaarLookahead * la)
+{
+  LookaheadEntry *entry = g_slice_new0 (LookaheadEntry);
+  gint ctus = la->ctu_width * la->ctu_height;
+
+  entry->thumb = gst_kvazaar_thumbnail_new (la->pic_width, la->pic_height);
+  entry->energy = g_new0 (gfloat, ctus);
+  entry->activity = g_new0 (gfloat, ctus);
+
+  return entry;
+}
+
+static void
+lookahead_entry_free (LookaheadEntry * entry)
+{
+  gst_kvazaar_thumbnail_free (entry->thumb);
+  g_free (entry->energy);
+  g_free (entry->activity);
+  g_slice_free (LookaheadEntry, entry);
+}
+
+GstKvazaarLookahead *
+gst_kvazaar_lookahead_new (guint depth, gint pic_width, gint pic_height)
+{
+  GstKvazaarLookahead *la = g_slice_new0 (GstKvazaarLookahead);
+
+  la->depth = depth;
+  la->pic_width = pic_width;
+  la->pic_height = pic_height;
+  la->ctu_width = (pic_width + GST_KVAZAAR_CTU_SIZE - 1) / GST_KVAZAAR_CTU_SIZE;
+  la->ctu_height =
+      (pic_height + GST_KVAZAAR_CTU_SIZE - 1) / GST_KVAZAAR_CTU_SIZE;
+  g_queue_init (&la->queue);
+  g_queue_init (&la->free_entries);
+
+  return la;
+}
+
+/*
+ * Free the lookahead. It must have been drained first, the frames and
+ * pictures it holds are not owned by it.
+ */
+void
+gst_kvazaar_lookahead_free (GstKvazaarLookahead * la)
+{
+  LookaheadEntry *entry;
+
+  if (!la)
+    return;
+
+  g_warn_if_fail (g_queue_is_empty (&la->queue));
+
+  while ((entry = g_queue_pop_head (&la->queue)))
+    lookahead_entry_free (entry);
+  while ((entry = g_queue_pop_head (&la->free_entries)))
+    lookahead_entry_free (entry);
+
+  g_slice_free (GstKvazaarLookahead, la);
+}
+
+/*
+ * Thumbnail block covering CTU (x, y), clipped to the thumbnail.
+ */
+static gboolean
+lookahead_ctu_block (const GstKvazaarThumbnail * thumb, gint x, gint y,
+    gint * bx, gint * by, gint * bw, gint * bh)
+{
+  *bx = x * THUMB_CTU_SIZE;
+  *by = y * THUMB_CTU_SIZE;
+  *bw = MIN (THUMB_CTU_SIZE, thumb->width - *bx);
+  *bh = MIN (THUMB_CTU_SIZE, thumb->height - *by);
+
+  return *bw > 0 && *bh > 0;
+}
+
+static void
+lookahead_compute_energy (GstKvazaarLookahead * la, LookaheadEntry * entry)
+{
+  const GstKvazaarThumbnail *thumb = entry->thumb;
+  gint x, y, bx, by, bw, bh;
+
+  for (y = 0; y < la->ctu_height; y++) {
+    for (x = 0; x < la->ctu_width; x++) {
+      gfloat *energy = &entry->energy[y * la->ctu_width + x];
+      guint32 sum;
+      guint64 sqsum;
+      gdouble n, var;
+
+      *energy = 0;
+      if (!lookahead_ctu_block (thumb, x, y, &bx, &by, &bw, &bh))
+        continue;
+
+      gst_kvazaar_block_sums_u8 (thumb->data + by * thumb->stride + bx,
+          thumb->stride, bw, bh, &sum, &sqsum);
+      n = bw * bh;
+      var = sqsum / n - (sum / n) * (sum / n);
+      *energy = log2 (MAX (var, 0) + 1);
+    }
+  }
+}
+
+static void
+lookahead_compute_activity (GstKvazaarLookahead * la, LookaheadEntry * entry,
+    const LookaheadEntry * next)
+{
+  const GstKvazaarThumbnail *a = entry->thumb;
+  const GstKvazaarThumbnail *b = next->thumb;
+  gint x, y, bx, by, bw, bh;
+
+  for (y = 0; y < la->ctu_height; y++) {
+    for (x = 0; x < la->ctu_width; x++) {
+      gfloat *activity = &entry->activity[y * la->ctu_width + x];
+
+      *activity = 0;
+      if (!lookahead_ctu_block (a, x, y, &bx, &by, &bw, &bh))
+        continue;
+
+      *activity = gst_kvazaar_sad_u8 (a->data + by * a->stride + bx,
+          a->stride, b->data + by * b->stride + bx, b->stride, bw, bh)
+          / (gfloat) (bw * bh);
+    }
+  }
+  entry->has_activity = TRUE;
+}
+
+/*
+ * Queue a picture. luma and stride (in bytes) describe its luma plane with
+ * samples of depth bits.
+ */
+void
+gst_kvazaar_lookahead_push (GstKvazaarLookahead * la, gpointer frame,
+    gpointer picture, const guint8 * luma, gint stride, gint depth)
+{
+  LookaheadEntry *entry, *prev;
+
+  entry = g_queue_pop_head (&la->free_entries);
+  if (!entry)
+    entry = lookahead_entry_new (la);
+
+  entry->frame = frame;
+  entry->picture = picture;
+  entry->has_activity = FALSE;
+
+  gst_kvazaar_thumbnail_fill (entry->thumb, luma, stride, depth);
+  lookahead_compute_energy (la, entry);
+
+  prev = g_queue_peek_tail (&la->queue);
+  if (prev)
+    lookahead_compute_activity (la, prev, entry);
+
+  g_queue_push_tail (&la->queue, entry);
+}
+
+/*
+ * Fill aq with the adaptive QP offsets of the oldest picture.
+ */
+static void
+lookahead_compute_aq (GstKvazaarLookahead * la, gdouble strength,
+    GstKvazaarQpMap * aq)
+{
+  LookaheadEntry *head = g_queue_peek_head (&la->queue);
+  gint ctus = la->ctu_width * la->ctu_height;
+  gfloat *activity = g_newa (gfloat, ctus);
+  gdouble mean_energy = 0, mean_activity = 0;
+  guint n_activity = 0;
+  GList *l;
+  gint i;
+
+  memset (activity, 0, ctus * sizeof (gfloat));
+
+  /* Temporal activity averaged over the whole lookahead window */
+  for (l = la->queue.head; l; l = l->next) {
+    LookaheadEntry *entry = l->data;
+
+    if (!entry->has_activity)
+      break;
+    for (i = 0; i < ctus; i++)
+      activity[i] += entry->activity[i];
+    n_activity++;
+  }
+
+  for (i = 0; i < ctus; i++) {
+    mean_energy += head->energy[i];
+    if (n_activity)
+      activity[i] = log2 (activity[i] / n_activity + 1);
+    mean_activity += activity[i];
+  }
+  mean_energy /= ctus;
+  mean_activity /= ctus;
+
+  gst_kvazaar_qp_map_clear (aq);
+  for (i = 0; i < ctus && i < aq->width * aq->height; i++) {
+    gdouble dqp = head->energy[i] - mean_energy;
+
+    if (n_activity)
+      dqp += AQ_TEMPORAL_WEIGHT * (activity[i] - mean_activity);
+    dqp = CLAMP (strength * dqp, -AQ_MAX_DQP, AQ_MAX_DQP);
+    aq->dqps[i] = (gint8) lrint (dqp);
+  }
+}
+
+/*
+ * Take the oldest picture out once the lookahead is full, or as long as
+ * there is one when draining. aq, if not NULL, receives its QP offsets.
+ */
+gboolean
+gst_kvazaar_lookahead_pop (GstKvazaarLookahead * la, gboolean drain,
+    gdouble strength, GstKvazaarQpMap * aq, gpointer * frame,
+    gpointer * picture)
+{
+  LookaheadEntry *entry;
+
+  if (g_queue_is_empty (&la->queue) ||
+      (!drain && g_queue_get_length (&la->queue) <= la->depth))
+    return FALSE;
+
+  if (aq)
+    lookahead_compute_aq (la, strength, aq);
+
+  entry = g_queue_pop_head (&la->queue);
+  *frame = entry->frame;
+  *picture = entry->picture;
+  entry->frame = NULL;
+  entry->picture = NULL;
+  g_queue_push_head (&la->free_entries, entry);
+
+  return TRUE;
+}
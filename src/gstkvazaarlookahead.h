@@ -0,0 +1,41 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GST_KVAZAAR_LOOKAHEAD_H__
+#define __GST_KVAZAAR_LOOKAHEAD_H__
+
+#include <glib.h>
+
+#include "gstkvazaarqpmap.h"
+
+G_BEGIN_DECLS
+
+typedef struct _GstKvazaarLookahead GstKvazaarLookahead;
+
+GstKvazaarLookahead *gst_kvazaar_lookahead_new (guint depth, gint pic_width,
+    gint pic_height);
+void gst_kvazaar_lookahead_free (GstKvazaarLookahead * la);
+
+void gst_kvazaar_lookahead_push (GstKvazaarLookahead * la, gpointer frame,
+    gpointer picture, const guint8 * luma, gint stride, gint depth);
+gboolean gst_kvazaar_lookahead_pop (GstKvazaarLookahead * la, gboolean drain,
+    gdouble strength, GstKvazaarQpMap * aq, gpointer * frame,
+    gpointer * picture);
+
+G_END_DECLS
+#endif /* __GST_KVAZAAR_LOOKAHEAD_H__ */
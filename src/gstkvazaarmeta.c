@@ -0,0 +1,193 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gstkvazaarmetaprivate.h"
+
+#include <string.h>
+
+GType
+gst_kvazaar_temporal_meta_api_get_type (void)
+{
+  static volatile GType type = 0;
+  static const gchar *tags[] = { NULL };
+
+  if (g_once_init_enter (&type)) {
+    GType _type =
+        gst_meta_api_type_register (GST_KVAZAAR_TEMPORAL_META_API_NAME,
+        tags);
+    g_once_init_leave (&type, _type);
+  }
+
+  return type;
+}
+
+static gboolean
+gst_kvazaar_temporal_meta_init (GstMeta * meta, gpointer params,
+    GstBuffer * buffer)
+{
+  GstKvazaarTemporalMeta *tmeta = (GstKvazaarTemporalMeta *) meta;
+
+  tmeta->temporal_id = 0;
+
+  return TRUE;
+}
+
+static gboolean
+gst_kvazaar_temporal_meta_transform (GstBuffer * dest, GstMeta * meta,
+    GstBuffer * buffer, GQuark type, gpointer data)
+{
+  GstKvazaarTemporalMeta *tmeta = (GstKvazaarTemporalMeta *) meta;
+
+  /* Any part of the access unit is in the same layer */
+  if (GST_META_TRANSFORM_IS_COPY (type))
+    return gst_buffer_add_kvazaar_temporal_meta (dest,
+        tmeta->temporal_id) != NULL;
+
+  return FALSE;
+}
+
+const GstMetaInfo *
+gst_kvazaar_temporal_meta_get_info (void)
+{
+  static const GstMetaInfo *meta_info = NULL;
+
+  if (g_once_init_enter ((GstMetaInfo **) & meta_info)) {
+    const GstMetaInfo *mi =
+        gst_meta_register (GST_KVAZAAR_TEMPORAL_META_API_TYPE,
+        "GstKvazaarTemporalMeta", sizeof (GstKvazaarTemporalMeta),
+        gst_kvazaar_temporal_meta_init, NULL,
+        gst_kvazaar_temporal_meta_transform);
+    g_once_init_leave ((GstMetaInfo **) & meta_info, (GstMetaInfo *) mi);
+  }
+
+  return meta_info;
+}
+
+GstKvazaarTemporalMeta *
+gst_buffer_add_kvazaar_temporal_meta (GstBuffer * buffer, guint temporal_id)
+{
+  GstKvazaarTemporalMeta *meta;
+
+  g_return_val_if_fail (GST_IS_BUFFER (buffer), NULL);
+
+  meta = (GstKvazaarTemporalMeta *) gst_buffer_add_meta (buffer,
+      GST_KVAZAAR_TEMPORAL_META_INFO, NULL);
+  if (meta)
+    meta->temporal_id = temporal_id;
+
+  return meta;
+}
+
+GType
+gst_kvazaar_frame_stats_meta_api_get_type (void)
+{
+  static volatile GType type = 0;
+  static const gchar *tags[] = { NULL };
+
+  if (g_once_init_enter (&type)) {
+    GType _type =
+        gst_meta_api_type_register (GST_KVAZAAR_FRAME_STATS_META_API_NAME,
+        tags);
+    g_once_init_leave (&type, _type);
+  }
+
+  return type;
+}
+
+static gboolean
+gst_kvazaar_frame_stats_meta_init (GstMeta * meta, gpointer params,
+    GstBuffer * buffer)
+{
+  GstKvazaarFrameStatsMeta *smeta = (GstKvazaarFrameStatsMeta *) meta;
+
+  smeta->encode_time = GST_CLOCK_TIME_NONE;
+  smeta->latency = GST_CLOCK_TIME_NONE;
+  smeta->size = 0;
+  smeta->qp = 0;
+  smeta->slice_type = 0;
+  smeta->nal_unit_type = 0;
+  smeta->poc = 0;
+  smeta->quality_frame_number = 0;
+  smeta->have_psnr = FALSE;
+  smeta->psnr[0] = smeta->psnr[1] = smeta->psnr[2] = 0.0;
+  smeta->have_ssim = FALSE;
+  smeta->ssim = 0.0;
+
+  return TRUE;
+}
+
+static gboolean
+gst_kvazaar_frame_stats_meta_transform (GstBuffer * dest, GstMeta * meta,
+    GstBuffer * buffer, GQuark type, gpointer data)
+{
+  GstKvazaarFrameStatsMeta *smeta = (GstKvazaarFrameStatsMeta *) meta;
+  GstKvazaarFrameStatsMeta *dmeta;
+
+  /* Parts of the access unit describe the whole of it */
+  if (!GST_META_TRANSFORM_IS_COPY (type))
+    return FALSE;
+
+  dmeta = gst_buffer_add_kvazaar_frame_stats_meta (dest);
+  if (!dmeta)
+    return FALSE;
+
+  dmeta->encode_time = smeta->encode_time;
+  dmeta->latency = smeta->latency;
+  dmeta->size = smeta->size;
+  dmeta->qp = smeta->qp;
+  dmeta->slice_type = smeta->slice_type;
+  dmeta->nal_unit_type = smeta->nal_unit_type;
+  dmeta->poc = smeta->poc;
+  dmeta->quality_frame_number = smeta->quality_frame_number;
+  dmeta->have_psnr = smeta->have_psnr;
+  memcpy (dmeta->psnr, smeta->psnr, sizeof (dmeta->psnr));
+  dmeta->have_ssim = smeta->have_ssim;
+  dmeta->ssim = smeta->ssim;
+
+  return TRUE;
+}
+
+const GstMetaInfo *
+gst_kvazaar_frame_stats_meta_get_info (void)
+{
+  static const GstMetaInfo *meta_info = NULL;
+
+  if (g_once_init_enter ((GstMetaInfo **) & meta_info)) {
+    const GstMetaInfo *mi =
+        gst_meta_register (GST_KVAZAAR_FRAME_STATS_META_API_TYPE,
+        "GstKvazaarFrameStatsMeta", sizeof (GstKvazaarFrameStatsMeta),
+        gst_kvazaar_frame_stats_meta_init, NULL,
+        gst_kvazaar_frame_stats_meta_transform);
+    g_once_init_leave ((GstMetaInfo **) & meta_info, (GstMetaInfo *) mi);
+  }
+
+  return meta_info;
+}
+
+GstKvazaarFrameStatsMeta *
+gst_buffer_add_kvazaar_frame_stats_meta (GstBuffer * buffer)
+{
+  g_return_val_if_fail (GST_IS_BUFFER (buffer), NULL);
+
+  return (GstKvazaarFrameStatsMeta *) gst_buffer_add_meta (buffer,
+      GST_KVAZAAR_FRAME_STATS_META_INFO, NULL);
+}
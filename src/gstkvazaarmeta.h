@@ -0,0 +1,99 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GST_KVAZAAR_META_H__
+#define __GST_KVAZAAR_META_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/*
+ * This header is installed for applications, which do not link the plugin.
+ * They read the metas with the gst_buffer_get_kvazaar_*_meta() getters,
+ * which find the API types by name once the plugin registered them.
+ */
+
+#define GST_KVAZAAR_TEMPORAL_META_API_NAME "GstKvazaarTemporalMetaAPI"
+
+typedef struct _GstKvazaarTemporalMeta GstKvazaarTemporalMeta;
+
+/*
+ * Temporal layer of an encoded access unit, from the NAL unit header of its
+ * slices. Layers above the highest one kept can be dropped without breaking
+ * the others.
+ */
+struct _GstKvazaarTemporalMeta
+{
+  GstMeta meta;
+
+  guint temporal_id;
+};
+
+static inline GstKvazaarTemporalMeta *
+gst_buffer_get_kvazaar_temporal_meta (GstBuffer * buffer)
+{
+  GType api = g_type_from_name (GST_KVAZAAR_TEMPORAL_META_API_NAME);
+
+  if (!api)
+    return NULL;
+
+  return (GstKvazaarTemporalMeta *) gst_buffer_get_meta (buffer, api);
+}
+
+#define GST_KVAZAAR_FRAME_STATS_META_API_NAME "GstKvazaarFrameStatsMetaAPI"
+
+typedef struct _GstKvazaarFrameStatsMeta GstKvazaarFrameStatsMeta;
+
+/*
+ * How an access unit was encoded. Slice and NAL unit types take the values
+ * of Kvazaar. The quality measures are the last ones done when the access
+ * unit was output, of the picture with system frame number
+ * quality_frame_number, since only a sample of the pictures is measured.
+ */
+struct _GstKvazaarFrameStatsMeta
+{
+  GstMeta meta;
+
+  GstClockTime encode_time;  /* encode call that output the access unit */
+  GstClockTime latency;      /* from the input of the picture */
+  guint size;                /* bytes */
+  gint qp;
+  gint slice_type;
+  gint nal_unit_type;
+  gint poc;
+  guint32 quality_frame_number;
+  gboolean have_psnr;
+  gdouble psnr[3];           /* Y, U and V, in dB */
+  gboolean have_ssim;
+  gdouble ssim;              /* of the luma plane */
+};
+
+static inline GstKvazaarFrameStatsMeta *
+gst_buffer_get_kvazaar_frame_stats_meta (GstBuffer * buffer)
+{
+  GType api = g_type_from_name (GST_KVAZAAR_FRAME_STATS_META_API_NAME);
+
+  if (!api)
+    return NULL;
+
+  return (GstKvazaarFrameStatsMeta *) gst_buffer_get_meta (buffer, api);
+}
+
+G_END_DECLS
+#endif /* __GST_KVAZAAR_META_H__ */
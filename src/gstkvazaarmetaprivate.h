@@ -0,0 +1,51 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GST_KVAZAAR_META_PRIVATE_H__
+#define __GST_KVAZAAR_META_PRIVATE_H__
+
+#include "gstkvazaarmeta.h"
+
+G_BEGIN_DECLS
+
+/* Registration and writers of the metas, for the plugin only. */
+
+#define GST_KVAZAAR_TEMPORAL_META_API_TYPE \
+  (gst_kvazaar_temporal_meta_api_get_type())
+#define GST_KVAZAAR_TEMPORAL_META_INFO \
+  (gst_kvazaar_temporal_meta_get_info())
+
+GType gst_kvazaar_temporal_meta_api_get_type (void);
+const GstMetaInfo *gst_kvazaar_temporal_meta_get_info (void);
+
+GstKvazaarTemporalMeta *gst_buffer_add_kvazaar_temporal_meta (GstBuffer *
+    buffer, guint temporal_id);
+
+#define GST_KVAZAAR_FRAME_STATS_META_API_TYPE \
+  (gst_kvazaar_frame_stats_meta_api_get_type())
+#define GST_KVAZAAR_FRAME_STATS_META_INFO \
+  (gst_kvazaar_frame_stats_meta_get_info())
+
+GType gst_kvazaar_frame_stats_meta_api_get_type (void);
+const GstMetaInfo *gst_kvazaar_frame_stats_meta_get_info (void);
+
+GstKvazaarFrameStatsMeta *gst_buffer_add_kvazaar_frame_stats_meta (GstBuffer *
+    buffer);
+
+G_END_DECLS
+#endif /* __GST_KVAZAAR_META_PRIVATE_H__ */
@@ -0,0 +1,186 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Per-picture delta QP maps.
+ *
+ * Several parts of the element want to bias the QP of a picture (static ROI,
+ * rate guard, adaptive QP, ...). Each of them adds its contribution to a map
+ * at CTU resolution, which is then handed to Kvazaar as the picture ROI.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gstkvazaarqpmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static inline gint8
+clamp_dqp (gint dqp)
+{
+  return CLAMP (dqp, GST_KVAZAAR_QP_MAP_MIN_DQP, GST_KVAZAAR_QP_MAP_MAX_DQP);
+}
+
+GstKvazaarQpMap *
+gst_kvazaar_qp_map_new (gint width, gint height)
+{
+  GstKvazaarQpMap *map;
+
+  g_return_val_if_fail (width > 0 && height > 0, NULL);
+
+  map = g_slice_new (GstKvazaarQpMap);
+  map->width = width;
+  map->height = height;
+  map->dqps = g_malloc0 (width * height);
+
+  return map;
+}
+
+/*
+ * Allocate a map covering a picture of pic_width x pic_height pixels.
+ */
+GstKvazaarQpMap *
+gst_kvazaar_qp_map_new_for_size (gint pic_width, gint pic_height)
+{
+  return gst_kvazaar_qp_map_new (
+      (pic_width + GST_KVAZAAR_CTU_SIZE - 1) / GST_KVAZAAR_CTU_SIZE,
+      (pic_height + GST_KVAZAAR_CTU_SIZE - 1) / GST_KVAZAAR_CTU_SIZE);
+}
+
+void
+gst_kvazaar_qp_map_free (GstKvazaarQpMap * map)
+{
+  if (!map)
+    return;
+
+  g_free (map->dqps);
+  g_slice_free (GstKvazaarQpMap, map);
+}
+
+void
+gst_kvazaar_qp_map_clear (GstKvazaarQpMap * map)
+{
+  memset (map->dqps, 0, map->width * map->height);
+}
+
+gboolean
+gst_kvazaar_qp_map_is_zero (const GstKvazaarQpMap * map)
+{
+  gint i;
+
+  for (i = 0; i < map->width * map->height; i++)
+    if (map->dqps[i])
+      return FALSE;
+
+  return TRUE;
+}
+
+/*
+ * Add the same delta QP to every CTU.
+ */
+void
+gst_kvazaar_qp_map_add (GstKvazaarQpMap * map, gint dqp)
+{
+  gint i;
+
+  if (!dqp)
+    return;
+
+  for (i = 0; i < map->width * map->height; i++)
+    map->dqps[i] = clamp_dqp (map->dqps[i] + dqp);
+}
+
+void
+gst_kvazaar_qp_map_add_ctu (GstKvazaarQpMap * map, gint x, gint y, gint dqp)
+{
+  gint8 *p;
+
+  if (x < 0 || y < 0 || x >= map->width || y >= map->height)
+    return;
+
+  p = &map->dqps[y * map->width + x];
+  *p = clamp_dqp (*p + dqp);
+}
+
+/*
+ * Add a map of any resolution, resampled to the CTU grid with nearest
+ * neighbour.
+ */
+void
+gst_kvazaar_qp_map_add_scaled (GstKvazaarQpMap * map, gint src_width,
+    gint src_height, const gint8 * src)
+{
+  gint x, y;
+
+  if (!src || src_width <= 0 || src_height <= 0)
+    return;
+
+  for (y = 0; y < map->height; y++) {
+    const gint8 *src_row = src + (y * src_height / map->height) * src_width;
+    gint8 *dst_row = map->dqps + y * map->width;
+
+    for (x = 0; x < map->width; x++)
+      dst_row[x] = clamp_dqp (dst_row[x] + src_row[x * src_width / map->width]);
+  }
+}
+
+/*
+ * Set the CTUs touched by a rectangle given in pixels to dqp, unless they
+ * already hold a stronger offset. Overlapping regions do not add up.
+ */
+void
+gst_kvazaar_qp_map_merge_rect (GstKvazaarQpMap * map, gint x, gint y,
+    gint width, gint height, gint dqp)
+{
+  gint x0, y0, x1, y1, i, j;
+
+  if (!dqp || width <= 0 || height <= 0)
+    return;
+
+  x0 = MAX (x, 0) / GST_KVAZAAR_CTU_SIZE;
+  y0 = MAX (y, 0) / GST_KVAZAAR_CTU_SIZE;
+  x1 = MIN ((x + width - 1) / GST_KVAZAAR_CTU_SIZE, map->width - 1);
+  y1 = MIN ((y + height - 1) / GST_KVAZAAR_CTU_SIZE, map->height - 1);
+  dqp = clamp_dqp (dqp);
+
+  for (j = y0; j <= y1; j++) {
+    gint8 *row = map->dqps + j * map->width;
+
+    for (i = x0; i <= x1; i++)
+      if (ABS (dqp) > ABS (row[i]))
+        row[i] = dqp;
+  }
+}
+
+/*
+ * Copy the map with malloc(), ownership goes to Kvazaar which releases the
+ * picture ROI with free().
+ */
+gint8 *
+gst_kvazaar_qp_map_dup_dqps (const GstKvazaarQpMap * map)
+{
+  gint8 *dqps = malloc (map->width * map->height);
+
+  if (dqps)
+    memcpy (dqps, map->dqps, map->width * map->height);
+
+  return dqps;
+}
@@ -0,0 +1,64 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GST_KVAZAAR_QP_MAP_H__
+#define __GST_KVAZAAR_QP_MAP_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Kvazaar codes the picture in 64x64 CTUs */
+#define GST_KVAZAAR_CTU_SIZE 64
+
+#define GST_KVAZAAR_QP_MAP_MIN_DQP (-51)
+#define GST_KVAZAAR_QP_MAP_MAX_DQP 51
+
+typedef struct _GstKvazaarQpMap GstKvazaarQpMap;
+
+/*
+ * Delta QP map at CTU resolution, in the layout of Kvazaar roi.dqps (row
+ * major, one signed delta per CTU).
+ */
+struct _GstKvazaarQpMap
+{
+  gint width;       /* in CTUs */
+  gint height;      /* in CTUs */
+  gint8 *dqps;
+};
+
+GstKvazaarQpMap *gst_kvazaar_qp_map_new (gint width, gint height);
+GstKvazaarQpMap *gst_kvazaar_qp_map_new_for_size (gint pic_width,
+    gint pic_height);
+void gst_kvazaar_qp_map_free (GstKvazaarQpMap * map);
+
+void gst_kvazaar_qp_map_clear (GstKvazaarQpMap * map);
+gboolean gst_kvazaar_qp_map_is_zero (const GstKvazaarQpMap * map);
+
+void gst_kvazaar_qp_map_add (GstKvazaarQpMap * map, gint dqp);
+void gst_kvazaar_qp_map_add_ctu (GstKvazaarQpMap * map, gint x, gint y,
+    gint dqp);
+void gst_kvazaar_qp_map_add_scaled (GstKvazaarQpMap * map, gint src_width,
+    gint src_height, const gint8 * src);
+void gst_kvazaar_qp_map_merge_rect (GstKvazaarQpMap * map, gint x, gint y,
+    gint width, gint height, gint dqp);
+
+gint8 *gst_kvazaar_qp_map_dup_dqps (const GstKvazaarQpMap * map);
+
+G_END_DECLS
+#endif /* __GST_KVAZAAR_QP_MAP_H__ */
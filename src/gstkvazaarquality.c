@@ -0,0 +1,395 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Quality of the reconstructed pictures of Kvazaar, measured on a worker
+ * thread.
+ *
+ * The encoding thread hands over the source and reconstructed pictures of a
+ * sample of the output, and goes on. When the worker falls behind, samples
+ * are skipped rather than queued, so that measuring never slows the encoding
+ * down.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gstkvazaarquality.h"
+
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Samples waiting for the worker before the next ones are skipped */
+#define QUALITY_MAX_PENDING 2
+
+struct _GstKvazaarQuality
+{
+  const kvz_api *api;
+  GstElement *element;
+  GThreadPool *pool;
+
+  GMutex lock;
+  GstKvazaarQualityResult last;
+  guint64 measured;
+  guint64 skipped;
+};
+
+typedef struct
+{
+  kvz_picture *src;
+  GstVideoFrame src_frame;      /* mapping the planes of src point into */
+  gboolean have_src_frame;
+  kvz_picture *rec;
+  GstBuffer *rec_buffer;
+  guint32 frame_number;
+  GstClockTime pts;
+  guint metrics;
+  gboolean post_message;
+} QualityJob;
+
+/*
+ * Sum of squared differences of two planes. Strides are in samples.
+ */
+guint64
+gst_kvazaar_plane_sse (const kvz_pixel * a, gint a_stride,
+    const kvz_pixel * b, gint b_stride, gint width, gint height)
+{
+  guint64 sse = 0;
+  gint x, y;
+
+  for (y = 0; y < height; y++) {
+    const kvz_pixel *pa = a + y * a_stride;
+    const kvz_pixel *pb = b + y * b_stride;
+
+    x = 0;
+#ifdef __SSE2__
+    {
+      /* a row of 8192 8-bit or 10-bit samples stays below 2^32 per lane */
+      const __m128i zero = _mm_setzero_si128 ();
+      __m128i acc = zero;
+      guint32 lanes[4];
+
+#if KVZ_BIT_DEPTH == 8
+      for (; x + 16 <= width; x += 16) {
+        __m128i va = _mm_loadu_si128 ((const __m128i *) (pa + x));
+        __m128i vb = _mm_loadu_si128 ((const __m128i *) (pb + x));
+        __m128i lo = _mm_sub_epi16 (_mm_unpacklo_epi8 (va, zero),
+            _mm_unpacklo_epi8 (vb, zero));
+        __m128i hi = _mm_sub_epi16 (_mm_unpackhi_epi8 (va, zero),
+            _mm_unpackhi_epi8 (vb, zero));
+
+        acc = _mm_add_epi32 (acc, _mm_madd_epi16 (lo, lo));
+        acc = _mm_add_epi32 (acc, _mm_madd_epi16 (hi, hi));
+      }
+#else
+      for (; x + 8 <= width; x += 8) {
+        __m128i d = _mm_sub_epi16 (
+            _mm_loadu_si128 ((const __m128i *) (pa + x)),
+            _mm_loadu_si128 ((const __m128i *) (pb + x)));
+
+        acc = _mm_add_epi32 (acc, _mm_madd_epi16 (d, d));
+      }
+#endif
+      _mm_storeu_si128 ((__m128i *) lanes, acc);
+      sse += (guint64) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+#endif
+    for (; x < width; x++) {
+      gint d = pa[x] - pb[x];
+
+      sse += d * d;
+    }
+  }
+
+  return sse;
+}
+
+/*
+ * Sums of an 8x8 window of both planes: sum of a, sum of b, sum of the
+ * squares of a and b, and sum of the products.
+ */
+static void
+quality_window_sums (const kvz_pixel * a, gint a_stride, const kvz_pixel * b,
+    gint b_stride, gint64 sums[4])
+{
+  gint y;
+
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i ones = _mm_set1_epi16 (1);
+  __m128i s_a = zero, s_b = zero, ss = zero, s_ab = zero;
+  gint32 lanes[4][4];
+
+  for (y = 0; y < 8; y++) {
+#if KVZ_BIT_DEPTH == 8
+    __m128i va = _mm_unpacklo_epi8 (_mm_loadl_epi64 ((const __m128i *)
+            (a + y * a_stride)), zero);
+    __m128i vb = _mm_unpacklo_epi8 (_mm_loadl_epi64 ((const __m128i *)
+            (b + y * b_stride)), zero);
+#else
+    __m128i va = _mm_loadu_si128 ((const __m128i *) (a + y * a_stride));
+    __m128i vb = _mm_loadu_si128 ((const __m128i *) (b + y * b_stride));
+#endif
+
+    s_a = _mm_add_epi16 (s_a, va);
+    s_b = _mm_add_epi16 (s_b, vb);
+    ss = _mm_add_epi32 (ss, _mm_add_epi32 (_mm_madd_epi16 (va, va),
+            _mm_madd_epi16 (vb, vb)));
+    s_ab = _mm_add_epi32 (s_ab, _mm_madd_epi16 (va, vb));
+  }
+
+  _mm_storeu_si128 ((__m128i *) lanes[0], _mm_madd_epi16 (s_a, ones));
+  _mm_storeu_si128 ((__m128i *) lanes[1], _mm_madd_epi16 (s_b, ones));
+  _mm_storeu_si128 ((__m128i *) lanes[2], ss);
+  _mm_storeu_si128 ((__m128i *) lanes[3], s_ab);
+  for (y = 0; y < 4; y++)
+    sums[y] = (gint64) lanes[y][0] + lanes[y][1] + lanes[y][2] + lanes[y][3];
+#else
+  sums[0] = sums[1] = sums[2] = sums[3] = 0;
+  for (y = 0; y < 8; y++) {
+    const kvz_pixel *pa = a + y * a_stride;
+    const kvz_pixel *pb = b + y * b_stride;
+    gint x;
+
+    for (x = 0; x < 8; x++) {
+      sums[0] += pa[x];
+      sums[1] += pb[x];
+      sums[2] += pa[x] * pa[x] + pb[x] * pb[x];
+      sums[3] += pa[x] * pb[x];
+    }
+  }
+#endif
+}
+
+/*
+ * Mean SSIM of two planes over 8x8 windows placed every 4 samples, with the
+ * constants of x264.
+ */
+gdouble
+gst_kvazaar_plane_ssim (const kvz_pixel * a, gint a_stride,
+    const kvz_pixel * b, gint b_stride, gint width, gint height)
+{
+  const gdouble max = (1 << KVZ_BIT_DEPTH) - 1;
+  const gdouble c1 = .01 * .01 * max * max * 64;
+  const gdouble c2 = .03 * .03 * max * max * 64 * 63;
+  gdouble total = 0;
+  guint windows = 0;
+  gint x, y;
+
+  for (y = 0; y + 8 <= height; y += 4) {
+    for (x = 0; x + 8 <= width; x += 4) {
+      gint64 sums[4];
+      gdouble s1, s2, vars, covar;
+
+      quality_window_sums (a + y * a_stride + x, a_stride,
+          b + y * b_stride + x, b_stride, sums);
+      s1 = sums[0];
+      s2 = sums[1];
+      vars = sums[2] * 64.0 - s1 * s1 - s2 * s2;
+      covar = sums[3] * 64.0 - s1 * s2;
+      total += (2 * s1 * s2 + c1) * (2 * covar + c2) /
+          ((s1 * s1 + s2 * s2 + c1) * (vars + c2));
+      windows++;
+    }
+  }
+
+  return windows ? total / windows : 1.0;
+}
+
+/*
+ * Measure a 4:2:0 reconstructed picture against its source.
+ */
+void
+gst_kvazaar_quality_measure (const kvz_picture * src, const kvz_picture * rec,
+    guint metrics, GstKvazaarQualityResult * result)
+{
+  const gdouble max = (1 << KVZ_BIT_DEPTH) - 1;
+  const kvz_pixel *a[3] = { src->y, src->u, src->v };
+  const kvz_pixel *b[3] = { rec->y, rec->u, rec->v };
+  gint c;
+
+  result->metrics = metrics;
+
+  if (metrics & GST_KVAZAAR_QUALITY_PSNR) {
+    for (c = 0; c < 3; c++) {
+      gint width = c ? src->width / 2 : src->width;
+      gint height = c ? src->height / 2 : src->height;
+      guint64 sse = gst_kvazaar_plane_sse (a[c],
+          c ? src->stride / 2 : src->stride, b[c],
+          c ? rec->stride / 2 : rec->stride, width, height);
+
+      result->psnr[c] = sse ?
+          10.0 * log10 (max * max * width * height / sse) : 100.0;
+    }
+  }
+
+  if (metrics & GST_KVAZAAR_QUALITY_SSIM)
+    result->ssim = gst_kvazaar_plane_ssim (src->y, src->stride, rec->y,
+        rec->stride, src->width, src->height);
+}
+
+static void
+gst_kvazaar_quality_work (gpointer data, gpointer user_data)
+{
+  GstKvazaarQuality *quality = user_data;
+  QualityJob *job = data;
+  GstKvazaarQualityResult result = { 0, };
+
+  result.frame_number = job->frame_number;
+  result.pts = job->pts;
+  gst_kvazaar_quality_measure (job->src, job->rec, job->metrics, &result);
+  quality->api->picture_free (job->src);
+  if (job->have_src_frame)
+    gst_video_frame_unmap (&job->src_frame);
+  if (job->rec_buffer)
+    gst_buffer_unref (job->rec_buffer);
+  else
+    quality->api->picture_free (job->rec);
+
+  g_mutex_lock (&quality->lock);
+  quality->last = result;
+  quality->measured++;
+  g_mutex_unlock (&quality->lock);
+
+  if (job->post_message) {
+    GstStructure *st = gst_structure_new ("kvazaarenc-quality",
+        "frame-number", G_TYPE_UINT, result.frame_number,
+        "pts", G_TYPE_UINT64, result.pts, NULL);
+
+    if (result.metrics & GST_KVAZAAR_QUALITY_PSNR)
+      gst_structure_set (st, "psnr-y", G_TYPE_DOUBLE, result.psnr[0],
+          "psnr-u", G_TYPE_DOUBLE, result.psnr[1],
+          "psnr-v", G_TYPE_DOUBLE, result.psnr[2], NULL);
+    if (result.metrics & GST_KVAZAAR_QUALITY_SSIM)
+      gst_structure_set (st, "ssim", G_TYPE_DOUBLE, result.ssim, NULL);
+    gst_element_post_message (quality->element,
+        gst_message_new_element (GST_OBJECT (quality->element), st));
+  }
+
+  g_slice_free (QualityJob, job);
+}
+
+GstKvazaarQuality *
+gst_kvazaar_quality_new (const kvz_api * api, GstElement * element,
+    GError ** err)
+{
+  GstKvazaarQuality *quality = g_slice_new0 (GstKvazaarQuality);
+
+  quality->pool = g_thread_pool_new (gst_kvazaar_quality_work, quality, 1,
+      FALSE, err);
+  if (!quality->pool) {
+    g_slice_free (GstKvazaarQuality, quality);
+    return NULL;
+  }
+  quality->api = api;
+  quality->element = gst_object_ref (element);
+  g_mutex_init (&quality->lock);
+
+  return quality;
+}
+
+/*
+ * Wait for the pending samples and stop the worker.
+ */
+void
+gst_kvazaar_quality_free (GstKvazaarQuality * quality)
+{
+  if (!quality)
+    return;
+
+  g_thread_pool_free (quality->pool, FALSE, TRUE);
+  gst_object_unref (quality->element);
+  g_mutex_clear (&quality->lock);
+  g_slice_free (GstKvazaarQuality, quality);
+}
+
+/*
+ * Hand a sample over to the worker, which frees both pictures. The planes
+ * of src point into src_frame when given, which the worker unmaps after
+ * measuring. When rec_buffer is given, rec is kept alive by that buffer
+ * instead, and the worker only takes a reference to it. Returns FALSE when
+ * the sample is skipped because the worker is behind; the pictures are
+ * freed and src_frame unmapped right away then.
+ */
+gboolean
+gst_kvazaar_quality_push (GstKvazaarQuality * quality, kvz_picture * src,
+    GstVideoFrame * src_frame, kvz_picture * rec, GstBuffer * rec_buffer,
+    guint32 frame_number, GstClockTime pts, guint metrics,
+    gboolean post_message)
+{
+  QualityJob *job;
+
+  if (g_thread_pool_unprocessed (quality->pool) >= QUALITY_MAX_PENDING) {
+    quality->api->picture_free (src);
+    if (src_frame)
+      gst_video_frame_unmap (src_frame);
+    if (!rec_buffer)
+      quality->api->picture_free (rec);
+    g_mutex_lock (&quality->lock);
+    quality->skipped++;
+    g_mutex_unlock (&quality->lock);
+    return FALSE;
+  }
+
+  job = g_slice_new (QualityJob);
+  job->src = src;
+  job->have_src_frame = src_frame != NULL;
+  if (src_frame)
+    job->src_frame = *src_frame;
+  job->rec = rec;
+  job->rec_buffer = rec_buffer ? gst_buffer_ref (rec_buffer) : NULL;
+  job->frame_number = frame_number;
+  job->pts = pts;
+  job->metrics = metrics;
+  job->post_message = post_message;
+  g_thread_pool_push (quality->pool, job, NULL);
+
+  return TRUE;
+}
+
+/*
+ * Latest measured sample, FALSE if there is none yet.
+ */
+gboolean
+gst_kvazaar_quality_get_last (GstKvazaarQuality * quality,
+    GstKvazaarQualityResult * result)
+{
+  gboolean ret;
+
+  g_mutex_lock (&quality->lock);
+  ret = quality->measured > 0;
+  if (ret)
+    *result = quality->last;
+  g_mutex_unlock (&quality->lock);
+
+  return ret;
+}
+
+void
+gst_kvazaar_quality_get_counts (GstKvazaarQuality * quality,
+    guint64 * measured, guint64 * skipped)
+{
+  g_mutex_lock (&quality->lock);
+  *measured = quality->measured;
+  *skipped = quality->skipped;
+  g_mutex_unlock (&quality->lock);
+}
@@ -0,0 +1,72 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GST_KVAZAAR_QUALITY_H__
+#define __GST_KVAZAAR_QUALITY_H__
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <kvazaar.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+  GST_KVAZAAR_QUALITY_PSNR = (1 << 0),
+  GST_KVAZAAR_QUALITY_SSIM = (1 << 1),
+} GstKvazaarQualityMetrics;
+
+typedef struct _GstKvazaarQuality GstKvazaarQuality;
+typedef struct _GstKvazaarQualityResult GstKvazaarQualityResult;
+
+/*
+ * Quality of a reconstructed picture against its source. SSIM is of the
+ * luma plane.
+ */
+struct _GstKvazaarQualityResult
+{
+  guint32 frame_number;      /* system frame number of the picture */
+  GstClockTime pts;
+  guint metrics;             /* GstKvazaarQualityMetrics measured */
+  gdouble psnr[3];           /* Y, U and V, in dB */
+  gdouble ssim;
+};
+
+GstKvazaarQuality *gst_kvazaar_quality_new (const kvz_api * api,
+    GstElement * element, GError ** err);
+void gst_kvazaar_quality_free (GstKvazaarQuality * quality);
+
+gboolean gst_kvazaar_quality_push (GstKvazaarQuality * quality,
+    kvz_picture * src, GstVideoFrame * src_frame, kvz_picture * rec,
+    GstBuffer * rec_buffer,
+    guint32 frame_number, GstClockTime pts, guint metrics,
+    gboolean post_message);
+gboolean gst_kvazaar_quality_get_last (GstKvazaarQuality * quality,
+    GstKvazaarQualityResult * result);
+void gst_kvazaar_quality_get_counts (GstKvazaarQuality * quality,
+    guint64 * measured, guint64 * skipped);
+
+void gst_kvazaar_quality_measure (const kvz_picture * src,
+    const kvz_picture * rec, guint metrics, GstKvazaarQualityResult * result);
+guint64 gst_kvazaar_plane_sse (const kvz_pixel * a, gint a_stride,
+    const kvz_pixel * b, gint b_stride, gint width, gint height);
+gdouble gst_kvazaar_plane_ssim (const kvz_pixel * a, gint a_stride,
+    const kvz_pixel * b, gint b_stride, gint width, gint height);
+
+G_END_DECLS
+#endif /* __GST_KVAZAAR_QUALITY_H__ */
@@ -0,0 +1,448 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Recording of the input of kvazaarenc, and reading it back for
+ * kvazaar-replay.
+ *
+ * The recorder writes from the streaming thread and from set_property, under
+ * its own lock. A write error stops the recording, the element is told by
+ * the return value of the frame writes. Recordings are read from a mapping,
+ * the pictures are wrapped in buffers without a copy.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gstkvazaarrecord.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Written by chunks of this size */
+#define RECORDER_BUFFER_SIZE        (1024 * 1024)
+
+struct _GstKvazaarRecorder
+{
+  GMutex lock;
+  FILE *out;
+  gint64 start;                 /* monotonic, in us */
+  gboolean failed;
+
+  /* layout of the pictures, from the last caps */
+  GstVideoInfo info;
+  gboolean have_info;
+  GstBuffer *scratch;           /* for pictures in another layout */
+};
+
+struct _GstKvazaarRecording
+{
+  GMappedFile *mapped;
+  const guint8 *data;
+  gsize size;
+  gsize pos;
+};
+
+static void
+put_u32 (guint8 * p, guint32 v)
+{
+  v = GUINT32_TO_LE (v);
+  memcpy (p, &v, sizeof (v));
+}
+
+static void
+put_u64 (guint8 * p, guint64 v)
+{
+  v = GUINT64_TO_LE (v);
+  memcpy (p, &v, sizeof (v));
+}
+
+static guint32
+read_u32 (const guint8 * p)
+{
+  guint32 v;
+
+  memcpy (&v, p, sizeof (v));
+  return GUINT32_FROM_LE (v);
+}
+
+static guint64
+read_u64 (const guint8 * p)
+{
+  guint64 v;
+
+  memcpy (&v, p, sizeof (v));
+  return GUINT64_FROM_LE (v);
+}
+
+GstKvazaarRecorder *
+gst_kvazaar_recorder_new (const gchar * filename, GError ** error)
+{
+  guint8 header[GST_KVAZAAR_RECORD_HEADER_SIZE] = { 0 };
+  GstKvazaarRecorder *recorder;
+  guint16 version = GUINT16_TO_LE (GST_KVAZAAR_RECORD_VERSION);
+  FILE *out;
+
+  out = fopen (filename, "wb");
+  if (!out) {
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+        "Can not create %s: %s", filename, g_strerror (errno));
+    return NULL;
+  }
+  setvbuf (out, NULL, _IOFBF, RECORDER_BUFFER_SIZE);
+
+  memcpy (header, GST_KVAZAAR_RECORD_MAGIC, 4);
+  memcpy (header + 4, &version, sizeof (version));
+  if (fwrite (header, sizeof (header), 1, out) != 1) {
+    g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_IO,
+        "Can not write to %s", filename);
+    fclose (out);
+    return NULL;
+  }
+
+  recorder = g_slice_new0 (GstKvazaarRecorder);
+  g_mutex_init (&recorder->lock);
+  recorder->out = out;
+  recorder->start = g_get_monotonic_time ();
+
+  return recorder;
+}
+
+void
+gst_kvazaar_recorder_free (GstKvazaarRecorder * recorder)
+{
+  if (!recorder)
+    return;
+
+  fclose (recorder->out);
+  gst_buffer_replace (&recorder->scratch, NULL);
+  g_mutex_clear (&recorder->lock);
+  g_slice_free (GstKvazaarRecorder, recorder);
+}
+
+/* Called with the lock */
+static gboolean
+gst_kvazaar_recorder_write_record (GstKvazaarRecorder * recorder,
+    GstKvazaarRecordType type, GstBuffer * buffer, guint32 frame_flags,
+    const guint8 * data, gsize size)
+{
+  static const guint8 zeros[GST_KVAZAAR_RECORD_ALIGN] = { 0 };
+  guint8 header[GST_KVAZAAR_RECORD_HEADER_SIZE] = { 0 };
+  gsize pad = GST_ROUND_UP_64 (size) - size;
+
+  if (recorder->failed)
+    return FALSE;
+
+  put_u32 (header, type);
+  put_u32 (header + 4, buffer ? GST_BUFFER_FLAGS (buffer) : 0);
+  put_u64 (header + 8, (g_get_monotonic_time () - recorder->start) * 1000);
+  put_u64 (header + 16, buffer ? GST_BUFFER_PTS (buffer) :
+      GST_CLOCK_TIME_NONE);
+  put_u64 (header + 24, buffer ? GST_BUFFER_DTS (buffer) :
+      GST_CLOCK_TIME_NONE);
+  put_u64 (header + 32, buffer ? GST_BUFFER_DURATION (buffer) :
+      GST_CLOCK_TIME_NONE);
+  put_u64 (header + 40, size);
+  put_u32 (header + 48, frame_flags);
+
+  if (fwrite (header, sizeof (header), 1, recorder->out) != 1 ||
+      (size && fwrite (data, size, 1, recorder->out) != 1) ||
+      (pad && fwrite (zeros, pad, 1, recorder->out) != 1))
+    recorder->failed = TRUE;
+
+  return !recorder->failed;
+}
+
+void
+gst_kvazaar_recorder_write_caps (GstKvazaarRecorder * recorder,
+    GstCaps * caps)
+{
+  gchar *str = gst_caps_to_string (caps);
+
+  g_mutex_lock (&recorder->lock);
+  recorder->have_info = gst_video_info_from_caps (&recorder->info, caps);
+  if (recorder->have_info && (!recorder->scratch ||
+          gst_buffer_get_size (recorder->scratch) !=
+          GST_VIDEO_INFO_SIZE (&recorder->info))) {
+    gst_buffer_replace (&recorder->scratch, NULL);
+    recorder->scratch = gst_buffer_new_allocate (NULL,
+        GST_VIDEO_INFO_SIZE (&recorder->info), NULL);
+  }
+  gst_kvazaar_recorder_write_record (recorder, GST_KVAZAAR_RECORD_CAPS, NULL,
+      0, (const guint8 *) str, strlen (str) + 1);
+  g_mutex_unlock (&recorder->lock);
+
+  g_free (str);
+}
+
+void
+gst_kvazaar_recorder_write_property (GstKvazaarRecorder * recorder,
+    const gchar * name, const GValue * value)
+{
+  gchar *str = gst_value_serialize (value);
+  gsize name_len, str_len;
+  guint8 *payload;
+
+  /* Values without a string form can not be set again */
+  if (!str)
+    return;
+
+  name_len = strlen (name) + 1;
+  str_len = strlen (str) + 1;
+  payload = g_malloc (name_len + str_len);
+  memcpy (payload, name, name_len);
+  memcpy (payload + name_len, str, str_len);
+
+  g_mutex_lock (&recorder->lock);
+  gst_kvazaar_recorder_write_record (recorder, GST_KVAZAAR_RECORD_PROPERTY,
+      NULL, 0, payload, name_len + str_len);
+  g_mutex_unlock (&recorder->lock);
+
+  g_free (payload);
+  g_free (str);
+}
+
+/*
+ * Write the current value of the readable and writable properties of
+ * object, except those in skip and those of GstObject.
+ */
+void
+gst_kvazaar_recorder_write_properties (GstKvazaarRecorder * recorder,
+    GObject * object, const gchar * const *skip)
+{
+  GParamSpec **specs;
+  guint i, n;
+
+  specs = g_object_class_list_properties (G_OBJECT_GET_CLASS (object), &n);
+  for (i = 0; i < n; i++) {
+    GValue value = G_VALUE_INIT;
+    const gchar * const *s;
+
+    if ((specs[i]->flags & G_PARAM_READWRITE) != G_PARAM_READWRITE ||
+        (specs[i]->flags & G_PARAM_CONSTRUCT_ONLY) ||
+        specs[i]->owner_type == GST_TYPE_OBJECT)
+      continue;
+    for (s = skip; s && *s; s++)
+      if (g_strcmp0 (*s, specs[i]->name) == 0)
+        break;
+    if (s && *s)
+      continue;
+
+    g_value_init (&value, specs[i]->value_type);
+    g_object_get_property (object, specs[i]->name, &value);
+    gst_kvazaar_recorder_write_property (recorder, specs[i]->name, &value);
+    g_value_unset (&value);
+  }
+  g_free (specs);
+}
+
+/* TRUE if the planes of vframe are where the default layout has them */
+static gboolean
+gst_kvazaar_recorder_is_default_layout (GstVideoFrame * vframe,
+    const GstVideoInfo * info)
+{
+  const guint8 *base = vframe->map[0].data;
+  guint i;
+
+  if (gst_buffer_n_memory (vframe->buffer) != 1 ||
+      vframe->map[0].size < GST_VIDEO_INFO_SIZE (info))
+    return FALSE;
+
+  for (i = 0; i < GST_VIDEO_INFO_N_PLANES (info); i++)
+    if (GST_VIDEO_FRAME_PLANE_STRIDE (vframe, i) !=
+        GST_VIDEO_INFO_PLANE_STRIDE (info, i) ||
+        (const guint8 *) GST_VIDEO_FRAME_PLANE_DATA (vframe, i) !=
+        base + GST_VIDEO_INFO_PLANE_OFFSET (info, i))
+      return FALSE;
+
+  return TRUE;
+}
+
+/*
+ * Write an input buffer as a picture of the last caps. Returns FALSE once
+ * the recording has failed.
+ */
+gboolean
+gst_kvazaar_recorder_write_frame (GstKvazaarRecorder * recorder,
+    GstBuffer * buffer, gboolean force_key_unit)
+{
+  guint32 flags = force_key_unit ? GST_KVAZAAR_RECORD_FLAG_FORCE_KEY_UNIT : 0;
+  GstVideoFrame vframe, packed;
+  gboolean ret;
+
+  g_mutex_lock (&recorder->lock);
+  if (!recorder->have_info ||
+      !gst_video_frame_map (&vframe, &recorder->info, buffer, GST_MAP_READ)) {
+    ret = !recorder->failed;
+    g_mutex_unlock (&recorder->lock);
+    return ret;
+  }
+
+  if (gst_kvazaar_recorder_is_default_layout (&vframe, &recorder->info)) {
+    ret = gst_kvazaar_recorder_write_record (recorder,
+        GST_KVAZAAR_RECORD_FRAME, buffer, flags, vframe.map[0].data,
+        GST_VIDEO_INFO_SIZE (&recorder->info));
+  } else if (gst_video_frame_map (&packed, &recorder->info,
+          recorder->scratch, GST_MAP_WRITE)) {
+    gst_video_frame_copy (&packed, &vframe);
+    ret = gst_kvazaar_recorder_write_record (recorder,
+        GST_KVAZAAR_RECORD_FRAME, buffer, flags, packed.map[0].data,
+        GST_VIDEO_INFO_SIZE (&recorder->info));
+    gst_video_frame_unmap (&packed);
+  } else {
+    ret = !recorder->failed;
+  }
+  gst_video_frame_unmap (&vframe);
+  g_mutex_unlock (&recorder->lock);
+
+  return ret;
+}
+
+void
+gst_kvazaar_recorder_write_eos (GstKvazaarRecorder * recorder)
+{
+  g_mutex_lock (&recorder->lock);
+  gst_kvazaar_recorder_write_record (recorder, GST_KVAZAAR_RECORD_EOS, NULL,
+      0, NULL, 0);
+  fflush (recorder->out);
+  g_mutex_unlock (&recorder->lock);
+}
+
+GstKvazaarRecording *
+gst_kvazaar_recording_open (const gchar * filename, GError ** error)
+{
+  GstKvazaarRecording *recording;
+  GMappedFile *mapped;
+  const guint8 *data;
+  gsize size;
+  guint16 version;
+
+  mapped = g_mapped_file_new (filename, FALSE, error);
+  if (!mapped)
+    return NULL;
+
+  data = (const guint8 *) g_mapped_file_get_contents (mapped);
+  size = g_mapped_file_get_length (mapped);
+
+  if (size < GST_KVAZAAR_RECORD_HEADER_SIZE ||
+      memcmp (data, GST_KVAZAAR_RECORD_MAGIC, 4) != 0)
+    goto invalid;
+
+  memcpy (&version, data + 4, sizeof (version));
+  if (GUINT16_FROM_LE (version) != GST_KVAZAAR_RECORD_VERSION)
+    goto invalid;
+
+  recording = g_slice_new0 (GstKvazaarRecording);
+  recording->mapped = mapped;
+  recording->data = data;
+  recording->size = size;
+  recording->pos = GST_KVAZAAR_RECORD_HEADER_SIZE;
+
+  return recording;
+
+invalid:
+  g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+      "%s is not a valid kvazaarenc recording", filename);
+  g_mapped_file_unref (mapped);
+  return NULL;
+}
+
+void
+gst_kvazaar_recording_close (GstKvazaarRecording * recording)
+{
+  if (!recording)
+    return;
+
+  g_mapped_file_unref (recording->mapped);
+  g_slice_free (GstKvazaarRecording, recording);
+}
+
+/*
+ * Read the next record. Returns FALSE at the end of the recording, or at a
+ * truncated or invalid record.
+ */
+gboolean
+gst_kvazaar_recording_next (GstKvazaarRecording * recording,
+    GstKvazaarRecord * record)
+{
+  const guint8 *p = recording->data + recording->pos;
+  guint64 size;
+
+  if (recording->size - recording->pos < GST_KVAZAAR_RECORD_HEADER_SIZE)
+    return FALSE;
+
+  size = read_u64 (p + 40);
+  if (size > recording->size - recording->pos -
+      GST_KVAZAAR_RECORD_HEADER_SIZE)
+    return FALSE;
+
+  record->type = read_u32 (p);
+  record->buffer_flags = read_u32 (p + 4);
+  record->time = read_u64 (p + 8);
+  record->pts = read_u64 (p + 16);
+  record->dts = read_u64 (p + 24);
+  record->duration = read_u64 (p + 32);
+  record->frame_flags = read_u32 (p + 48);
+  record->data = p + GST_KVAZAAR_RECORD_HEADER_SIZE;
+  record->size = size;
+
+  /* Strings are NUL terminated, a property has two */
+  if ((record->type == GST_KVAZAAR_RECORD_CAPS ||
+          record->type == GST_KVAZAAR_RECORD_PROPERTY) &&
+      (!size || record->data[size - 1] != '\0'))
+    return FALSE;
+  if (record->type == GST_KVAZAAR_RECORD_PROPERTY &&
+      strlen ((const gchar *) record->data) + 1 >= size)
+    return FALSE;
+
+  recording->pos = MIN (recording->size, recording->pos +
+      GST_KVAZAAR_RECORD_HEADER_SIZE + GST_ROUND_UP_64 (size));
+
+  return TRUE;
+}
+
+void
+gst_kvazaar_recording_rewind (GstKvazaarRecording * recording)
+{
+  recording->pos = GST_KVAZAAR_RECORD_HEADER_SIZE;
+}
+
+/*
+ * Wrap the picture of a frame record in a buffer, which keeps the mapping
+ * alive.
+ */
+GstBuffer *
+gst_kvazaar_recording_get_buffer (GstKvazaarRecording * recording,
+    const GstKvazaarRecord * record)
+{
+  GstBuffer *buffer;
+
+  buffer = gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY,
+      (gpointer) record->data, record->size, 0, record->size,
+      g_mapped_file_ref (recording->mapped),
+      (GDestroyNotify) g_mapped_file_unref);
+
+  GST_BUFFER_FLAGS (buffer) = record->buffer_flags;
+  GST_BUFFER_PTS (buffer) = record->pts;
+  GST_BUFFER_DTS (buffer) = record->dts;
+  GST_BUFFER_DURATION (buffer) = record->duration;
+
+  return buffer;
+}
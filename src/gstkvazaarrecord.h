@@ -0,0 +1,113 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GST_KVAZAAR_RECORD_H__
+#define __GST_KVAZAAR_RECORD_H__
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Recording of the input of kvazaarenc, all fields little endian:
+ *
+ *   0   magic "KREC"
+ *   4   guint16 version (1)
+ *   6   ..  reserved (0) up to 64
+ *   64  records
+ *
+ * A record is a 64 bytes header:
+ *
+ *   0   guint32 type
+ *   4   guint32 buffer flags of a frame
+ *   8   guint64 arrival time in ns since the start of the recording
+ *   16  guint64 pts
+ *   24  guint64 dts
+ *   32  guint64 duration
+ *   40  guint64 payload size
+ *   48  guint32 frame flags
+ *   52  ..  reserved (0) up to 64
+ *
+ * followed by the payload, padded with zeros to a multiple of 64 bytes so
+ * that the pictures can be used in place from a mapping:
+ *
+ *   CAPS      the caps as a string, NUL terminated
+ *   PROPERTY  the name and the serialized value, each NUL terminated
+ *   FRAME     the picture, in the default layout of the last caps
+ *   EOS       nothing
+ *
+ * A recording starts with the value of every property of the element.
+ */
+#define GST_KVAZAAR_RECORD_MAGIC "KREC"
+#define GST_KVAZAAR_RECORD_VERSION 1
+#define GST_KVAZAAR_RECORD_HEADER_SIZE 64
+#define GST_KVAZAAR_RECORD_ALIGN 64
+
+typedef enum
+{
+  GST_KVAZAAR_RECORD_CAPS = 1,
+  GST_KVAZAAR_RECORD_PROPERTY = 2,
+  GST_KVAZAAR_RECORD_FRAME = 3,
+  GST_KVAZAAR_RECORD_EOS = 4,
+} GstKvazaarRecordType;
+
+#define GST_KVAZAAR_RECORD_FLAG_FORCE_KEY_UNIT (1 << 0)
+
+typedef struct
+{
+  GstKvazaarRecordType type;
+  guint32 buffer_flags;
+  guint64 time;
+  GstClockTime pts;
+  GstClockTime dts;
+  GstClockTime duration;
+  guint32 frame_flags;
+  const guint8 *data;
+  gsize size;
+} GstKvazaarRecord;
+
+typedef struct _GstKvazaarRecorder GstKvazaarRecorder;
+typedef struct _GstKvazaarRecording GstKvazaarRecording;
+
+GstKvazaarRecorder *gst_kvazaar_recorder_new (const gchar * filename,
+    GError ** error);
+void gst_kvazaar_recorder_free (GstKvazaarRecorder * recorder);
+
+void gst_kvazaar_recorder_write_caps (GstKvazaarRecorder * recorder,
+    GstCaps * caps);
+void gst_kvazaar_recorder_write_property (GstKvazaarRecorder * recorder,
+    const gchar * name, const GValue * value);
+void gst_kvazaar_recorder_write_properties (GstKvazaarRecorder * recorder,
+    GObject * object, const gchar * const *skip);
+gboolean gst_kvazaar_recorder_write_frame (GstKvazaarRecorder * recorder,
+    GstBuffer * buffer, gboolean force_key_unit);
+void gst_kvazaar_recorder_write_eos (GstKvazaarRecorder * recorder);
+
+GstKvazaarRecording *gst_kvazaar_recording_open (const gchar * filename,
+    GError ** error);
+void gst_kvazaar_recording_close (GstKvazaarRecording * recording);
+
+gboolean gst_kvazaar_recording_next (GstKvazaarRecording * recording,
+    GstKvazaarRecord * record);
+void gst_kvazaar_recording_rewind (GstKvazaarRecording * recording);
+GstBuffer *gst_kvazaar_recording_get_buffer (GstKvazaarRecording * recording,
+    const GstKvazaarRecord * record);
+
+G_END_DECLS
+#endif /* __GST_KVAZAAR_RECORD_H__ */
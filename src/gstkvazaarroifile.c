@@ -0,0 +1,229 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Per-frame ROI maps read from a memory mapped sequence file.
+ *
+ * The maps are used in place from the mapping, looking one up is a binary
+ * search in the key index, or a check of the next entry when the pictures
+ * come in order.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gstkvazaarroifile.h"
+
+#include <string.h>
+
+struct _GstKvazaarRoiFile
+{
+  GMappedFile *mapped;
+  guint16 flags;
+  gint width;
+  gint height;
+  guint count;
+  const guint8 *keys;
+  const gint8 *maps;
+  guint last;               /* entry returned by the previous lookup */
+};
+
+static guint32
+read_u32 (const guint8 * p)
+{
+  guint32 v;
+
+  memcpy (&v, p, sizeof (v));
+  return GUINT32_FROM_LE (v);
+}
+
+static guint64
+read_key (const GstKvazaarRoiFile * file, guint i)
+{
+  guint64 v;
+
+  memcpy (&v, file->keys + i * sizeof (v), sizeof (v));
+  return GUINT64_FROM_LE (v);
+}
+
+GstKvazaarRoiFile *
+gst_kvazaar_roi_file_open (const gchar * filename, GError ** error)
+{
+  GstKvazaarRoiFile *file;
+  GMappedFile *mapped;
+  const guint8 *data;
+  gsize size;
+  guint16 version;
+  guint64 map_size, expected;
+  guint i;
+
+  mapped = g_mapped_file_new (filename, FALSE, error);
+  if (!mapped)
+    return NULL;
+
+  data = (const guint8 *) g_mapped_file_get_contents (mapped);
+  size = g_mapped_file_get_length (mapped);
+
+  if (size < GST_KVAZAAR_ROI_FILE_HEADER_SIZE ||
+      memcmp (data, GST_KVAZAAR_ROI_FILE_MAGIC, 4) != 0)
+    goto invalid;
+
+  memcpy (&version, data + 4, sizeof (version));
+  if (GUINT16_FROM_LE (version) != GST_KVAZAAR_ROI_FILE_VERSION)
+    goto invalid;
+
+  file = g_slice_new0 (GstKvazaarRoiFile);
+  file->mapped = mapped;
+  memcpy (&file->flags, data + 6, sizeof (file->flags));
+  file->flags = GUINT16_FROM_LE (file->flags);
+  file->width = read_u32 (data + 8);
+  file->height = read_u32 (data + 12);
+  file->count = read_u32 (data + 16);
+
+  map_size = (guint64) file->width * file->height;
+  expected = GST_KVAZAAR_ROI_FILE_HEADER_SIZE +
+      (guint64) file->count * (sizeof (guint64) + map_size);
+  if (file->width <= 0 || file->height <= 0 || map_size > G_MAXINT ||
+      expected > size) {
+    g_slice_free (GstKvazaarRoiFile, file);
+    goto invalid;
+  }
+
+  file->keys = data + GST_KVAZAAR_ROI_FILE_HEADER_SIZE;
+  file->maps = (const gint8 *) (file->keys + file->count * sizeof (guint64));
+
+  /* The lookup is a binary search, it needs strictly increasing keys */
+  for (i = 1; i < file->count; i++) {
+    if (read_key (file, i) <= read_key (file, i - 1)) {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+          "%s: key of map %u is not above the previous one", filename, i);
+      gst_kvazaar_roi_file_close (file);
+      return NULL;
+    }
+  }
+
+  return file;
+
+invalid:
+  g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+      "%s is not a valid ROI sequence file", filename);
+  g_mapped_file_unref (mapped);
+  return NULL;
+}
+
+void
+gst_kvazaar_roi_file_close (GstKvazaarRoiFile * file)
+{
+  if (!file)
+    return;
+
+  g_mapped_file_unref (file->mapped);
+  g_slice_free (GstKvazaarRoiFile, file);
+}
+
+gboolean
+gst_kvazaar_roi_file_is_pts (const GstKvazaarRoiFile * file)
+{
+  return (file->flags & GST_KVAZAAR_ROI_FILE_FLAG_PTS) != 0;
+}
+
+guint
+gst_kvazaar_roi_file_get_count (const GstKvazaarRoiFile * file)
+{
+  return file->count;
+}
+
+/* TRUE if entry i is the map in effect at key */
+static gboolean
+entry_covers (const GstKvazaarRoiFile * file, guint i, guint64 key)
+{
+  return read_key (file, i) <= key &&
+      (i + 1 == file->count || read_key (file, i + 1) > key);
+}
+
+/*
+ * Find the map in effect at key, the last one with a key not above it.
+ * Returns NULL before the first map.
+ */
+const gint8 *
+gst_kvazaar_roi_file_lookup (GstKvazaarRoiFile * file, guint64 key,
+    gint * width, gint * height)
+{
+  guint lo, hi, i;
+
+  if (!file->count || key < read_key (file, 0))
+    return NULL;
+
+  if (entry_covers (file, file->last, key)) {
+    i = file->last;
+  } else if (file->last + 1 < file->count &&
+      entry_covers (file, file->last + 1, key)) {
+    i = file->last + 1;
+  } else {
+    /* first entry with a key above, the map is the one before */
+    lo = 0;
+    hi = file->count;
+    while (lo < hi) {
+      guint mid = lo + (hi - lo) / 2;
+
+      if (read_key (file, mid) <= key)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    i = lo - 1;
+  }
+
+  file->last = i;
+  *width = file->width;
+  *height = file->height;
+
+  return file->maps + (gsize) i * file->width * file->height;
+}
+
+gboolean
+gst_kvazaar_roi_file_write_header (FILE * out, guint16 flags, guint32 width,
+    guint32 height, guint32 count)
+{
+  guint8 header[GST_KVAZAAR_ROI_FILE_HEADER_SIZE] = { 0 };
+  guint16 v16;
+  guint32 v32;
+
+  memcpy (header, GST_KVAZAAR_ROI_FILE_MAGIC, 4);
+  v16 = GUINT16_TO_LE (GST_KVAZAAR_ROI_FILE_VERSION);
+  memcpy (header + 4, &v16, sizeof (v16));
+  v16 = GUINT16_TO_LE (flags);
+  memcpy (header + 6, &v16, sizeof (v16));
+  v32 = GUINT32_TO_LE (width);
+  memcpy (header + 8, &v32, sizeof (v32));
+  v32 = GUINT32_TO_LE (height);
+  memcpy (header + 12, &v32, sizeof (v32));
+  v32 = GUINT32_TO_LE (count);
+  memcpy (header + 16, &v32, sizeof (v32));
+
+  return fwrite (header, sizeof (header), 1, out) == 1;
+}
+
+gboolean
+gst_kvazaar_roi_file_write_key (FILE * out, guint64 key)
+{
+  key = GUINT64_TO_LE (key);
+
+  return fwrite (&key, sizeof (key), 1, out) == 1;
+}
@@ -0,0 +1,66 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GST_KVAZAAR_ROI_FILE_H__
+#define __GST_KVAZAAR_ROI_FILE_H__
+
+#include <glib.h>
+#include <stdio.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Binary ROI sequence file, all fields little endian:
+ *
+ *   0   magic "KROI"
+ *   4   guint16 version (1)
+ *   6   guint16 flags
+ *   8   guint32 map width
+ *   12  guint32 map height
+ *   16  guint32 number of maps
+ *   20  guint32 reserved (0)
+ *   24  guint64 key of each map, in strictly increasing order
+ *   ..  gint8 delta QPs of each map, width * height each, row major
+ *
+ * The key is the frame number, or the PTS in nanoseconds with
+ * GST_KVAZAAR_ROI_FILE_FLAG_PTS. A map applies from its key until the key
+ * of the next one.
+ */
+#define GST_KVAZAAR_ROI_FILE_MAGIC "KROI"
+#define GST_KVAZAAR_ROI_FILE_VERSION 1
+#define GST_KVAZAAR_ROI_FILE_HEADER_SIZE 24
+
+#define GST_KVAZAAR_ROI_FILE_FLAG_PTS (1 << 0)
+
+typedef struct _GstKvazaarRoiFile GstKvazaarRoiFile;
+
+GstKvazaarRoiFile *gst_kvazaar_roi_file_open (const gchar * filename,
+    GError ** error);
+void gst_kvazaar_roi_file_close (GstKvazaarRoiFile * file);
+
+gboolean gst_kvazaar_roi_file_is_pts (const GstKvazaarRoiFile * file);
+guint gst_kvazaar_roi_file_get_count (const GstKvazaarRoiFile * file);
+const gint8 *gst_kvazaar_roi_file_lookup (GstKvazaarRoiFile * file,
+    guint64 key, gint * width, gint * height);
+
+gboolean gst_kvazaar_roi_file_write_header (FILE * out, guint16 flags,
+    guint32 width, guint32 height, guint32 count);
+gboolean gst_kvazaar_roi_file_write_key (FILE * out, guint64 key);
+
+G_END_DECLS
+#endif /* __GST_KVAZAAR_ROI_FILE_H__ */
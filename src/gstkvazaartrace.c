@@ -0,0 +1,194 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gstkvazaartrace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+/* Events are formatted in memory and written by chunks of this size */
+#define TRACE_FLUSH_SIZE            (64 * 1024)
+
+gboolean gst_kvazaar_trace_enabled = FALSE;
+
+static GMutex trace_lock;
+static FILE *trace_file;
+static GString *trace_buf;
+static gint64 trace_epoch;
+
+/* Small thread IDs, as the trace viewers expect integers */
+static GPrivate trace_tid;
+static gint trace_next_tid;
+
+static gint
+gst_kvazaar_trace_get_tid (void)
+{
+  gint tid = GPOINTER_TO_INT (g_private_get (&trace_tid));
+
+  if (!tid) {
+    tid = g_atomic_int_add (&trace_next_tid, 1) + 1;
+    g_private_set (&trace_tid, GINT_TO_POINTER (tid));
+  }
+
+  return tid;
+}
+
+static void
+gst_kvazaar_trace_write (void)
+{
+  if (trace_buf->len)
+    fwrite (trace_buf->str, 1, trace_buf->len, trace_file);
+  g_string_truncate (trace_buf, 0);
+}
+
+static void gst_kvazaar_trace_append (const gchar * format, ...)
+    G_GNUC_PRINTF (1, 2);
+
+static void
+gst_kvazaar_trace_append (const gchar * format, ...)
+{
+  va_list args;
+
+  g_mutex_lock (&trace_lock);
+  va_start (args, format);
+  g_string_append_vprintf (trace_buf, format, args);
+  va_end (args);
+  /* The JSON array format allows the closing bracket to be left out */
+  g_string_append (trace_buf, ",\n");
+  if (trace_buf->len >= TRACE_FLUSH_SIZE)
+    gst_kvazaar_trace_write ();
+  g_mutex_unlock (&trace_lock);
+}
+
+/*
+ * Write out the pending events.
+ */
+void
+gst_kvazaar_trace_flush (void)
+{
+  if (!gst_kvazaar_trace_enabled)
+    return;
+
+  g_mutex_lock (&trace_lock);
+  gst_kvazaar_trace_write ();
+  fflush (trace_file);
+  g_mutex_unlock (&trace_lock);
+}
+
+/*
+ * Open the trace file named by GST_KVAZAAR_TRACE, once.
+ */
+void
+gst_kvazaar_trace_init (void)
+{
+  const gchar *path = g_getenv ("GST_KVAZAAR_TRACE");
+
+  if (gst_kvazaar_trace_enabled || !path || !*path)
+    return;
+
+  trace_file = fopen (path, "w");
+  if (!trace_file) {
+    GST_WARNING ("Can not open trace file %s", path);
+    return;
+  }
+
+  trace_buf = g_string_sized_new (TRACE_FLUSH_SIZE + 1024);
+  trace_epoch = g_get_monotonic_time ();
+  fputs ("[\n", trace_file);
+  gst_kvazaar_trace_enabled = TRUE;
+  atexit (gst_kvazaar_trace_flush);
+
+  gst_kvazaar_trace_append ("{\"name\":\"process_name\",\"ph\":\"M\","
+      "\"pid\":1,\"args\":{\"name\":\"gst-kvazaar\"}}");
+}
+
+/*
+ * Element name as a JSON string body. Element names are set by the
+ * application and may hold quotes, backslashes or control characters.
+ */
+static gchar *
+gst_kvazaar_trace_escape (const gchar * str)
+{
+  GString *out = g_string_sized_new (strlen (str));
+  const gchar *p;
+
+  for (p = str; *p; p++) {
+    if (*p == '"' || *p == '\\')
+      g_string_append_printf (out, "\\%c", *p);
+    else if ((guchar) * p < 0x20)
+      g_string_append_printf (out, "\\u%04x", (guchar) * p);
+    else
+      g_string_append_c (out, *p);
+  }
+
+  return g_string_free (out, FALSE);
+}
+
+/*
+ * A stage of frame, from start to now, on the calling thread. frame is -1
+ * when the stage is not about a single frame.
+ */
+void
+gst_kvazaar_trace_span (GstObject * obj, const gchar * name, gint64 frame,
+    gint64 start)
+{
+  gint64 now = g_get_monotonic_time ();
+  gchar *element = gst_kvazaar_trace_escape (GST_OBJECT_NAME (obj));
+
+  gst_kvazaar_trace_append ("{\"name\":\"%s\",\"cat\":\"kvazaar\","
+      "\"ph\":\"X\",\"ts\":%" G_GINT64_FORMAT ",\"dur\":%" G_GINT64_FORMAT
+      ",\"pid\":1,\"tid\":%d,\"args\":{\"element\":\"%s\",\"frame\":%"
+      G_GINT64_FORMAT "}}", name, start - trace_epoch, now - start,
+      gst_kvazaar_trace_get_tid (), element, frame);
+  g_free (element);
+}
+
+/*
+ * Lifetime of a frame in the element, as an async slice matched by element
+ * and frame number across threads.
+ */
+static void
+gst_kvazaar_trace_frame (GstObject * obj, guint32 frame, const gchar * phase)
+{
+  gchar *element = gst_kvazaar_trace_escape (GST_OBJECT_NAME (obj));
+
+  gst_kvazaar_trace_append ("{\"name\":\"frame\",\"cat\":\"kvazaar\","
+      "\"ph\":\"%s\",\"id\":\"%s/%u\",\"ts\":%" G_GINT64_FORMAT ","
+      "\"pid\":1,\"tid\":%d,\"args\":{\"element\":\"%s\",\"frame\":%u}}",
+      phase, element, frame, g_get_monotonic_time () - trace_epoch,
+      gst_kvazaar_trace_get_tid (), element, frame);
+  g_free (element);
+}
+
+void
+gst_kvazaar_trace_frame_begin (GstObject * obj, guint32 frame)
+{
+  gst_kvazaar_trace_frame (obj, frame, "b");
+}
+
+void
+gst_kvazaar_trace_frame_end (GstObject * obj, guint32 frame)
+{
+  gst_kvazaar_trace_frame (obj, frame, "e");
+}
@@ -0,0 +1,46 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GST_KVAZAAR_TRACE_H__
+#define __GST_KVAZAAR_TRACE_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Timestamps of the stages of the encoding, written as Chrome trace events
+ * (chrome://tracing, Perfetto) to the file named by GST_KVAZAAR_TRACE.
+ * Without it each trace point is a single test of a global.
+ */
+extern gboolean gst_kvazaar_trace_enabled;
+
+/* Start of a span, 0 when tracing is off */
+#define GST_KVAZAAR_TRACE_START() \
+  (G_UNLIKELY (gst_kvazaar_trace_enabled) ? g_get_monotonic_time () : 0)
+
+void gst_kvazaar_trace_init (void);
+void gst_kvazaar_trace_flush (void);
+
+void gst_kvazaar_trace_span (GstObject * obj, const gchar * name,
+    gint64 frame, gint64 start);
+void gst_kvazaar_trace_frame_begin (GstObject * obj, guint32 frame);
+void gst_kvazaar_trace_frame_end (GstObject * obj, guint32 frame);
+
+G_END_DECLS
+#endif /* __GST_KVAZAAR_TRACE_H__ */
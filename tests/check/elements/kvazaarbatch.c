@@ -0,0 +1,151 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "kvazaartestutils.h"
+
+#define FRAMES 20
+#define STREAMS 3
+
+/* Each stream has its own time range, so that a buffer of another stream
+ * is told apart */
+#define STREAM_OFFSET(s) ((s) * 10 * GST_SECOND)
+
+static void
+push_frames (GstHarness ** h)
+{
+  guint i, s;
+
+  /* Interleaved, as from several sources at once */
+  for (i = 0; i < FRAMES; i++) {
+    for (s = 0; s < STREAMS; s++) {
+      GstBuffer *buf = create_frame (h[s], i);
+
+      GST_BUFFER_PTS (buf) += STREAM_OFFSET (s);
+      fail_unless_equals_int (gst_harness_push (h[s], buf), GST_FLOW_OK);
+    }
+  }
+}
+
+GST_START_TEST (test_streams_flush_eos)
+{
+  GstElement *batch;
+  GstHarness *h[STREAMS];
+  GstPad *sinkpads[STREAMS];
+  GstSegment segment;
+  guint i, s;
+
+  batch = gst_element_factory_make ("kvazaarbatch", NULL);
+  fail_unless (batch != NULL);
+  /* Fewer workers than streams and a short queue, so that streams wait
+   * for each other; without reordering, each stream outputs in input
+   * order */
+  g_object_set (batch, "workers", 2, "max-queued", 2, "option-string",
+      "preset=ultrafast,gop=0", NULL);
+
+  for (s = 0; s < STREAMS; s++) {
+    gchar *sinkname, *srcname;
+
+#if GST_CHECK_VERSION (1, 20, 0)
+    sinkpads[s] = gst_element_request_pad_simple (batch, "sink_%u");
+#else
+    sinkpads[s] = gst_element_get_request_pad (batch, "sink_%u");
+#endif
+    fail_unless (sinkpads[s] != NULL);
+    sinkname = gst_pad_get_name (sinkpads[s]);
+    srcname = g_strdup_printf ("src_%s", sinkname + strlen ("sink_"));
+    h[s] = gst_harness_new_with_element (batch, sinkname, srcname);
+    gst_harness_set_src_caps_str (h[s], I420_CAPS);
+    g_free (sinkname);
+    g_free (srcname);
+  }
+
+  push_frames (h);
+
+  /* A flushing seek on every stream drops what the encoders hold */
+  for (s = 0; s < STREAMS; s++) {
+    GstBuffer *buf;
+
+    fail_unless (gst_harness_push_event (h[s], gst_event_new_flush_start ()));
+    fail_unless (gst_harness_push_event (h[s],
+            gst_event_new_flush_stop (TRUE)));
+    while ((buf = gst_harness_try_pull (h[s])))
+      gst_buffer_unref (buf);
+
+    gst_segment_init (&segment, GST_FORMAT_TIME);
+    fail_unless (gst_harness_push_event (h[s],
+            gst_event_new_segment (&segment)));
+  }
+
+  push_frames (h);
+  for (s = 0; s < STREAMS; s++)
+    fail_unless (gst_harness_push_event (h[s], gst_event_new_eos ()));
+
+  /* Every picture after the seek comes out on its own stream, in order,
+   * then EOS. A pull times out rather than hang. */
+  for (s = 0; s < STREAMS; s++) {
+    GstEvent *event;
+
+    for (i = 0; i < FRAMES; i++) {
+      GstBuffer *buf = gst_harness_pull (h[s]);
+
+      fail_unless (buf != NULL);
+      fail_unless_equals_uint64 (GST_BUFFER_PTS (buf), STREAM_OFFSET (s) +
+          gst_util_uint64_scale (i, GST_SECOND, 30));
+      gst_buffer_unref (buf);
+    }
+
+    do {
+      event = gst_harness_pull_event (h[s]);
+      fail_unless (event != NULL);
+      if (GST_EVENT_TYPE (event) == GST_EVENT_EOS) {
+        gst_event_unref (event);
+        break;
+      }
+      gst_event_unref (event);
+    } while (TRUE);
+    fail_unless (gst_harness_try_pull (h[s]) == NULL);
+  }
+
+  for (s = 0; s < STREAMS; s++)
+    gst_harness_teardown (h[s]);
+  for (s = 0; s < STREAMS; s++) {
+    gst_element_release_request_pad (batch, sinkpads[s]);
+    gst_object_unref (sinkpads[s]);
+  }
+  gst_object_unref (batch);
+}
+
+GST_END_TEST;
+
+static Suite *
+kvazaarbatch_suite (void)
+{
+  Suite *s = suite_create ("kvazaarbatch");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_streams_flush_eos);
+
+  return s;
+}
+
+GST_CHECK_MAIN (kvazaarbatch);
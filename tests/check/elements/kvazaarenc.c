@@ -0,0 +1,465 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "kvazaartestutils.h"
+
+#include "gstkvazaarmeta.h"
+
+#define FRAMES 30
+
+GST_START_TEST (test_zerolatency_one_in_one_out)
+{
+  GstHarness *h;
+  guint i;
+
+  h = gst_harness_new_parse ("kvazaarenc tune=zerolatency preset=ultrafast");
+  gst_harness_set_src_caps_str (h, I420_CAPS);
+
+  for (i = 0; i < FRAMES; i++) {
+    GstBuffer *out;
+
+    fail_unless_equals_int (gst_harness_push (h, create_frame (h, i)),
+        GST_FLOW_OK);
+    /* The access unit of each picture comes out before the next one goes
+     * in */
+    fail_unless_equals_int (gst_harness_buffers_received (h), i + 1);
+    out = gst_harness_pull (h);
+    fail_unless (out != NULL);
+    fail_unless_equals_uint64 (GST_BUFFER_PTS (out),
+        gst_util_uint64_scale (i, GST_SECOND, 30));
+    gst_buffer_unref (out);
+  }
+
+  /* and the encoder holds no picture back for EOS */
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+  fail_unless_equals_int (gst_harness_buffers_received (h), FRAMES);
+  fail_unless_equals_uint64 (gst_harness_query_latency (h), 0);
+
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_frame_stats)
+{
+  GstHarness *h;
+  GstElement *enc;
+  GstBus *bus;
+  GstMessage *msg;
+  GstStructure *stats;
+  guint64 frames, keyframes;
+  guint window, keyframe_size;
+  gdouble bitrate;
+  guint sizes[FRAMES];
+  guint i;
+
+  h = gst_harness_new_parse ("kvazaarenc tune=zerolatency preset=ultrafast "
+      "frame-stats=message");
+  bus = gst_bus_new ();
+  gst_element_set_bus (h->element, bus);
+  gst_harness_set_src_caps_str (h, I420_CAPS);
+
+  for (i = 0; i < FRAMES; i++)
+    fail_unless_equals_int (gst_harness_push (h, create_frame (h, i)),
+        GST_FLOW_OK);
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+
+  for (i = 0; i < FRAMES; i++) {
+    GstBuffer *out = gst_harness_pull (h);
+
+    fail_unless (out != NULL);
+    sizes[i] = gst_buffer_get_size (out);
+    gst_buffer_unref (out);
+  }
+
+  /* One message per access unit, in output order, with its size */
+  for (i = 0; i < FRAMES; i++) {
+    const GstStructure *st;
+    guint64 pts;
+    guint size;
+
+    msg = gst_bus_pop_filtered (bus, GST_MESSAGE_ELEMENT);
+    fail_unless (msg != NULL);
+    st = gst_message_get_structure (msg);
+    fail_unless (gst_structure_has_name (st, "kvazaarenc-frame-stats"));
+    fail_unless (gst_structure_get_uint64 (st, "pts", &pts));
+    fail_unless_equals_uint64 (pts, gst_util_uint64_scale (i, GST_SECOND,
+            30));
+    fail_unless (gst_structure_get_uint (st, "size", &size));
+    fail_unless_equals_int (size, sizes[i]);
+    gst_message_unref (msg);
+  }
+  fail_unless (gst_bus_pop_filtered (bus, GST_MESSAGE_ELEMENT) == NULL);
+
+  /* The rolling statistics cover the same access units */
+  enc = gst_harness_find_element (h, "kvazaarenc");
+  g_object_get (enc, "stats", &stats, NULL);
+  fail_unless (stats != NULL);
+  fail_unless (gst_structure_get_uint64 (stats, "frames", &frames));
+  fail_unless_equals_uint64 (frames, FRAMES);
+  fail_unless (gst_structure_get_uint (stats, "window", &window));
+  fail_unless (window > 1 && window <= FRAMES);
+  fail_unless (gst_structure_get_double (stats, "bitrate", &bitrate));
+  fail_unless (bitrate > 0);
+  fail_unless (gst_structure_get_uint64 (stats, "keyframes", &keyframes));
+  fail_unless (keyframes >= 1);
+  fail_unless (gst_structure_get_uint (stats, "keyframe-size-max",
+          &keyframe_size));
+  fail_unless (keyframe_size >= sizes[0]);
+  gst_structure_free (stats);
+  gst_object_unref (enc);
+
+  gst_element_set_bus (h->element, NULL);
+  gst_object_unref (bus);
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+/* After each flush, encoding restarts on a new encoder, with a key frame */
+GST_START_TEST (test_flush_restarts_with_key_frame)
+{
+  GstHarness *h;
+  GstSegment segment;
+  guint i, n;
+
+  h = gst_harness_new_parse ("kvazaarenc tune=zerolatency preset=ultrafast");
+  gst_harness_set_src_caps_str (h, I420_CAPS);
+
+  for (n = 0; n < 3; n++) {
+    if (n > 0) {
+      fail_unless (gst_harness_push_event (h, gst_event_new_flush_start ()));
+      fail_unless (gst_harness_push_event (h,
+              gst_event_new_flush_stop (TRUE)));
+      gst_segment_init (&segment, GST_FORMAT_TIME);
+      fail_unless (gst_harness_push_event (h,
+              gst_event_new_segment (&segment)));
+    }
+
+    for (i = 0; i < FRAMES / 3; i++) {
+      GstBuffer *out;
+
+      fail_unless_equals_int (gst_harness_push (h, create_frame (h, i)),
+          GST_FLOW_OK);
+      out = gst_harness_pull (h);
+      fail_unless (out != NULL);
+      fail_unless_equals_int (GST_BUFFER_FLAG_IS_SET (out,
+              GST_BUFFER_FLAG_DELTA_UNIT), i > 0);
+      gst_buffer_unref (out);
+    }
+  }
+
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+#if GST_CHECK_VERSION (1, 16, 0)
+/* Every encoded picture comes out of the recon pad with the PTS of its
+ * access unit, in the buffer of Kvazaar, whose layout the video meta
+ * gives */
+static void
+check_recon (const gchar * quality_interval)
+{
+  GstElement *enc;
+  GstHarness *h, *h_recon;
+  GstVideoInfo info;
+  GstCaps *caps;
+  guint i;
+
+  enc = gst_element_factory_make ("kvazaarenc", NULL);
+  fail_unless (enc != NULL);
+  gst_util_set_object_arg (G_OBJECT (enc), "tune", "zerolatency");
+  gst_util_set_object_arg (G_OBJECT (enc), "preset", "ultrafast");
+  gst_util_set_object_arg (G_OBJECT (enc), "quality-interval",
+      quality_interval);
+
+  h = gst_harness_new_with_element (enc, "sink", "src");
+  h_recon = gst_harness_new_with_element (enc, NULL, "recon");
+  gst_harness_add_propose_allocation_meta (h_recon, GST_VIDEO_META_API_TYPE,
+      NULL);
+  gst_harness_set_src_caps_str (h, I420_CAPS);
+
+  for (i = 0; i < FRAMES; i++)
+    fail_unless_equals_int (gst_harness_push (h, create_frame (h, i)),
+        GST_FLOW_OK);
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+
+  caps = gst_pad_get_current_caps (h_recon->sinkpad);
+  fail_unless (caps != NULL);
+  fail_unless (gst_video_info_from_caps (&info, caps));
+  gst_caps_unref (caps);
+  fail_unless_equals_int (GST_VIDEO_INFO_WIDTH (&info), WIDTH);
+  fail_unless_equals_int (GST_VIDEO_INFO_HEIGHT (&info), HEIGHT);
+
+  fail_unless_equals_int (gst_harness_buffers_in_queue (h), FRAMES);
+  fail_unless_equals_int (gst_harness_buffers_in_queue (h_recon), FRAMES);
+  for (i = 0; i < FRAMES; i++) {
+    GstBuffer *out = gst_harness_pull (h);
+    GstBuffer *recon = gst_harness_pull (h_recon);
+    GstVideoMeta *meta;
+
+    fail_unless (out != NULL);
+    fail_unless (recon != NULL);
+    fail_unless_equals_uint64 (GST_BUFFER_PTS (recon), GST_BUFFER_PTS (out));
+
+    /* The planes of a Kvazaar picture share one allocation, with half the
+     * luma stride for the chroma planes. 64 pixels need no padding. */
+    meta = gst_buffer_get_video_meta (recon);
+    fail_unless (meta != NULL);
+    fail_unless_equals_int (meta->width, WIDTH);
+    fail_unless_equals_int (meta->height, HEIGHT);
+    fail_unless_equals_int (meta->stride[0],
+        WIDTH * GST_VIDEO_INFO_COMP_PSTRIDE (&info, 0));
+    fail_unless_equals_int (meta->stride[1], meta->stride[0] / 2);
+    fail_unless_equals_int (meta->stride[2], meta->stride[0] / 2);
+
+    gst_buffer_unref (recon);
+    gst_buffer_unref (out);
+  }
+
+  gst_harness_teardown (h_recon);
+  gst_harness_teardown (h);
+  gst_object_unref (enc);
+}
+
+GST_START_TEST (test_recon)
+{
+  check_recon ("0");
+  /* the quality worker then reads the same pictures */
+  check_recon ("1");
+}
+
+GST_END_TEST;
+#endif
+
+/* The metas are read with the installed header only, as an application
+ * does */
+GST_START_TEST (test_frame_stats_meta)
+{
+  GstHarness *h;
+  guint i;
+
+  h = gst_harness_new_parse ("kvazaarenc tune=zerolatency preset=ultrafast "
+      "frame-stats=meta");
+  gst_harness_set_src_caps_str (h, I420_CAPS);
+
+  for (i = 0; i < FRAMES; i++) {
+    GstKvazaarFrameStatsMeta *stats;
+    GstBuffer *out;
+
+    fail_unless_equals_int (gst_harness_push (h, create_frame (h, i)),
+        GST_FLOW_OK);
+    out = gst_harness_pull (h);
+    fail_unless (out != NULL);
+
+    stats = gst_buffer_get_kvazaar_frame_stats_meta (out);
+    fail_unless (stats != NULL);
+    fail_unless_equals_int (stats->size, gst_buffer_get_size (out));
+    fail_unless (gst_buffer_get_kvazaar_temporal_meta (out) != NULL);
+    gst_buffer_unref (out);
+  }
+
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+/* Encodes FRAMES pictures with a hierarchical GOP and returns the number
+ * of access units output, with the highest temporal ID among them */
+static guint
+encode_temporal_layers (const gchar * max_temporal_layer, guint * max_id)
+{
+  GstHarness *h;
+  gchar *launch;
+  guint i, n;
+
+  launch = g_strdup_printf ("kvazaarenc preset=ultrafast gop=8 %s",
+      max_temporal_layer);
+  h = gst_harness_new_parse (launch);
+  g_free (launch);
+  gst_harness_set_src_caps_str (h, I420_CAPS);
+
+  for (i = 0; i < FRAMES; i++)
+    fail_unless_equals_int (gst_harness_push (h, create_frame (h, i)),
+        GST_FLOW_OK);
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+
+  *max_id = 0;
+  n = gst_harness_buffers_in_queue (h);
+  for (i = 0; i < n; i++) {
+    GstKvazaarTemporalMeta *meta;
+    GstBuffer *out = gst_harness_pull (h);
+
+    fail_unless (out != NULL);
+    meta = gst_buffer_get_kvazaar_temporal_meta (out);
+    fail_unless (meta != NULL);
+    if (!GST_BUFFER_FLAG_IS_SET (out, GST_BUFFER_FLAG_DELTA_UNIT))
+      fail_unless_equals_int (meta->temporal_id, 0);
+    /* only pictures above the base layer can be left out */
+    if (GST_BUFFER_FLAG_IS_SET (out, GST_BUFFER_FLAG_DROPPABLE))
+      fail_unless (meta->temporal_id > 0);
+    *max_id = MAX (*max_id, meta->temporal_id);
+    gst_buffer_unref (out);
+  }
+
+  gst_harness_teardown (h);
+
+  return n;
+}
+
+GST_START_TEST (test_max_temporal_layer)
+{
+  guint n, layers, max_id;
+
+  /* All layers of the GOP come out by default */
+  n = encode_temporal_layers ("", &layers);
+  fail_unless_equals_int (n, FRAMES);
+
+  /* and none above max-temporal-layer */
+  n = encode_temporal_layers ("max-temporal-layer=1", &max_id);
+  fail_unless (max_id <= 1);
+  if (layers > 1)
+    fail_unless (n < FRAMES);
+
+  n = encode_temporal_layers ("max-temporal-layer=0", &max_id);
+  fail_unless_equals_int (max_id, 0);
+  if (layers > 0)
+    fail_unless (n > 0 && n < FRAMES);
+}
+
+GST_END_TEST;
+
+#if GST_CHECK_VERSION (1, 12, 0)
+#define INTERLEAVED_CAPS \
+  "video/x-raw, format = (string) I420, width = (int) 64, " \
+  "height = (int) 64, framerate = (fraction) 30/1, " \
+  "interlace-mode = (string) interleaved, field-order = (string) %s"
+
+/* pic_struct of the first picture timing SEI of an access unit, -1 if
+ * there is none */
+static gint
+get_pic_struct (GstBuffer * buf)
+{
+  GstMapInfo map;
+  gint pic_struct = -1;
+  gsize i;
+
+  gst_buffer_map (buf, &map, GST_MAP_READ);
+  for (i = 0; i + 3 < map.size && pic_struct < 0; i++) {
+    const guint8 *nal = map.data + i + 3;
+    gsize left = map.size - i - 3;
+    gsize pos = 2;
+    guint type = 0, size = 0;
+
+    if (map.data[i] || map.data[i + 1] || map.data[i + 2] != 1)
+      continue;
+    /* prefix SEI */
+    if (left < 2 || ((nal[0] >> 1) & 0x3f) != 39)
+      continue;
+
+    while (pos < left && nal[pos] == 0xff)
+      type += nal[pos++];
+    if (pos < left)
+      type += nal[pos++];
+    while (pos < left && nal[pos] == 0xff)
+      size += nal[pos++];
+    if (pos < left)
+      size += nal[pos++];
+
+    /* pic_struct is the first 4 bits of a picture timing payload */
+    if (type == 1 && size > 0 && pos < left)
+      pic_struct = nal[pos] >> 4;
+  }
+  gst_buffer_unmap (buf, &map);
+
+  return pic_struct;
+}
+
+/* Interleaved caps give Kvazaar the field order to code, which it signals
+ * in the pic_struct of the first field: 1 for a top field, 2 for a bottom
+ * field. Both fields of a frame come out in one access unit, with the
+ * timestamps of the frame. */
+static void
+check_field_order (const gchar * field_order, gint first_pic_struct)
+{
+  GstHarness *h;
+  gchar *caps;
+  guint i;
+
+  h = gst_harness_new_parse ("kvazaarenc tune=zerolatency preset=ultrafast");
+  caps = g_strdup_printf (INTERLEAVED_CAPS, field_order);
+  gst_harness_set_src_caps_str (h, caps);
+  g_free (caps);
+
+  for (i = 0; i < FRAMES; i++)
+    fail_unless_equals_int (gst_harness_push (h, create_frame (h, i)),
+        GST_FLOW_OK);
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+
+  fail_unless_equals_int (gst_harness_buffers_in_queue (h), FRAMES);
+  for (i = 0; i < FRAMES; i++) {
+    GstBuffer *out = gst_harness_pull (h);
+
+    fail_unless (out != NULL);
+    fail_unless_equals_uint64 (GST_BUFFER_PTS (out),
+        gst_util_uint64_scale (i, GST_SECOND, 30));
+    if (i == 0)
+      fail_unless_equals_int (get_pic_struct (out), first_pic_struct);
+    gst_buffer_unref (out);
+  }
+
+  gst_harness_teardown (h);
+}
+
+GST_START_TEST (test_interleaved_field_order)
+{
+  check_field_order ("top-field-first", 1);
+  check_field_order ("bottom-field-first", 2);
+}
+
+GST_END_TEST;
+#endif
+
+static Suite *
+kvazaarenc_suite (void)
+{
+  Suite *s = suite_create ("kvazaarenc");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_zerolatency_one_in_one_out);
+  tcase_add_test (tc_chain, test_flush_restarts_with_key_frame);
+  tcase_add_test (tc_chain, test_frame_stats);
+  tcase_add_test (tc_chain, test_frame_stats_meta);
+  tcase_add_test (tc_chain, test_max_temporal_layer);
+#if GST_CHECK_VERSION (1, 16, 0)
+  tcase_add_test (tc_chain, test_recon);
+#endif
+#if GST_CHECK_VERSION (1, 12, 0)
+  tcase_add_test (tc_chain, test_interleaved_field_order);
+#endif
+
+  return s;
+}
+
+GST_CHECK_MAIN (kvazaarenc);
@@ -0,0 +1,147 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "kvazaartestutils.h"
+
+#define FRAMES 24
+#define INTRA_PERIOD 8
+/* A key frame asked on one rendition, off the intra period */
+#define FORCED_FRAME 13
+
+/* Pull every access unit of a rendition, and return the PTS of its IRAPs
+ * in output order */
+static GArray *
+pull_irap_pts (GstHarness * h, guint expected)
+{
+  GArray *pts = g_array_new (FALSE, FALSE, sizeof (GstClockTime));
+  guint i;
+
+  fail_unless_equals_int (gst_harness_buffers_in_queue (h), expected);
+  for (i = 0; i < expected; i++) {
+    GstBuffer *buf = gst_harness_pull (h);
+
+    fail_unless (buf != NULL);
+    if (!GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_DELTA_UNIT))
+      g_array_append_val (pts, GST_BUFFER_PTS (buf));
+    gst_buffer_unref (buf);
+  }
+
+  return pts;
+}
+
+static void
+check_caps_size (GstHarness * h, gint width, gint height)
+{
+  GstCaps *caps = gst_pad_get_current_caps (h->sinkpad);
+  GstStructure *s;
+  gint caps_width, caps_height;
+
+  fail_unless (caps != NULL);
+  s = gst_caps_get_structure (caps, 0);
+  fail_unless (gst_structure_has_name (s, "video/x-h265"));
+  fail_unless (gst_structure_get_int (s, "width", &caps_width));
+  fail_unless (gst_structure_get_int (s, "height", &caps_height));
+  fail_unless_equals_int (caps_width, width);
+  fail_unless_equals_int (caps_height, height);
+  gst_caps_unref (caps);
+}
+
+GST_START_TEST (test_aligned_renditions)
+{
+  GstElement *ladder;
+  GstHarness *h_full, *h_half;
+  GstPad *pad;
+  GArray *full_pts, *half_pts;
+  guint i;
+
+  ladder = gst_element_factory_make ("kvazaarladder", NULL);
+  fail_unless (ladder != NULL);
+  g_object_set (ladder, "intra-period", INTRA_PERIOD, "option-string",
+      "preset=ultrafast", NULL);
+
+  /* One rendition of the input size and one of half of it, with the
+   * height from the input aspect ratio */
+  h_full = gst_harness_new_with_element (ladder, "sink", "src_0");
+  h_half = gst_harness_new_with_element (ladder, NULL, "src_1");
+  pad = gst_pad_get_peer (h_half->sinkpad);
+  fail_unless (pad != NULL);
+  g_object_set (pad, "width", WIDTH / 2, NULL);
+  gst_object_unref (pad);
+
+  gst_harness_set_src_caps_str (h_full, I420_CAPS);
+
+  for (i = 0; i < FRAMES; i++) {
+    if (i == FORCED_FRAME)
+      fail_unless (gst_harness_push_upstream_event (h_half,
+              gst_video_event_new_upstream_force_key_unit
+              (GST_CLOCK_TIME_NONE, TRUE, 0)));
+    fail_unless_equals_int (gst_harness_push (h_full, create_frame (h_full,
+                i)), GST_FLOW_OK);
+  }
+  fail_unless (gst_harness_push_event (h_full, gst_event_new_eos ()));
+
+  check_caps_size (h_full, WIDTH, HEIGHT);
+  check_caps_size (h_half, WIDTH / 2, HEIGHT / 2);
+
+  /* The renditions report the pictures their encoders hold, the same for
+   * the same GOP */
+  fail_unless (gst_harness_query_latency (h_full) > 0);
+  fail_unless_equals_uint64 (gst_harness_query_latency (h_half),
+      gst_harness_query_latency (h_full));
+
+  /* Every rendition has all pictures, with its IRAPs on the same ones,
+   * including the one asked on a single rendition */
+  full_pts = pull_irap_pts (h_full, FRAMES);
+  half_pts = pull_irap_pts (h_half, FRAMES);
+  fail_unless (full_pts->len > 1);
+  fail_unless_equals_int (full_pts->len, half_pts->len);
+  for (i = 0; i < full_pts->len; i++)
+    fail_unless_equals_uint64 (g_array_index (full_pts, GstClockTime, i),
+        g_array_index (half_pts, GstClockTime, i));
+  for (i = 0; i < full_pts->len; i++)
+    if (g_array_index (full_pts, GstClockTime, i) ==
+        gst_util_uint64_scale (FORCED_FRAME, GST_SECOND, 30))
+      break;
+  fail_unless (i < full_pts->len);
+
+  g_array_unref (full_pts);
+  g_array_unref (half_pts);
+  gst_harness_teardown (h_half);
+  gst_harness_teardown (h_full);
+  gst_object_unref (ladder);
+}
+
+GST_END_TEST;
+
+static Suite *
+kvazaarladder_suite (void)
+{
+  Suite *s = suite_create ("kvazaarladder");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_aligned_renditions);
+
+  return s;
+}
+
+GST_CHECK_MAIN (kvazaarladder);
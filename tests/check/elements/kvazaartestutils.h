@@ -0,0 +1,60 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __KVAZAAR_TEST_UTILS_H__
+#define __KVAZAAR_TEST_UTILS_H__
+
+#include <gst/check/gstcheck.h>
+#include <gst/check/gstharness.h>
+#include <gst/video/video.h>
+
+#include <string.h>
+
+/* Input of the element tests */
+#define WIDTH 64
+#define HEIGHT 64
+
+#define I420_CAPS \
+  "video/x-raw, format = (string) I420, width = (int) 64, " \
+  "height = (int) 64, framerate = (fraction) 30/1"
+
+/* A grey picture with a moving bar, so that pictures differ */
+static inline GstBuffer *
+create_frame (GstHarness * h, guint n)
+{
+  GstVideoInfo info;
+  GstMapInfo map;
+  GstBuffer *buf;
+  guint y;
+
+  gst_video_info_set_format (&info, GST_VIDEO_FORMAT_I420, WIDTH, HEIGHT);
+  buf = gst_harness_create_buffer (h, GST_VIDEO_INFO_SIZE (&info));
+  gst_buffer_map (buf, &map, GST_MAP_WRITE);
+  memset (map.data, 128, map.size);
+  for (y = 0; y < HEIGHT; y++)
+    memset (map.data + y * GST_VIDEO_INFO_PLANE_STRIDE (&info, 0) +
+        (n * 4) % (WIDTH - 8), 235, 8);
+  gst_buffer_unmap (buf, &map);
+
+  GST_BUFFER_PTS (buf) = gst_util_uint64_scale (n, GST_SECOND, 30);
+  GST_BUFFER_DURATION (buf) = gst_util_uint64_scale (1, GST_SECOND, 30);
+
+  return buf;
+}
+
+#endif /* __KVAZAAR_TEST_UTILS_H__ */
@@ -0,0 +1,263 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Encode a recording made with the record-location property of kvazaarenc
+ * again, to reproduce its load offline.
+ *
+ * The pictures are pushed from the mapped recording through
+ *
+ *   appsrc ! kvazaarenc ! fakesink (or filesink with --output)
+ *
+ * with their caps, timestamps, flags and key unit requests. The properties
+ * set before the first frame are applied before starting, later changes
+ * are applied from the streaming thread just before the frame that followed
+ * them in the recording. Frames are pushed as fast as the encoder takes
+ * them, or at their recorded arrival times with --realtime.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/video/video.h>
+
+#include "gstkvazaarrecord.h"
+
+typedef struct
+{
+  guint64 frame;                /* frames recorded before the change */
+  const gchar *name;
+  const gchar *value;
+} ReplayProperty;
+
+typedef struct
+{
+  GstElement *enc;
+  GArray *props;
+  guint next_prop;
+  guint64 frames;               /* reached the encoder */
+} Replay;
+
+static void
+replay_set_property (GstElement * enc, const gchar * name,
+    const gchar * value)
+{
+  if (!g_object_class_find_property (G_OBJECT_GET_CLASS (enc), name)) {
+    g_printerr ("kvazaarenc has no property %s, skipped\n", name);
+    return;
+  }
+  gst_util_set_object_arg (G_OBJECT (enc), name, value);
+}
+
+/* Applies the property changes recorded before this frame */
+static GstPadProbeReturn
+replay_frame_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  Replay *replay = user_data;
+
+  while (replay->next_prop < replay->props->len) {
+    ReplayProperty *prop = &g_array_index (replay->props, ReplayProperty,
+        replay->next_prop);
+
+    if (prop->frame > replay->frames)
+      break;
+    replay_set_property (replay->enc, prop->name, prop->value);
+    replay->next_prop++;
+  }
+  replay->frames++;
+
+  return GST_PAD_PROBE_OK;
+}
+
+int
+main (int argc, char **argv)
+{
+  gboolean realtime = FALSE;
+  gchar *output = NULL;
+  gchar **overrides = NULL;
+  GOptionEntry entries[] = {
+    {"realtime", 'r', 0, G_OPTION_ARG_NONE, &realtime,
+        "Push the frames at their recorded arrival times", NULL},
+    {"output", 'o', 0, G_OPTION_ARG_FILENAME, &output,
+        "Write the encoded stream to FILE", "FILE"},
+    {"set", 's', 0, G_OPTION_ARG_STRING_ARRAY, &overrides,
+        "Set a kvazaarenc property after the recorded ones, can be repeated",
+        "NAME=VALUE"},
+    {NULL}
+  };
+  GOptionContext *ctx;
+  GError *err = NULL;
+  GstKvazaarRecording *recording;
+  GstKvazaarRecord record;
+  Replay replay = { NULL, };
+  GstElement *pipeline, *src, *sink;
+  GstPad *pad;
+  GstBus *bus;
+  GstMessage *msg;
+  guint64 frames = 0;
+  gint64 start;
+  gdouble wall;
+  gboolean have_caps = FALSE;
+  guint i;
+  int ret = 0;
+
+  ctx = g_option_context_new ("RECORDING");
+  g_option_context_set_summary (ctx, "Encode a kvazaarenc recording again");
+  g_option_context_add_main_entries (ctx, entries, NULL);
+  g_option_context_add_group (ctx, gst_init_get_option_group ());
+  if (!g_option_context_parse (ctx, &argc, &argv, &err) || argc != 2) {
+    g_printerr ("%s\n", err ? err->message : "expected a recording");
+    g_clear_error (&err);
+    g_option_context_free (ctx);
+    return 1;
+  }
+  g_option_context_free (ctx);
+
+  recording = gst_kvazaar_recording_open (argv[1], &err);
+  if (!recording) {
+    g_printerr ("%s\n", err->message);
+    g_error_free (err);
+    return 1;
+  }
+
+  /* Index the property changes by the frame they came before */
+  replay.props = g_array_new (FALSE, FALSE, sizeof (ReplayProperty));
+  while (gst_kvazaar_recording_next (recording, &record)) {
+    if (record.type == GST_KVAZAAR_RECORD_PROPERTY) {
+      ReplayProperty prop;
+
+      prop.frame = frames;
+      prop.name = (const gchar *) record.data;
+      prop.value = prop.name + strlen (prop.name) + 1;
+      g_array_append_val (replay.props, prop);
+    } else if (record.type == GST_KVAZAAR_RECORD_FRAME) {
+      frames++;
+    }
+  }
+  gst_kvazaar_recording_rewind (recording);
+
+  pipeline = gst_pipeline_new (NULL);
+  src = gst_element_factory_make ("appsrc", NULL);
+  replay.enc = gst_element_factory_make ("kvazaarenc", NULL);
+  sink = gst_element_factory_make (output ? "filesink" : "fakesink", NULL);
+  if (!src || !replay.enc || !sink) {
+    g_printerr ("appsrc, kvazaarenc or %s not found\n",
+        output ? "filesink" : "fakesink");
+    return 1;
+  }
+  if (output)
+    g_object_set (sink, "location", output, NULL);
+  else
+    g_object_set (sink, "sync", FALSE, NULL);
+  g_object_set (src, "format", GST_FORMAT_TIME, "block", TRUE, NULL);
+  gst_bin_add_many (GST_BIN (pipeline), src, replay.enc, sink, NULL);
+  gst_element_link_many (src, replay.enc, sink, NULL);
+
+  /* Settings of the recording, then the overrides */
+  while (replay.next_prop < replay.props->len &&
+      g_array_index (replay.props, ReplayProperty, replay.next_prop).frame ==
+      0) {
+    ReplayProperty *prop = &g_array_index (replay.props, ReplayProperty,
+        replay.next_prop);
+
+    replay_set_property (replay.enc, prop->name, prop->value);
+    replay.next_prop++;
+  }
+  for (i = 0; overrides && overrides[i]; i++) {
+    gchar **kv = g_strsplit (overrides[i], "=", 2);
+
+    if (kv[0] && kv[1])
+      replay_set_property (replay.enc, kv[0], kv[1]);
+    else
+      g_printerr ("ignoring %s, expected NAME=VALUE\n", overrides[i]);
+    g_strfreev (kv);
+  }
+
+  pad = gst_element_get_static_pad (replay.enc, "sink");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, replay_frame_probe,
+      &replay, NULL);
+  gst_object_unref (pad);
+
+  bus = gst_element_get_bus (pipeline);
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+  start = g_get_monotonic_time ();
+
+  frames = 0;
+  while (gst_kvazaar_recording_next (recording, &record)) {
+    if (record.type == GST_KVAZAAR_RECORD_EOS)
+      break;
+
+    if (realtime) {
+      gint64 wait = start + record.time / 1000 - g_get_monotonic_time ();
+
+      if (wait > 0)
+        g_usleep (wait);
+    }
+
+    if (record.type == GST_KVAZAAR_RECORD_CAPS) {
+      GstCaps *caps = gst_caps_from_string ((const gchar *) record.data);
+
+      gst_app_src_set_caps (GST_APP_SRC (src), caps);
+      gst_caps_unref (caps);
+      have_caps = TRUE;
+    } else if (record.type == GST_KVAZAAR_RECORD_FRAME && have_caps) {
+      if (record.frame_flags & GST_KVAZAAR_RECORD_FLAG_FORCE_KEY_UNIT)
+        gst_element_send_event (src,
+            gst_video_event_new_downstream_force_key_unit (record.pts,
+                GST_CLOCK_TIME_NONE, record.pts, FALSE, 0));
+
+      if (gst_app_src_push_buffer (GST_APP_SRC (src),
+              gst_kvazaar_recording_get_buffer (recording,
+                  &record)) != GST_FLOW_OK)
+        break;
+      frames++;
+    }
+  }
+  gst_app_src_end_of_stream (GST_APP_SRC (src));
+
+  msg = gst_bus_timed_pop_filtered (bus, GST_CLOCK_TIME_NONE,
+      GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  wall = (g_get_monotonic_time () - start) / 1e6;
+  if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_ERROR) {
+    gchar *debug = NULL;
+
+    gst_message_parse_error (msg, &err, &debug);
+    g_printerr ("%s\n%s\n", err->message, debug ? debug : "");
+    g_error_free (err);
+    g_free (debug);
+    ret = 1;
+  }
+  gst_message_unref (msg);
+
+  g_print ("%" G_GUINT64_FORMAT " frames in %.3f s, %.2f fps\n", frames,
+      wall, wall > 0 ? frames / wall : 0);
+
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (bus);
+  gst_object_unref (pipeline);
+  g_array_free (replay.props, TRUE);
+  gst_kvazaar_recording_close (recording);
+  g_strfreev (overrides);
+
+  return ret;
+}
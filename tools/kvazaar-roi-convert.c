@@ -0,0 +1,218 @@
+/* GStreamer HEVC encoder plugin
+ * Copyright (C) <2019> Alexandre Esse <alexandre.esse.dev@gmail.com>
+ *
+ * This file is part of gst-kvazaar.
+ *
+ * gst-kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * gst-kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with gst-kvazaar.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Convert ROI maps in the text syntax of the kvazaarenc roi property to a
+ * ROI sequence file for the roi-file property.
+ *
+ * Every line of the input holds the map of one frame:
+ *
+ *   [@<key>] <width> <height> <dqp> <dqp> ...
+ *
+ * where the values are separated by ",", ";", ":" or " ". The key is the
+ * frame number, or the PTS in nanoseconds with --pts. Without a key a line
+ * applies to the frame after the previous one. Empty lines and lines
+ * starting with "#" are skipped.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gstkvazaarroifile.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+static gboolean
+parse_value (const gchar * str, gint64 min, gint64 max, gint64 * value)
+{
+  gchar *end;
+
+  errno = 0;
+  *value = g_ascii_strtoll (str, &end, 10);
+
+  return errno == 0 && *end == '\0' && *value >= min && *value <= max;
+}
+
+static gboolean
+parse_line (gchar * line, guint lineno, gboolean * has_key, guint64 * key,
+    gint * width, gint * height, GByteArray * maps)
+{
+  gchar **tokens, **t;
+  gint64 v;
+  gint n = 0, size;
+  gboolean ret = FALSE;
+
+  tokens = g_strsplit_set (line, ",;: \t", -1);
+  t = tokens;
+
+  while (*t && **t == '\0')
+    t++;
+
+  *has_key = *t && **t == '@';
+  if (*has_key) {
+    if (!parse_value (*t + 1, 0, G_MAXINT64, &v))
+      goto error;
+    *key = v;
+    t++;
+  }
+
+  for (; *t; t++) {
+    if (**t == '\0')
+      continue;
+
+    if (n < 2) {
+      if (!parse_value (*t, 1, G_MAXINT, &v))
+        goto error;
+      if (n == 0 && *width && v != *width)
+        goto size_error;
+      if (n == 1 && *height && v != *height)
+        goto size_error;
+      if (n == 0)
+        *width = v;
+      else
+        *height = v;
+    } else {
+      gint8 dqp;
+
+      if (!parse_value (*t, -51, 51, &v))
+        goto error;
+      dqp = v;
+      g_byte_array_append (maps, (const guint8 *) &dqp, 1);
+    }
+    n++;
+  }
+
+  size = *width * *height;
+  if (n - 2 != size) {
+    g_printerr ("line %u: expected %d delta QPs, got %d\n", lineno, size,
+        MAX (n - 2, 0));
+    goto out;
+  }
+
+  ret = TRUE;
+  goto out;
+
+error:
+  g_printerr ("line %u: invalid value \"%s\"\n", lineno, *t);
+  goto out;
+size_error:
+  g_printerr ("line %u: all maps must have the same size\n", lineno);
+out:
+  g_strfreev (tokens);
+  return ret;
+}
+
+int
+main (int argc, char **argv)
+{
+  gboolean pts = FALSE;
+  GOptionEntry entries[] = {
+    {"pts", 'p', 0, G_OPTION_ARG_NONE, &pts,
+        "Keys are PTS in nanoseconds instead of frame numbers", NULL},
+    {NULL}
+  };
+  GOptionContext *ctx;
+  GError *err = NULL;
+  gchar *contents;
+  gchar **lines;
+  GArray *keys;
+  GByteArray *maps;
+  FILE *out;
+  gint width = 0, height = 0;
+  guint64 key = 0;
+  guint i;
+  int ret = 1;
+
+  ctx = g_option_context_new ("INPUT.txt OUTPUT.roi");
+  g_option_context_set_summary (ctx, "Convert kvazaarenc text ROI maps to "
+      "a ROI sequence file");
+  g_option_context_add_main_entries (ctx, entries, NULL);
+  if (!g_option_context_parse (ctx, &argc, &argv, &err) || argc != 3) {
+    g_printerr ("%s\n", err ? err->message :
+        "expected an input and an output file");
+    g_clear_error (&err);
+    g_option_context_free (ctx);
+    return 1;
+  }
+  g_option_context_free (ctx);
+
+  if (!g_file_get_contents (argv[1], &contents, NULL, &err)) {
+    g_printerr ("%s\n", err->message);
+    g_error_free (err);
+    return 1;
+  }
+
+  keys = g_array_new (FALSE, FALSE, sizeof (guint64));
+  maps = g_byte_array_new ();
+  lines = g_strsplit (contents, "\n", -1);
+  g_free (contents);
+
+  for (i = 0; lines[i]; i++) {
+    gboolean has_key;
+    gchar *line = g_strstrip (lines[i]);
+
+    if (*line == '\0' || *line == '#')
+      continue;
+
+    if (!parse_line (line, i + 1, &has_key, &key, &width, &height, maps))
+      goto done;
+    if (!has_key && keys->len)
+      key = g_array_index (keys, guint64, keys->len - 1) + 1;
+    if (keys->len && key <= g_array_index (keys, guint64, keys->len - 1)) {
+      g_printerr ("line %u: keys must be increasing\n", i + 1);
+      goto done;
+    }
+    g_array_append_val (keys, key);
+  }
+
+  if (!keys->len) {
+    g_printerr ("%s holds no ROI map\n", argv[1]);
+    goto done;
+  }
+
+  out = fopen (argv[2], "wb");
+  if (!out) {
+    g_printerr ("can not open %s: %s\n", argv[2], g_strerror (errno));
+    goto done;
+  }
+
+  ret = !gst_kvazaar_roi_file_write_header (out,
+      pts ? GST_KVAZAAR_ROI_FILE_FLAG_PTS : 0, width, height, keys->len);
+  for (i = 0; !ret && i < keys->len; i++)
+    ret = !gst_kvazaar_roi_file_write_key (out, g_array_index (keys, guint64,
+            i));
+  if (!ret && fwrite (maps->data, 1, maps->len, out) != maps->len)
+    ret = 1;
+  if (fclose (out) != 0)
+    ret = 1;
+
+  if (ret)
+    g_printerr ("error writing %s\n", argv[2]);
+  else
+    g_print ("%u maps of %dx%d written to %s\n", keys->len, width, height,
+        argv[2]);
+
+done:
+  g_strfreev (lines);
+  g_array_free (keys, TRUE);
+  g_byte_array_free (maps, TRUE);
+  return ret;
+}